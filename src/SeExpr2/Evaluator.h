@@ -15,29 +15,421 @@
  http://www.apache.org/licenses/LICENSE-2.0
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#include <set>
+#include <map>
+
 #include "ExprConfig.h"
 #include "ExprLLVMAll.h"
+#include "ExprNode.h"
+#include "ExprFunc.h"
+#include "ExprFuncStandard.h"
+#include "ExprFuncX.h"
+#include "Interpreter.h"
 #include "VarBlock.h"
 
 #if defined(SEEXPR_ENABLE_LLVM)
 #include <llvm/Config/llvm-config.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/DiagnosticInfo.h>
 #include <llvm/Support/Compiler.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Target/TargetMachine.h>
+#if LLVM_VERSION_MAJOR >= 4
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#else
+#include <llvm/Bitcode/ReaderWriter.h>
+#endif
+#ifdef SEEXPR_ENABLE_BUILTIN_BITCODE
+#include <llvm/Linker/Linker.h>
+#include <llvm/Transforms/IPO/Internalize.h>
+#include "ExprBuiltins.h"
+#include "ExprBuiltinsBitcode.h"
+#endif
 #endif
 
 extern "C" void SeExpr2LLVMEvalFPVarRef(SeExpr2::ExprVarRef *seVR, double *result);
 extern "C" void SeExpr2LLVMEvalStrVarRef(SeExpr2::ExprVarRef *seVR, double *result);
-extern "C" void SeExpr2LLVMEvalCustomFunction(int *opDataArg,
-                                              double *fpArg,
-                                              char **strArg,
-                                              void **funcdata,
-                                              const SeExpr2::ExprFuncNode *node);
+extern "C" void SeExpr2LLVMEvalCustomFunction(SeExpr2::ExprFuncSimple *func,
+                                              SeExpr2::ExprFuncNode::Data *data,
+                                              int nargs,
+                                              const int *argIndex,
+                                              double *fpArgs,
+                                              char **strArgs,
+                                              double *fpResult,
+                                              char **strResult);
 
 namespace SeExpr2 {
 #if defined(SEEXPR_ENABLE_LLVM)
 
 LLVM_VALUE promoteToDim(LLVM_VALUE val, unsigned dim, llvm::IRBuilder<> &Builder);
+std::string llvmStandardFunctionSymbol(const std::string &name);
+/// Generates a function computing the parse tree for lanes consecutive points with vector instructions, taking
+/// (outputPointer, dataBlock, firstIndex, floatOutput). Returns nullptr if some node has no lane-wide code.
+llvm::Function *codegenLanes(const ExprNode *parseTree,
+                             const ExprType &desiredReturnType,
+                             unsigned lanes,
+                             const std::string &name,
+                             llvm::Module *module);
+
+/// On-disk cache of compiled expression objects, enabled by setting SE_EXPR_JIT_CACHE to a directory.
+/// Only modules whose name starts with prefix() are cached. LLVMEvaluator gives those names to modules derived
+/// from the expression fingerprint when their code does not refer to any address in the current process.
+class LLVMObjectCache : public llvm::ObjectCache {
+  public:
+    static const char *prefix() { return "_cached"; }
+
+    LLVMObjectCache(const std::string &directory) : _directory(directory) {}
+
+    /// Reads the object stored for moduleName, nullptr when there is none or it is not a valid object file
+    std::unique_ptr<llvm::MemoryBuffer> loadObject(const std::string &moduleName) const {
+        auto buffer = llvm::MemoryBuffer::getFile(_directory + "/" + moduleName + ".o");
+        if (!buffer) return nullptr;
+#if LLVM_VERSION_MAJOR >= 4
+        auto object = llvm::object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+        if (!object) {
+            llvm::consumeError(object.takeError());
+            return nullptr;
+        }
+#else
+        if (!llvm::object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef())) return nullptr;
+#endif
+        return std::move(*buffer);
+    }
+
+    /// Makes the next getObject for moduleName return object, which LLVMEvaluator loaded when it decided to skip
+    /// the optimization of the module (call with the session mutex held, right before the module is compiled)
+    void provideObject(const std::string &moduleName, std::unique_ptr<llvm::MemoryBuffer> object) {
+        _providedName = moduleName;
+        _provided = std::move(object);
+    }
+
+    void notifyObjectCompiled(const llvm::Module *module, llvm::MemoryBufferRef object) override {
+        std::string path;
+        if (!objectPath(module, path)) return;
+        // write to a unique file first so concurrent processes never load a partially written object
+        int fd;
+        llvm::SmallString<128> tempPath;
+        if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, tempPath)) return;
+        {
+            llvm::raw_fd_ostream out(fd, true);
+            out << object.getBuffer();
+        }
+        if (llvm::sys::fs::rename(tempPath, path)) llvm::sys::fs::remove(tempPath);
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *module) override {
+        // Only hand out the object provided for the module: reading the file again here could find it removed or
+        // replaced since, and the module, whose optimization was skipped, would be compiled and stored unoptimized.
+        // Modules without a provided object were optimized and are compiled (and stored) as usual.
+        if (!_provided || module->getModuleIdentifier() != _providedName) return nullptr;
+        _providedName.clear();
+        return std::move(_provided);
+    }
+
+  private:
+    bool objectPath(const llvm::Module *module, std::string &path) const {
+        const std::string &name = module->getModuleIdentifier();
+        if (name.compare(0, strlen(prefix()), prefix()) != 0) return false;
+        path = _directory + "/" + name + ".o";
+        return true;
+    }
+
+    std::string _directory;
+    std::string _providedName;
+    std::unique_ptr<llvm::MemoryBuffer> _provided;
+};
+
+/// MCJIT memory manager giving every module its own memory, so that the code of one module can be freed while
+/// the engine keeps running the others. Allocations go to the module set by beginModule, which works because the
+/// session loads one module at a time (with its mutex held).
+class LLVMModuleMemoryManager : public llvm::RTDyldMemoryManager {
+  public:
+    /// Code and data sections of one module
+    struct ModuleMemory {
+        llvm::SectionMemoryManager sections;
+        size_t bytes = 0;
+    };
+
+    /// bytes counts the code and data of all modules that were not freed, objectBytes the objects the engine loaded
+    LLVMModuleMemoryManager(size_t &bytes, size_t &objectBytes)
+        : _bytes(bytes), _objectBytes(objectBytes), _current(nullptr) {}
+
+    /// Sets the memory of the module that is about to be loaded, nullptr when it was
+    void beginModule(ModuleMemory *memory) { _current = memory; }
+
+    /// Frees the memory of a module the engine no longer holds
+    void freeModule(std::unique_ptr<ModuleMemory> memory) {
+        _bytes -= memory->bytes;
+#if LLVM_VERSION_MAJOR > 4
+        memory->sections.deregisterEHFrames();
+#else
+        // the unwinder only forgets the frames of the whole engine, so the memory stays until the engine goes
+        _retired.push_back(std::move(memory));
+#endif
+    }
+
+    uint8_t *allocateCodeSection(uintptr_t size,
+                                 unsigned alignment,
+                                 unsigned sectionID,
+                                 llvm::StringRef sectionName) override {
+        _current->bytes += size;
+        _bytes += size;
+        return _current->sections.allocateCodeSection(size, alignment, sectionID, sectionName);
+    }
+
+    uint8_t *allocateDataSection(uintptr_t size,
+                                 unsigned alignment,
+                                 unsigned sectionID,
+                                 llvm::StringRef sectionName,
+                                 bool isReadOnly) override {
+        _current->bytes += size;
+        _bytes += size;
+        return _current->sections.allocateDataSection(size, alignment, sectionID, sectionName, isReadOnly);
+    }
+
+    bool finalizeMemory(std::string *errMsg = nullptr) override {
+        return _current ? _current->sections.finalizeMemory(errMsg) : false;
+    }
+
+    /// MCJIT keeps every object it loaded, and the symbols of its runtime linker, until the engine goes
+    void notifyObjectLoaded(llvm::ExecutionEngine *, const llvm::object::ObjectFile &object) override {
+        _objectBytes += object.getData().size();
+    }
+
+#if LLVM_VERSION_MAJOR > 4
+    void registerEHFrames(uint8_t *addr, uint64_t loadAddr, size_t size) override {
+        _current->sections.registerEHFrames(addr, loadAddr, size);
+    }
+
+    /// Each module deregisters its frames when it is freed
+    void deregisterEHFrames() override {}
+#endif
+
+  private:
+    size_t &_bytes;
+    size_t &_objectBytes;
+    ModuleMemory *_current;
+#if LLVM_VERSION_MAJOR <= 4
+    std::vector<std::unique_ptr<ModuleMemory>> _retired;
+#endif
+};
+
+#if LLVM_VERSION_MAJOR >= 6
+/// Diagnostic handler collecting what the loop vectorizer did with the loop of one function. Installed on the
+/// session context while that function's module is optimized, it also keeps the "loop not vectorized" warnings
+/// the vectorize hint causes off stderr.
+class LLVMVectorizeRemarks : public llvm::DiagnosticHandler {
+  public:
+    explicit LLVMVectorizeRemarks(const llvm::Function *function) : _function(function), _vectorized(false) {}
+
+    bool isAnalysisRemarkEnabled(llvm::StringRef passName) const override { return passName == "loop-vectorize"; }
+    bool isMissedOptRemarkEnabled(llvm::StringRef passName) const override { return passName == "loop-vectorize"; }
+    bool isPassedOptRemarkEnabled(llvm::StringRef passName) const override { return passName == "loop-vectorize"; }
+    bool isAnyRemarkEnabled() const override { return true; }
+
+    bool handleDiagnostics(const llvm::DiagnosticInfo &info) override {
+        auto *remark = llvm::dyn_cast<llvm::DiagnosticInfoIROptimization>(&info);
+        if (!remark) return false;
+        // analysis remarks about loops forced to vectorize come without a pass name, so that they are always shown
+        llvm::StringRef passName = remark->getPassName();
+        if (passName != "loop-vectorize" && passName != "transform-warning" && !passName.empty()) return false;
+        if (&remark->getFunction() != _function) return true;
+        if (remark->getKind() == llvm::DK_OptimizationRemark && remark->getRemarkName() == "Vectorized")
+            _vectorized = true;
+        _remarks += remark->getMsg();
+        _remarks += "\n";
+        return true;
+    }
+
+    bool vectorized() const { return _vectorized; }
+    const std::string &remarks() const { return _remarks; }
+
+  private:
+    const llvm::Function *_function;
+    bool _vectorized;
+    std::string _remarks;
+};
+#endif
+
+class LLVMEvaluator;
+
+/// Process wide JIT state shared by all expressions using the LLVM backend.
+/// The native target and the LLVMContext are set up once, and every expression is compiled as its own module
+/// into a pooled MCJIT engine. A module is removed from its engine and its code freed when the expression goes
+/// away. Engines keep some bookkeeping for every module they loaded, so they take a limited number of modules and
+/// are destroyed once all of those were removed.
+/// With a code budget (setCodeBudget or SE_EXPR_JIT_BUDGET) the code of the least recently used expressions is
+/// freed early, see LLVMEvaluator::trimCodeCache. MCJIT keeps the objects of removed modules until the engine
+/// goes, so those count against the budget, and the code left in an engine that lost most of its modules is moved
+/// to a new one.
+class LLVMSession {
+  public:
+    /// Execution engine loading the modules of up to maxModulesPerEngine expressions
+    struct Engine {
+        std::unique_ptr<llvm::ExecutionEngine> executionEngine;
+        /// Owned by the execution engine
+        LLVMModuleMemoryManager *memoryManager = nullptr;
+        /// Memory of the empty module the engine is created with
+        LLVMModuleMemoryManager::ModuleMemory placeholderMemory;
+        /// Names of the modules the engine holds, which must stay distinct
+        std::set<std::string> moduleNames;
+        int numModules = 0;
+        int refCount = 0;
+        /// Bytes of code and data the engine holds
+        size_t bytes = 0;
+        /// Bytes of the objects the engine loaded, which it keeps even after their modules were removed
+        size_t objectBytes = 0;
+
+#if LLVM_VERSION_MAJOR > 4
+        ~Engine() { placeholderMemory.sections.deregisterEHFrames(); }
+#endif
+    };
+    static const int maxModulesPerEngine = 256;
+
+    /// The session is intentionally never destroyed so expressions may outlive static destruction
+    static LLVMSession &instance() {
+        static LLVMSession *session = new LLVMSession;
+        return *session;
+    }
+
+    /// Guards the shared context and engines; hold it while generating, compiling or unloading code
+    std::mutex &mutex() { return _mutex; }
+
+    llvm::LLVMContext &context() { return *_context; }
+
+    /// Object cache shared by all engines or nullptr when SE_EXPR_JIT_CACHE is not set
+    LLVMObjectCache *objectCache() { return _objectCache.get(); }
+
+    /// Seconds spent compiling so far (call with the mutex held)
+    double &compileSeconds() { return _compileSeconds; }
+
+    /// Bytes the engines may hold before their code is evicted, 0 for no limit (read without the mutex)
+    size_t codeBudget() const { return _codeBudget.load(std::memory_order_relaxed); }
+    void setCodeBudget(size_t bytes) { _codeBudget.store(bytes, std::memory_order_relaxed); }
+
+    /// Bytes of code, data and objects held by all engines (call with the mutex held)
+    size_t residentBytes() const {
+        size_t bytes = 0;
+        for (auto &engine : _engines) bytes += engine->bytes + engine->objectBytes;
+        return bytes;
+    }
+
+    /// Whether most of the modules the engine was given were removed. It takes no more and what it keeps of those
+    /// modules only goes with the engine, so the code still in it is better loaded into another one.
+    bool retired(const Engine *engine) const {
+        return engine && engine != _current && engine->refCount * 4 <= engine->numModules;
+    }
+
+    /// Whether some engine is retired (call with the mutex held)
+    bool anyRetired() const {
+        for (auto &engine : _engines)
+            if (retired(engine.get())) return true;
+        return false;
+    }
+
+    /// Evaluators holding a reference to an engine (call with the mutex held)
+    std::set<LLVMEvaluator *> &evaluators() { return _evaluators; }
+
+    /// Coarse clock for least recently used eviction, advanced by each trimming of the code cache
+    uint64_t epoch() const { return _epoch.load(std::memory_order_relaxed); }
+    void advanceEpoch() { _epoch.fetch_add(1, std::memory_order_relaxed); }
+
+    /// Name prefix that is unique for the lifetime of the process (call with the mutex held)
+    std::string uniqueName() {
+        std::ostringstream o;
+        o << "_" << std::setbase(16) << _nameCounter++;
+        return o.str();
+    }
+
+    /// Returns an engine to add one more module to, or nullptr on error (call with the mutex held)
+    Engine *acquireEngine(std::string &errStr) {
+        if (!_current || _current->numModules >= maxModulesPerEngine) {
+            std::unique_ptr<Engine> engine(new Engine);
+            std::unique_ptr<llvm::Module> placeholder(new llvm::Module("SeExpr2Session", *_context));
+            engine->memoryManager = new LLVMModuleMemoryManager(engine->bytes, engine->objectBytes);
+            llvm::ExecutionEngine *executionEngine =
+                llvm::EngineBuilder(std::move(placeholder))
+                    .setErrorStr(&errStr)
+                    .setMCPU(llvm::sys::getHostCPUName())
+                    .setOptLevel(llvm::CodeGenOpt::Aggressive)
+                    .setMCJITMemoryManager(std::unique_ptr<llvm::RTDyldMemoryManager>(engine->memoryManager))
+                    .create();
+            if (!executionEngine) return nullptr;
+            engine->executionEngine.reset(executionEngine);
+            // load the placeholder now so that its sections are not counted as the first expression's
+            engine->memoryManager->beginModule(&engine->placeholderMemory);
+            executionEngine->finalizeObject();
+            engine->memoryManager->beginModule(nullptr);
+            _engines.push_back(std::move(engine));
+            _current = _engines.back().get();
+            if (_objectCache) executionEngine->setObjectCache(_objectCache.get());
+        }
+        _current->numModules++;
+        _current->refCount++;
+        return _current;
+    }
+
+    /// Drops a reference taken by acquireEngine and destroys the engine once unused (call with the mutex held)
+    void releaseEngine(Engine *engine) {
+        if (--engine->refCount > 0) return;
+        if (engine == _current) _current = nullptr;
+        for (auto it = _engines.begin(); it != _engines.end(); ++it) {
+            if (it->get() == engine) {
+                _engines.erase(it);
+                break;
+            }
+        }
+    }
+
+  private:
+    LLVMSession()
+        : _context(new llvm::LLVMContext()), _current(nullptr), _nameCounter(0), _compileSeconds(0), _codeBudget(0),
+          _epoch(0) {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+        const char *cacheDirectory = getenv("SE_EXPR_JIT_CACHE");
+        if (cacheDirectory && *cacheDirectory && !llvm::sys::fs::create_directories(cacheDirectory))
+            _objectCache.reset(new LLVMObjectCache(cacheDirectory));
+        if (const char *budget = getenv("SE_EXPR_JIT_BUDGET")) _codeBudget = strtoull(budget, nullptr, 10);
+    }
+
+    std::mutex _mutex;
+    std::unique_ptr<llvm::LLVMContext> _context;
+    std::unique_ptr<LLVMObjectCache> _objectCache;
+    std::vector<std::unique_ptr<Engine>> _engines;
+    Engine *_current;
+    uint64_t _nameCounter;
+    double _compileSeconds;
+    std::atomic<size_t> _codeBudget;
+    std::atomic<uint64_t> _epoch;
+    std::set<LLVMEvaluator *> _evaluators;
+};
 
 class LLVMEvaluator {
+  public:
+    /// Expression compiled into a loop function, see prepLLVM(const std::vector<Stage>&)
+    struct Stage {
+        ExprNode *parseTree;
+        ExprType desiredReturnType;
+        /// Variable block entry receiving the result, or -1 for the loop function's outputVarBlockOffset argument
+        int outputVarBlockOffset;
+        /// Creator of the variable block, tells which entries store their values as float (may be null)
+        const VarBlockCreator *varBlockCreator;
+    };
+
+  private:
     // TODO: this seems needlessly complex, let's fix it
     // TODO: let the dev code allocate memory?
     // FP is the native function for this expression.
@@ -49,28 +441,40 @@ class LLVMEvaluator {
         FunctionPtr functionPtr;
         FunctionPtrMultiple functionPtrMultiple;
         T *resultData;
+        int resultDim;
 
       public:
         LLVMEvaluationContext(const LLVMEvaluationContext &) = delete;
         LLVMEvaluationContext &operator=(const LLVMEvaluationContext &) = delete;
         ~LLVMEvaluationContext() { delete[] resultData; }
-        LLVMEvaluationContext() : functionPtr(nullptr), resultData(nullptr) {}
+        LLVMEvaluationContext() : functionPtr(nullptr), resultData(nullptr), resultDim(0) {}
+        /// Points at new code, keeping the result storage (callers may still read it) when the dimension matches
         void init(void *fp, void *fpLoop, int dim) {
-            reset();
+            if (dim != resultDim) {
+                reset();
+                resultData = new T[dim];
+                resultDim = dim;
+            }
             functionPtr = reinterpret_cast<FunctionPtr>(fp);
             functionPtrMultiple = reinterpret_cast<FunctionPtrMultiple>(fpLoop);
-            resultData = new T[dim];
         }
         void reset() {
             if (resultData) delete[] resultData;
             functionPtr = nullptr;
             resultData = nullptr;
+            resultDim = 0;
         }
         const T *operator()(VarBlock *varBlock) {
             assert(functionPtr && resultData);
             functionPtr(resultData, varBlock ? varBlock->data() : nullptr, varBlock ? varBlock->indirectIndex : 0);
             return resultData;
         }
+        /// Evaluates into caller owned storage of at least dim elements (reentrant)
+        const T *operator()(VarBlock *varBlock, T *out) const {
+            assert(functionPtr && out);
+            functionPtr(out, varBlock ? varBlock->data() : nullptr, varBlock ? varBlock->indirectIndex : 0);
+            return out;
+        }
         void operator()(VarBlock *varBlock, size_t outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) {
             assert(functionPtr && resultData);
             functionPtrMultiple(varBlock ? varBlock->data() : nullptr, outputVarBlockOffset, rangeStart, rangeEnd);
@@ -79,33 +483,302 @@ class LLVMEvaluator {
     std::unique_ptr<LLVMEvaluationContext<double>> _llvmEvalFP;
     std::unique_ptr<LLVMEvaluationContext<char *>> _llvmEvalStr;
 
-    std::unique_ptr<llvm::LLVMContext> _llvmContext;
-    std::unique_ptr<llvm::ExecutionEngine> TheExecutionEngine;
+    /// Shared context, the session engine holding this expression's code, the module of the code (owned by the
+    /// engine once loaded, null before) with its name and its memory
+    llvm::LLVMContext *_llvmContext;
+    LLVMSession::Engine *_engine;
+    llvm::Module *_module;
+    std::string _moduleName;
+    std::unique_ptr<LLVMModuleMemoryManager::ModuleMemory> _moduleMemory;
+
+    /// Requested optimization level, whether the code is known to be evaluated a lot, and what prepLLVM did
+    Expression::JitOptLevel _optLevel;
+    bool _hot;
+    int _compiledOptLevel;
+    double _compileSeconds;
+    bool _loadedFromCache;
+
+    /// Whether the optimizer vectorized the loop of evalMultiple, and the loop vectorizer's remarks about it
+    bool _loopVectorized;
+    std::string _vectorizeRemarks;
+    /// Points the loop of evalMultiple computes at once with lane-wide code, 0 if it computes them one at a time
+    int _laneWidth;
+    /// The builtins the optimizer inlined after they were linked from the embedded bitcode
+    std::vector<std::string> _inlinedBuiltins;
+
+    /// What loading the code again after an eviction takes. The module is kept as bitcode, so the parse trees it
+    /// was generated from (which for ExprKernel belong to other expressions) are not needed.
+    struct ReloadableCode {
+        llvm::SmallVector<char, 0> bitcode;
+        /// Name prefix of the functions in the bitcode
+        std::string name;
+        /// False when the module was loaded from the object cache without being optimized
+        bool optimized = false;
+        bool linkedBuiltins = false;
+        std::map<std::string, void *> standardFunctions;
+        ExprType desiredReturnType;
+    };
+
+    /// Code cache state: the code to load again after an eviction and the bytes the code took (guarded by the
+    /// session mutex), the number of evaluations running it, whether it was evicted, whether loading it again
+    /// failed and when it was last used
+    ReloadableCode _reloadable;
+    size_t _codeBytes;
+    mutable std::atomic<int> _users;
+    mutable std::atomic<bool> _evicted;
+    mutable std::atomic<bool> _failed;
+    mutable std::atomic<uint64_t> _lastUse;
+
+    /// Code made by generateLLVM for compileLLVM to optimize and load
+    struct GeneratedCode {
+        std::unique_ptr<llvm::Module> module;
+        std::vector<llvm::Function *> pointFunctions;
+        llvm::Function *loopFunction = nullptr;
+        std::map<std::string, void *> standardFunctions;
+        ExprType desiredReturnType;
+        int optLevel = 0;
+        int laneWidth = 0;
+        /// Object read from the object cache, the module is then loaded from it without being optimized
+        std::unique_ptr<llvm::MemoryBuffer> cachedObject;
+        bool linkedBuiltins = false;
+        /// Name prefix of the module and its functions
+        std::string name;
+        /// Seconds generateLLVM took
+        double seconds = 0;
+    };
+    std::unique_ptr<GeneratedCode> _generated;
+
+    /// Keeps the code from being evicted while it runs, loading it again first if it was. Evaluations are counted
+    /// even without a code budget, since one may be set while they run. False if there is no code to run.
+    class CodeUse {
+      public:
+        explicit CodeUse(const LLVMEvaluator &evaluator) : _evaluator(evaluator), _acquired(evaluator.acquireCode()) {}
+        ~CodeUse() {
+            if (_acquired) _evaluator._users.fetch_sub(1);
+        }
+        explicit operator bool() const { return _acquired; }
+
+      private:
+        const LLVMEvaluator &_evaluator;
+        bool _acquired;
+    };
+
+    bool acquireCode() const {
+        for (;;) {
+            // pairs with trimCodeCache marking the evaluator evicted before checking for users
+            _users.fetch_add(1);
+            if (!_evicted.load()) {
+                // only written when the epoch moved on, so evaluations from several threads share the cache line
+                uint64_t epoch = LLVMSession::instance().epoch();
+                if (_lastUse.load(std::memory_order_relaxed) != epoch)
+                    _lastUse.store(epoch, std::memory_order_relaxed);
+                return true;
+            }
+            _users.fetch_sub(1);
+            if (_failed.load()) return false;
+            LLVMSession &session = LLVMSession::instance();
+            std::lock_guard<std::mutex> lock(session.mutex());
+            if (_evicted.load() && !const_cast<LLVMEvaluator *>(this)->reloadCode(session)) {
+                _failed.store(true);
+                return false;
+            }
+        }
+    }
+
+    /// Removes the module from the engine, frees its code and drops the reference to the engine (call with the
+    /// session mutex held)
+    void releaseCode(LLVMSession &session) {
+        session.evaluators().erase(this);
+        if (_engine) {
+            if (_module) {
+                _engine->executionEngine->removeModule(_module);
+                delete _module;
+                _engine->memoryManager->freeModule(std::move(_moduleMemory));
+            }
+            _engine->moduleNames.erase(_moduleName);
+            session.releaseEngine(_engine);
+        }
+        _engine = nullptr;
+        _module = nullptr;
+        _moduleName.clear();
+        _moduleMemory.reset();
+        _codeBytes = 0;
+    }
 
   public:
-    LLVMEvaluator() {}
+    LLVMEvaluator()
+        : _llvmContext(nullptr), _engine(nullptr), _module(nullptr), _optLevel(Expression::JitO3), _hot(false),
+          _compiledOptLevel(-1), _compileSeconds(0), _loadedFromCache(false), _loopVectorized(false), _laneWidth(0),
+          _codeBytes(0), _users(0), _evicted(false), _failed(false), _lastUse(0) {}
+    LLVMEvaluator(const LLVMEvaluator &) = delete;
+    LLVMEvaluator &operator=(const LLVMEvaluator &) = delete;
+    ~LLVMEvaluator() {
+        if (_engine) {
+            LLVMSession &session = LLVMSession::instance();
+            std::lock_guard<std::mutex> lock(session.mutex());
+            releaseCode(session);
+        }
+    }
 
-    const char *evalStr(VarBlock *varBlock) { return *(*_llvmEvalStr)(varBlock); }
-    const double *evalFP(VarBlock *varBlock) { return (*_llvmEvalFP)(varBlock); }
+    /// The evaluation functions do nothing (and return nullptr) once failed() is true
+    const char *evalStr(VarBlock *varBlock) {
+        CodeUse use(*this);
+        return use ? *(*_llvmEvalStr)(varBlock) : nullptr;
+    }
+    const double *evalFP(VarBlock *varBlock) {
+        CodeUse use(*this);
+        return use ? (*_llvmEvalFP)(varBlock) : nullptr;
+    }
+
+    /// Reentrant variants writing the result to out instead of the evaluator's own storage.
+    /// out must hold the desired return dimension for evalFP and a single pointer for evalStr.
+    const char *evalStr(VarBlock *varBlock, char **out) const {
+        CodeUse use(*this);
+        return use ? *(*_llvmEvalStr)(varBlock, out) : nullptr;
+    }
+    const double *evalFP(VarBlock *varBlock, double *out) const {
+        CodeUse use(*this);
+        return use ? (*_llvmEvalFP)(varBlock, out) : nullptr;
+    }
 
     void evalMultiple(VarBlock *varBlock, uint32_t outputVarBlockOffset, uint32_t rangeStart, uint32_t rangeEnd) {
-        return (*_llvmEvalFP)(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+        CodeUse use(*this);
+        if (use) (*_llvmEvalFP)(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+    }
+
+    /// True once code evicted from the code cache could not be loaded again. The caller then has to evaluate some
+    /// other way, until the next prepLLVM.
+    bool failed() const { return _failed.load(); }
+
+    /// Bytes of code and data the engine allocated for this evaluator, 0 if it holds no code
+    size_t codeBytes() const {
+        LLVMSession &session = LLVMSession::instance();
+        std::lock_guard<std::mutex> lock(session.mutex());
+        return _codeBytes;
+    }
+
+    /// Bytes of code and data held by all engines
+    static size_t residentBytes() {
+        LLVMSession &session = LLVMSession::instance();
+        std::lock_guard<std::mutex> lock(session.mutex());
+        return session.residentBytes();
     }
 
+    /// Limits the bytes held by the engines (0 for no limit) and evicts code over it right away
+    static void setCodeBudget(size_t bytes) {
+        LLVMSession &session = LLVMSession::instance();
+        std::lock_guard<std::mutex> lock(session.mutex());
+        session.setCodeBudget(bytes);
+        trimCodeCache(session, nullptr);
+    }
+
+    static size_t codeBudget() { return LLVMSession::instance().codeBudget(); }
+
     void debugPrint() {
         // TheModule->print(llvm::errs(), nullptr);
     }
 
-    bool prepLLVM(ExprNode *parseTree, ExprType desiredReturnType) {
+    /// Optimization level of the next prepLLVM. JitAdaptive decides from the size of the code and hot.
+    void setOptLevel(Expression::JitOptLevel level, bool hot = false) {
+        _optLevel = level;
+        _hot = hot;
+    }
+
+    /// Optimization level (0-3) the last successful prepLLVM compiled at, or -1
+    int compiledOptLevel() const { return _compiledOptLevel; }
+
+    /// Seconds the last successful prepLLVM took
+    double compileSeconds() const { return _compileSeconds; }
+
+    /// Whether the last successful prepLLVM loaded the machine code from the object cache
+    bool loadedFromCache() const { return _loadedFromCache; }
+
+    /// Whether the last successful prepLLVM vectorized the loop evalMultiple runs. The loop only asks for it, the
+    /// vectorizer gives up on loops calling functions it has no vector version of (most of libm and the
+    /// builtins). Always false when the code was loaded from the object cache or LLVM is older than 6, and when
+    /// the loop has lane-wide code (it then only computes the points left over after the last group).
+    bool loopVectorized() const { return _loopVectorized; }
+
+    /// What the loop vectorizer said about the loop of the last successful prepLLVM, one remark per line
+    const std::string &vectorizeRemarks() const { return _vectorizeRemarks; }
+
+    /// Points the loop evalMultiple runs computes at once with the lane-wide code of the last successful prepLLVM
+    /// (4 or 8), 0 when it computes them one at a time. The loop computes the points left over after the last
+    /// whole group one at a time.
+    int laneWidth() const { return _laneWidth; }
+
+    /// The builtins the last successful prepLLVM linked from the embedded bitcode and inlined. Always empty when
+    /// the bitcode is not embedded or the code was loaded from the object cache.
+    const std::vector<std::string> &inlinedBuiltins() const { return _inlinedBuiltins; }
+
+    /// Seconds all LLVM evaluators spent in prepLLVM
+    static double totalCompileSeconds() {
+        LLVMSession &session = LLVMSession::instance();
+        std::lock_guard<std::mutex> lock(session.mutex());
+        return session.compileSeconds();
+    }
+
+    bool prepLLVM(ExprNode *parseTree, ExprType desiredReturnType, const VarBlockCreator *varBlockCreator = nullptr) {
+        return prepLLVM(std::vector<Stage>(1, Stage{parseTree, desiredReturnType, -1, varBlockCreator}));
+    }
+    bool generateLLVM(ExprNode *parseTree, ExprType desiredReturnType, const VarBlockCreator *varBlockCreator = nullptr) {
+        return generateLLVM(std::vector<Stage>(1, Stage{parseTree, desiredReturnType, -1, varBlockCreator}));
+    }
+
+    /// Compiles the stages into one loop function evaluating all of them for each point in order. Results a stage
+    /// stores to the variable block reach later stages reading them without a round trip through memory.
+    /// evalFP/evalStr evaluate the first stage.
+    bool prepLLVM(const std::vector<Stage> &stages) { return generateLLVM(stages) && compileLLVM(); }
+
+    /// First half of prepLLVM, generating and verifying the code of the stages. This is the only part reading the
+    /// parse trees and the variables and functions they resolved, so it must run while those are alive.
+    bool generateLLVM(const std::vector<Stage> &stages) {
         using namespace llvm;
-        InitializeNativeTarget();
-        InitializeNativeTargetAsmPrinter();
-        InitializeNativeTargetAsmParser();
+        LLVMSession &session = LLVMSession::instance();
+        std::lock_guard<std::mutex> lock(session.mutex());
+        auto compileStart = std::chrono::steady_clock::now();
+        _generated.reset();
 
-        std::string uniqueName = getUniqueName();
+        std::string ErrStr;
+        if (_engine) releaseCode(session);
+        _engine = session.acquireEngine(ErrStr);
+        if (!_engine) {
+            fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
+            exit(1);
+        }
+        ExecutionEngine *executionEngine = _engine->executionEngine.get();
+
+        // Name the module after the fingerprint if its code can be shared through the object cache
+        CodeInfo info;
+        for (const Stage &stage : stages) {
+            collectCodeInfo(stage.parseTree, info);
+            info.numBlockSlots = std::max(info.numBlockSlots, stage.outputVarBlockOffset + 1);
+            for (int offset : floatOutputs(stage)) info.signature << "float output " << offset << "\n";
+        }
+        int optLevel = _optLevel;
+        if (_optLevel == Expression::JitAdaptive)
+            optLevel = _hot || info.numNodes >= Expression::jitAdaptiveThreshold ? 3 : 1;
+        // Unoptimized code is compiled as fast as possible, without lane-wide versions of the stages
+        unsigned lanes = optLevel >= 1 ? hostLaneWidth() : 0;
+        info.signature << "O" << optLevel << " lanes " << lanes << "\n";
+        std::string uniqueName;
+        std::unique_ptr<MemoryBuffer> cachedObject;
+        if (session.objectCache() && info.cacheable && stages.size() == 1) {
+            std::string name =
+                LLVMObjectCache::prefix() + fingerprint(stages[0].parseTree, stages[0].desiredReturnType, info);
+            if (_engine->moduleNames.insert(name + "_module").second) {
+                uniqueName = name;
+                cachedObject = session.objectCache()->loadObject(name + "_module");
+            }
+        }
+        if (uniqueName.empty()) {
+            uniqueName = session.uniqueName();
+            _engine->moduleNames.insert(uniqueName + "_module");
+        }
+        _moduleName = uniqueName + "_module";
 
         // create Module
-        _llvmContext.reset(new LLVMContext());
+        _llvmContext = &session.context();
 
         std::unique_ptr<Module> TheModule(new Module(uniqueName + "_module", *_llvmContext));
 
@@ -121,109 +794,129 @@ class LLVMEvaluator {
         Type        *voidTy         = Type::getVoidTy(*_llvmContext);           // void
 
         // create bindings to helper functions for variables and fucntions
-        Function *SeExpr2LLVMEvalCustomFunctionFunc = nullptr;
-        Function *SeExpr2LLVMEvalFPVarRefFunc = nullptr;
-        Function *SeExpr2LLVMEvalStrVarRefFunc = nullptr;
-        Function *SeExpr2LLVMEvalstrlenFunc = nullptr;
-        Function *SeExpr2LLVMEvalmallocFunc = nullptr;
-        Function *SeExpr2LLVMEvalfreeFunc = nullptr;
-        Function *SeExpr2LLVMEvalmemsetFunc = nullptr;
-        Function *SeExpr2LLVMEvalstrcatFunc = nullptr;
-        Function *SeExpr2LLVMEvalstrcmpFunc = nullptr;
         {
             {
-                FunctionType *FT = FunctionType::get(voidTy, {i32PtrTy, doublePtrTy, i8PtrPtrTy, i8PtrPtrTy, i64Ty}, false);
-                SeExpr2LLVMEvalCustomFunctionFunc = Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalCustomFunction", TheModule.get());
+                FunctionType *FT = FunctionType::get(
+                    voidTy, {i8PtrTy, i8PtrTy, i32Ty, i32PtrTy, doublePtrTy, i8PtrPtrTy, doublePtrTy, i8PtrPtrTy}, false);
+                Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalCustomFunction", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(voidTy, {i8PtrTy, doublePtrTy}, false);
-                SeExpr2LLVMEvalFPVarRefFunc = Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalFPVarRef", TheModule.get());
+                Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalFPVarRef", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(voidTy, {i8PtrTy, i8PtrPtrTy}, false);
-                SeExpr2LLVMEvalStrVarRefFunc = Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalStrVarRef", TheModule.get());
+                Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalStrVarRef", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(i32Ty, { i8PtrTy }, false);
-                SeExpr2LLVMEvalstrlenFunc = Function::Create(FT, Function::ExternalLinkage, "strlen", TheModule.get());
+                Function::Create(FT, Function::ExternalLinkage, "strlen", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(i8PtrTy, { i32Ty }, false);
-                SeExpr2LLVMEvalmallocFunc = Function::Create(FT, Function::ExternalLinkage, "malloc", TheModule.get());
+                Function::Create(FT, Function::ExternalLinkage, "malloc", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(voidTy, { i8PtrTy }, false);
-                SeExpr2LLVMEvalfreeFunc = Function::Create(FT, Function::ExternalLinkage, "free", TheModule.get());
+                Function::Create(FT, Function::ExternalLinkage, "free", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(voidTy, { i8PtrTy, i32Ty, i32Ty }, false);
-                SeExpr2LLVMEvalmemsetFunc = Function::Create(FT, Function::ExternalLinkage, "memset", TheModule.get());
+                Function::Create(FT, Function::ExternalLinkage, "memset", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(i8PtrTy, { i8PtrTy, i8PtrTy }, false);
-                SeExpr2LLVMEvalstrcatFunc = Function::Create(FT, Function::ExternalLinkage, "strcat", TheModule.get());
+                Function::Create(FT, Function::ExternalLinkage, "strcat", TheModule.get());
             }
             {
                 FunctionType *FT = FunctionType::get(i32Ty, {i8PtrTy, i8PtrTy}, false);
-                SeExpr2LLVMEvalstrcmpFunc = Function::Create(FT, Function::ExternalLinkage, "strcmp", TheModule.get());
+                Function::Create(FT, Function::ExternalLinkage, "strcmp", TheModule.get());
             }
         }
 
-        // create function and entry BB
-        bool desireFP = desiredReturnType.isFP();
-        Type *ParamTys[] = {
-            desireFP ? doublePtrTy : i8PtrPtrTy,
-            doublePtrPtrTy,
-            i32Ty
-        };
-        FunctionType *FT = FunctionType::get(voidTy, ParamTys, false);
-        Function *F = Function::Create(FT, Function::ExternalLinkage, uniqueName + "_func", TheModule.get());
-#if LLVM_VERSION_MAJOR > 4
-        F->addAttribute(llvm::AttributeList::FunctionIndex, llvm::Attribute::AlwaysInline);
+        // create one function and entry BB per stage
+        std::vector<Function *> pointFunctions;
+        for (size_t stageIndex = 0; stageIndex < stages.size(); stageIndex++) {
+            ExprNode *parseTree = stages[stageIndex].parseTree;
+            const ExprType &desiredReturnType = stages[stageIndex].desiredReturnType;
+            bool desireFP = desiredReturnType.isFP();
+            Type *ParamTys[] = {
+                desireFP ? doublePtrTy : i8PtrPtrTy,
+                doublePtrPtrTy,
+                i32Ty
+            };
+            FunctionType *FT = FunctionType::get(voidTy, ParamTys, false);
+            Function *F = Function::Create(FT, Function::ExternalLinkage,
+                                           uniqueName + "_func" + (stageIndex ? std::to_string(stageIndex) : ""), TheModule.get());
+#if LLVM_VERSION_MAJOR >= 14
+            F->addFnAttr(llvm::Attribute::AlwaysInline);
+#elif LLVM_VERSION_MAJOR > 4
+            F->addAttribute(llvm::AttributeList::FunctionIndex, llvm::Attribute::AlwaysInline);
 #else
-        F->addAttribute(llvm::AttributeSet::FunctionIndex, llvm::Attribute::AlwaysInline);
+            F->addAttribute(llvm::AttributeSet::FunctionIndex, llvm::Attribute::AlwaysInline);
 #endif
-        {
-            // label the function with names
-            const char *names[] = {"outputPointer", "dataBlock", "indirectIndex"};
-            int idx = 0;
-            for (auto &arg : F->args()) arg.setName(names[idx++]);
-        }
+            {
+                // label the function with names
+                const char *names[] = {"outputPointer", "dataBlock", "indirectIndex"};
+                int idx = 0;
+                for (auto &arg : F->args()) arg.setName(names[idx++]);
+            }
 
-        unsigned int dimDesired = (unsigned)desiredReturnType.dim();
-        unsigned int dimGenerated = parseTree->type().dim();
-        {
-            BasicBlock *BB = BasicBlock::Create(*_llvmContext, "entry", F);
-            IRBuilder<> Builder(BB);
-
-            // codegen
-            Value *lastVal = parseTree->codegen(Builder);
-
-            // return values through parameter.
-            Value *firstArg = &*F->arg_begin();
-            if (desireFP) {
-                if (dimGenerated > 1) {
-                    Value *newLastVal = promoteToDim(lastVal, dimDesired, Builder);
-                    assert(newLastVal->getType()->getVectorNumElements() >= dimDesired);
-                    for (unsigned i = 0; i < dimDesired; ++i) {
-                        Value *idx = ConstantInt::get(Type::getInt64Ty(*_llvmContext), i);
-                        Value *val = Builder.CreateExtractElement(newLastVal, idx);
-                        Value *ptr = Builder.CreateInBoundsGEP(firstArg, idx);
-                        Builder.CreateStore(val, ptr);
-                    }
-                } else if (dimGenerated == 1) {
-                    for (unsigned i = 0; i < dimDesired; ++i) {
-                        Value *ptr = Builder.CreateConstInBoundsGEP1_32(nullptr, firstArg, i);
-                        Builder.CreateStore(lastVal, ptr);
+            unsigned int dimDesired = (unsigned)desiredReturnType.dim();
+            unsigned int dimGenerated = parseTree->type().dim();
+            {
+                BasicBlock *BB = BasicBlock::Create(*_llvmContext, "entry", F);
+                IRBuilder<> Builder(BB);
+
+                // codegen
+                prepareCustomFunctionData(parseTree);
+                Value *lastVal = parseTree->codegen(Builder);
+
+                // return values through parameter.
+                Value *firstArg = &*F->arg_begin();
+                if (desireFP) {
+                    if (dimGenerated > 1) {
+                        Value *newLastVal = promoteToDim(lastVal, dimDesired, Builder);
+                        assert(vectorNumElements(newLastVal->getType()) >= dimDesired);
+                        for (unsigned i = 0; i < dimDesired; ++i) {
+                            Value *idx = ConstantInt::get(Type::getInt64Ty(*_llvmContext), i);
+                            Value *val = Builder.CreateExtractElement(newLastVal, idx);
+                            Value *ptr = createInBoundsGEP(Builder, firstArg, idx);
+                            Builder.CreateStore(val, ptr);
+                        }
+                    } else if (dimGenerated == 1) {
+                        for (unsigned i = 0; i < dimDesired; ++i) {
+                            Value *ptr = createConstInBoundsGEP1_32(Builder, firstArg, i);
+                            Builder.CreateStore(lastVal, ptr);
+                        }
+                    } else {
+                        assert(false && "error. dim of FP is less than 1.");
                     }
                 } else {
-                    assert(false && "error. dim of FP is less than 1.");
+                    Builder.CreateStore(lastVal, firstArg);
                 }
-            } else {
-                Builder.CreateStore(lastVal, firstArg);
+
+                Builder.CreateRetVoid();
             }
+            pointFunctions.push_back(F);
+        }
 
-            Builder.CreateRetVoid();
+        // Lane-wide versions of the stages for the loop to compute whole groups of points. A stage reading an entry
+        // uniformly that some stage stores its result to would see the entry change in the middle of a group.
+        std::vector<Function *> laneFunctions;
+        for (size_t stageIndex = 0; stageIndex < stages.size() && lanes; stageIndex++) {
+            const Stage &stage = stages[stageIndex];
+            Function *F = info.uniformBlockSlots.count(stage.outputVarBlockOffset)
+                              ? nullptr
+                              : codegenLanes(stage.parseTree, stage.desiredReturnType, lanes,
+                                             uniqueName + "_lanes" + (stageIndex ? std::to_string(stageIndex) : ""),
+                                             TheModule.get());
+            if (!F) {
+                for (Function *laneFunction : laneFunctions) laneFunction->eraseFromParent();
+                laneFunctions.clear();
+                break;
+            }
+            laneFunctions.push_back(F);
         }
 
         // write a new function
@@ -239,7 +932,6 @@ class LLVMEvaluator {
         }
         {
             // Local variables
-            Value *dimValue = ConstantInt::get(i32Ty, dimDesired);
             Value *oneValue = ConstantInt::get(i32Ty, 1);
 
             // Basic blocks
@@ -264,34 +956,138 @@ class LLVMEvaluator {
             Value *indexVar = Builder.CreateAlloca(Type::getInt32Ty(*_llvmContext), oneValue, "indexVar");
             Value *outputVarBlockOffsetVar = Builder.CreateAlloca(Type::getInt32Ty(*_llvmContext), oneValue, "outputVarBlockOffsetVar");
             Value *varBlockDoublePtrPtrVar = Builder.CreateAlloca(doublePtrPtrTy, oneValue, "varBlockDoublePtrPtrVar");
-            Value *varBlockTPtrPtrVar = Builder.CreateAlloca(desireFP == true ? doublePtrPtrTy : i8PtrPtrPtrTy, oneValue, "varBlockTPtrPtrVar");
 
             // Copy variables from args
             Builder.CreateStore(Builder.CreatePointerCast(varBlockCharPtrPtrArg, doublePtrPtrTy, "varBlockAsDoublePtrPtr"), varBlockDoublePtrPtrVar);
-            Builder.CreateStore(Builder.CreatePointerCast(varBlockCharPtrPtrArg, desireFP ? doublePtrPtrTy : i8PtrPtrPtrTy, "varBlockAsTPtrPtr"), varBlockTPtrPtrVar);
             Builder.CreateStore(rangeStartArg, rangeStartVar);
             Builder.CreateStore(rangeEndArg, rangeEndVar);
             Builder.CreateStore(outputVarBlockOffsetArg, outputVarBlockOffsetVar);
 
-            // Set output pointer
-            Value *outputBasePtrPtr = Builder.CreateGEP(nullptr, Builder.CreateLoad(varBlockTPtrPtrVar), outputVarBlockOffsetArg, "outputBasePtrPtr");
-            Value *outputBasePtr = Builder.CreateLoad(outputBasePtrPtr, "outputBasePtr");
-            Builder.CreateStore(Builder.CreateLoad(rangeStartVar), indexVar);
+            // Set output pointers
+            std::vector<Value *> outputBasePtrs;
+            for (const Stage &stage : stages) {
+                bool desireFP = stage.desiredReturnType.isFP();
+                Value *varBlockAsTPtrPtr = Builder.CreatePointerCast(varBlockCharPtrPtrArg, desireFP ? doublePtrPtrTy : i8PtrPtrPtrTy, "varBlockAsTPtrPtr");
+                Value *outputOffset = stage.outputVarBlockOffset < 0 ? outputVarBlockOffsetArg : ConstantInt::get(i32Ty, stage.outputVarBlockOffset);
+                Value *outputBasePtrPtr = createGEP(Builder, varBlockAsTPtrPtr, outputOffset, "outputBasePtrPtr");
+                outputBasePtrs.push_back(createLoad(Builder, outputBasePtrPtr, "outputBasePtr"));
+            }
+            Builder.CreateStore(createLoad(Builder, rangeStartVar), indexVar);
 
-            Builder.CreateBr(loopCmpBlock);
+            // Results stored to float entries are computed into a double temporary and narrowed. When the entry is
+            // the outputVarBlockOffset argument it is only known at run time, the branch on it is loop invariant.
+            std::vector<Value *> floatOutputConds(stages.size(), nullptr), floatTemps(stages.size(), nullptr);
+            for (size_t stageIndex = 0; stageIndex < stages.size(); stageIndex++) {
+                const Stage &stage = stages[stageIndex];
+                std::vector<int> offsets = floatOutputs(stage);
+                if (offsets.empty()) continue;
+                Value *cond = ConstantInt::getTrue(*_llvmContext);
+                if (stage.outputVarBlockOffset < 0) {
+                    cond = ConstantInt::getFalse(*_llvmContext);
+                    for (int offset : offsets) cond = Builder.CreateOr(cond, Builder.CreateICmpEQ(outputVarBlockOffsetArg, ConstantInt::get(i32Ty, offset)));
+                }
+                floatOutputConds[stageIndex] = cond;
+                floatTemps[stageIndex] = Builder.CreateAlloca(Type::getDoubleTy(*_llvmContext), ConstantInt::get(i32Ty, stage.desiredReturnType.dim()), "floatOutputTemp");
+            }
+
+            // Give the loop a private copy of the variable pointers. Stores to the output can't change it, so
+            // once the stages are inlined the pointer loads are hoisted and the vectorizer sees plain strided accesses.
+            Value *localBlock = Builder.CreateAlloca(doublePtrTy, ConstantInt::get(i32Ty, std::max(info.numBlockSlots, 1)), "localVarBlock");
+            Value *varBlockAsDoublePtrPtr = createLoad(Builder, varBlockDoublePtrPtrVar);
+            for (int slot = 0; slot < info.numBlockSlots; slot++) {
+                Value *slotIndex = ConstantInt::get(i32Ty, slot);
+                Builder.CreateStore(createLoad(Builder, createGEP(Builder, varBlockAsDoublePtrPtr, slotIndex)),
+                                    createGEP(Builder, localBlock, slotIndex));
+            }
+            Builder.CreateStore(localBlock, varBlockDoublePtrPtrVar);
+
+            // Compute groups of points with the lane-wide code while a whole group is left, the scalar loop does the
+            // rest. An outputVarBlockOffset argument naming an entry read uniformly keeps to the scalar loop.
+            if (!laneFunctions.empty()) {
+                BasicBlock *lanesCmpBlock = BasicBlock::Create(*_llvmContext, "lanesCmp", FLOOP, loopCmpBlock);
+                BasicBlock *lanesRepeatBlock = BasicBlock::Create(*_llvmContext, "lanesRepeat", FLOOP, loopCmpBlock);
+                Value *useLanes = ConstantInt::getTrue(*_llvmContext);
+                for (const Stage &stage : stages)
+                    if (stage.outputVarBlockOffset < 0)
+                        for (int slot : info.uniformBlockSlots)
+                            useLanes = Builder.CreateAnd(
+                                useLanes, Builder.CreateICmpNE(outputVarBlockOffsetArg, ConstantInt::get(i32Ty, slot)));
+                Builder.CreateCondBr(useLanes, lanesCmpBlock, loopCmpBlock);
+
+                Builder.SetInsertPoint(lanesCmpBlock);
+                Value *groupEnd = Builder.CreateAdd(createLoad(Builder, indexVar), ConstantInt::get(i32Ty, lanes));
+                Builder.CreateCondBr(Builder.CreateICmpULE(groupEnd, createLoad(Builder, rangeEndVar)),
+                                     lanesRepeatBlock, loopCmpBlock);
+
+                Builder.SetInsertPoint(lanesRepeatBlock);
+                for (size_t stageIndex = 0; stageIndex < stages.size(); stageIndex++) {
+                    Value *floatOutput = floatOutputConds[stageIndex] ? floatOutputConds[stageIndex]
+                                                                      : ConstantInt::getFalse(*_llvmContext);
+                    Builder.CreateCall(laneFunctions[stageIndex],
+                                       {outputBasePtrs[stageIndex], createLoad(Builder, varBlockDoublePtrPtrVar),
+                                        createLoad(Builder, indexVar), floatOutput});
+                }
+                Builder.CreateStore(
+                    Builder.CreateAdd(createLoad(Builder, indexVar), ConstantInt::get(i32Ty, lanes)), indexVar);
+                Builder.CreateBr(lanesCmpBlock);
+            } else {
+                Builder.CreateBr(loopCmpBlock);
+            }
             Builder.SetInsertPoint(loopCmpBlock);
-            Value *cond = Builder.CreateICmpULT(Builder.CreateLoad(indexVar), Builder.CreateLoad(rangeEndVar));
+            Value *cond = Builder.CreateICmpULT(createLoad(Builder, indexVar), createLoad(Builder, rangeEndVar));
             Builder.CreateCondBr(cond, loopRepeatBlock, loopEndBlock);
 
             Builder.SetInsertPoint(loopRepeatBlock);
-            Value *myOutputPtr = Builder.CreateGEP(nullptr, outputBasePtr, Builder.CreateMul(dimValue, Builder.CreateLoad(indexVar)));
-            Builder.CreateCall(F, {myOutputPtr, Builder.CreateLoad(varBlockDoublePtrPtrVar), Builder.CreateLoad(indexVar)});
+            for (size_t stageIndex = 0; stageIndex < stages.size(); stageIndex++) {
+                int dim = stages[stageIndex].desiredReturnType.dim();
+                Value *dimValue = ConstantInt::get(i32Ty, dim);
+                Value *elementIndex = Builder.CreateMul(dimValue, createLoad(Builder, indexVar));
+                Value *myOutputPtr = createGEP(Builder, outputBasePtrs[stageIndex], elementIndex);
+                if (!floatOutputConds[stageIndex]) {
+                    Builder.CreateCall(pointFunctions[stageIndex], {myOutputPtr, createLoad(Builder, varBlockDoublePtrPtrVar), createLoad(Builder, indexVar)});
+                    continue;
+                }
+
+                BasicBlock *floatOutputBlock = BasicBlock::Create(*_llvmContext, "floatOutput", FLOOP, loopIncBlock);
+                BasicBlock *doubleOutputBlock = BasicBlock::Create(*_llvmContext, "doubleOutput", FLOOP, loopIncBlock);
+                BasicBlock *outputStoredBlock = BasicBlock::Create(*_llvmContext, "outputStored", FLOOP, loopIncBlock);
+                Builder.CreateCondBr(floatOutputConds[stageIndex], floatOutputBlock, doubleOutputBlock);
+
+                Builder.SetInsertPoint(doubleOutputBlock);
+                Builder.CreateCall(pointFunctions[stageIndex], {myOutputPtr, createLoad(Builder, varBlockDoublePtrPtrVar), createLoad(Builder, indexVar)});
+                Builder.CreateBr(outputStoredBlock);
+
+                Builder.SetInsertPoint(floatOutputBlock);
+                Builder.CreateCall(pointFunctions[stageIndex], {floatTemps[stageIndex], createLoad(Builder, varBlockDoublePtrPtrVar), createLoad(Builder, indexVar)});
+                Value *floatBasePtr = Builder.CreatePointerCast(outputBasePtrs[stageIndex], Type::getFloatPtrTy(*_llvmContext));
+                for (int component = 0; component < dim; component++) {
+                    Value *componentIndex = ConstantInt::get(i32Ty, component);
+                    Value *value = createLoad(Builder, createGEP(Builder, floatTemps[stageIndex], componentIndex));
+                    Builder.CreateStore(Builder.CreateFPTrunc(value, Type::getFloatTy(*_llvmContext)),
+                                        createGEP(Builder, floatBasePtr, Builder.CreateAdd(elementIndex, componentIndex)));
+                }
+                Builder.CreateBr(outputStoredBlock);
+
+                Builder.SetInsertPoint(outputStoredBlock);
+            }
 
             Builder.CreateBr(loopIncBlock);
 
             Builder.SetInsertPoint(loopIncBlock);
-            Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(indexVar), oneValue), indexVar);
-            Builder.CreateBr(loopCmpBlock);
+            Builder.CreateStore(Builder.CreateAdd(createLoad(Builder, indexVar), oneValue), indexVar);
+            BranchInst *backEdge = Builder.CreateBr(loopCmpBlock);
+
+            // Without lane-wide code ask for the loop to be vectorized (remainder iterations are left to the
+            // vectorizer's epilogue), compileLLVM records whether it was. With it the loop only computes the few
+            // points left over and is kept scalar.
+            Metadata *vectorizeEnable[] = {
+                MDString::get(*_llvmContext, "llvm.loop.vectorize.enable"),
+                ConstantAsMetadata::get(ConstantInt::get(Type::getInt1Ty(*_llvmContext), laneFunctions.empty()))};
+            SmallVector<Metadata *, 2> loopProperties(1);
+            loopProperties.push_back(MDNode::get(*_llvmContext, vectorizeEnable));
+            MDNode *loopID = MDNode::getDistinct(*_llvmContext, loopProperties);
+            loopID->replaceOperandWith(0, loopID);
+            backEdge->setMetadata(LLVMContext::MD_loop, loopID);
 
             Builder.SetInsertPoint(loopEndBlock);
             Builder.CreateRetVoid();
@@ -310,83 +1106,475 @@ class LLVMEvaluator {
         //     TheModule->print(llvm::errs(), nullptr);
         // }
         Module *altModule = TheModule.get();
-        std::string ErrStr;
-        TheExecutionEngine.reset(EngineBuilder(std::move(TheModule))
-                                     .setErrorStr(&ErrStr)
-                                 //     .setUseMCJIT(true)
-                                     .setOptLevel(CodeGenOpt::Aggressive)
-                                     .create());
-
-        altModule->setDataLayout(TheExecutionEngine->getDataLayout());
-
-        // Add bindings to C linkage helper functions
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalFPVarRefFunc, (void *)SeExpr2LLVMEvalFPVarRef);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalStrVarRefFunc, (void *)SeExpr2LLVMEvalStrVarRef);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalCustomFunctionFunc, (void *)SeExpr2LLVMEvalCustomFunction);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalstrlenFunc, (void *)strlen);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalstrcatFunc, (void *)strcat);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalstrcmpFunc, (void *)strcmp);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalmemsetFunc, (void *)memset);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalmallocFunc, (void *)malloc);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalfreeFunc, (void *)free);
+        altModule->setDataLayout(executionEngine->getDataLayout());
+
+        // Bring in the builtins from the embedded bitcode so the optimizer sees through the calls
+        bool linkedBuiltins = false;
+#ifdef SEEXPR_ENABLE_BUILTIN_BITCODE
+        linkedBuiltins = linkBuiltins(*altModule, info);
+#endif
 
         // [verify]
         std::string errorStr;
         llvm::raw_string_ostream raw(errorStr);
         if (llvm::verifyModule(*altModule, &raw)) {
-            parseTree->addError(ErrorCode::Unknown, { raw.str() });
+            stages[0].parseTree->addError(ErrorCode::Unknown, { raw.str() });
             return false;
         }
 
-        // Setup optimization
+        _generated.reset(new GeneratedCode);
+        _generated->module = std::move(TheModule);
+        _generated->pointFunctions = pointFunctions;
+        _generated->loopFunction = FLOOP;
+        _generated->standardFunctions = info.standardFunctions;
+        _generated->desiredReturnType = stages[0].desiredReturnType;
+        _generated->optLevel = optLevel;
+        _generated->laneWidth = laneFunctions.empty() ? 0 : lanes;
+        _generated->cachedObject = std::move(cachedObject);
+        _generated->linkedBuiltins = linkedBuiltins;
+        _generated->name = uniqueName;
+        _generated->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - compileStart).count();
+        return true;
+    }
+
+    /// Second half of prepLLVM, optimizing the code generateLLVM made and loading it into the engine. It only
+    /// touches LLVM state, so it may run on another thread after generateLLVM returned.
+    bool compileLLVM() {
+        using namespace llvm;
+        LLVMSession &session = LLVMSession::instance();
+        std::lock_guard<std::mutex> lock(session.mutex());
+        auto compileStart = std::chrono::steady_clock::now();
+        if (!_generated) return false;
+        std::unique_ptr<GeneratedCode> generated(std::move(_generated));
+        std::unique_ptr<Module> TheModule(std::move(generated->module));
+        int optLevel = generated->optLevel;
+        bool cachedObject = generated->cachedObject != nullptr;
+        bool loopVectorized = false;
+        std::string vectorizeRemarks;
+        std::vector<std::string> inlinedBuiltins;
+
+        // Optimize (not needed when the engine will load the machine code from the cache)
+        if (!cachedObject) {
+            optimizeModule(*TheModule, generated->pointFunctions, generated->loopFunction, optLevel,
+                           generated->linkedBuiltins, loopVectorized, vectorizeRemarks);
+#ifdef SEEXPR_ENABLE_BUILTIN_BITCODE
+            if (generated->linkedBuiltins)
+                inlinedBuiltins = findInlinedBuiltins(*TheModule, generated->standardFunctions);
+#endif
+        }
+
+        // Keep the module to load it again if its code gets evicted
+        _reloadable.bitcode.clear();
+        raw_svector_ostream bitcodeStream(_reloadable.bitcode);
+#if LLVM_VERSION_MAJOR >= 7
+        WriteBitcodeToFile(*TheModule, bitcodeStream);
+#else
+        WriteBitcodeToFile(TheModule.get(), bitcodeStream);
+#endif
+        _reloadable.name = generated->name;
+        _reloadable.optimized = !cachedObject;
+        _reloadable.linkedBuiltins = generated->linkedBuiltins;
+        _reloadable.standardFunctions = generated->standardFunctions;
+        _reloadable.desiredReturnType = generated->desiredReturnType;
+
+        if (cachedObject) session.objectCache()->provideObject(_moduleName, std::move(generated->cachedObject));
+        if (!loadModule(session, std::move(TheModule), generated->name, optLevel)) {
+            releaseCode(session);
+            return false;
+        }
+
+        if (Expression::debugging) {
+            #ifdef DEBUG
+            std::cerr << "Pre verified LLVM byte code " << std::endl;
+            _module->print(llvm::errs(), nullptr);
+            #endif
+        }
+
+        _compiledOptLevel = optLevel;
+        _loadedFromCache = cachedObject;
+        _loopVectorized = loopVectorized;
+        _laneWidth = generated->laneWidth;
+        _vectorizeRemarks = vectorizeRemarks;
+        _inlinedBuiltins = inlinedBuiltins;
+        _compileSeconds =
+            generated->seconds + std::chrono::duration<double>(std::chrono::steady_clock::now() - compileStart).count();
+        session.compileSeconds() += _compileSeconds;
+        if (Expression::debugging)
+            std::cerr << "LLVM compilation at -O" << optLevel << (cachedObject ? " (cached)" : "") << " took "
+                      << _compileSeconds * 1000 << " ms for " << _codeBytes << " bytes"
+                      << (loopVectorized ? ", loop vectorized" : "")
+                      << (_laneWidth ? ", " + std::to_string(_laneWidth) + " lanes" : std::string()) << std::endl
+                      << vectorizeRemarks;
+
+        _lastUse.store(session.epoch(), std::memory_order_relaxed);
+        _evicted.store(false);
+        _failed.store(false);
+        trimCodeCache(session, this);
+
+        return true;
+    }
+
+  private:
+    /// Runs the optimization passes of optLevel over the module, telling whether the loop function was vectorized
+    /// and what the loop vectorizer said about it
+    void optimizeModule(llvm::Module &module,
+                        const std::vector<llvm::Function *> &pointFunctions,
+                        llvm::Function *loopFunction,
+                        int optLevel,
+                        bool linkedBuiltins,
+                        bool &loopVectorized,
+                        std::string &vectorizeRemarks) {
         llvm::PassManagerBuilder builder;
         std::unique_ptr<llvm::legacy::PassManager> pm(new llvm::legacy::PassManager);
-        std::unique_ptr<llvm::legacy::FunctionPassManager> fpm(new llvm::legacy::FunctionPassManager(altModule));
-        builder.OptLevel = 3;
+        std::unique_ptr<llvm::legacy::FunctionPassManager> fpm(new llvm::legacy::FunctionPassManager(&module));
+        builder.OptLevel = optLevel;
+        builder.LoopVectorize = optLevel >= 2;
+        builder.SLPVectorize = optLevel >= 2;
+        // without the target's cost model the vectorizers assume there are no vector registers
+        if (llvm::TargetMachine *targetMachine = _engine->executionEngine->getTargetMachine()) {
+            pm->add(llvm::createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+            fpm->add(llvm::createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+        }
 #if (LLVM_VERSION_MAJOR >= 4)
-        builder.Inliner = llvm::createAlwaysInlinerLegacyPass();
+        // the builtins' own callees (noise octaves, ...) are only worth inlining with the regular inliner
+        builder.Inliner = linkedBuiltins && optLevel >= 2
+                              ? llvm::createFunctionInliningPass(builder.OptLevel, builder.SizeLevel, false)
+                              : llvm::createAlwaysInlinerLegacyPass();
 #else
         builder.Inliner = llvm::createAlwaysInlinerPass();
 #endif
         builder.populateModulePassManager(*pm);
         // fpm->add(new llvm::DataLayoutPass());
         builder.populateFunctionPassManager(*fpm);
-        fpm->run(*F);
-        fpm->run(*FLOOP);
-        pm->run(*altModule);
+#if LLVM_VERSION_MAJOR >= 6
+        // the vectorize hint of the loop is only a request, find out what came of it
+        LLVMVectorizeRemarks *remarks = new LLVMVectorizeRemarks(loopFunction);
+        std::unique_ptr<llvm::DiagnosticHandler> previousHandler = _llvmContext->getDiagnosticHandler();
+        _llvmContext->setDiagnosticHandler(std::unique_ptr<llvm::DiagnosticHandler>(remarks));
+#endif
+        for (llvm::Function *F : pointFunctions) fpm->run(*F);
+        fpm->run(*loopFunction);
+        pm->run(module);
+#if LLVM_VERSION_MAJOR >= 6
+        loopVectorized = remarks->vectorized();
+        vectorizeRemarks = remarks->remarks();
+        _llvmContext->setDiagnosticHandler(std::move(previousHandler));
+#endif
+    }
 
-        // Create the JIT.  This takes ownership of the module.
+    /// Hands the module, whose functions are named after name, to the engine, which takes ownership of it, loads its
+    /// code and points evaluation at it. Returns false if the functions cannot be found (call with the session
+    /// mutex held).
+    bool loadModule(LLVMSession &session, std::unique_ptr<llvm::Module> module, const std::string &name, int optLevel) {
+        using namespace llvm;
+        ExecutionEngine *executionEngine = _engine->executionEngine.get();
+        Module *altModule = module.get();
+        executionEngine->addModule(std::move(module));
+        _module = altModule;
 
-        if (!TheExecutionEngine) {
-            fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
-            exit(1);
+        // Add bindings to C linkage helper functions (by symbol name, so remapping for each module is harmless)
+        const std::pair<const char *, void *> helpers[] = {
+            {"SeExpr2LLVMEvalFPVarRef", (void *)SeExpr2LLVMEvalFPVarRef},
+            {"SeExpr2LLVMEvalStrVarRef", (void *)SeExpr2LLVMEvalStrVarRef},
+            {"SeExpr2LLVMEvalCustomFunction", (void *)SeExpr2LLVMEvalCustomFunction},
+            {"strlen", (void *)strlen},
+            {"strcat", (void *)strcat},
+            {"strcmp", (void *)strcmp},
+            {"memset", (void *)memset},
+            {"malloc", (void *)malloc},
+            {"free", (void *)free}};
+        for (auto &helper : helpers)
+            if (Function *declaration = altModule->getFunction(helper.first))
+                executionEngine->updateGlobalMapping(declaration, helper.second);
+        for (auto &standardFunction : _reloadable.standardFunctions) {
+            Function *declaration = altModule->getFunction(llvmStandardFunctionSymbol(standardFunction.first));
+            if (declaration && declaration->isDeclaration())
+                executionEngine->updateGlobalMapping(declaration, standardFunction.second);
         }
 
-        TheExecutionEngine->finalizeObject();
-        void *fp = TheExecutionEngine->getPointerToFunction(F);
-        void *fpLoop = TheExecutionEngine->getPointerToFunction(FLOOP);
-        if (desireFP) {
-            _llvmEvalFP.reset(new LLVMEvaluationContext<double>);
+        // Only the modules added since the last call are compiled, at the level of this one
+        if (TargetMachine *targetMachine = executionEngine->getTargetMachine())
+            targetMachine->setOptLevel(static_cast<CodeGenOpt::Level>(optLevel));
+        _moduleMemory.reset(new LLVMModuleMemoryManager::ModuleMemory);
+        _engine->memoryManager->beginModule(_moduleMemory.get());
+        executionEngine->finalizeObject();
+        Function *pointFunction = altModule->getFunction(name + "_func");
+        Function *loopFunction = altModule->getFunction(name + "_loopfunc");
+        void *fp = pointFunction ? executionEngine->getPointerToFunction(pointFunction) : nullptr;
+        void *fpLoop = loopFunction ? executionEngine->getPointerToFunction(loopFunction) : nullptr;
+        _engine->memoryManager->beginModule(nullptr);
+        _codeBytes = _moduleMemory->bytes;
+        session.evaluators().insert(this);
+        if (!fp || !fpLoop) return false;
+
+        unsigned int dimDesired = (unsigned)_reloadable.desiredReturnType.dim();
+        if (_reloadable.desiredReturnType.isFP()) {
+            if (!_llvmEvalFP) _llvmEvalFP.reset(new LLVMEvaluationContext<double>);
             _llvmEvalFP->init(fp, fpLoop, dimDesired);
         } else {
-            _llvmEvalStr.reset(new LLVMEvaluationContext<char *>);
+            if (!_llvmEvalStr) _llvmEvalStr.reset(new LLVMEvaluationContext<char *>);
             _llvmEvalStr->init(fp, fpLoop, dimDesired);
         }
+        return true;
+    }
 
-        if (Expression::debugging) {
-            #ifdef DEBUG
-            std::cerr << "Pre verified LLVM byte code " << std::endl;
-            altModule->print(llvm::errs(), nullptr);
-            #endif
+    /// Loads the code trimCodeCache evicted again from its bitcode, into the engine taking new modules. Returns
+    /// false if that fails (call with the session mutex held).
+    bool reloadCode(LLVMSession &session) {
+        std::string errStr;
+        _engine = session.acquireEngine(errStr);
+        if (!_engine) return false;
+        llvm::MemoryBufferRef bitcode(llvm::StringRef(_reloadable.bitcode.data(), _reloadable.bitcode.size()),
+                                      _reloadable.name);
+        auto parsed = llvm::parseBitcodeFile(bitcode, session.context());
+        if (!parsed) {
+#if LLVM_VERSION_MAJOR >= 4
+            llvm::consumeError(parsed.takeError());
+#endif
+            releaseCode(session);
+            return false;
+        }
+        std::unique_ptr<llvm::Module> module(std::move(*parsed));
+
+        // the engine may still know the symbols of the evicted code, so its functions get new names
+        std::string name = session.uniqueName();
+        std::vector<llvm::Function *> pointFunctions;
+        llvm::Function *loopFunction = nullptr;
+        for (llvm::Function &function : *module) {
+            std::string functionName = function.getName().str();
+            if (function.isDeclaration() || functionName.compare(0, _reloadable.name.size(), _reloadable.name) != 0)
+                continue;
+            function.setName(name + functionName.substr(_reloadable.name.size()));
+            if (functionName == _reloadable.name + "_loopfunc")
+                loopFunction = &function;
+            else
+                pointFunctions.push_back(&function);
+        }
+        _moduleName = name + "_module";
+        module->setModuleIdentifier(_moduleName);
+        _engine->moduleNames.insert(_moduleName);
+        if (!_reloadable.optimized && loopFunction) {
+            bool loopVectorized = false;
+            std::string vectorizeRemarks;
+            optimizeModule(*module, pointFunctions, loopFunction, _compiledOptLevel, _reloadable.linkedBuiltins,
+                           loopVectorized, vectorizeRemarks);
+        }
+        if (!loadModule(session, std::move(module), name, _compiledOptLevel)) {
+            releaseCode(session);
+            return false;
         }
+        if (Expression::debugging)
+            std::cerr << "loaded evicted LLVM code again, " << _codeBytes << " bytes" << std::endl;
 
+        _lastUse.store(session.epoch(), std::memory_order_relaxed);
+        _evicted.store(false);
+        trimCodeCache(session, this);
         return true;
     }
 
-    std::string getUniqueName() const {
+    /// Evicts the code of the least recently used expressions until the engines hold no more than the code budget,
+    /// and the code left in retired engines so that those can go (see LLVMSession::retired), skipping keep and the
+    /// expressions whose code is running (call with the session mutex held).
+    static void trimCodeCache(LLVMSession &session, const LLVMEvaluator *keep) {
+        size_t budget = session.codeBudget();
+        bool overBudget = budget && session.residentBytes() > budget;
+        if (!overBudget && !session.anyRetired()) return;
+        if (overBudget) session.advanceEpoch();
+
+        std::vector<std::pair<uint64_t, LLVMEvaluator *>> order;
+        for (LLVMEvaluator *evaluator : session.evaluators())
+            if (evaluator != keep) order.emplace_back(evaluator->_lastUse.load(std::memory_order_relaxed), evaluator);
+        std::sort(order.begin(), order.end());
+
+        int evicted = 0;
+        for (auto &entry : order) {
+            LLVMEvaluator *evaluator = entry.second;
+            if (!session.retired(evaluator->_engine) && (!budget || session.residentBytes() <= budget)) continue;
+            // marked evicted before checking for users, pairs with acquireCode
+            evaluator->_evicted.store(true);
+            if (evaluator->_users.load()) {
+                evaluator->_evicted.store(false);
+                continue;
+            }
+            evaluator->releaseCode(session);
+            evicted++;
+        }
+        if (Expression::debugging && evicted)
+            std::cerr << "evicted the LLVM code of " << evicted << " expressions" << std::endl;
+    }
+
+    /// What the generated code refers to outside of the variable block
+    struct CodeInfo {
+        /// False if the code embeds addresses of objects in this process (var refs, custom functions, ...)
+        bool cacheable = true;
+        /// Variables and functions the code was generated for
+        std::ostringstream signature;
+        /// Number of variable block entries the code reads
+        int numBlockSlots = 0;
+        /// Standard functions called through llvmStandardFunctionSymbol()
+        std::map<std::string, void *> standardFunctions;
+        /// Size of the parse trees
+        int numNodes = 0;
+        /// Variable block entries read as uniform (the same value for every point)
+        std::set<int> uniformBlockSlots;
+    };
+
+    /// Variable block entries the stage may store its result to that hold floats
+    static std::vector<int> floatOutputs(const Stage &stage) {
+        std::vector<int> offsets;
+        if (!stage.varBlockCreator || !stage.desiredReturnType.isFP()) return offsets;
+        for (int offset = 0; offset < stage.varBlockCreator->numVariables(); offset++)
+            if (stage.varBlockCreator->precision(offset) == VarBlockCreator::Precision::Float &&
+                (stage.outputVarBlockOffset < 0 || stage.outputVarBlockOffset == offset))
+                offsets.push_back(offset);
+        return offsets;
+    }
+
+    /// Whether some ExprFuncSimple call below node has not built its data yet
+    static bool needsCustomFunctionData(const ExprNode *node) {
+        if (const ExprFuncNode *funcNode = dynamic_cast<const ExprFuncNode *>(node))
+            if (funcNode->func() && !funcNode->getData() &&
+                dynamic_cast<const ExprFuncSimple *>(funcNode->func()->funcx()))
+                return true;
+        for (int i = 0; i < node->numChildren(); i++)
+            if (needsCustomFunctionData(node->child(i))) return true;
+        return false;
+    }
+
+    /// Build the data of the ExprFuncSimple calls once before generating code that hands it to them. Their data
+    /// is built along with an interpreter program, which also computes the constant arguments evalConstant reads.
+    static void prepareCustomFunctionData(const ExprNode *parseTree) {
+        if (!needsCustomFunctionData(parseTree)) return;
+        Interpreter interpreter;
+        parseTree->buildInterpreter(&interpreter);
+    }
+
+#ifdef SEEXPR_ENABLE_BUILTIN_BITCODE
+    /// True if func is the builtin the embedded bitcode defines for name (and not a function the host registered)
+    static bool isBitcodeBuiltin(const std::string &name, void *func) {
+#define SEEXPR_BITCODE_ADDRESS(name, func, type) {#name, (void *)static_cast<ExprFuncStandard::type *>(func)},
+        static const std::map<std::string, void *> builtins = {SEEXPR_BITCODE_BUILTINS(SEEXPR_BITCODE_ADDRESS)};
+#undef SEEXPR_BITCODE_ADDRESS
+        auto it = builtins.find(name);
+        return it != builtins.end() && it->second == func;
+    }
+
+    /// Link the definitions of the builtins the module calls from the embedded bitcode. They become internal to the
+    /// module and always inlined. Returns false if there were none (or the bitcode cannot be read).
+    static bool linkBuiltins(llvm::Module &module, const CodeInfo &info) {
+        std::set<std::string> symbols;
+        for (auto &standardFunction : info.standardFunctions)
+            if (isBitcodeBuiltin(standardFunction.first, standardFunction.second))
+                symbols.insert(llvmStandardFunctionSymbol(standardFunction.first));
+        if (symbols.empty()) return false;
+
+        // lazily loaded, so only the functions that get linked are read
+        llvm::StringRef bitcode(reinterpret_cast<const char *>(builtinsBitcode), builtinsBitcodeSize);
+        llvm::Expected<std::unique_ptr<llvm::Module>> builtins =
+            llvm::getLazyBitcodeModule(llvm::MemoryBufferRef(bitcode, "SeExpr2Builtins"), module.getContext());
+        if (!builtins) {
+            llvm::consumeError(builtins.takeError());
+            return false;
+        }
+        // hide the entry points the module must not link, i.e. the ones whose name the host gave another function
+        const std::string prefix = llvmStandardFunctionSymbol("");
+        for (llvm::Function &function : **builtins) {
+            std::string name = function.getName().str();
+            if (name.compare(0, prefix.size(), prefix) != 0) continue;
+            llvm::Function *declaration = module.getFunction(name);
+            if (!symbols.count(name) || !declaration || declaration->getFunctionType() != function.getFunctionType())
+                function.setName(name + ".unused");
+        }
+        (*builtins)->setDataLayout(module.getDataLayout());
+        (*builtins)->setTargetTriple(module.getTargetTriple());
+        bool failed = llvm::Linker::linkModules(
+            module, std::move(*builtins), llvm::Linker::LinkOnlyNeeded,
+            [](llvm::Module &linkedModule, const llvm::StringSet<> &linked) {
+                llvm::internalizeModule(linkedModule, [&linked](const llvm::GlobalValue &value) {
+                    return !value.hasName() || !linked.count(value.getName());
+                });
+            });
+        if (failed) return false;
+
+        bool linkedAny = false;
+        for (const std::string &symbol : symbols) {
+            llvm::Function *function = module.getFunction(symbol);
+            if (!function || function->isDeclaration()) continue;
+            function->addFnAttr(llvm::Attribute::AlwaysInline);
+            linkedAny = true;
+        }
+        return linkedAny;
+    }
+
+    /// The linked builtins no optimized function calls anymore. They were internal to the module, so they have
+    /// been inlined into every caller.
+    static std::vector<std::string> findInlinedBuiltins(llvm::Module &module,
+                                                        const std::map<std::string, void *> &standardFunctions) {
+        std::vector<std::string> inlined;
+        for (auto &standardFunction : standardFunctions) {
+            if (!isBitcodeBuiltin(standardFunction.first, standardFunction.second)) continue;
+            llvm::Function *function = module.getFunction(llvmStandardFunctionSymbol(standardFunction.first));
+            if (!function || (!function->isDeclaration() && function->use_empty()))
+                inlined.push_back(standardFunction.first);
+        }
+        return inlined;
+    }
+#endif
+
+    static void collectCodeInfo(const ExprNode *node, CodeInfo &info) {
+        info.numNodes++;
+        if (const ExprVarNode *varNode = dynamic_cast<const ExprVarNode *>(node)) {
+            if (const VarBlockCreator::Ref *ref = dynamic_cast<const VarBlockCreator::Ref *>(varNode->codegenVar())) {
+                info.signature << "var " << varNode->name() << " " << ref->type().toString() << " " << ref->offset()
+                               << " " << ref->stride()
+                               << (ref->precision() == VarBlockCreator::Precision::Float ? " float" : "") << "\n";
+                info.numBlockSlots = std::max(info.numBlockSlots, (int)ref->offset() + 1);
+                if (ref->type().isLifetimeUniform()) info.uniformBlockSlots.insert(ref->offset());
+            } else if (varNode->codegenVar()) {
+                info.cacheable = false;
+            }
+        } else if (const ExprFuncNode *funcNode = dynamic_cast<const ExprFuncNode *>(node)) {
+            const ExprFuncStandard *standard =
+                funcNode->func() ? dynamic_cast<const ExprFuncStandard *>(funcNode->func()->funcx()) : nullptr;
+            if (standard) {
+                info.signature << "func " << funcNode->name() << " " << standard->getFuncType();
+#ifdef SEEXPR_ENABLE_BUILTIN_BITCODE
+                if (isBitcodeBuiltin(funcNode->name(), standard->getFuncPointer())) info.signature << " bitcode";
+#endif
+                info.signature << "\n";
+                info.standardFunctions[funcNode->name()] = standard->getFuncPointer();
+            } else if (strcmp(funcNode->name(), "printf") != 0) {
+                info.cacheable = false;
+            }
+        } else if (dynamic_cast<const ExprBinaryOpNode *>(node) && node->type().isString()) {
+            // string concatenation keeps its result in the node
+            info.cacheable = false;
+        }
+        for (int i = 0; i < node->numChildren(); i++) collectCodeInfo(node->child(i), info);
+    }
+
+    /// Points the lane-wide code computes at once: as many doubles as the host's widest vector registers hold, but
+    /// at least 4 (LLVM splits vectors wider than the registers)
+    static unsigned hostLaneWidth() {
+        llvm::StringMap<bool> features;
+        return llvm::sys::getHostCPUFeatures(features) && features.lookup("avx512f") ? 8 : 4;
+    }
+
+    /// Hash of everything the generated machine code depends on
+    static std::string fingerprint(const ExprNode *parseTree, const ExprType &desiredReturnType, const CodeInfo &info) {
+        std::ostringstream key;
+        key << "SeExpr2 JIT 1 LLVM " << LLVM_VERSION_STRING << " " << llvm::sys::getProcessTriple() << " "
+            << llvm::sys::getHostCPUName().str() << "\n" << desiredReturnType.toString() << "\n"
+            << parseTree->expr()->getExpr() << "\n" << info.signature.str();
+        // 64 bit FNV-1a
+        uint64_t hash = 14695981039346656037ULL;
+        for (char c : key.str()) {
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211ULL;
+        }
         std::ostringstream o;
-        o << std::setbase(16) << (uint64_t)(this);
-        return ("_" + o.str());
+        o << std::setbase(16) << std::setw(16) << std::setfill('0') << hash;
+        return o.str();
     }
 };
 
@@ -402,7 +1590,21 @@ class LLVMEvaluator {
         unsupported();
         return 0;
     }
-    bool prepLLVM(ExprNode *parseTree, ExprType desiredReturnType) {
+    const char *evalStr(VarBlock *varBlock, char **out) const {
+        throw std::runtime_error("LLVM is not enabled in build");
+    }
+    const double *evalFP(VarBlock *varBlock, double *out) const {
+        throw std::runtime_error("LLVM is not enabled in build");
+    }
+    bool prepLLVM(ExprNode *parseTree, ExprType desiredReturnType, const VarBlockCreator *varBlockCreator = nullptr) {
+        unsupported();
+        return false;
+    }
+    bool generateLLVM(ExprNode *parseTree, ExprType desiredReturnType, const VarBlockCreator *varBlockCreator = nullptr) {
+        unsupported();
+        return false;
+    }
+    bool compileLLVM() {
         unsupported();
         return false;
     }
@@ -410,6 +1612,20 @@ class LLVMEvaluator {
         unsupported();
     }
     void debugPrint() {}
+    bool failed() const { return false; }
+    void setOptLevel(Expression::JitOptLevel level, bool hot = false) {}
+    int compiledOptLevel() const { return -1; }
+    double compileSeconds() const { return 0; }
+    bool loadedFromCache() const { return false; }
+    bool loopVectorized() const { return false; }
+    int laneWidth() const { return 0; }
+    std::string vectorizeRemarks() const { return std::string(); }
+    std::vector<std::string> inlinedBuiltins() const { return std::vector<std::string>(); }
+    static double totalCompileSeconds() { return 0; }
+    size_t codeBytes() const { return 0; }
+    static size_t residentBytes() { return 0; }
+    static void setCodeBudget(size_t bytes) {}
+    static size_t codeBudget() { return 0; }
 };
 #endif
 
@@ -24,8 +24,10 @@
 #include <algorithm>
 #include <cfloat>
 #include <random>
+#include <type_traits>
 
 #include "ExprFunc.h"
+#include "ExprFuncStandard.h"
 #include "ExprNode.h"
 #include "Vec.h"
 #include "Curve.h"
@@ -1982,5 +1984,39 @@ void defineBuiltins(ExprFunc::Define define, ExprFunc::Define3 define3) {
     //        FUNCNDOC(testfunc,2,2);
 
     FUNCNDOC(sprintf, 1, -1);
+
+// the interpreter calls the hot functions directly
+#define INLINE(name, func) \
+    inlineStandardFunc<std::remove_pointer<decltype(standardFuncType(func))>::type, func>(name)
+    INLINE("abs", ::fabs);
+    INLINE("ceil", ::ceil);
+    INLINE("cos", ::cos);
+    INLINE("exp", ::exp);
+    INLINE("floor", ::floor);
+    INLINE("log", ::log);
+    INLINE("sin", ::sin);
+    INLINE("sqrt", ::sqrt);
+    INLINE("tan", ::tan);
+    INLINE("atan2", ::atan2);
+    INLINE("fmod", ::fmod);
+    INLINE("pow", ::pow);
+    INLINE("clamp", SeExpr2::clamp);
+    INLINE("round", SeExpr2::round);
+    INLINE("max", SeExpr2::max);
+    INLINE("min", SeExpr2::min);
+    INLINE("boxstep", SeExpr2::boxstep);
+    INLINE("linearstep", SeExpr2::linearstep);
+    INLINE("smoothstep", SeExpr2::smoothstep);
+    INLINE("mix", SeExpr2::mix);
+    INLINE("fit", SeExpr2::fit);
+    INLINE("noise", SeExpr2::noise);
+    INLINE("snoise", SeExpr2::snoise);
+    INLINE("fbm", SeExpr2::fbm);
+    INLINE("turbulence", SeExpr2::turbulence);
+    INLINE("cellnoise", SeExpr2::cellnoise);
+    INLINE("length", SeExpr2::length);
+    INLINE("dist", SeExpr2::dist);
+    INLINE("dot", SeExpr2::dot);
+#undef INLINE
 }
 }
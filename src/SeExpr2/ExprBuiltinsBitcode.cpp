@@ -0,0 +1,62 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+
+// Not part of the library: the build compiles this file along with ExprBuiltins.cpp and Noise.cpp to LLVM
+// bitcode, which the LLVM backend links into the modules it generates (see LLVMEvaluator::linkBuiltins).
+
+#include "ExprBuiltins.h"
+#include "ExprBuiltinsBitcode.h"
+#include "Vec.h"
+
+namespace {
+inline const SeExpr2::Vec3d& vec(const double* v) { return *reinterpret_cast<const SeExpr2::Vec3d*>(v); }
+inline const SeExpr2::Vec3d* vecs(const double* v) { return reinterpret_cast<const SeExpr2::Vec3d*>(v); }
+inline void store(double* out, const SeExpr2::Vec3d& v) {
+    out[0] = v[0];
+    out[1] = v[1];
+    out[2] = v[2];
+}
+}
+
+// Entry points with the signatures of getSeExprFuncStandardLLVMType()
+#define SEEXPR_BITCODE_Func1(name, func) \
+    double SeExpr2Std_##name(double a) { return func(a); }
+#define SEEXPR_BITCODE_Func2(name, func) \
+    double SeExpr2Std_##name(double a, double b) { return func(a, b); }
+#define SEEXPR_BITCODE_Func3(name, func) \
+    double SeExpr2Std_##name(double a, double b, double c) { return func(a, b, c); }
+#define SEEXPR_BITCODE_Func5(name, func) \
+    double SeExpr2Std_##name(double a, double b, double c, double d, double e) { return func(a, b, c, d, e); }
+#define SEEXPR_BITCODE_Func1v(name, func) \
+    double SeExpr2Std_##name(double* a) { return func(vec(a)); }
+#define SEEXPR_BITCODE_Func2v(name, func) \
+    double SeExpr2Std_##name(double* a, double* b) { return func(vec(a), vec(b)); }
+#define SEEXPR_BITCODE_Func1vv(name, func) \
+    void SeExpr2Std_##name(double* out, double* a) { store(out, func(vec(a))); }
+#define SEEXPR_BITCODE_Func2vv(name, func) \
+    void SeExpr2Std_##name(double* out, double* a, double* b) { store(out, func(vec(a), vec(b))); }
+#define SEEXPR_BITCODE_Funcn(name, func) \
+    double SeExpr2Std_##name(int n, double* args) { return func(n, args); }
+#define SEEXPR_BITCODE_Funcnv(name, func) \
+    double SeExpr2Std_##name(int n, double* args) { return func(n, vecs(args)); }
+#define SEEXPR_BITCODE_Funcnvv(name, func) \
+    void SeExpr2Std_##name(double* out, int n, double* args) { store(out, func(n, vecs(args))); }
+#define SEEXPR_BITCODE_DEFINE(name, func, type) SEEXPR_BITCODE_##type(name, func)
+
+extern "C" {
+SEEXPR_BITCODE_BUILTINS(SEEXPR_BITCODE_DEFINE)
+}
@@ -0,0 +1,91 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#ifndef ExprBuiltinsBitcode_h
+#define ExprBuiltinsBitcode_h
+
+#include <cstddef>
+
+/// Builtins that ExprBuiltinsBitcode.cpp compiles to LLVM bitcode, as X(name, function, ExprFuncStandard type).
+/// The bitcode defines llvmStandardFunctionSymbol(name) for each of them with the ABI the generated code calls,
+/// so the LLVM backend can link the definitions into its modules and inline them.
+#define SEEXPR_BITCODE_BUILTINS(X)                \
+    X(deg, SeExpr2::deg, Func1)                   \
+    X(rad, SeExpr2::rad, Func1)                   \
+    X(cosd, SeExpr2::cosd, Func1)                 \
+    X(sind, SeExpr2::sind, Func1)                 \
+    X(tand, SeExpr2::tand, Func1)                 \
+    X(acosd, SeExpr2::acosd, Func1)               \
+    X(asind, SeExpr2::asind, Func1)               \
+    X(atand, SeExpr2::atand, Func1)               \
+    X(atan2d, SeExpr2::atan2d, Func2)             \
+    X(clamp, SeExpr2::clamp, Func3)               \
+    X(round, SeExpr2::round, Func1)               \
+    X(max, SeExpr2::max, Func2)                   \
+    X(min, SeExpr2::min, Func2)                   \
+    X(invert, SeExpr2::invert, Func1)             \
+    X(compress, SeExpr2::compress, Func3)         \
+    X(expand, SeExpr2::expand, Func3)             \
+    X(fit, SeExpr2::fit, Func5)                   \
+    X(gamma, SeExpr2::gamma, Func2)               \
+    X(bias, SeExpr2::bias, Func2)                 \
+    X(contrast, SeExpr2::contrast, Func2)         \
+    X(boxstep, SeExpr2::boxstep, Func2)           \
+    X(linearstep, SeExpr2::linearstep, Func3)     \
+    X(smoothstep, SeExpr2::smoothstep, Func3)     \
+    X(gaussstep, SeExpr2::gaussstep, Func3)       \
+    X(remap, SeExpr2::remap, Func5)               \
+    X(mix, SeExpr2::mix, Func3)                   \
+    X(hsi, SeExpr2::hsi, Funcnvv)                 \
+    X(midhsi, SeExpr2::midhsi, Funcnvv)           \
+    X(rgbtohsl, SeExpr2::rgbtohsl, Func1vv)       \
+    X(hsltorgb, SeExpr2::hsltorgb, Func1vv)       \
+    X(hash, SeExpr2::hash, Funcn)                 \
+    X(noise, SeExpr2::noise, Funcnv)              \
+    X(snoise, SeExpr2::snoise, Func1v)            \
+    X(cnoise, SeExpr2::cnoise, Func1vv)           \
+    X(vnoise, SeExpr2::vnoise, Func1vv)           \
+    X(turbulence, SeExpr2::turbulence, Funcnv)    \
+    X(vturbulence, SeExpr2::vturbulence, Funcnvv) \
+    X(cturbulence, SeExpr2::cturbulence, Funcnvv) \
+    X(fbm, SeExpr2::fbm, Funcnv)                  \
+    X(vfbm, SeExpr2::vfbm, Funcnvv)               \
+    X(cfbm, SeExpr2::cfbm, Funcnvv)               \
+    X(cellnoise, SeExpr2::cellnoise, Func1v)      \
+    X(ccellnoise, SeExpr2::ccellnoise, Func1vv)   \
+    X(pnoise, SeExpr2::pnoise, Func2v)            \
+    X(dist, SeExpr2::dist, Func2v)                \
+    X(length, SeExpr2::length, Func1v)            \
+    X(hypot, SeExpr2::hypot, Func2)               \
+    X(dot, SeExpr2::dot, Func2v)                  \
+    X(norm, SeExpr2::norm, Func1vv)               \
+    X(cross, SeExpr2::cross, Func2vv)             \
+    X(angle, SeExpr2::angle, Func2v)              \
+    X(ortho, SeExpr2::ortho, Func2vv)             \
+    X(up, SeExpr2::up, Func2vv)                   \
+    X(cycle, SeExpr2::cycle, Func3)               \
+    X(pick, SeExpr2::pick, Funcn)                 \
+    X(choose, SeExpr2::choose, Funcn)             \
+    X(wchoose, SeExpr2::wchoose, Funcn)           \
+    X(spline, SeExpr2::spline, Funcn)
+
+namespace SeExpr2 {
+/// The bitcode of ExprBuiltinsBitcode.cpp, embedded at build time when SEEXPR_ENABLE_BUILTIN_BITCODE is set
+extern const unsigned char builtinsBitcode[];
+extern const size_t builtinsBitcodeSize;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#include <algorithm>
+
+#include "ExprExecutor.h"
+
+namespace SeExpr2 {
+
+namespace {
+/// Set while the thread runs tasks of a pool
+thread_local bool runningTasks = false;
+}
+
+ExprThreadPool::ExprThreadPool(int numWorkers) : _running(0), _task(nullptr), _stop(false) {
+    _nextStart = _start.get_future().share();
+    if (numWorkers <= 0) numWorkers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    for (int i = 0; i < numWorkers; i++) _workers.emplace_back(new Worker);
+    for (int i = 1; i < numWorkers; i++) _threads.emplace_back(&ExprThreadPool::threadMain, this, i, _nextStart);
+}
+
+ExprThreadPool::~ExprThreadPool() {
+    _stop = true;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _start.set_value();
+    }
+    for (auto& thread : _threads) thread.join();
+}
+
+ExprThreadPool& ExprThreadPool::global() {
+    static ExprThreadPool pool;
+    return pool;
+}
+
+void ExprThreadPool::run(size_t numTasks, const std::function<void(size_t, int)>& task) {
+    if (numTasks == 0) return;
+    if (runningTasks) {
+        // the workers may all be busy with tasks waiting for us (or hold _runMutex), so don't wait for them
+        for (size_t i = 0; i < numTasks; i++) task(i, 0);
+        return;
+    }
+    std::lock_guard<std::mutex> runLock(_runMutex);
+
+    // hand every worker an equal share up front, stealing evens out the rest
+    size_t numWorkers = _workers.size();
+    for (size_t i = 0; i < numWorkers; i++) {
+        std::lock_guard<std::mutex> lock(_workers[i]->mutex);
+        _workers[i]->begin = numTasks * i / numWorkers;
+        _workers[i]->end = numTasks * (i + 1) / numWorkers;
+    }
+
+    _task = &task;
+    _running = static_cast<int>(_threads.size());
+    _finished = std::promise<void>();
+    std::future<void> finished = _finished.get_future();
+    {
+        // threads done with this run will wait for the next one
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::promise<void> start(std::move(_start));
+        _start = std::promise<void>();
+        _nextStart = _start.get_future().share();
+        start.set_value();
+    }
+
+    work(0);
+
+    if (!_threads.empty()) finished.wait();
+    _task = nullptr;
+    if (_exception) {
+        std::exception_ptr exception;
+        std::swap(exception, _exception);
+        std::rethrow_exception(exception);
+    }
+}
+
+void ExprThreadPool::threadMain(int worker, std::shared_future<void> start) {
+    for (;;) {
+        start.wait();
+        if (_stop) return;
+        {
+            // run() replaced _nextStart before starting us and can't do so again before we finish
+            std::lock_guard<std::mutex> lock(_mutex);
+            start = _nextStart;
+        }
+        work(worker);
+        if (--_running == 0) _finished.set_value();
+    }
+}
+
+void ExprThreadPool::work(int worker) {
+    runningTasks = true;
+    size_t index;
+    while (nextTask(worker, index)) {
+        try {
+            (*_task)(index, worker);
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_exception) _exception = std::current_exception();
+            }
+            fail();
+        }
+    }
+    runningTasks = false;
+}
+
+void ExprThreadPool::fail() {
+    // drop the tasks not started yet, the workers then finish as usual
+    for (auto& worker : _workers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->begin = worker->end;
+    }
+}
+
+bool ExprThreadPool::nextTask(int worker, size_t& index) {
+    Worker& self = *_workers[worker];
+    {
+        std::lock_guard<std::mutex> lock(self.mutex);
+        if (self.begin < self.end) {
+            index = self.begin++;
+            return true;
+        }
+    }
+
+    // steal the back half of the first other worker that has tasks left
+    int numWorkers = static_cast<int>(_workers.size());
+    for (int i = 1; i < numWorkers; i++) {
+        Worker& victim = *_workers[(worker + i) % numWorkers];
+        size_t begin, end;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.begin >= victim.end) continue;
+            end = victim.end;
+            begin = victim.end = victim.begin + (victim.end - victim.begin) / 2;
+        }
+        std::lock_guard<std::mutex> lock(self.mutex);
+        index = begin;
+        self.begin = begin + 1;
+        self.end = end;
+        return true;
+    }
+    return false;
+}
+}
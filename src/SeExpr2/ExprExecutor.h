@@ -0,0 +1,90 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SeExpr2 {
+
+/// Runs independent tasks on a fixed number of workers (see Expression::evalParallel).
+/// Implement this to hand the work to the host application's own scheduler.
+class ExprExecutor {
+  public:
+    virtual ~ExprExecutor() {}
+
+    /// Number of workers, tasks are passed a worker index in [0,numWorkers())
+    virtual int numWorkers() const = 0;
+
+    /// Call task(index, worker) for every index in [0,numTasks) and return once all calls have finished.
+    /// Calls running at the same time must be passed different worker indices. If a call throws, the calls not
+    /// started yet may be skipped; the exception is rethrown once all started calls have finished.
+    virtual void run(size_t numTasks, const std::function<void(size_t, int)>& task) = 0;
+};
+
+/// Work stealing thread pool, used by evalParallel when no executor is given.
+/// The tasks of a run are split into one contiguous range per worker; a worker running out of tasks steals half
+/// of the remaining range of another. The thread calling run() takes part as worker 0. A task calling run() again
+/// (on any pool) has the nested tasks run inline on its own thread.
+class ExprThreadPool : public ExprExecutor {
+  public:
+    /// Create a pool of numWorkers workers (0 for one per hardware thread)
+    explicit ExprThreadPool(int numWorkers = 0);
+    ~ExprThreadPool();
+
+    int numWorkers() const override { return static_cast<int>(_workers.size()); }
+    void run(size_t numTasks, const std::function<void(size_t, int)>& task) override;
+
+    /// Pool shared by everybody not providing an executor
+    static ExprThreadPool& global();
+
+  private:
+    /// Range of tasks still to be run by a worker
+    struct Worker {
+        std::mutex mutex;
+        size_t begin = 0, end = 0;
+    };
+
+    void threadMain(int worker, std::shared_future<void> start);
+    void work(int worker);
+    bool nextTask(int worker, size_t& index);
+    void fail();
+
+    std::vector<std::unique_ptr<Worker> > _workers;
+    std::vector<std::thread> _threads;
+    /// Serializes run() calls from different threads
+    std::mutex _runMutex;
+    /// Guards _start and _nextStart
+    std::mutex _mutex;
+    /// Set to start the threads, which then wait for _nextStart (the future of the following run)
+    std::promise<void> _start;
+    std::shared_future<void> _nextStart;
+    /// Set by the last thread finishing a run
+    std::promise<void> _finished;
+    std::atomic<int> _running;
+    const std::function<void(size_t, int)>* _task;
+    /// First exception thrown by a task of the current run, guarded by _mutex
+    std::exception_ptr _exception;
+    bool _stop;
+};
+}
@@ -142,6 +142,160 @@ int FuncNVVOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
     return 1;
 }
 
+// Batch versions of the above, calling the function once per active lane
+int Func0OpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func0* func = (ExprFuncStandard::Func0*)(c[opData[0]]);
+    double* out = Interpreter::batchSlot(fp, opData[1]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func();
+    return 1;
+}
+int Func1OpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func1* func = (ExprFuncStandard::Func1*)(c[opData[0]]);
+    const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+    double* out = Interpreter::batchSlot(fp, opData[2]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(in0[l]);
+    return 1;
+}
+int Func2OpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func2* func = (ExprFuncStandard::Func2*)(c[opData[0]]);
+    const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+    const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+    double* out = Interpreter::batchSlot(fp, opData[3]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(in0[l], in1[l]);
+    return 1;
+}
+int Func3OpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func3* func = (ExprFuncStandard::Func3*)(c[opData[0]]);
+    const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+    const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+    const double* in2 = Interpreter::batchSlot(fp, opData[3]);
+    double* out = Interpreter::batchSlot(fp, opData[4]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(in0[l], in1[l], in2[l]);
+    return 1;
+}
+int Func4OpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func4* func = (ExprFuncStandard::Func4*)(c[opData[0]]);
+    const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+    const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+    const double* in2 = Interpreter::batchSlot(fp, opData[3]);
+    const double* in3 = Interpreter::batchSlot(fp, opData[4]);
+    double* out = Interpreter::batchSlot(fp, opData[5]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(in0[l], in1[l], in2[l], in3[l]);
+    return 1;
+}
+int Func5OpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func5* func = (ExprFuncStandard::Func5*)(c[opData[0]]);
+    const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+    const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+    const double* in2 = Interpreter::batchSlot(fp, opData[3]);
+    const double* in3 = Interpreter::batchSlot(fp, opData[4]);
+    const double* in4 = Interpreter::batchSlot(fp, opData[5]);
+    double* out = Interpreter::batchSlot(fp, opData[6]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(in0[l], in1[l], in2[l], in3[l], in4[l]);
+    return 1;
+}
+int Func6OpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func6* func = (ExprFuncStandard::Func6*)(c[opData[0]]);
+    const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+    const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+    const double* in2 = Interpreter::batchSlot(fp, opData[3]);
+    const double* in3 = Interpreter::batchSlot(fp, opData[4]);
+    const double* in4 = Interpreter::batchSlot(fp, opData[5]);
+    const double* in5 = Interpreter::batchSlot(fp, opData[6]);
+    double* out = Interpreter::batchSlot(fp, opData[7]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(in0[l], in1[l], in2[l], in3[l], in4[l], in5[l]);
+    return 1;
+}
+int FuncNOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Funcn* func = (ExprFuncStandard::Funcn*)(c[opData[0]]);
+    int n = opData[1];
+    double* vals = static_cast<double*>(alloca(n * sizeof(double)));
+    double* out = Interpreter::batchSlot(fp, opData[n + 2]);
+    for (int l = 0; l < batch.lanes; l++) {
+        if (!batch.active(l)) continue;
+        for (int k = 0; k < n; k++) vals[k] = Interpreter::batchSlot(fp, opData[k + 2])[l];
+        out[l] = func(n, vals);
+    }
+    return 1;
+}
+
+//! Gathers lane l of the FP[3] starting at slot k of a batch frame
+static Vec3d batchVec3d(double* fp, int k, int l) {
+    return Vec3d(
+        Interpreter::batchSlot(fp, k)[l], Interpreter::batchSlot(fp, k + 1)[l], Interpreter::batchSlot(fp, k + 2)[l]);
+}
+
+//! Scatters v to lane l of the FP[3] starting at slot k of a batch frame
+static void batchSetVec3d(double* fp, int k, int l, const Vec3d& v) {
+    for (int i = 0; i < 3; i++) Interpreter::batchSlot(fp, k + i)[l] = v[i];
+}
+
+int Func1VOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func1v* func = (ExprFuncStandard::Func1v*)(c[opData[0]]);
+    double* out = Interpreter::batchSlot(fp, opData[2]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(batchVec3d(fp, opData[1], l));
+    return 1;
+}
+int Func2VOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func2v* func = (ExprFuncStandard::Func2v*)(c[opData[0]]);
+    double* out = Interpreter::batchSlot(fp, opData[3]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) out[l] = func(batchVec3d(fp, opData[1], l), batchVec3d(fp, opData[2], l));
+    return 1;
+}
+int Func1VVOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func1vv* func = (ExprFuncStandard::Func1vv*)(c[opData[0]]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l)) batchSetVec3d(fp, opData[2], l, func(batchVec3d(fp, opData[1], l)));
+    return 1;
+}
+int Func2VVOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Func2vv* func = (ExprFuncStandard::Func2vv*)(c[opData[0]]);
+    for (int l = 0; l < batch.lanes; l++)
+        if (batch.active(l))
+            batchSetVec3d(fp, opData[3], l, func(batchVec3d(fp, opData[1], l), batchVec3d(fp, opData[2], l)));
+    return 1;
+}
+int FuncNVOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Funcnv* func = (ExprFuncStandard::Funcnv*)(c[opData[0]]);
+    int n = opData[1];
+    Vec3d* vals = static_cast<Vec3d*>(alloca(n * sizeof(Vec3d)));
+    double* out = Interpreter::batchSlot(fp, opData[n + 2]);
+    for (int l = 0; l < batch.lanes; l++) {
+        if (!batch.active(l)) continue;
+        for (int k = 0; k < n; k++) new (vals + k) Vec3d(batchVec3d(fp, opData[k + 2], l));  // placement new!
+        out[l] = func(n, vals);
+    }
+    return 1;
+}
+int FuncNVVOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+    ExprFuncStandard::Funcnvv* func = (ExprFuncStandard::Funcnvv*)(c[opData[0]]);
+    int n = opData[1];
+    Vec3d* vals = static_cast<Vec3d*>(alloca(n * sizeof(Vec3d)));
+    for (int l = 0; l < batch.lanes; l++) {
+        if (!batch.active(l)) continue;
+        for (int k = 0; k < n; k++) new (vals + k) Vec3d(batchVec3d(fp, opData[k + 2], l));  // placement new!
+        batchSetVec3d(fp, opData[n + 2], l, func(n, vals));
+    }
+    return 1;
+}
+
+namespace {
+typedef std::map<void*, std::pair<Interpreter::OpF, Interpreter::BatchOpF> > InlinedRegistry;
+InlinedRegistry& inlinedRegistry() {
+    static InlinedRegistry registry;
+    return registry;
+}
+}
+
 int ExprFuncStandard::buildInterpreter(const ExprFuncNode* node, Interpreter* interpreter) const {
     std::vector<int> argOps;
     for (int c = 0; c < node->numChildren(); c++) {
@@ -154,57 +308,77 @@ int ExprFuncStandard::buildInterpreter(const ExprFuncNode* node, Interpreter* in
     interpreter->s[funcPtrLoc] = (char*)_func;
 
     Interpreter::OpF op = 0;
+    Interpreter::BatchOpF batchOp = 0;
     switch (_funcType) {
         case FUNC0:
             op = Func0Op;
+            batchOp = Func0OpBatch;
             break;
         case FUNC1:
             op = Func1Op;
+            batchOp = Func1OpBatch;
             break;
         case FUNC2:
             op = Func2Op;
+            batchOp = Func2OpBatch;
             break;
         case FUNC3:
             op = Func3Op;
+            batchOp = Func3OpBatch;
             break;
         case FUNC4:
             op = Func4Op;
+            batchOp = Func4OpBatch;
             break;
         case FUNC5:
             op = Func5Op;
+            batchOp = Func5OpBatch;
             break;
         case FUNC6:
             op = Func6Op;
+            batchOp = Func6OpBatch;
             break;
         case FUNCN:
             op = FuncNOp;
+            batchOp = FuncNOpBatch;
             break;
         case FUNC1V:
             op = Func1VOp;
+            batchOp = Func1VOpBatch;
             break;
         case FUNC2V:
             op = Func2VOp;
+            batchOp = Func2VOpBatch;
             break;
         case FUNCNV:
             op = FuncNVOp;
+            batchOp = FuncNVOpBatch;
             break;
         case FUNC1VV:
             op = Func1VVOp;
+            batchOp = Func1VVOpBatch;
             break;
         case FUNC2VV:
             op = Func2VVOp;
+            batchOp = Func2VVOpBatch;
             break;
         case FUNCNVV:
             op = FuncNVVOp;
+            batchOp = FuncNVVOpBatch;
             break;
         default:
             assert(false);
     }
+    InlinedRegistry::const_iterator inlined = inlinedRegistry().find(_func);
+    if (inlined != inlinedRegistry().end()) {
+        op = inlined->second.first;
+        batchOp = inlined->second.second;
+    }
 
     if (_funcType < VEC) {
         retOp = interpreter->allocFP(node->type().dim());
         for (int k = 0; k < node->type().dim(); k++) {
-            interpreter->addOp(op);
+            interpreter->addOp(op, batchOp);
             interpreter->addOperand(funcPtrLoc);
             if (_funcType == FUNCN) interpreter->addOperand(static_cast<int>(argOps.size()));
             for (size_t c = 0; c < argOps.size(); c++) {
@@ -229,7 +403,7 @@ int ExprFuncStandard::buildInterpreter(const ExprFuncNode* node, Interpreter* in
             }
         retOp = interpreter->allocFP(_funcType >= VECVEC ? 3 : 1);
 
-        interpreter->addOp(op);
+        interpreter->addOp(op, batchOp);
         interpreter->addOperand(funcPtrLoc);
         if (_funcType == FUNCNV || _funcType == FUNCNVV) interpreter->addOperand(static_cast<int>(argOps.size()));
         for (size_t c = 0; c < argOps.size(); c++) {
@@ -244,4 +418,60 @@ int ExprFuncStandard::buildInterpreter(const ExprFuncNode* node, Interpreter* in
     }
     return retOp;
 }
+
+namespace {
+//! Operands of the standard function ops: the function, the number of arguments (if counted), the arguments
+//! and the result
+template <bool counted, int argDim, int resultDim>
+bool FuncOperands(const Interpreter&, const int*, int numOperands, std::vector<Interpreter::Operand>& operands) {
+    operands.push_back(Interpreter::Operand::ptrRead(0, Interpreter::Operand::StandardFunc));
+    for (int i = counted ? 2 : 1; i < numOperands - 1; i++) operands.push_back(Interpreter::Operand::fpRead(i, argDim));
+    operands.push_back(Interpreter::Operand::fpWrite(numOperands - 1, resultDim));
+    return true;
+}
+
+bool registerStandardFuncOps() {
+    Interpreter::registerOp(Func0Op, "Func0Op", Func0OpBatch, FuncOperands<false, 1, 1>);
+    Interpreter::registerOp(Func1Op, "Func1Op", Func1OpBatch, FuncOperands<false, 1, 1>);
+    Interpreter::registerOp(Func2Op, "Func2Op", Func2OpBatch, FuncOperands<false, 1, 1>);
+    Interpreter::registerOp(Func3Op, "Func3Op", Func3OpBatch, FuncOperands<false, 1, 1>);
+    Interpreter::registerOp(Func4Op, "Func4Op", Func4OpBatch, FuncOperands<false, 1, 1>);
+    Interpreter::registerOp(Func5Op, "Func5Op", Func5OpBatch, FuncOperands<false, 1, 1>);
+    Interpreter::registerOp(Func6Op, "Func6Op", Func6OpBatch, FuncOperands<false, 1, 1>);
+    Interpreter::registerOp(FuncNOp, "FuncNOp", FuncNOpBatch, FuncOperands<true, 1, 1>);
+    Interpreter::registerOp(Func1VOp, "Func1VOp", Func1VOpBatch, FuncOperands<false, 3, 1>);
+    Interpreter::registerOp(Func2VOp, "Func2VOp", Func2VOpBatch, FuncOperands<false, 3, 1>);
+    Interpreter::registerOp(FuncNVOp, "FuncNVOp", FuncNVOpBatch, FuncOperands<true, 3, 1>);
+    Interpreter::registerOp(Func1VVOp, "Func1VVOp", Func1VVOpBatch, FuncOperands<false, 3, 3>);
+    Interpreter::registerOp(Func2VVOp, "Func2VVOp", Func2VVOpBatch, FuncOperands<false, 3, 3>);
+    Interpreter::registerOp(FuncNVVOp, "FuncNVVOp", FuncNVVOpBatch, FuncOperands<true, 3, 3>);
+    return true;
+}
+const bool standardFuncOpsRegistered = registerStandardFuncOps();
+}
+
+void ExprFuncStandard::registerInlined(
+    FuncType type, void* func, Interpreter::OpF op, Interpreter::BatchOpF batch, const std::string& name) {
+    Interpreter::OperandsF operands = nullptr;
+    switch (type) {
+        case FUNC1:
+        case FUNC2:
+        case FUNC3:
+        case FUNC5:
+            operands = FuncOperands<false, 1, 1>;
+            break;
+        case FUNC1V:
+        case FUNC2V:
+            operands = FuncOperands<false, 3, 1>;
+            break;
+        case FUNCNV:
+            operands = FuncOperands<true, 3, 1>;
+            break;
+        default:
+            assert(false && "no inlined ops for this type of function");
+            return;
+    }
+    Interpreter::registerOp(op, name, batch, operands);
+    inlinedRegistry()[func] = std::make_pair(op, batch);
+}
 }
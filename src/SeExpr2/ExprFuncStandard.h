@@ -17,6 +17,9 @@
 #ifndef _ExprFuncStandard_h_
 #define _ExprFuncStandard_h_
 
+#include <cassert>
+#include <string>
+
 #include "Vec.h"
 #include "ExprFuncX.h"
 
@@ -144,10 +147,181 @@ class ExprFuncStandard : public ExprFuncX {
     void* getFuncPointer() const { return _func; }
     FuncType getFuncType() const { return _funcType; }
 
+    /// Use op and batch (whose operands are those of the generic op of type) to call func instead of the generic
+    /// op calling through the function pointer
+    static void registerInlined(
+        FuncType type, void* func, Interpreter::OpF op, Interpreter::BatchOpF batch, const std::string& name);
+
   private:
     FuncType _funcType;
     void* _func;  // blind func style
 };
+
+/// Interpreter ops calling a standard function known at compile time, so that it is inlined into them. Their
+/// operands are those of the generic ops (the function pointer operand is ignored).
+template <class F, F* func>
+struct StandardFuncInlined;
+
+template <ExprFuncStandard::Func1* func>
+struct StandardFuncInlined<ExprFuncStandard::Func1, func> {
+    static const ExprFuncStandard::FuncType type = ExprFuncStandard::FUNC1;
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        fp[opData[2]] = func(fp[opData[1]]);
+        return 1;
+    }
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+        double* out = Interpreter::batchSlot(fp, opData[2]);
+        for (int l = 0; l < batch.lanes; l++)
+            if (batch.active(l)) out[l] = func(in0[l]);
+        return 1;
+    }
+};
+
+template <ExprFuncStandard::Func2* func>
+struct StandardFuncInlined<ExprFuncStandard::Func2, func> {
+    static const ExprFuncStandard::FuncType type = ExprFuncStandard::FUNC2;
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        fp[opData[3]] = func(fp[opData[1]], fp[opData[2]]);
+        return 1;
+    }
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+        const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+        double* out = Interpreter::batchSlot(fp, opData[3]);
+        for (int l = 0; l < batch.lanes; l++)
+            if (batch.active(l)) out[l] = func(in0[l], in1[l]);
+        return 1;
+    }
+};
+
+template <ExprFuncStandard::Func3* func>
+struct StandardFuncInlined<ExprFuncStandard::Func3, func> {
+    static const ExprFuncStandard::FuncType type = ExprFuncStandard::FUNC3;
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        fp[opData[4]] = func(fp[opData[1]], fp[opData[2]], fp[opData[3]]);
+        return 1;
+    }
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+        const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+        const double* in2 = Interpreter::batchSlot(fp, opData[3]);
+        double* out = Interpreter::batchSlot(fp, opData[4]);
+        for (int l = 0; l < batch.lanes; l++)
+            if (batch.active(l)) out[l] = func(in0[l], in1[l], in2[l]);
+        return 1;
+    }
+};
+
+template <ExprFuncStandard::Func5* func>
+struct StandardFuncInlined<ExprFuncStandard::Func5, func> {
+    static const ExprFuncStandard::FuncType type = ExprFuncStandard::FUNC5;
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        fp[opData[6]] = func(fp[opData[1]], fp[opData[2]], fp[opData[3]], fp[opData[4]], fp[opData[5]]);
+        return 1;
+    }
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+        const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+        const double* in2 = Interpreter::batchSlot(fp, opData[3]);
+        const double* in3 = Interpreter::batchSlot(fp, opData[4]);
+        const double* in4 = Interpreter::batchSlot(fp, opData[5]);
+        double* out = Interpreter::batchSlot(fp, opData[6]);
+        for (int l = 0; l < batch.lanes; l++)
+            if (batch.active(l)) out[l] = func(in0[l], in1[l], in2[l], in3[l], in4[l]);
+        return 1;
+    }
+};
+
+template <ExprFuncStandard::Func1v* func>
+struct StandardFuncInlined<ExprFuncStandard::Func1v, func> {
+    static const ExprFuncStandard::FuncType type = ExprFuncStandard::FUNC1V;
+    // the argument is read in place
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        fp[opData[2]] = func(Vec3d::copy(&fp[opData[1]]));
+        return 1;
+    }
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+        double* out = Interpreter::batchSlot(fp, opData[2]);
+        for (int l = 0; l < batch.lanes; l++)
+            if (batch.active(l))
+                out[l] = func(Vec3d(in0[l], in0[l + Interpreter::batchSize], in0[l + 2 * Interpreter::batchSize]));
+        return 1;
+    }
+};
+
+template <ExprFuncStandard::Func2v* func>
+struct StandardFuncInlined<ExprFuncStandard::Func2v, func> {
+    static const ExprFuncStandard::FuncType type = ExprFuncStandard::FUNC2V;
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        fp[opData[3]] = func(Vec3d::copy(&fp[opData[1]]), Vec3d::copy(&fp[opData[2]]));
+        return 1;
+    }
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const int n = Interpreter::batchSize;
+        const double* in0 = Interpreter::batchSlot(fp, opData[1]);
+        const double* in1 = Interpreter::batchSlot(fp, opData[2]);
+        double* out = Interpreter::batchSlot(fp, opData[3]);
+        for (int l = 0; l < batch.lanes; l++)
+            if (batch.active(l))
+                out[l] = func(Vec3d(in0[l], in0[l + n], in0[l + 2 * n]), Vec3d(in1[l], in1[l + n], in1[l + 2 * n]));
+        return 1;
+    }
+};
+
+/// Functions with a variable number of vector arguments take them as an array, which is kept on the stack
+/// (only functions taking at most maxArgs arguments are inlined)
+template <ExprFuncStandard::Funcnv* func>
+struct StandardFuncInlined<ExprFuncStandard::Funcnv, func> {
+    static const ExprFuncStandard::FuncType type = ExprFuncStandard::FUNCNV;
+    static const int maxArgs = 8;
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        int n = opData[1];
+        assert(n <= maxArgs);
+        Vec3d vals[maxArgs];
+        for (int k = 0; k < n; k++) vals[k] = Vec3d::copy(&fp[opData[k + 2]]);
+        fp[opData[n + 2]] = func(n, vals);
+        return 1;
+    }
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        int n = opData[1];
+        assert(n <= maxArgs);
+        Vec3d vals[maxArgs];
+        double* out = Interpreter::batchSlot(fp, opData[n + 2]);
+        for (int l = 0; l < batch.lanes; l++) {
+            if (!batch.active(l)) continue;
+            for (int k = 0; k < n; k++) {
+                const double* in = Interpreter::batchSlot(fp, opData[k + 2]);
+                vals[k] = Vec3d(in[l], in[l + Interpreter::batchSize], in[l + 2 * Interpreter::batchSize]);
+            }
+            out[l] = func(n, vals);
+        }
+        return 1;
+    }
+};
+
+/// Used with decltype to find the type of a standard function from its (possibly overloaded) name
+ExprFuncStandard::Func1* standardFuncType(ExprFuncStandard::Func1*);
+ExprFuncStandard::Func2* standardFuncType(ExprFuncStandard::Func2*);
+ExprFuncStandard::Func3* standardFuncType(ExprFuncStandard::Func3*);
+ExprFuncStandard::Func5* standardFuncType(ExprFuncStandard::Func5*);
+ExprFuncStandard::Func1v* standardFuncType(ExprFuncStandard::Func1v*);
+ExprFuncStandard::Func2v* standardFuncType(ExprFuncStandard::Func2v*);
+ExprFuncStandard::Funcnv* standardFuncType(ExprFuncStandard::Funcnv*);
+
+/// Register the inlined ops of the standard function func
+template <class F, F* func>
+void inlineStandardFunc(const std::string& name) {
+    typedef StandardFuncInlined<F, func> Inlined;
+    ExprFuncStandard::registerInlined(Inlined::type, (void*)func, Inlined::f, Inlined::batch, name);
+}
+
+/// Interpreter ops of the vector valued standard functions (used by the interpreter's fusions)
+int Func1VVOp(int* opData, double* fp, char** c, std::vector<int>& callStack);
+int Func2VVOp(int* opData, double* fp, char** c, std::vector<int>& callStack);
+int Func1VVOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch);
+int Func2VVOpBatch(int* opData, double* fp, char** c, Interpreter::Batch& batch);
 }
 
 #endif
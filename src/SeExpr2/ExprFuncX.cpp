@@ -29,6 +29,66 @@ int ExprFuncSimple::EvalOp(int *opData, double *fp, char **c, std::vector<int> &
     return 1;
 }
 
+namespace {
+//! Batch version of ExprFuncSimple::EvalOp. Each lane's arguments are gathered into a small
+//! point frame ([nargs,out...,args...]) using the dimensions appended after the arguments.
+int EvalBatchOp(int *opData, double *fp, char **c, Interpreter::Batch &batch) {
+    ExprFuncSimple *simple = reinterpret_cast<ExprFuncSimple *>(c[opData[0]]);
+    int nargs = static_cast<int>(Interpreter::batchSlot(fp, opData[3])[0]);
+    const int *dims = opData + 4 + nargs;
+
+    int *laneOpData = static_cast<int *>(alloca((4 + nargs) * sizeof(int)));
+    laneOpData[0] = opData[0];
+    laneOpData[1] = opData[1];
+    laneOpData[2] = 1;
+    laneOpData[3] = 0;
+    int frameSize = 1 + dims[0];
+    for (int i = 0; i < nargs; i++) {
+        // strings are the same for every lane, keep referring to them directly
+        laneOpData[4 + i] = dims[1 + i] ? frameSize : opData[4 + i];
+        frameSize += dims[1 + i];
+    }
+    double *laneFp = static_cast<double *>(alloca(frameSize * sizeof(double)));
+    laneFp[0] = nargs;
+
+    std::vector<int> callStack;
+    for (int l = 0; l < batch.lanes; l++) {
+        if (!batch.active(l)) continue;
+        for (int i = 0; i < nargs; i++)
+            for (int k = 0; k < dims[1 + i]; k++)
+                laneFp[laneOpData[4 + i] + k] = Interpreter::batchSlot(fp, opData[4 + i] + k)[l];
+        ExprFuncSimple::ArgHandle args(laneOpData, laneFp, c, callStack);
+        simple->eval(args);
+        for (int k = 0; k < dims[0]; k++) Interpreter::batchSlot(fp, opData[2] + k)[l] = laneFp[1 + k];
+    }
+    return 1;
+}
+
+//! Operands of ExprFuncSimple::EvalOp ([func,data,out,nargs,args...,dims...] with nargs+1 dims)
+bool EvalOperands(const Interpreter &,
+                  const int *opData,
+                  int numOperands,
+                  std::vector<Interpreter::Operand> &operands) {
+    if (numOperands < 5 || (numOperands - 5) % 2) return false;
+    int nargs = (numOperands - 5) / 2;
+    const int *dims = opData + 4 + nargs;
+    operands.push_back(Interpreter::Operand::ptrRead(0, Interpreter::Operand::SimpleFunc));
+    operands.push_back(Interpreter::Operand::ptrRead(1, Interpreter::Operand::FuncData));
+    operands.push_back(Interpreter::Operand::fpRead(3));
+    for (int i = 0; i < nargs; i++)
+        operands.push_back(dims[1 + i] ? Interpreter::Operand::fpRead(4 + i, dims[1 + i])
+                                       : Interpreter::Operand::ptrRead(4 + i));
+    operands.push_back(dims[0] ? Interpreter::Operand::fpWrite(2, dims[0]) : Interpreter::Operand::ptrWrite(2));
+    return true;
+}
+}
+
+bool ExprFuncSimple::registerEvalOp() {
+    Interpreter::registerOp(EvalOp, "ExprFuncSimple::EvalOp", EvalBatchOp, EvalOperands);
+    return true;
+}
+const bool ExprFuncSimple::_evalOpRegistered = ExprFuncSimple::registerEvalOp();
+
 int ExprFuncSimple::buildInterpreter(const ExprFuncNode *node, Interpreter *interpreter) const {
     std::vector<int> operands;
     for (int c = 0; c < node->numChildren(); c++) {
@@ -57,7 +117,8 @@ int ExprFuncSimple::buildInterpreter(const ExprFuncNode *node, Interpreter *inte
     else
         assert(false);
 
-    interpreter->addOp(EvalOp);
+    // string results can differ per point, so those calls are only run a point at a time
+    interpreter->addOp(EvalOp, node->type().isFP() ? EvalBatchOp : nullptr);
     int ptrLoc = interpreter->allocPtr();
     int ptrDataLoc = interpreter->allocPtr();
     interpreter->s[ptrLoc] = (char *)this;
@@ -68,15 +129,40 @@ int ExprFuncSimple::buildInterpreter(const ExprFuncNode *node, Interpreter *inte
     for (size_t c = 0; c < operands.size(); c++) {
         interpreter->addOperand(operands[c]);
     }
+    // dimensions of the output and arguments (0 for strings) used by the batch version
+    interpreter->addOperand(node->type().isFP() ? node->type().dim() : 0);
+    for (int c = 0; c < node->numChildren(); c++) {
+        int promoted = node->promote(c);
+        const ExprType &argType = node->child(c)->type();
+        interpreter->addOperand(promoted != 0 ? promoted : argType.isFP() ? argType.dim() : 0);
+    }
     interpreter->endOp(false);  // do not eval because the function may not be evaluatable!
 
     // call into interpreter eval
     int pc = interpreter->nextPC() - 1;
     int *opCurr = (&interpreter->opData[0]) + interpreter->ops[pc].second;
 
-    ArgHandle args(opCurr, &interpreter->d[0], &interpreter->s[0], interpreter->callStack);
-    ExprFuncNode::Data* data = evalConstant(node, args);
-    node->setData(data);
+    // the data is built once per node, an interpreter built after the LLVM code (which also needed it) shares it
+    ExprFuncNode::Data* data = node->getData();
+    if (!data) {
+        ArgHandle args(opCurr, &interpreter->d[0], &interpreter->s[0], interpreter->callStack);
+        std::vector<ExprFuncNode::ConstantArg> constantArgs(operands.size());
+        for (size_t c = 0; c < operands.size(); c++) {
+            ExprFuncNode::ConstantArg &arg = constantArgs[c];
+            int dim = opCurr[4 + operands.size() + 1 + c];
+            if (dim) {
+                arg.fp.assign(&interpreter->d[operands[c]], &interpreter->d[operands[c]] + dim);
+            } else {
+                const char *str = interpreter->s[operands[c]];
+                arg.isString = true;
+                arg.isNull = !str;
+                if (str) arg.str = str;
+            }
+        }
+        node->setConstantArgs(std::move(constantArgs));
+        data = evalConstant(node, args);
+        node->setData(data);
+    }
     interpreter->s[ptrDataLoc] = reinterpret_cast<char *>(data);
 
     return outoperand;
@@ -84,51 +170,17 @@ int ExprFuncSimple::buildInterpreter(const ExprFuncNode *node, Interpreter *inte
 }
 
 extern "C" {
-//            allocate int[4+number of args];
-//            allocate char*[2];
-//            allocate double[1+ sizeof(ret) + sizeof(args)]
-//
-//            int[0]= c , 0
-//            int[1]= c , 1
-//            int[2]= f,  0
-//            int[3]= f,  8
-//
-//            int[4]= f, 8
-//            int[5]= f, 9
-//
-//
-//                    double[0] = 0
-//                    double[1] = 0
-//                    double[2] = 0
-//                    double[3] = 0
-// opData indexes either into f or into c.
-// opdata[0] points to ExprFuncSimple instance
-// opdata[1] points to the data generated by evalConstant
-// opdata[2] points to return value
-// opdata[3] points to number of args
-// opdata[4] points to beginning of arguments in
-void SeExpr2LLVMEvalCustomFunction(int *opDataArg,
-                                   double *fpArg,
-                                   char **strArg,
-                                   void **funcdata,
-                                   const SeExpr2::ExprFuncNode *node) {
-    const SeExpr2::ExprFunc *func = node->func();
-    SeExpr2::ExprFuncX *funcX = const_cast<SeExpr2::ExprFuncX *>(func->funcx());
-    SeExpr2::ExprFuncSimple *funcSimple = static_cast<SeExpr2::ExprFuncSimple *>(funcX);
-
-    strArg[0] = reinterpret_cast<char *>(funcSimple);
-
-    std::vector<int> callStack;
-    SeExpr2::ExprFuncSimple::ArgHandle handle(opDataArg, fpArg, strArg, callStack);
-    if (!*funcdata) {
-        handle.data = funcSimple->evalConstant(node, handle);
-        *funcdata = reinterpret_cast<void *>(handle.data);
-        node->setData(handle.data);
-    } else {
-        handle.data = reinterpret_cast<SeExpr2::ExprFuncNode::Data *>(*funcdata);
-    }
-
-    funcSimple->eval(handle);
-    // for (int i = 0; i < retSize; ++i) result[i] = fp[1 + i];
+// Called by LLVM generated code for ExprFuncSimple functions. data was built by evalConstant when the code was
+// generated, argIndex gives where every argument was stored in fpArgs or strArgs.
+void SeExpr2LLVMEvalCustomFunction(SeExpr2::ExprFuncSimple *func,
+                                   SeExpr2::ExprFuncNode::Data *data,
+                                   int nargs,
+                                   const int *argIndex,
+                                   double *fpArgs,
+                                   char **strArgs,
+                                   double *fpResult,
+                                   char **strResult) {
+    SeExpr2::ExprFuncSimple::ArgHandle handle(data, nargs, argIndex, fpArgs, strArgs, fpResult, strResult);
+    func->eval(handle);
 }
 }
@@ -81,6 +81,18 @@ class ExprFuncSimple : public ExprFuncX {
               _nargs((int)fp[opData[3]]),  // TODO: would be good not to have to convert to int!
               opData(opData + 4), fp(fp), c(c) {}
 
+        /// Handle for a call from LLVM generated code: argument i is at fp[argIndex[i]] (or c[argIndex[i]] for
+        /// strings) and the result is written to fpResult (or strResult)
+        ArgHandle(ExprFuncNode::Data* data,
+                  int nargs,
+                  const int* argIndex,
+                  double* fp,
+                  char** c,
+                  double* fpResult,
+                  char** strResult)
+            : outFp(*fpResult), outStr(*strResult), data(data), _nargs(nargs), opData(const_cast<int*>(argIndex)),
+              fp(fp), c(c) {}
+
         template <int d>
         Vec<double, d, true> inFp(int i) {
             return Vec<double, d, true>(&fp[opData[i]]);
@@ -114,6 +126,9 @@ class ExprFuncSimple : public ExprFuncX {
 
   private:
     static int EvalOp(int* opData, double* fp, char** c, std::vector<int>& callStack);
+    //! Register EvalOp with the interpreter (describing its operands)
+    static bool registerEvalOp();
+    static const bool _evalOpRegistered;
 };
 
 class ExprFuncLocal : public ExprFuncX {
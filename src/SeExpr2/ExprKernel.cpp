@@ -0,0 +1,85 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#include <algorithm>
+
+#include "ExprKernel.h"
+#include "Expression.h"
+#include "Evaluator.h"
+
+namespace SeExpr2 {
+
+ExprKernel::ExprKernel() : _prepped(false) {}
+
+ExprKernel::~ExprKernel() {}
+
+void ExprKernel::add(const Expression& expr, int outputVarBlockOffset) {
+    _stages.push_back(std::make_pair(&expr, outputVarBlockOffset));
+    _llvmEvaluator.reset();
+    _prepped = false;
+}
+
+bool ExprKernel::isValid() const {
+    // type checking is enough, building each stage's own code would be wasted when the fused loop is compiled
+    for (auto& stage : _stages) {
+        stage.first->prepTypes();
+        if (!stage.first->_isValid || !stage.first->_desiredReturnType.isFP()) return false;
+    }
+    return true;
+}
+
+void ExprKernel::prep() {
+    _prepped = true;
+    if (_stages.empty() || !isValid()) return;
+#if defined(SEEXPR_ENABLE_LLVM)
+    std::vector<LLVMEvaluator::Stage> stages;
+    for (auto& stage : _stages) {
+        if (!stage.first->useLLVM()) return;
+        stages.push_back(LLVMEvaluator::Stage{
+            stage.first->_parseTree, stage.first->_desiredReturnType, stage.second, stage.first->varBlockCreator()});
+    }
+    // the fused loop runs the code of every stage, compile it at the highest level any of them asks for
+    Expression::JitOptLevel optLevel = Expression::JitO0;
+    bool adaptive = false;
+    for (auto& stage : _stages) {
+        if (stage.first->jitOptLevel() == Expression::JitAdaptive)
+            adaptive = true;
+        else
+            optLevel = std::max(optLevel, stage.first->jitOptLevel());
+    }
+    // (adaptive compiles at -O1 at least)
+    if (adaptive && optLevel <= Expression::JitO1) optLevel = Expression::JitAdaptive;
+    _llvmEvaluator.reset(new LLVMEvaluator());
+    _llvmEvaluator->setOptLevel(optLevel);
+    if (!_llvmEvaluator->prepLLVM(stages)) _llvmEvaluator.reset();
+#endif
+}
+
+void ExprKernel::evalMultiple(VarBlock* varBlock, size_t rangeStart, size_t rangeEnd) {
+    if (!_prepped) prep();
+    if (!isValid()) return;
+    if (_llvmEvaluator) {
+        _llvmEvaluator->evalMultiple(varBlock, 0, rangeStart, rangeEnd);
+        if (!_llvmEvaluator->failed()) return;
+        // the evicted code could not be loaded again, every stage evaluates on its own from now on
+        _llvmEvaluator.reset();
+    }
+    for (size_t start = rangeStart; start < rangeEnd; start += stripSize) {
+        size_t end = std::min(rangeEnd, start + stripSize);
+        for (auto& stage : _stages) stage.first->evalMultiple(varBlock, stage.second, start, end);
+    }
+}
+}
@@ -0,0 +1,66 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace SeExpr2 {
+
+class Expression;
+class LLVMEvaluator;
+class VarBlock;
+
+/// Evaluates an ordered list of expressions sharing a VarBlockCreator in a single pass over the points.
+/// Every expression stores its result to a variable block entry, which expressions added after it may read.
+/// With LLVM all expressions are compiled into one loop function so intermediate results stay in registers,
+/// otherwise the points are evaluated in strips that are run through every expression while still in cache.
+/// If the code cache evicts the loop function it is loaded again from its bitcode, without going back to the
+/// expressions' parse trees, and if that fails the kernel goes on with strips.
+class ExprKernel {
+  public:
+    ExprKernel();
+    ~ExprKernel();
+
+    /// Don't allow copying and operator='ing'
+    ExprKernel(const ExprKernel&) = delete;
+    ExprKernel& operator=(const ExprKernel&) = delete;
+
+    /// Append an expression storing its result to the variable block entry outputVarBlockOffset.
+    /// The expression must outlive the kernel and must not be changed after being added.
+    void add(const Expression& expr, int outputVarBlockOffset);
+
+    /// True if all expressions are valid and return FP values (only type checks them, their code is built when
+    /// the kernel can't be fused)
+    bool isValid() const;
+
+    /// Evaluate all expressions in order for the points [rangeStart,rangeEnd)
+    void evalMultiple(VarBlock* varBlock, size_t rangeStart, size_t rangeEnd);
+
+    /// Number of points evaluated per strip when the expressions can't be fused
+    static const size_t stripSize = 256;
+
+  private:
+    /** Compile the fused loop if all expressions use LLVM */
+    void prep();
+
+    std::vector<std::pair<const Expression*, int> > _stages;
+    std::unique_ptr<LLVMEvaluator> _llvmEvaluator;
+    bool _prepped;
+};
+}
@@ -35,6 +35,7 @@
 #include <llvm/ExecutionEngine/Interpreter.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Object/ObjectFile.h>
 #include <llvm/InitializePasses.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/DerivedTypes.h>
@@ -50,5 +51,84 @@
 #include <llvm/Support/ManagedStatic.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Config/llvm-config.h>
+
+namespace SeExpr2 {
+// IRBuilder calls that newer LLVM only takes with the pointee or callee type spelled out, read off the pointer
+inline llvm::LoadInst *createLoad(llvm::IRBuilder<> &builder, llvm::Value *ptr, const llvm::Twine &name = "") {
+    return builder.CreateLoad(ptr->getType()->getPointerElementType(), ptr, name);
+}
+
+// Loads and stores of vectors spanning several elements of an array, which are only aligned like the elements
+inline llvm::LoadInst *createAlignedLoad(llvm::IRBuilder<> &builder,
+                                         llvm::Type *type,
+                                         llvm::Value *ptr,
+                                         unsigned align) {
+#if LLVM_VERSION_MAJOR >= 10
+    return builder.CreateAlignedLoad(type, ptr, llvm::MaybeAlign(align));
+#else
+    return builder.CreateAlignedLoad(type, ptr, align);
+#endif
+}
+
+inline llvm::StoreInst *createAlignedStore(llvm::IRBuilder<> &builder,
+                                           llvm::Value *value,
+                                           llvm::Value *ptr,
+                                           unsigned align) {
+#if LLVM_VERSION_MAJOR >= 10
+    return builder.CreateAlignedStore(value, ptr, llvm::MaybeAlign(align));
+#else
+    return builder.CreateAlignedStore(value, ptr, align);
+#endif
+}
+
+inline llvm::Value *createGEP(llvm::IRBuilder<> &builder,
+                              llvm::Value *ptr,
+                              llvm::Value *index,
+                              const llvm::Twine &name = "") {
+    return builder.CreateGEP(ptr->getType()->getPointerElementType(), ptr, index, name);
+}
+
+inline llvm::Value *createInBoundsGEP(llvm::IRBuilder<> &builder, llvm::Value *ptr, llvm::Value *index) {
+    return builder.CreateInBoundsGEP(ptr->getType()->getPointerElementType(), ptr, index);
+}
+
+inline llvm::Value *createConstGEP1_32(llvm::IRBuilder<> &builder, llvm::Value *ptr, unsigned index) {
+    return builder.CreateConstGEP1_32(ptr->getType()->getPointerElementType(), ptr, index);
+}
+
+inline llvm::Value *createConstInBoundsGEP1_32(llvm::IRBuilder<> &builder, llvm::Value *ptr, unsigned index) {
+    return builder.CreateConstInBoundsGEP1_32(ptr->getType()->getPointerElementType(), ptr, index);
+}
+
+inline llvm::Value *createConstGEP2_32(llvm::IRBuilder<> &builder, llvm::Value *ptr, unsigned index0, unsigned index1) {
+    return builder.CreateConstGEP2_32(ptr->getType()->getPointerElementType(), ptr, index0, index1);
+}
+
+inline llvm::CallInst *createCall(llvm::IRBuilder<> &builder, llvm::Value *callee, llvm::ArrayRef<llvm::Value *> args) {
+#if LLVM_VERSION_MAJOR >= 5
+    return builder.CreateCall(
+        llvm::cast<llvm::FunctionType>(callee->getType()->getPointerElementType()), callee, args);
+#else
+    return builder.CreateCall(callee, args);
+#endif
+}
+
+inline unsigned vectorNumElements(llvm::Type *type) {
+#if LLVM_VERSION_MAJOR >= 11
+    return llvm::cast<llvm::FixedVectorType>(type)->getNumElements();
+#else
+    return type->getVectorNumElements();
+#endif
+}
+
+inline llvm::VectorType *vectorType(llvm::Type *elementType, unsigned numElements) {
+#if LLVM_VERSION_MAJOR >= 11
+    return llvm::FixedVectorType::get(elementType, numElements);
+#else
+    return llvm::VectorType::get(elementType, numElements);
+#endif
+}
+}
 #endif
 #endif
@@ -24,6 +24,7 @@
 #include "VarBlock.h"
 #include "StringUtils.h"
 #include <array>
+#include <typeinfo>
 using namespace llvm;
 using namespace SeExpr2;
 
@@ -121,7 +122,7 @@ FunctionType *getSeExprFuncStandardLLVMType(ExprFuncStandard::FuncType sft, LLVM
 Type *createLLVMTyForSeExprType(LLVMContext &llvmContext, ExprType seType) {
     if (seType.isFP()) {
         int dim = seType.dim();
-        return dim == 1 ? Type::getDoubleTy(llvmContext) : VectorType::get(Type::getDoubleTy(llvmContext), dim);
+        return dim == 1 ? Type::getDoubleTy(llvmContext) : vectorType(Type::getDoubleTy(llvmContext), dim);
     } else if (seType.isString()) {
         // TODO: post c++11
         // static_assert(sizeof(char*) == 8, "Expect 64-bit pointers");
@@ -134,7 +135,7 @@ Type *createLLVMTyForSeExprType(LLVMContext &llvmContext, ExprType seType) {
 // Copy a scalar "val" to a vector of "dim" length
 LLVM_VALUE createVecVal(LLVM_BUILDER Builder, LLVM_VALUE val, unsigned dim) {
     LLVMContext &llvmContext = Builder.getContext();
-    VectorType *doubleVecTy = VectorType::get(Type::getDoubleTy(llvmContext), dim);
+    VectorType *doubleVecTy = vectorType(Type::getDoubleTy(llvmContext), dim);
     LLVM_VALUE vecVal = UndefValue::get(doubleVecTy);
     for (unsigned i = 0; i < dim; i++)
         vecVal = Builder.CreateInsertElement(vecVal, val, ConstantInt::get(Type::getInt32Ty(llvmContext), i));
@@ -147,7 +148,7 @@ LLVM_VALUE createVecVal(LLVM_BUILDER Builder, ArrayRef<LLVM_VALUE> val, const st
 
     LLVMContext &llvmContext = Builder.getContext();
     unsigned dim = val.size();
-    VectorType *elemType = VectorType::get(val[0]->getType(), dim);
+    VectorType *elemType = vectorType(val[0]->getType(), dim);
     LLVM_VALUE vecVal = UndefValue::get(elemType);
     for (unsigned i = 0; i < dim; i++)
         vecVal = Builder.CreateInsertElement(vecVal, val[i], ConstantInt::get(Type::getInt32Ty(llvmContext), i), name);
@@ -160,15 +161,15 @@ LLVM_VALUE createVecValFromAlloca(LLVM_BUILDER Builder, AllocaInst *destPtr, uns
     std::vector<LLVM_VALUE> vals;
 
     for (unsigned i = 0; i < vecLen; ++i) {
-        LLVM_VALUE ptr = destTy->isDoubleTy() ? Builder.CreateConstGEP1_32(destPtr, i)
-                                              : Builder.CreateConstGEP2_32(nullptr, destPtr, 0, i);
-        vals.push_back(Builder.CreateLoad(ptr));
+        LLVM_VALUE ptr = destTy->isDoubleTy() ? createConstGEP1_32(Builder, destPtr, i)
+                                              : createConstGEP2_32(Builder, destPtr, 0, i);
+        vals.push_back(createLoad(Builder, ptr));
     }
 
     return createVecVal(Builder, vals);
 }
 
-LLVM_VALUE getFirstElement(LLVM_VALUE V, IRBuilder<> Builder) {
+LLVM_VALUE getFirstElement(LLVM_VALUE V, LLVM_BUILDER Builder) {
     Type *VTy = V->getType();
     if (VTy->isDoubleTy()) return V;
     if (VTy->isPointerTy()) return V;
@@ -185,7 +186,7 @@ LLVM_VALUE promoteToTy(LLVM_VALUE val, Type *destTy, LLVM_BUILDER Builder) {
 
     if (destTy->isDoubleTy()) return val;
 
-    return createVecVal(Builder, val, destTy->getVectorNumElements());
+    return createVecVal(Builder, val, vectorNumElements(destTy));
 }
 
 AllocaInst *createAllocaInst(LLVM_BUILDER Builder, Type *ty, unsigned arraySize = 1, const std::string &varName = "") {
@@ -236,7 +237,7 @@ std::pair<LLVM_VALUE, LLVM_VALUE> promoteBinaryOperandsToAppropriateVector(LLVM_
 
     assert(target->getType()->isVectorTy());
 
-    unsigned dim = target->getType()->getVectorNumElements();
+    unsigned dim = vectorNumElements(target->getType());
     LLVM_VALUE vecVal = createVecVal(Builder, toPromote, dim);
 
     if (op1Ty->isVectorTy())
@@ -259,11 +260,11 @@ LLVM_VALUE promoteOperand(LLVM_BUILDER Builder, const ExprType refType, LLVM_VAL
 AllocaInst *storeVectorToDoublePtr(LLVM_BUILDER Builder, LLVM_VALUE vecVal) {
     LLVMContext &llvmContext = Builder.getContext();
     AllocaInst *doublePtr =
-        createAllocaInst(Builder, Type::getDoubleTy(llvmContext), vecVal->getType()->getVectorNumElements());
+        createAllocaInst(Builder, Type::getDoubleTy(llvmContext), vectorNumElements(vecVal->getType()));
     for (unsigned i = 0; i < 3; ++i) {
         LLVM_VALUE idx = ConstantInt::get(Type::getInt32Ty(llvmContext), i);
         LLVM_VALUE val = Builder.CreateExtractElement(vecVal, idx);
-        LLVM_VALUE ptr = Builder.CreateConstGEP1_32(doublePtr, i);
+        LLVM_VALUE ptr = createConstGEP1_32(Builder, doublePtr, i);
         Builder.CreateStore(val, ptr);
     }
     return doublePtr;
@@ -288,7 +289,7 @@ std::vector<LLVM_VALUE> promoteArgs(std::vector<LLVM_VALUE> args,
     if (isTakeOnlyDoubleArg(seFuncType)) return args;
 
     LLVMContext &llvmContext = Builder.getContext();
-    VectorType *destTy = VectorType::get(Type::getDoubleTy(llvmContext), 3);
+    VectorType *destTy = vectorType(Type::getDoubleTy(llvmContext), 3);
     std::vector<LLVM_VALUE> ret;
     for (unsigned i = 0; i < args.size(); ++i) ret.push_back(promoteToTy(args[i], destTy, Builder));
     return ret;
@@ -319,7 +320,7 @@ std::vector<LLVM_VALUE> convertArgsToPointerAndLength(LLVM_BUILDER Builder,
     if (seFuncType == ExprFuncStandard::FUNCN) {
         AllocaInst *doublePtr = createAllocaInst(Builder, Type::getDoubleTy(llvmContext), numArgs);
         for (unsigned i = 0; i < numArgs; ++i) {
-            LLVM_VALUE ptr = Builder.CreateConstGEP1_32(doublePtr, i);
+            LLVM_VALUE ptr = createConstGEP1_32(Builder, doublePtr, i);
             Builder.CreateStore(actualArgs[i], ptr);
         }
         args.push_back(doublePtr);
@@ -329,11 +330,11 @@ std::vector<LLVM_VALUE> convertArgsToPointerAndLength(LLVM_BUILDER Builder,
     AllocaInst *arrayPtr = createArray(Builder, ArrayType::get(Type::getDoubleTy(llvmContext), 3), numArgs);
     for (unsigned i = 0; i < numArgs; ++i) {
         LLVM_VALUE toInsert = actualArgs[i];
-        LLVM_VALUE subArrayPtr = Builder.CreateConstGEP2_32(nullptr, arrayPtr, 0, i);
+        LLVM_VALUE subArrayPtr = createConstGEP2_32(Builder, arrayPtr, 0, i);
         for (unsigned j = 0; j < 3; ++j) {
-            LLVM_VALUE destAddr = Builder.CreateConstGEP2_32(nullptr, subArrayPtr, 0, j);
-            LLVM_VALUE srcAddr = Builder.CreateConstGEP1_32(toInsert, j);
-            Builder.CreateStore(Builder.CreateLoad(srcAddr), destAddr);
+            LLVM_VALUE destAddr = createConstGEP2_32(Builder, subArrayPtr, 0, j);
+            LLVM_VALUE srcAddr = createConstGEP1_32(Builder, toInsert, j);
+            Builder.CreateStore(createLoad(Builder, srcAddr), destAddr);
         }
     }
     args.push_back(Builder.CreateBitCast(arrayPtr, Type::getDoublePtrTy(llvmContext)));
@@ -351,13 +352,13 @@ LLVM_VALUE executeStandardFunction(LLVM_BUILDER Builder,
 
     if (isVarArg(seFuncType)) args = convertArgsToPointerAndLength(Builder, args, seFuncType);
 
-    if (isReturnVector(seFuncType) == false) return Builder.CreateCall(addrVal, args);
+    if (isReturnVector(seFuncType) == false) return createCall(Builder, addrVal, args);
 
     // TODO: assume standard function all use vector of length 3 as parameter
     //       or return type.
     AllocaInst *retPtr = createAllocaInst(Builder, Type::getDoubleTy(llvmContext), 3);
     args.insert(args.begin(), retPtr);
-    Builder.CreateCall(addrVal, replaceVecArgWithDoublePointer(Builder, args));
+    createCall(Builder, addrVal, replaceVecArgWithDoublePointer(Builder, args));
     return createVecValFromAlloca(Builder, retPtr, 3);
 }
 
@@ -381,9 +382,9 @@ LLVM_VALUE callPrintf(const ExprFuncNode *seFunc, LLVM_BUILDER Builder, Function
         LLVM_VALUE arg = seFunc->child(i)->codegen(Builder);
         if (arg->getType()->isVectorTy()) {
             AllocaInst *vecArray = storeVectorToDoublePtr(Builder, arg);
-            for (unsigned i = 0; i < arg->getType()->getVectorNumElements(); ++i) {
-                LLVM_VALUE elemPtr = Builder.CreateConstGEP1_32(vecArray, i);
-                args.push_back(Builder.CreateLoad(elemPtr));
+            for (unsigned i = 0; i < vectorNumElements(arg->getType()); ++i) {
+                LLVM_VALUE elemPtr = createConstGEP1_32(Builder, vecArray, i);
+                args.push_back(createLoad(Builder, elemPtr));
             }
         } else
             args.push_back(arg);
@@ -393,7 +394,6 @@ LLVM_VALUE callPrintf(const ExprFuncNode *seFunc, LLVM_BUILDER Builder, Function
     return ConstantFP::get(Type::getDoubleTy(llvmContext), 0.0);
 }
 
-// TODO: not good. need better implementation.
 LLVM_VALUE callCustomFunction(const ExprFuncNode *funcNode, LLVM_BUILDER Builder) {
     LLVMContext &llvmContext = Builder.getContext();
 
@@ -406,80 +406,58 @@ LLVM_VALUE callCustomFunction(const ExprFuncNode *funcNode, LLVM_BUILDER Builder
     unsigned sizeOfRet = (unsigned)funcNode->type().dim();
     assert(sizeOfRet == 1 || funcNode->type().isFP());
 
-    // TODO: is this necessary ? Doesn't seem to be used :/
-    createAllocaInst(Builder, Type::getDoubleTy(llvmContext), sizeOfRet);
+    // a few types that are reused throughout this function
+    Type*           int32Ty     = Type::getInt32Ty(llvmContext);        // int
+    Type*           doubleTy    = Type::getDoubleTy(llvmContext);       // double
+    PointerType*    int8PtrTy   = Type::getInt8PtrTy(llvmContext);      // char*
+    Type*           int64Ty     = Type::getInt64Ty(llvmContext);        // int64_t
 
-    // calculate how much space for opData, fpArg and strArg
-    unsigned sizeOfFpArgs = 1 + sizeOfRet;
-    unsigned sizeOfStrArgs = 2;
+    // every argument gets an index into fpArgs or strArgs, known now so the table is a constant
+    std::vector<Constant *> argIndex;
+    unsigned sizeOfFpArgs = 0;
+    unsigned sizeOfStrArgs = 0;
     for (int i = 0; i < nargs; ++i) {
         ExprType argType = funcNode->child(i)->type();
         if (argType.isFP()) {
+            argIndex.push_back(ConstantInt::get(int32Ty, sizeOfFpArgs));
             sizeOfFpArgs += std::max(funcNode->promote(i), argType.dim());
         } else if (argType.isString()) {
+            argIndex.push_back(ConstantInt::get(int32Ty, sizeOfStrArgs));
             sizeOfStrArgs += 1;
         } else {
             assert(false && "invalid type encountered");
         }
     }
 
-    // a few types that are reused throughout this function
-    Type*           int32Ty     = Type::getInt32Ty(llvmContext);        // int
-    Type*           doubleTy    = Type::getDoubleTy(llvmContext);       // double
-    PointerType*    int8PtrTy   = Type::getInt8PtrTy(llvmContext);      // char*
-    Type*           int64Ty     = Type::getInt64Ty(llvmContext);        // int64_t
-
-
-    // allocate data that we will feed to SeExpr2LLVMEvalCustomFunction on the stack
-    AllocaInst *opDataArg = createAllocaInst(Builder, int32Ty, (unsigned)nargs + 4, "opDataArgPtr");
-    AllocaInst *fpArg = createAllocaInst(Builder, doubleTy, sizeOfFpArgs, "fpArgPtr");
-    AllocaInst *strArg = createAllocaInst(Builder, int8PtrTy, sizeOfStrArgs, "strArgPtr");
+    AllocaInst *fpArgs = createAllocaInst(Builder, doubleTy, std::max(sizeOfFpArgs, 1u), "fpArgs");
+    AllocaInst *strArgs = createAllocaInst(Builder, int8PtrTy, std::max(sizeOfStrArgs, 1u), "strArgs");
+    AllocaInst *fpResult = createAllocaInst(Builder, doubleTy, sizeOfRet, "fpResult");
+    AllocaInst *strResult = createAllocaInst(Builder, int8PtrTy, 1, "strResult");
 
-    // fill fpArgPtr's first value
-    Builder.CreateStore(ConstantFP::get(doubleTy, nargs), fpArg);
-
-    // fill opDataArgPtr
-    Builder.CreateStore(ConstantInt::get(int32Ty, 0), Builder.CreateConstGEP1_32(opDataArg, 0));
-    Builder.CreateStore(ConstantInt::get(int32Ty, 1), Builder.CreateConstGEP1_32(opDataArg, 1));
-    Builder.CreateStore(ConstantInt::get(int32Ty, 1), Builder.CreateConstGEP1_32(opDataArg, 2));
-    Builder.CreateStore(ConstantInt::get(int32Ty, 0), Builder.CreateConstGEP1_32(opDataArg, 3));
-
-    // Load arguments into the pseudo interpreter data structure
-    unsigned fpIdx = 1 + sizeOfRet;
-    unsigned strIdx = 2;
-    for (int argIndex = 0; argIndex < nargs; ++argIndex) {
-        int opIndex = argIndex + 4;
-        ExprType argType = funcNode->child(argIndex)->type();
+    // store the arguments where the function reads them
+    unsigned fpIdx = 0;
+    unsigned strIdx = 0;
+    for (int i = 0; i < nargs; ++i) {
+        ExprType argType = funcNode->child(i)->type();
         if (argType.isFP()) {
-            // store the fpArgPtr indirection index
-            Builder.CreateStore(ConstantInt::get(int32Ty, fpIdx), Builder.CreateConstGEP1_32(opDataArg, opIndex));
+            int promote = funcNode->promote(i);
             if (argType.dim() > 1) {
                 for (int comp = 0; comp < argType.dim(); comp++) {
                     LLVM_VALUE compIndex = ConstantInt::get(int32Ty, comp);
-                    LLVM_VALUE val = Builder.CreateExtractElement(args[argIndex], compIndex);
-                    LLVM_VALUE fpArgPtr = Builder.CreateConstGEP1_32(fpArg, fpIdx + comp);
-                    Builder.CreateStore(val, fpArgPtr);
+                    LLVM_VALUE val = Builder.CreateExtractElement(args[i], compIndex);
+                    Builder.CreateStore(val, createConstGEP1_32(Builder, fpArgs, fpIdx + comp));
                 }
                 fpIdx += argType.dim();
+            } else if (promote) {
+                for (int comp = 0; comp < promote; comp++)
+                    Builder.CreateStore(args[i], createConstGEP1_32(Builder, fpArgs, fpIdx + comp));
+                fpIdx += promote;
             } else {
-                // TODO: this needs the promote!!!
-                int promote = funcNode->promote(argIndex);
-                if (promote) {
-                    LLVM_VALUE val = args[argIndex];
-                    for (int comp = 0; comp < promote; comp++) {
-                        LLVM_VALUE fpArgPtr = Builder.CreateConstGEP1_32(fpArg, fpIdx + comp);
-                        Builder.CreateStore(val, fpArgPtr);
-                    }
-                    fpIdx += promote;
-                } else {
-                    Builder.CreateStore(args[argIndex], Builder.CreateConstGEP1_32(fpArg, fpIdx));
-                    fpIdx++;
-                }
+                Builder.CreateStore(args[i], createConstGEP1_32(Builder, fpArgs, fpIdx));
+                fpIdx++;
             }
         } else if (argType.isString()) {
-            // store the strArgPtr indirection index
-            Builder.CreateStore(ConstantInt::get(int32Ty, strIdx), Builder.CreateConstGEP1_32(opDataArg, opIndex));
-            Builder.CreateStore(args[argIndex], Builder.CreateConstGEP1_32(strArg, strIdx));
+            Builder.CreateStore(args[i], createConstGEP1_32(Builder, strArgs, strIdx));
             strIdx++;
         }
     }
@@ -487,41 +465,39 @@ LLVM_VALUE callCustomFunction(const ExprFuncNode *funcNode, LLVM_BUILDER Builder
     // get the module from the builder
     Module* module = llvm_getModule(Builder);
 
-    // TODO: thread safety?
-    // TODO: This leaks!
-    GlobalVariable *dataGV = new GlobalVariable(*module, int8PtrTy, false, GlobalValue::InternalLinkage, ConstantPointerNull::get(int8PtrTy));
+    LLVM_VALUE argIndexPtr = ConstantPointerNull::get(Type::getInt32PtrTy(llvmContext));
+    if (nargs) {
+        ArrayType *argIndexTy = ArrayType::get(int32Ty, nargs);
+        GlobalVariable *argIndexGV = new GlobalVariable(*module, argIndexTy, true, GlobalValue::PrivateLinkage,
+                                                        ConstantArray::get(argIndexTy, argIndex), "argIndex");
+        argIndexPtr = Builder.CreatePointerCast(argIndexGV, Type::getInt32PtrTy(llvmContext));
+    }
 
-    // call the function
+    // the data was built by LLVMEvaluator before generating code, see prepareCustomFunctionData
+    const ExprFuncSimple *func = static_cast<const ExprFuncSimple *>(funcNode->func()->funcx());
     Builder.CreateCall(
         module->getFunction("SeExpr2LLVMEvalCustomFunction"),
         {
-            opDataArg,
-            fpArg,
-            strArg,
-            dataGV,
-            ConstantInt::get(int64Ty, (uint64_t)funcNode)
+            Builder.CreateIntToPtr(ConstantInt::get(int64Ty, (uint64_t)func), int8PtrTy),
+            Builder.CreateIntToPtr(ConstantInt::get(int64Ty, (uint64_t)funcNode->getData()), int8PtrTy),
+            ConstantInt::get(int32Ty, nargs),
+            argIndexPtr,
+            fpArgs,
+            strArgs,
+            fpResult,
+            strResult
         }
     );
 
     // read the result from memory
-    int resultOffset = 1;
     if (funcNode->type().isFP()) {
-        if (sizeOfRet == 1) {
-            return Builder.CreateLoad(Builder.CreateConstGEP1_32(fpArg, resultOffset));
-        } else if (sizeOfRet > 1) {
-            std::vector<LLVM_VALUE> resultArray;
-            for (unsigned int comp = 0; comp < sizeOfRet; comp++) {
-                LLVM_VALUE ptr = Builder.CreateConstGEP1_32(fpArg, resultOffset + comp);  // skip nargs
-                resultArray.push_back(Builder.CreateLoad(ptr));
-            }
-            return createVecVal(Builder, resultArray);
-        }
-    } else {
-        return Builder.CreateLoad(Builder.CreateConstGEP1_32(strArg, 1));
+        if (sizeOfRet == 1) return createLoad(Builder, fpResult);
+        std::vector<LLVM_VALUE> resultArray;
+        for (unsigned int comp = 0; comp < sizeOfRet; comp++)
+            resultArray.push_back(createLoad(Builder, createConstGEP1_32(Builder, fpResult, comp)));
+        return createVecVal(Builder, resultArray);
     }
-
-    assert(false);
-    return 0;
+    return createLoad(Builder, strResult);
 }
 }
 
@@ -538,6 +514,8 @@ LLVM_VALUE promoteToDim(LLVM_VALUE val, unsigned dim, LLVM_BUILDER Builder) {
     return createVecVal(Builder, val, dim);
 }
 
+std::string llvmStandardFunctionSymbol(const std::string &name) { return "SeExpr2Std_" + name; }
+
 LLVM_VALUE ExprNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     for (int i = 0; i < numChildren(); i++) child(i)->codegen(Builder);
     return 0;
@@ -561,7 +539,27 @@ LLVM_VALUE ExprNumNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     return ConstantFP::get(Builder.getContext(), APFloat(_val));
 }
 
+namespace {
+//! Whether node is a string literal or a concatenation of literals, in which case value gets the string
+bool constantString(const ExprNode *node, std::string &value) {
+    if (const ExprStrNode *str = dynamic_cast<const ExprStrNode *>(node)) {
+        value = unescapeString(str->str());
+        return true;
+    }
+    const ExprBinaryOpNode *binary = dynamic_cast<const ExprBinaryOpNode *>(node);
+    if (!binary || !binary->type().isString() || binary->_op != '+') return false;
+    std::string value1, value2;
+    if (!constantString(binary->child(0), value1) || !constantString(binary->child(1), value2)) return false;
+    value = value1 + value2;
+    return true;
+}
+}
+
 LLVM_VALUE ExprBinaryOpNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
+    // concatenations of literals are done once here rather than allocating a new string every evaluation
+    std::string constant;
+    if (constantString(this, constant)) return Builder.CreateGlobalStringPtr(constant);
+
     LLVM_VALUE c1 = child(0)->codegen(Builder);
     LLVM_VALUE c2 = child(1)->codegen(Builder);
     std::pair<LLVM_VALUE, LLVM_VALUE> pv = promoteBinaryOperandsToAppropriateVector(Builder, c1, c2);
@@ -627,14 +625,14 @@ LLVM_VALUE ExprBinaryOpNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
 
         // concatenate operand strings into output string
         Builder.CreateCall(strcat, { alloc, op1 });                         // strcat(alloc, op1);
-        LLVM_VALUE newAlloc = Builder.CreateGEP(nullptr, alloc, len1);      // newAlloc = alloc + len1
+        LLVM_VALUE newAlloc = createGEP(Builder, alloc, len1);      // newAlloc = alloc + len1
         Builder.CreateCall(strcat, { newAlloc, op2 });                      // strcat(alloc, op2);
 
         // store the address in the node's _out member so that it will be
         // cleaned up when the expression is destroyed.
         APInt outAddr = APInt(64, (uint64_t)&_out);
         LLVM_VALUE out = Constant::getIntegerValue(i8PtrPtrTy, outAddr);    // out = &_out;
-        Builder.CreateCall(free, { Builder.CreateLoad(out) });              // free(*out);
+        Builder.CreateCall(free, { createLoad(Builder, out) });              // free(*out);
         Builder.CreateStore(alloc, out);                                    // *out = alloc
         return alloc;
     }
@@ -663,26 +661,37 @@ LLVM_VALUE ExprLocalVar::codegen(LLVM_BUILDER Builder, const std::string &varNam
 }
 
 LLVM_VALUE ExprCompareEqNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
-    LLVM_VALUE op1 = getFirstElement(child(0)->codegen(Builder), Builder);
-    LLVM_VALUE op2 = getFirstElement(child(1)->codegen(Builder), Builder);
+    LLVM_VALUE op1 = child(0)->codegen(Builder);
+    LLVM_VALUE op2 = child(1)->codegen(Builder);
 
     LLVM_VALUE boolVal = 0;
 
     const bool isString = child(0)->type().isString();
 
     if (isString == false) {
+        // vectors are equal when all of their components are, like in the interpreter
+        std::pair<LLVM_VALUE, LLVM_VALUE> pv = promoteBinaryOperandsToAppropriateVector(Builder, op1, op2);
+        LLVM_VALUE componentsEqual = Builder.CreateFCmpOEQ(pv.first, pv.second);
+        LLVM_VALUE equal = componentsEqual;
+        if (componentsEqual->getType()->isVectorTy()) {
+            equal = Builder.CreateExtractElement(componentsEqual, Builder.getInt32(0));
+            for (unsigned i = 1; i < vectorNumElements(componentsEqual->getType()); i++)
+                equal = Builder.CreateAnd(equal, Builder.CreateExtractElement(componentsEqual, Builder.getInt32(i)));
+        }
         switch (_op) {
         case '!':
-            boolVal = Builder.CreateFCmpONE(op1, op2);
+            boolVal = Builder.CreateNot(equal);
             break;
         case '=':
-            boolVal = Builder.CreateFCmpOEQ(op1, op2);
+            boolVal = equal;
             break;
         default:
             assert(false && "Unkown CompareEq op.");
         }
-        return Builder.CreateUIToFP(boolVal, op1->getType());
+        return Builder.CreateUIToFP(boolVal, Type::getDoubleTy(Builder.getContext()));
     } else {
+        op1 = getFirstElement(op1, Builder);
+        op2 = getFirstElement(op2, Builder);
         // precompute a few things
         LLVMContext &llvmContext = Builder.getContext();
         Module *module = llvm_getModule(Builder);
@@ -840,40 +849,26 @@ LLVM_VALUE ExprCondNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
 #endif
 }
 
-LLVM_VALUE ExprFuncNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
+namespace {
+//! Calls the standard function of funcNode with the generated arguments, once per component for scalar
+//! parameters given vectors
+LLVM_VALUE callStandardFunction(const ExprFuncNode *funcNode,
+                                const ExprFuncStandard *standfunc,
+                                std::vector<LLVM_VALUE> args,
+                                LLVM_BUILDER Builder) {
     LLVMContext &llvmContext = Builder.getContext();
     Module *M = llvm_getModule(Builder);
-    std::string calleeName(name());
-
-    /************* call local function or printf *************/
-    Function *callee = M->getFunction(calleeName);
-    if (calleeName == "printf") {
-        if (!callee) {
-            FunctionType *FT = FunctionType::get(Type::getVoidTy(llvmContext), Type::getInt8PtrTy(llvmContext), true);
-            callee = Function::Create(FT, GlobalValue::ExternalLinkage, "printf", llvm_getModule(Builder));
-        }
-        return callPrintf(this, Builder, callee);
-    } else if (callee) {
-        std::vector<LLVM_VALUE> args =
-            promoteArgs(codegenFuncCallArgs(Builder, this), Builder, callee->getFunctionType());
-        return Builder.CreateCall(callee, args);
-    }
 
-    /************* call standard function or custom function *************/
-    // call custom function
-    const ExprFuncStandard *standfunc = dynamic_cast<const ExprFuncStandard *>(_func->funcx());
-    if (!standfunc) return callCustomFunction(this, Builder);
-
-    // call standard function
     // get function pointer
     ExprFuncStandard::FuncType seFuncType = standfunc->getFuncType();
     FunctionType *llvmFuncType = getSeExprFuncStandardLLVMType(seFuncType, llvmContext);
-    void *fp = standfunc->getFuncPointer();
-    ConstantInt *funcAddr = ConstantInt::get(Type::getInt64Ty(llvmContext), (uint64_t)fp);
-    LLVM_VALUE addrVal = Builder.CreateIntToPtr(funcAddr, PointerType::getUnqual(llvmFuncType));
+    // called through a named declaration that LLVMEvaluator binds to standfunc->getFuncPointer(), so the
+    // machine code does not depend on where the function was loaded
+    std::string symbol = llvmStandardFunctionSymbol(funcNode->name());
+    Function *addrVal = M->getFunction(symbol);
+    if (!addrVal) addrVal = Function::Create(llvmFuncType, GlobalValue::ExternalLinkage, symbol, M);
 
     // Collect distribution positions
-    std::vector<LLVM_VALUE> args = codegenFuncCallArgs(Builder, this);
     std::vector<int> argumentIsVectorAndNeedsDistribution(args.size(), 0);
     Type *maxVectorArgType = nullptr;
     if (seFuncType == ExprFuncStandard::FUNCN) {
@@ -902,7 +897,7 @@ LLVM_VALUE ExprFuncNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     assert(maxVectorArgType->isVectorTy());
 
     std::vector<LLVM_VALUE> ret;
-    for (unsigned vecComponent = 0; vecComponent < maxVectorArgType->getVectorNumElements(); ++vecComponent) {
+    for (unsigned vecComponent = 0; vecComponent < vectorNumElements(maxVectorArgType); ++vecComponent) {
         LLVM_VALUE idx = ConstantInt::get(Type::getInt32Ty(llvmContext), vecComponent);
         std::vector<LLVM_VALUE> realArgs;
         // Break the function into multiple calls per component of the output
@@ -911,7 +906,7 @@ LLVM_VALUE ExprFuncNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
             LLVM_VALUE realArg = args[argIndex];
             if (argumentIsVectorAndNeedsDistribution[argIndex]) {
                 if (args[argIndex]->getType()->isPointerTy())
-                    realArg = Builder.CreateLoad(Builder.CreateConstGEP2_32(nullptr, args[argIndex], 0, vecComponent));
+                    realArg = createLoad(Builder, createConstGEP2_32(Builder, args[argIndex], 0, vecComponent));
                 else
                     realArg = Builder.CreateExtractElement(args[argIndex], idx);
             }
@@ -921,6 +916,33 @@ LLVM_VALUE ExprFuncNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     }
     return createVecVal(Builder, ret);
 }
+}
+
+LLVM_VALUE ExprFuncNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
+    LLVMContext &llvmContext = Builder.getContext();
+    Module *M = llvm_getModule(Builder);
+    std::string calleeName(name());
+
+    if (_localFunc) return _localFunc->codegenCall(this, Builder);
+
+    /************* call printf *************/
+    if (calleeName == "printf") {
+        Function *callee = M->getFunction(calleeName);
+        if (!callee) {
+            FunctionType *FT = FunctionType::get(Type::getVoidTy(llvmContext), Type::getInt8PtrTy(llvmContext), true);
+            callee = Function::Create(FT, GlobalValue::ExternalLinkage, "printf", llvm_getModule(Builder));
+        }
+        return callPrintf(this, Builder, callee);
+    }
+
+    /************* call standard function or custom function *************/
+    // call custom function
+    const ExprFuncStandard *standfunc = dynamic_cast<const ExprFuncStandard *>(_func->funcx());
+    if (!standfunc) return callCustomFunction(this, Builder);
+
+    // call standard function
+    return callStandardFunction(this, standfunc, codegenFuncCallArgs(Builder, this), Builder);
+}
 
 LLVM_VALUE ExprIfThenElseNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     LLVM_VALUE condVal = getFirstElement(child(0)->codegen(Builder), Builder);
@@ -956,9 +978,9 @@ LLVM_VALUE ExprIfThenElseNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
         if (finalVar->valid()) {
             ExprType refType = finalVar->type();
             Builder.SetInsertPoint(thenBlock);
-            LLVM_VALUE thenValue = promoteOperand(Builder, refType, Builder.CreateLoad(finalVar->_thenVar->varPtr()));
+            LLVM_VALUE thenValue = promoteOperand(Builder, refType, createLoad(Builder, finalVar->_thenVar->varPtr()));
             Builder.SetInsertPoint(elseBlock);
-            LLVM_VALUE elseValue = promoteOperand(Builder, refType, Builder.CreateLoad(finalVar->_elseVar->varPtr()));
+            LLVM_VALUE elseValue = promoteOperand(Builder, refType, createLoad(Builder, finalVar->_elseVar->varPtr()));
 
             Type *finalType = thenValue->getType();
             Builder.SetInsertPoint(phiBlock);
@@ -990,28 +1012,20 @@ LLVM_VALUE ExprIfThenElseNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
 }
 
 LLVM_VALUE ExprLocalFunctionNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
-    IRBuilder<>::InsertPoint oldIP = Builder.saveIP();
-    LLVMContext &llvmContext = Builder.getContext();
+    // the body is generated at every call site, within the function reading the variable block
+    return 0;
+}
 
-    // codegen prototype
-    Function *F = cast<Function>(child(0)->codegen(Builder));
-
-    // create alloca for args
-    BasicBlock *BB = BasicBlock::Create(llvmContext, "entry", F);
-    Builder.SetInsertPoint(BB);
-    Function::arg_iterator AI = F->arg_begin();
-    for (int i = 0, e = F->arg_size(); i != e; ++i, ++AI) {
-        AllocaInst *Alloca = createAllocaInst(Builder, AI->getType(), 1, AI->getName());
-        Alloca->takeName(&*AI);
-        Builder.CreateStore(&*AI, Alloca);
+LLVM_VALUE ExprLocalFunctionNode::codegenCall(const ExprFuncNode *callerNode, LLVM_BUILDER Builder) LLVM_BODY {
+    std::vector<LLVM_VALUE> args = codegenFuncCallArgs(Builder, callerNode);
+    for (int i = 0; i < callerNode->numChildren(); i++) {
+        if (callerNode->promote(i)) args[i] = promoteToDim(args[i], callerNode->promote(i), Builder);
+        const ExprVarNode *parameter = static_cast<const ExprVarNode *>(prototype()->arg(i));
+        LLVM_VALUE varPtr = parameter->localVar()->codegen(Builder, parameter->name(), args[i]);
+        Builder.CreateStore(args[i], varPtr);
     }
-
-    LLVM_VALUE result = 0;
-    for (int i = 1; i < numChildren(); i++) result = child(i)->codegen(Builder);
-
-    Builder.CreateRet(result);
-    Builder.restoreIP(oldIP);
-    return 0;
+    LLVM_VALUE result = child(1)->codegen(Builder);
+    return _promote ? promoteToDim(result, _promote, Builder) : result;
 }
 
 LLVM_VALUE ExprPrototypeNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
@@ -1047,9 +1061,15 @@ LLVM_VALUE ExprSubscriptNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
 
     if (op1->getType()->isDoubleTy()) return op1;
 
+    // subscripts outside of the vector give 0 like in the interpreter (and converting them would be undefined)
     LLVMContext &llvmContext = Builder.getContext();
-    LLVM_VALUE idx = Builder.CreateFPToUI(op2, Type::getInt32Ty(llvmContext));
-    return Builder.CreateExtractElement(op1, idx);
+    unsigned dim = vectorNumElements(op1->getType());
+    LLVM_VALUE inRange = Builder.CreateAnd(Builder.CreateFCmpOGT(op2, ConstantFP::get(op2->getType(), -1.0)),
+                                           Builder.CreateFCmpOLT(op2, ConstantFP::get(op2->getType(), dim)));
+    LLVM_VALUE idx = Builder.CreateSelect(
+        inRange, Builder.CreateFPToSI(op2, Type::getInt32Ty(llvmContext)), Builder.getInt32(0));
+    LLVM_VALUE zero = ConstantFP::get(Type::getDoubleTy(llvmContext), 0.0);
+    return Builder.CreateSelect(inRange, Builder.CreateExtractElement(op1, idx), zero);
 }
 
 LLVM_VALUE ExprUnaryOpNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
@@ -1103,7 +1123,7 @@ struct VarCodeGeneration {
         // load our return value
         LLVM_VALUE ret = 0;
         if (dim == 1) {
-            ret = Builder.CreateLoad(returnValue);
+            ret = createLoad(Builder, returnValue);
         } else {
             // TODO: I don't really see how this requires dim==3... this assert should be removable
             assert(dim == 3 && "future work.");
@@ -1115,6 +1135,40 @@ struct VarCodeGeneration {
         return ret;
     }
 
+    /// Uniform values do not change while points are evaluated, so loop passes may hoist their loads (and the
+    /// math depending only on them) out of the loop over the points
+    static LLVM_VALUE uniformLoad(LoadInst *load) {
+        load->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(load->getContext(), llvm::None));
+        return load;
+    }
+
+    /// Specialized variables are plain constants, the optimizer folds them like literals
+    static LLVM_VALUE codegen(ExprConstantVarRef *varRef, const std::string &varName, LLVM_BUILDER Builder) {
+        const std::vector<double> &values = varRef->values();
+        if (values.size() == 1) return ConstantFP::get(Builder.getContext(), APFloat(values[0]));
+        std::vector<LLVM_VALUE> elements;
+        for (double value : values) elements.push_back(ConstantFP::get(Builder.getContext(), APFloat(value)));
+        return createVecVal(Builder, elements, varName);
+    }
+
+    /// Variables kept at a fixed address are loaded from it. Nothing tells points apart while the generated code
+    /// runs, so every load is invariant and may be hoisted out of the loop over the points.
+    static LLVM_VALUE codegen(ExprPointerVarRef *varRef, const std::string &varName, LLVM_BUILDER Builder) {
+        LLVMContext &llvmContext = Builder.getContext();
+        Type *int64Ty = Type::getInt64Ty(llvmContext);
+        Type *doublePtrTy = Type::getDoublePtrTy(llvmContext);
+
+        int dim = varRef->type().dim();
+        std::vector<LLVM_VALUE> values;
+        for (int component = 0; component < dim; component++) {
+            const double *address = varRef->data() + component * varRef->stride();
+            LLVM_VALUE ptr = Builder.CreateIntToPtr(ConstantInt::get(int64Ty, (uint64_t)address), doublePtrTy);
+            values.push_back(uniformLoad(createLoad(Builder, ptr, varName)));
+        }
+        if (dim == 1) return values[0];
+        return createVecVal(Builder, values, varName);
+    }
+
     static LLVM_VALUE codegen(VarBlockCreator::Ref *varRef, const std::string &varName, LLVM_BUILDER Builder) {
         LLVMContext &llvmContext = Builder.getContext();
 
@@ -1131,14 +1185,20 @@ struct VarCodeGeneration {
         Type *ptrToPtrTy = variableBlock->getType();
         Value *variableBlockAsPtrPtr = Builder.CreatePointerCast(variableBlock, ptrToPtrTy);
         Value *variableOffsetIndex = ConstantInt::get(Type::getInt32Ty(llvmContext), variableOffset);
-        Value *variableBlockIndirectPtrPtr = Builder.CreateInBoundsGEP(variableBlockAsPtrPtr, variableOffsetIndex);
-        Value *baseMemory = Builder.CreateLoad(variableBlockIndirectPtrPtr);
+        Value *variableBlockIndirectPtrPtr = createInBoundsGEP(Builder, variableBlockAsPtrPtr, variableOffsetIndex);
+        Value *baseMemory = createLoad(Builder, variableBlockIndirectPtrPtr);
         Value *variableStrideValue = ConstantInt::get(Type::getInt32Ty(llvmContext), variableStride);
+        // float variables are widened as they are loaded, the expression computes in double
+        bool isFloat = varRef->precision() == VarBlockCreator::Precision::Float;
+        Type *elementTy = isFloat ? Type::getFloatTy(llvmContext) : Type::getDoubleTy(llvmContext);
+        if (isFloat) baseMemory = Builder.CreatePointerCast(baseMemory, PointerType::getUnqual(elementTy));
+        auto widen = [&](Value *value) {
+            return isFloat ? Builder.CreateFPExt(value, Type::getDoubleTy(llvmContext)) : value;
+        };
         if (dim == 1) {
             /// If we are uniform always assume indirectIndex is 0 (there's only one value)
-            Value *variablePointer =
-                varRef->type().isLifetimeUniform() ? baseMemory : Builder.CreateInBoundsGEP(baseMemory, indirectIndex);
-            return Builder.CreateLoad(variablePointer);
+            if (varRef->type().isLifetimeUniform()) return widen(uniformLoad(createLoad(Builder, baseMemory)));
+            return widen(createLoad(Builder, createInBoundsGEP(Builder, baseMemory, indirectIndex)));
         } else {
             std::vector<Value *> loadedValues(dim);
             for (int component = 0; component < dim; component++) {
@@ -1146,12 +1206,13 @@ struct VarCodeGeneration {
                 /// If we are uniform always assume indirectIndex is 0 (there's only one value)
                 Value *variablePointer =
                     varRef->type().isLifetimeUniform()
-                        ? Builder.CreateInBoundsGEP(Type::getDoubleTy(llvmContext), baseMemory, componentIndex)
+                        ? Builder.CreateInBoundsGEP(elementTy, baseMemory, componentIndex)
                         : Builder.CreateInBoundsGEP(
-                              Type::getDoubleTy(llvmContext),
+                              elementTy,
                               baseMemory,
                               Builder.CreateAdd(Builder.CreateMul(indirectIndex, variableStrideValue), componentIndex));
-                loadedValues[component] = Builder.CreateLoad(variablePointer, varName);
+                LoadInst *load = createLoad(Builder, variablePointer, varName);
+                loadedValues[component] = widen(varRef->type().isLifetimeUniform() ? uniformLoad(load) : load);
             }
             return createVecVal(Builder, loadedValues, varName);
         }
@@ -1166,18 +1227,23 @@ LLVM_VALUE ExprVarNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
         std::string varName("external_");
         varName.append(name());
         // if (LLVM_VALUE valPtr = resolveLocalVar(varName.c_str(), Builder))
-        //     return Builder.CreateLoad(valPtr);
-        if (VarBlockCreator::Ref *varBlockRef = dynamic_cast<VarBlockCreator::Ref *>(_var))
+        //     return createLoad(Builder, valPtr);
+        ExprVarRef *var = _capturedVar ? _capturedVar.get() : _var;
+        if (VarBlockCreator::Ref *varBlockRef = dynamic_cast<VarBlockCreator::Ref *>(var))
             return VarCodeGeneration::codegen(varBlockRef, varName, Builder);
+        else if (ExprConstantVarRef *constantRef = dynamic_cast<ExprConstantVarRef *>(var))
+            return VarCodeGeneration::codegen(constantRef, varName, Builder);
+        else if (ExprPointerVarRef *pointerRef = dynamic_cast<ExprPointerVarRef *>(var))
+            return VarCodeGeneration::codegen(pointerRef, varName, Builder);
         else
-            return VarCodeGeneration::codegen(_var, varName, Builder);
+            return VarCodeGeneration::codegen(var, varName, Builder);
     } else if (_localVar) {
         ExprType varTy = _localVar->type();
         if (varTy.isFP() || varTy.isString()) {
             // LLVM_VALUE valPtr = resolveLocalVar(name(), Builder);
             LLVM_VALUE varPtr = _localVar->varPtr();
             assert(varPtr && "can not found symbol?");
-            return Builder.CreateLoad(varPtr);
+            return createLoad(Builder, varPtr);
         }
     }
 
@@ -1194,6 +1260,483 @@ LLVM_VALUE ExprVecNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     }
     return createVecVal(Builder, elems);
 }
+
+/// Generates a parse tree for a group of consecutive points at once. Values are structures of arrays: each
+/// component of a value is a vector holding it for every point (lane) of the group. Standard functions have no
+/// lane-wide versions and are called for one lane after the other. codegen returns false for the nodes without
+/// lane-wide code (strings, if statements, custom functions and variables evaluated through callbacks).
+class LaneCodeGeneration {
+  public:
+    typedef std::vector<LLVM_VALUE> Components;
+
+    LaneCodeGeneration(LLVM_BUILDER Builder, unsigned lanes, LLVM_VALUE variableBlock, LLVM_VALUE index)
+        : _builder(Builder), _lanes(lanes), _variableBlock(variableBlock), _index(index) {}
+
+    bool codegen(const ExprNode *node, Components &result) {
+        result.clear();
+        if (node->type().isString()) return false;
+        if (typeid(*node) == typeid(ExprNode)) {
+            // list of assignments
+            for (int i = 0; i < node->numChildren(); i++)
+                if (!codegen(node->child(i), result)) return false;
+            result.clear();
+            return true;
+        } else if (dynamic_cast<const ExprModuleNode *>(node)) {
+            // local functions are generated at their call sites
+            for (int i = 0; i < node->numChildren(); i++)
+                if (!dynamic_cast<const ExprLocalFunctionNode *>(node->child(i)) && !codegen(node->child(i), result))
+                    return false;
+            return !result.empty();
+        } else if (dynamic_cast<const ExprBlockNode *>(node)) {
+            return codegen(node->child(0), result) && codegen(node->child(1), result);
+        } else if (const ExprAssignNode *assign = dynamic_cast<const ExprAssignNode *>(node)) {
+            // without if statements every assignment dominates the uses it reaches, so locals need no memory
+            Components value;
+            if (!codegen(assign->child(0), value) || value.empty()) return false;
+            _locals[assign->localVar()] = value;
+            return true;
+        } else if (const ExprVarNode *var = dynamic_cast<const ExprVarNode *>(node)) {
+            return codegenVar(var, result);
+        } else if (const ExprNumNode *num = dynamic_cast<const ExprNumNode *>(node)) {
+            result.push_back(splat(ConstantFP::get(_builder.getContext(), APFloat(num->value()))));
+            return true;
+        } else if (dynamic_cast<const ExprVecNode *>(node)) {
+            for (int i = 0; i < node->numChildren(); i++) {
+                Components element;
+                if (!codegen(node->child(i), element)) return false;
+                result.push_back(element[0]);
+            }
+            return true;
+        } else if (const ExprUnaryOpNode *unary = dynamic_cast<const ExprUnaryOpNode *>(node)) {
+            return codegenUnary(unary, result);
+        } else if (const ExprBinaryOpNode *binary = dynamic_cast<const ExprBinaryOpNode *>(node)) {
+            return codegenBinary(binary, result);
+        } else if (const ExprCompareEqNode *compareEq = dynamic_cast<const ExprCompareEqNode *>(node)) {
+            return codegenCompareEq(compareEq, result);
+        } else if (const ExprCompareNode *compare = dynamic_cast<const ExprCompareNode *>(node)) {
+            return codegenCompare(compare, result);
+        } else if (dynamic_cast<const ExprCondNode *>(node)) {
+            return codegenCond(node, result);
+        } else if (dynamic_cast<const ExprSubscriptNode *>(node)) {
+            return codegenSubscript(node, result);
+        } else if (const ExprFuncNode *func = dynamic_cast<const ExprFuncNode *>(node)) {
+            return codegenFunc(func, result);
+        }
+        return false;
+    }
+
+    /// Stores the components of value for each lane of the group to output, in the layout of the variable block
+    void store(const Components &value, LLVM_VALUE output, Type *elementTy) {
+        Components narrowed;
+        for (LLVM_VALUE component : value)
+            narrowed.push_back(elementTy->isFloatTy() ? _builder.CreateFPTrunc(component, vectorType(elementTy, _lanes))
+                                                      : component);
+        LLVM_VALUE group = interleave(narrowed);
+        LLVM_VALUE first = createInBoundsGEP(
+            _builder, output, _builder.CreateMul(_index, _builder.getInt32((unsigned)value.size())));
+        createAlignedStore(_builder, group, _builder.CreatePointerCast(first, PointerType::getUnqual(group->getType())),
+                           elementTy->getPrimitiveSizeInBits() / 8);
+    }
+
+  private:
+    Type *laneTy() { return vectorType(Type::getDoubleTy(_builder.getContext()), _lanes); }
+
+    LLVM_VALUE splat(LLVM_VALUE scalar) { return _builder.CreateVectorSplat(_lanes, scalar); }
+
+    LLVM_VALUE splat(double scalar) { return splat(ConstantFP::get(_builder.getContext(), APFloat(scalar))); }
+
+    LLVM_VALUE nonZero(LLVM_VALUE value) { return _builder.CreateFCmpUNE(value, splat(0.0)); }
+
+    LLVM_VALUE toDouble(LLVM_VALUE mask) { return _builder.CreateUIToFP(mask, laneTy()); }
+
+    /// Whether mask is set for some lane of the group
+    LLVM_VALUE anyLane(LLVM_VALUE mask) {
+        Type *bitsTy = IntegerType::get(_builder.getContext(), _lanes);
+        return _builder.CreateICmpNE(_builder.CreateBitCast(mask, bitsTy), ConstantInt::get(bitsTy, 0));
+    }
+
+    /// Shuffle mask picking every stride'th element, starting at start
+    LLVM_VALUE strideMask(unsigned start, unsigned stride) {
+        std::vector<uint32_t> indices;
+        for (unsigned lane = 0; lane < _lanes; lane++) indices.push_back(start + lane * stride);
+        return ConstantDataVector::get(_builder.getContext(), indices);
+    }
+
+    /// A scalar value is promoted to a tuple of dim components, like promoteToDim
+    static Components promote(const Components &value, int dim) {
+        if (value.size() != 1 || dim <= 1) return value;
+        return Components(dim, value[0]);
+    }
+
+    /// Promotes the scalar one of two values to the dimension of the other, false if they are tuples of different
+    /// dimensions
+    static bool promotePair(Components &first, Components &second) {
+        first = promote(first, (int)second.size());
+        second = promote(second, (int)first.size());
+        return first.size() == second.size();
+    }
+
+    /// Generates node only when some lane of mask needs it, its components are undefined in the other lanes.
+    /// Nothing it computes for one lane can fault in another, this only saves the work no lane needs.
+    bool codegenMasked(LLVM_VALUE mask, const ExprNode *node, Components &result) {
+        LLVMContext &llvmContext = _builder.getContext();
+        Function *F = llvm_getFunction(_builder);
+        BasicBlock *skipBlock = _builder.GetInsertBlock();
+        BasicBlock *someBlock = BasicBlock::Create(llvmContext, "someLanes", F);
+        BasicBlock *joinBlock = BasicBlock::Create(llvmContext, "joinLanes", F);
+        _builder.CreateCondBr(anyLane(mask), someBlock, joinBlock);
+
+        _builder.SetInsertPoint(someBlock);
+        // locals the node binds (parameters of local functions) do not dominate what follows the join
+        std::map<const ExprLocalVar *, Components> locals = _locals;
+        bool generated = codegen(node, result);
+        _locals = std::move(locals);
+        if (!generated || result.empty()) return false;
+        _builder.CreateBr(joinBlock);
+        someBlock = _builder.GetInsertBlock();
+
+        _builder.SetInsertPoint(joinBlock);
+        for (LLVM_VALUE &component : result) {
+            PHINode *phi = _builder.CreatePHI(component->getType(), 2);
+            phi->addIncoming(component, someBlock);
+            phi->addIncoming(UndefValue::get(component->getType()), skipBlock);
+            component = phi;
+        }
+        return true;
+    }
+
+    bool codegenVar(const ExprVarNode *node, Components &result) {
+        if (const ExprVarRef *var = node->codegenVar()) {
+            if (!var->type().isFP()) return false;
+            if (const VarBlockCreator::Ref *ref = dynamic_cast<const VarBlockCreator::Ref *>(var)) {
+                loadVariable(ref, result);
+            } else if (const ExprConstantVarRef *constantRef = dynamic_cast<const ExprConstantVarRef *>(var)) {
+                for (double value : constantRef->values()) result.push_back(splat(value));
+            } else if (const ExprPointerVarRef *pointerRef = dynamic_cast<const ExprPointerVarRef *>(var)) {
+                Type *int64Ty = Type::getInt64Ty(_builder.getContext());
+                for (int component = 0; component < pointerRef->type().dim(); component++) {
+                    const double *address = pointerRef->data() + component * pointerRef->stride();
+                    LLVM_VALUE ptr = _builder.CreateIntToPtr(ConstantInt::get(int64Ty, (uint64_t)address),
+                                                             Type::getDoublePtrTy(_builder.getContext()));
+                    result.push_back(splat(VarCodeGeneration::uniformLoad(createLoad(_builder, ptr, node->name()))));
+                }
+            } else {
+                return false;
+            }
+            return true;
+        }
+        auto it = _locals.find(node->localVar());
+        if (it == _locals.end()) return false;
+        result = it->second;
+        return true;
+    }
+
+    /// Varying variables hold the components of each point next to each other, so one load takes those of the
+    /// whole group and shuffles pick the components apart. Uniform variables are loaded once and broadcast.
+    void loadVariable(const VarBlockCreator::Ref *ref, Components &result) {
+        LLVMContext &llvmContext = _builder.getContext();
+        LLVM_VALUE baseMemory = createLoad(_builder, createInBoundsGEP(_builder, _variableBlock,
+                                                                       _builder.getInt32(ref->offset())));
+        bool isFloat = ref->precision() == VarBlockCreator::Precision::Float;
+        Type *elementTy = isFloat ? Type::getFloatTy(llvmContext) : Type::getDoubleTy(llvmContext);
+        if (isFloat) baseMemory = _builder.CreatePointerCast(baseMemory, PointerType::getUnqual(elementTy));
+        int dim = ref->type().dim();
+
+        if (ref->type().isLifetimeUniform()) {
+            for (int component = 0; component < dim; component++) {
+                LLVM_VALUE value = VarCodeGeneration::uniformLoad(
+                    createLoad(_builder, createInBoundsGEP(_builder, baseMemory, _builder.getInt32(component))));
+                if (isFloat) value = _builder.CreateFPExt(value, Type::getDoubleTy(llvmContext));
+                result.push_back(splat(value));
+            }
+            return;
+        }
+
+        unsigned stride = ref->stride();
+        Type *groupTy = vectorType(elementTy, _lanes * stride);
+        LLVM_VALUE first =
+            createInBoundsGEP(_builder, baseMemory, _builder.CreateMul(_index, _builder.getInt32(stride)));
+        LLVM_VALUE group = createAlignedLoad(_builder, groupTy,
+                                             _builder.CreatePointerCast(first, PointerType::getUnqual(groupTy)),
+                                             elementTy->getPrimitiveSizeInBits() / 8);
+        for (int component = 0; component < dim; component++) {
+            LLVM_VALUE value = stride == 1 ? group
+                                           : _builder.CreateShuffleVector(group, UndefValue::get(groupTy),
+                                                                          strideMask(component, stride));
+            if (isFloat) value = _builder.CreateFPExt(value, laneTy());
+            result.push_back(value);
+        }
+    }
+
+    /// Inverse of the shuffles of loadVariable: the first lane's components, then the second lane's...
+    LLVM_VALUE interleave(const Components &components) {
+        unsigned dim = components.size();
+        if (dim == 1) return components[0];
+        Type *componentTy = components[0]->getType();
+        LLVM_VALUE group = UndefValue::get(vectorType(componentTy->getScalarType(), _lanes * dim));
+        for (unsigned component = 0; component < dim; component++) {
+            // widen the component to the size of the group (the added elements are undefined), then merge it in
+            std::vector<uint32_t> widen, merge;
+            for (unsigned i = 0; i < _lanes * dim; i++) {
+                widen.push_back(std::min(i, _lanes));
+                merge.push_back(i % dim == component ? _lanes * dim + i / dim : i);
+            }
+            LLVMContext &llvmContext = _builder.getContext();
+            LLVM_VALUE widened = _builder.CreateShuffleVector(components[component], UndefValue::get(componentTy),
+                                                              ConstantDataVector::get(llvmContext, widen));
+            group = _builder.CreateShuffleVector(group, widened, ConstantDataVector::get(llvmContext, merge));
+        }
+        return group;
+    }
+
+    bool codegenUnary(const ExprUnaryOpNode *node, Components &result) {
+        if (!codegen(node->child(0), result)) return false;
+        LLVM_VALUE negateZero = ConstantFP::getZeroValueForNegation(laneTy());
+        for (LLVM_VALUE &component : result) {
+            switch (node->_op) {
+                case '-':
+                    component = _builder.CreateFSub(negateZero, component);
+                    break;
+                case '~':
+                    component = _builder.CreateFAdd(_builder.CreateFSub(negateZero, component), splat(1.0));
+                    break;
+                case '!':
+                    component = _builder.CreateSelect(_builder.CreateFCmpOEQ(splat(0.0), component), splat(1.0),
+                                                      splat(0.0));
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool codegenBinary(const ExprBinaryOpNode *node, Components &result) {
+        Components op1, op2;
+        if (!codegen(node->child(0), op1) || !codegen(node->child(1), op2) || !promotePair(op1, op2)) return false;
+        Module *module = llvm_getModule(_builder);
+        for (size_t i = 0; i < op1.size(); i++) {
+            LLVM_VALUE a = op1[i], b = op2[i];
+            switch (node->_op) {
+                case '+':
+                    result.push_back(_builder.CreateFAdd(a, b));
+                    break;
+                case '-':
+                    result.push_back(_builder.CreateFSub(a, b));
+                    break;
+                case '*':
+                    result.push_back(_builder.CreateFMul(a, b));
+                    break;
+                case '/':
+                    result.push_back(_builder.CreateFDiv(a, b));
+                    break;
+                case '%': {
+                    // same as the scalar code: a==0 ? 0 : a-floor(a/b)*b
+                    Function *floorFun = Intrinsic::getDeclaration(module, Intrinsic::floor, laneTy());
+                    LLVM_VALUE floored = _builder.CreateCall(floorFun, {_builder.CreateFDiv(a, b)});
+                    LLVM_VALUE normal = _builder.CreateFSub(a, _builder.CreateFMul(floored, b));
+                    result.push_back(
+                        _builder.CreateSelect(_builder.CreateFCmpOEQ(splat(0.0), a), splat(0.0), normal));
+                    break;
+                }
+                case '^': {
+                    Function *powFun = Intrinsic::getDeclaration(module, Intrinsic::pow, laneTy());
+                    result.push_back(_builder.CreateCall(powFun, {a, b}));
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool codegenCompareEq(const ExprCompareEqNode *node, Components &result) {
+        Components op1, op2;
+        if (!codegen(node->child(0), op1) || !codegen(node->child(1), op2) || !promotePair(op1, op2)) return false;
+        // vectors are equal when all of their components are
+        LLVM_VALUE equal = _builder.CreateFCmpOEQ(op1[0], op2[0]);
+        for (size_t i = 1; i < op1.size(); i++)
+            equal = _builder.CreateAnd(equal, _builder.CreateFCmpOEQ(op1[i], op2[i]));
+        if (node->_op == '!')
+            equal = _builder.CreateNot(equal);
+        else if (node->_op != '=')
+            return false;
+        result.push_back(toDouble(equal));
+        return true;
+    }
+
+    bool codegenCompare(const ExprCompareNode *node, Components &result) {
+        Components op1, op2;
+        if (!codegen(node->child(0), op1)) return false;
+        if (node->_op == '&' || node->_op == '|') {
+            // the second operand is only evaluated for the lanes the first one does not decide
+            LLVM_VALUE op1IsOne = nonZero(op1[0]);
+            bool isAnd = node->_op == '&';
+            if (!codegenMasked(isAnd ? op1IsOne : _builder.CreateNot(op1IsOne), node->child(1), op2)) return false;
+            LLVM_VALUE op2IsOne = nonZero(op2[0]);
+            LLVMContext &llvmContext = _builder.getContext();
+            LLVM_VALUE decided = isAnd ? ConstantInt::getFalse(llvmContext) : ConstantInt::getTrue(llvmContext);
+            LLVM_VALUE decidedMask = _builder.CreateVectorSplat(_lanes, decided);
+            result.push_back(toDouble(isAnd ? _builder.CreateSelect(op1IsOne, op2IsOne, decidedMask)
+                                            : _builder.CreateSelect(op1IsOne, decidedMask, op2IsOne)));
+            return true;
+        }
+        if (!codegen(node->child(1), op2)) return false;
+        LLVM_VALUE a = op1[0], b = op2[0];
+        switch (node->_op) {
+            case 'g':
+                result.push_back(toDouble(_builder.CreateFCmpOGE(a, b)));
+                return true;
+            case 'l':
+                result.push_back(toDouble(_builder.CreateFCmpOLE(a, b)));
+                return true;
+            case '>':
+                result.push_back(toDouble(_builder.CreateFCmpOGT(a, b)));
+                return true;
+            case '<':
+                result.push_back(toDouble(_builder.CreateFCmpOLT(a, b)));
+                return true;
+        }
+        return false;
+    }
+
+    /// Both branches are evaluated for the lanes taking them and blended
+    bool codegenCond(const ExprNode *node, Components &result) {
+        Components condition, trueValue, falseValue;
+        if (!codegen(node->child(0), condition)) return false;
+        LLVM_VALUE mask = nonZero(condition[0]);
+        if (!codegenMasked(mask, node->child(1), trueValue) ||
+            !codegenMasked(_builder.CreateNot(mask), node->child(2), falseValue))
+            return false;
+        trueValue = promote(trueValue, node->type().dim());
+        falseValue = promote(falseValue, node->type().dim());
+        if (trueValue.size() != falseValue.size()) return false;
+        for (size_t i = 0; i < trueValue.size(); i++)
+            result.push_back(_builder.CreateSelect(mask, trueValue[i], falseValue[i]));
+        return true;
+    }
+
+    /// Subscripts outside of the vector give 0 like in the scalar code
+    bool codegenSubscript(const ExprNode *node, Components &result) {
+        Components vec, index;
+        if (!codegen(node->child(0), vec) || !codegen(node->child(1), index)) return false;
+        if (vec.size() == 1) {
+            result = vec;
+            return true;
+        }
+        unsigned dim = vec.size();
+        LLVM_VALUE inRange = _builder.CreateAnd(_builder.CreateFCmpOGT(index[0], splat(-1.0)),
+                                                _builder.CreateFCmpOLT(index[0], splat((double)dim)));
+        LLVM_VALUE component =
+            _builder.CreateFPToSI(index[0], vectorType(Type::getInt32Ty(_builder.getContext()), _lanes));
+        LLVM_VALUE selected = splat(0.0);
+        for (unsigned i = 0; i < dim; i++)
+            selected = _builder.CreateSelect(_builder.CreateICmpEQ(component, _builder.CreateVectorSplat(
+                                                                                  _lanes, _builder.getInt32(i))),
+                                             vec[i], selected);
+        result.push_back(_builder.CreateSelect(inRange, selected, splat(0.0)));
+        return true;
+    }
+
+    bool codegenFunc(const ExprFuncNode *node, Components &result) {
+        std::vector<Components> args(node->numChildren());
+        for (int i = 0; i < node->numChildren(); i++)
+            if (!codegen(node->child(i), args[i]) || args[i].empty()) return false;
+
+        if (const ExprLocalFunctionNode *localFunc = node->localFunc()) {
+            for (int i = 0; i < node->numChildren(); i++) {
+                const ExprVarNode *parameter = static_cast<const ExprVarNode *>(localFunc->prototype()->arg(i));
+                _locals[parameter->localVar()] = promote(args[i], node->promote(i));
+            }
+            if (!codegen(localFunc->child(1), result)) return false;
+            result = promote(result, localFunc->promote());
+            return true;
+        }
+
+        const ExprFuncStandard *standfunc =
+            node->func() ? dynamic_cast<const ExprFuncStandard *>(node->func()->funcx()) : nullptr;
+        if (!standfunc || !strcmp(node->name(), "printf")) return false;
+        for (unsigned lane = 0; lane < _lanes; lane++) {
+            std::vector<LLVM_VALUE> laneArgs;
+            for (const Components &arg : args) {
+                std::vector<LLVM_VALUE> elements;
+                for (LLVM_VALUE component : arg) elements.push_back(_builder.CreateExtractElement(component, lane));
+                laneArgs.push_back(elements.size() == 1 ? elements[0] : createVecVal(_builder, elements));
+            }
+            LLVM_VALUE value = callStandardFunction(node, standfunc, laneArgs, _builder);
+            unsigned dim = value->getType()->isVectorTy() ? vectorNumElements(value->getType()) : 1;
+            if (!lane) result.assign(dim, UndefValue::get(laneTy()));
+            for (unsigned i = 0; i < dim; i++) {
+                LLVM_VALUE element = dim == 1 ? value : _builder.CreateExtractElement(value, i);
+                result[i] = _builder.CreateInsertElement(result[i], element, lane);
+            }
+        }
+        return true;
+    }
+
+    llvm::IRBuilder<> &_builder;
+    unsigned _lanes;
+    LLVM_VALUE _variableBlock;
+    LLVM_VALUE _index;
+    /// Values of the local variables (and parameters of local functions) last assigned
+    std::map<const ExprLocalVar *, Components> _locals;
+};
+
+Function *codegenLanes(const ExprNode *parseTree,
+                       const ExprType &desiredReturnType,
+                       unsigned lanes,
+                       const std::string &name,
+                       Module *module) {
+    if (!desiredReturnType.isFP()) return nullptr;
+    LLVMContext &llvmContext = module->getContext();
+    Type *doublePtrTy = Type::getDoublePtrTy(llvmContext);
+    FunctionType *FT = FunctionType::get(
+        Type::getVoidTy(llvmContext),
+        {doublePtrTy, PointerType::getUnqual(doublePtrTy), Type::getInt32Ty(llvmContext), Type::getInt1Ty(llvmContext)},
+        false);
+    Function *F = Function::Create(FT, GlobalValue::InternalLinkage, name, module);
+#if LLVM_VERSION_MAJOR >= 14
+    F->addFnAttr(llvm::Attribute::AlwaysInline);
+#elif LLVM_VERSION_MAJOR > 4
+    F->addAttribute(llvm::AttributeList::FunctionIndex, llvm::Attribute::AlwaysInline);
+#else
+    F->addAttribute(llvm::AttributeSet::FunctionIndex, llvm::Attribute::AlwaysInline);
+#endif
+    const char *names[] = {"outputPointer", "dataBlock", "firstIndex", "floatOutput"};
+    std::vector<Argument *> args;
+    for (auto &arg : F->args()) {
+        arg.setName(names[args.size()]);
+        args.push_back(&arg);
+    }
+
+    IRBuilder<> Builder(BasicBlock::Create(llvmContext, "entry", F));
+    LaneCodeGeneration generator(Builder, lanes, args[1], args[2]);
+    LaneCodeGeneration::Components value;
+    int dim = desiredReturnType.dim();
+    if (!generator.codegen(parseTree, value) || value.empty() || (value.size() > 1 && (int)value.size() < dim)) {
+        F->eraseFromParent();
+        return nullptr;
+    }
+    // scalars are replicated, extra components dropped like in the point function
+    value.resize(dim, value[0]);
+
+    // float entries of the variable block get the results narrowed
+    BasicBlock *floatOutputBlock = BasicBlock::Create(llvmContext, "floatOutput", F);
+    BasicBlock *doubleOutputBlock = BasicBlock::Create(llvmContext, "doubleOutput", F);
+    BasicBlock *outputStoredBlock = BasicBlock::Create(llvmContext, "outputStored", F);
+    Builder.CreateCondBr(args[3], floatOutputBlock, doubleOutputBlock);
+    Builder.SetInsertPoint(floatOutputBlock);
+    Type *floatTy = Type::getFloatTy(llvmContext);
+    generator.store(value, Builder.CreatePointerCast(args[0], PointerType::getUnqual(floatTy)), floatTy);
+    Builder.CreateBr(outputStoredBlock);
+    Builder.SetInsertPoint(doubleOutputBlock);
+    generator.store(value, args[0], Type::getDoubleTy(llvmContext));
+    Builder.CreateBr(outputStoredBlock);
+    Builder.SetInsertPoint(outputStoredBlock);
+    Builder.CreateRetVoid();
+    return F;
+}
 }
 
 #endif
@@ -139,22 +139,21 @@ ExprType ExprModuleNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
 ExprType ExprPrototypeNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
     bool error = false;
 
-#if 0 // TODO: implement prototype
-    if (_retTypeSet) checkCondition(returnType().isValid(), "Function has bad return type", error);
+    if (_retTypeSet)
+        checkCondition(returnType().isValid(), ErrorCode::Unknown, { "Function has bad return type" }, error);
 
+    // the parameters are local variables of the function's scope, with the types they were declared with
     _argTypes.clear();
     for (int c = 0; c < numChildren(); c++) {
-        ExprType type = child(c)->type();
-        checkCondition(type.isValid(), "Function has a parameter with a bad type", error);
+        ExprVarNode* parameter = static_cast<ExprVarNode*>(child(c));
+        ExprType type = parameter->type();
+        checkCondition(
+            type.isFP() || type.isString(), ErrorCode::Unknown, { "Function has a parameter with a bad type" }, error);
         _argTypes.push_back(type);
-        ExprLocalVar* localVar = new ExprLocalVar(type);
-        envBuilder.current()->add(((ExprVarNode*)child(c))->name(), localVar);
-        std::cerr << "after create localvar phi " << localVar->getPhi() << std::endl;
-        child(c)->prep(wantScalar, envBuilder);
+        envBuilder.current()->add(parameter->name(), std::unique_ptr<ExprLocalVar>(new ExprLocalVar(type)));
+        parameter->prep(wantScalar, envBuilder);
     }
-#else
-    checkCondition(false, ErrorCode::Unknown, { "Prototypes are currently not supported" }, error);
-#endif
+
     if (error)
         setType(ExprType().Error());
     else
@@ -170,89 +169,66 @@ void ExprPrototypeNode::addArgTypes(ExprNode* surrogate) {
     for (int i = 0; i < numChildren(); i++) _argTypes.push_back(child(i)->type());
 }
 
-void ExprPrototypeNode::addArgs(ExprNode* surrogate) {
-    ExprNode::addChildren(surrogate);
-#if 0
-    ExprNode * child;
-    ExprType type;
-    for(int i = 0; i < numChildren(); i++) {
-        child = this->child(i);
-        type = child->type();
-
-        _argTypes.push_back(type);
-        _env.add(((ExprVarNode*)child)->name(), new ExprLocalVar(type));
-    }
-#endif
-}
+void ExprPrototypeNode::addArgs(ExprNode* surrogate) { ExprNode::addChildren(surrogate); }
 
 ExprType ExprLocalFunctionNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
     bool error = false;
 
-#if 0  // TODO: no local functions for now
+    // the function sees its parameters and the functions defined before it, not itself
+    ExprVarEnv* moduleEnv = envBuilder.current();
+    envBuilder.setCurrent(envBuilder.createDescendant(moduleEnv));
 
-    // prep prototype and check for errors
-    ExprPrototypeNode* prototype = (ExprPrototypeNode*)child(0);
-    ExprVarEnv functionEnv;
-    functionEnv.resetAndSetParent(&env);
-    if (!prototype->prep(false, functionEnv).isValid()) error = true;
+    ExprPrototypeNode* prototype = static_cast<ExprPrototypeNode*>(child(0));
+    if (!prototype->prep(false, envBuilder).isValid()) error = true;
 
     // decide what return type we want
-    bool returnWantsScalar = false;
-    if (!error && prototype->isReturnTypeSet()) returnWantsScalar = prototype->returnType().isFP(1);
+    bool returnWantsScalar = !error && prototype->isReturnTypeSet() && prototype->returnType().isFP(1);
 
-    // prep block and check for errors
-    ExprNode* block = child(1);
-    ExprType blockType = block->prep(returnWantsScalar, functionEnv);
+    ExprType blockType = child(1)->prep(returnWantsScalar, envBuilder);
+    envBuilder.setCurrent(moduleEnv);
 
-    if (!error && blockType.isValid()) {
+    if (!error && (blockType.isFP() || blockType.isString())) {
         if (prototype->isReturnTypeSet()) {
-            if (blockType != prototype->returnType()) {
-                checkCondition(false,
-                               "In function result of block '" + blockType.toString() +
-                                   "' does not match given return type " + prototype->returnType().toString(),
-                               error);
-            }
-
-        } else
+            ExprType returnType = prototype->returnType();
+            bool compatible = ExprType::valuesCompatible(returnType, blockType) &&
+                              returnType.isLifeCompatible(blockType) &&
+                              (!returnType.isFP() || returnType.dim() >= blockType.dim());
+            checkCondition(
+                compatible, ErrorCode::TypeMismatch12, { blockType.toString(), returnType.toString() }, error);
+            _promote = returnType.isFP() && returnType.dim() > blockType.dim() ? returnType.dim() : 0;
+            // calls are only as varying as the body
+            prototype->setReturnType(returnType.setLifetime(blockType));
+        } else {
             prototype->setReturnType(blockType);
-        // register the function in the symbol table
-
-        env.addFunction(prototype->name(), this);
-    } else {
-        checkCondition(false, "Invalid type for blockType is " + blockType.toString(), error);
-        error = true;
+            _promote = 0;
+        }
+    } else if (!error) {
+        checkCondition(false, ErrorCode::ExpectedStringOrFloatAnyD, {}, error);
     }
-#else
-    checkCondition(false, ErrorCode::Unknown, { "Local functions are currently not supported." }, error);
-#endif
 
-    if (error)
+    if (error) {
         setType(ExprType().Error());
-    else
+    } else {
+        moduleEnv->addFunction(prototype->name(), this);
         setType(ExprType().None().Varying());
+    }
 
     return _type;
 }
 
-// TODO: write buildInterpreter for local function node
 ExprType ExprLocalFunctionNode::prep(ExprFuncNode* callerNode, bool scalarWanted, ExprVarEnvBuilder& envBuilder) const {
-#if 0
     bool error = false;
-    callerNode->checkCondition(callerNode->numChildren() == prototype()->numChildren(),
-                               "Incorrect number of arguments to function call",
-                               error);
-    for (int i = 0; i < callerNode->numChildren(); i++) {
-        // TODO: is this right?
-        // bool compatible=ExprType::valuesCompatible(callerNode->child(i)->prep(false,env), prototype()->argType(i));
-        if (!callerNode->checkArg(i, prototype()->argType(i), envBuilder)) error = true;
-        // callerNode->child(i)->checkCondition(compatible,"Incorrect type for argument",error);
+    int nargs = callerNode->numChildren(), nparams = prototype()->numChildren();
+    const std::string& name = prototype()->name();
+    if (callerNode->checkCondition(nargs >= nparams, ErrorCode::FunctionTooFewArguments, { name }, error) &&
+        callerNode->checkCondition(nargs <= nparams, ErrorCode::FunctionTooManyArguments, { name }, error)) {
+        for (int c = 0; c < nargs; c++)
+            if (!callerNode->checkArg(c, prototype()->argType(c), envBuilder)) error = true;
+    } else {
+        // prep the arguments anyways to catch as many errors as possible
+        for (int c = 0; c < nargs; c++) callerNode->child(c)->prep(false, envBuilder);
     }
     return error ? ExprType().Error() : prototype()->returnType();
-#else
-    bool error = false;
-    callerNode->checkCondition(false, ErrorCode::Unknown, {"Local functions are currently not supported." }, error);
-    return ExprType().Error();
-#endif
 }
 
 ExprType ExprBlockNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
@@ -496,8 +472,9 @@ ExprType ExprVarNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
         setType(_localVar->type());
         return _type;
     } else {
-        // user defined external variable
-        _var = _expr->resolveVar(name());
+        // user defined external variable (unless the expression was specialized for it)
+        _var = _expr->specializedVar(name());
+        if (!_var) _var = _expr->resolveVar(name());
         if (!_var) {
             if (const VarBlockCreator* creator = _expr->varBlockCreator()) {
                 // data block defined external var
@@ -516,6 +493,31 @@ ExprType ExprVarNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
     return _type;
 }
 
+namespace {
+//! Stands for a variable evaluated through ExprVarRef::eval, which the generated code still calls at run time
+class ExprCapturedVarRef : public ExprVarRef {
+  public:
+    ExprCapturedVarRef(ExprVarRef* var) : ExprVarRef(var->type()), _var(var) {}
+
+    void eval(double* result) { _var->eval(result); }
+    void eval(const char** resultStr) { _var->eval(resultStr); }
+
+  private:
+    ExprVarRef* _var;
+};
+}
+
+void ExprVarNode::captureVar() const {
+    if (const VarBlockCreator::Ref* blockRef = dynamic_cast<const VarBlockCreator::Ref*>(_var))
+        _capturedVar.reset(new VarBlockCreator::Ref(*blockRef));
+    else if (const ExprConstantVarRef* constantRef = dynamic_cast<const ExprConstantVarRef*>(_var))
+        _capturedVar.reset(new ExprConstantVarRef(*constantRef));
+    else if (const ExprPointerVarRef* pointerRef = dynamic_cast<const ExprPointerVarRef*>(_var))
+        _capturedVar.reset(new ExprPointerVarRef(*pointerRef));
+    else if (_var)
+        _capturedVar.reset(new ExprCapturedVarRef(_var));
+}
+
 ExprType ExprNumNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
     _type = ExprType().FP(1).Constant();
     return _type;
@@ -541,7 +543,6 @@ ExprType ExprFuncNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
     if (ExprLocalFunctionNode* localFunction = envBuilder.current()->findFunction(_name)) {
         _localFunc = localFunction;
         setTypeWithChildLife(localFunction->prep(this, wantScalar, envBuilder));
-        // TODO: we need to type check arguments here
     } else {
         if (!_func) _func = _expr->resolveFunc(_name);
         if (!_func) _func = ExprFunc::lookup(_name);
@@ -565,6 +566,8 @@ ExprType ExprFuncNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
 }
 
 int ExprFuncNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     if (_localFunc)
         return _localFunc->buildInterpreterForCall(this, interpreter);
     else if (_func)
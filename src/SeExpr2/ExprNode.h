@@ -315,11 +315,19 @@ class ExprLocalFunctionNode : public ExprNode {
     int buildInterpreter(Interpreter* interpreter) const;
     /// Build interpreter if we are called
     int buildInterpreterForCall(const ExprFuncNode* callerNode, Interpreter* interpreter) const;
+    /// Whether the interpreter builds the body at every call site (see Expression::interpreterInlineThreshold)
+    bool inlined() const;
     virtual LLVM_VALUE codegen(LLVM_BUILDER) LLVM_BODY;
+    /// Generate the body at a call site
+    LLVM_VALUE codegenCall(const ExprFuncNode* callerNode, LLVM_BUILDER) LLVM_BODY;
+    /// Dimension the result of the body is promoted to for the declared return type, 0 if it is not
+    int promote() const { return _promote; }
 
   private:
     mutable int _procedurePC;
     mutable int _returnedDataOp;
+    /// Dimension the result of the body is promoted to for the declared return type, 0 if it is not
+    int _promote = 0;
 };
 
 /// Node that computes local variables before evaluating expression
@@ -471,10 +479,17 @@ class ExprVarNode : public ExprNode {
     const ExprLocalVar* localVar() const { return _localVar; }
     const ExprVarRef* var() const { return _var; }
 
+    /// Copies what code generation reads from the external variable, so that the code may be generated on
+    /// another thread after the expression resolving the variable (and possibly owning it) started to go away
+    void captureVar() const;
+    /// The external variable as code generation sees it
+    const ExprVarRef* codegenVar() const { return _capturedVar ? _capturedVar.get() : _var; }
+
   private:
     std::string _name;
     ExprLocalVar* _localVar;
     ExprVarRef* _var;
+    mutable std::unique_ptr<ExprVarRef> _capturedVar;
 };
 
 /// Node that stores a numeric constant
@@ -584,8 +599,21 @@ class ExprFuncNode : public ExprNode {
         used from ExprFuncX::eval()
     */
     Data* getData() const { return _data; }
+
+    //! value an argument had when ExprFuncSimple::evalConstant built the data
+    struct ConstantArg {
+        std::vector<double> fp;
+        std::string str;
+        bool isString = false, isNull = false;
+    };
+    //! remember the arguments the data was built from, so that Expression::saveProgram can save them and
+    //! loadProgram can build the data again
+    void setConstantArgs(std::vector<ConstantArg> args) const { _constantArgs = std::move(args); }
+    const std::vector<ConstantArg>& constantArgs() const { return _constantArgs; }
+
     int promote(int i) const { return _promote[i]; }
     const ExprFunc* func() const { return _func; }
+    const ExprLocalFunctionNode* localFunc() const { return _localFunc; }
 
   private:
     std::string _name;
@@ -596,6 +624,7 @@ class ExprFuncNode : public ExprNode {
                                               //    mutable std::vector<Vec3d> _vecArgs;
     mutable std::vector<int> _promote;
     mutable Data* _data;
+    mutable std::vector<ConstantArg> _constantArgs;
 };
 
 /// Policy which provides all the AST Types for the parser.
@@ -20,6 +20,11 @@
 #include <stack>
 #include <algorithm>
 #include <sstream>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
 #endif
 
 #include "ExprConfig.h"
@@ -32,7 +37,10 @@
 #include "Platform.h"
 
 #include "Evaluator.h"
+#include "VarBlock.h"
+#include "ExprExecutor.h"
 #include "ExprWalker.h"
+#include "Utils.h"
 
 #include <cstdio>
 #include <typeinfo>
@@ -56,8 +64,8 @@ static Expression::EvaluationStrategy chooseDefaultEvaluationStrategy() {
 #if defined(SEEXPR_ENABLE_LLVM)
     if (char* env = getenv("SE_EXPR_EVAL")) {
         if (Expression::debugging) std::cerr << "Overriding SeExpr Evaluation Default to be " << env << std::endl;
-        return !strcmp(env, "LLVM") ? Expression::UseLLVM : !strcmp(env, "INTERPRETER") ? Expression::UseInterpreter
-                                                                                        : Expression::UseInterpreter;
+        return !strcmp(env, "LLVM") ? Expression::UseLLVM : !strcmp(env, "TIERED") ? Expression::UseTiered
+                                                                                   : Expression::UseInterpreter;
     } else
         return Expression::UseLLVM;
 #else
@@ -65,6 +73,96 @@ static Expression::EvaluationStrategy chooseDefaultEvaluationStrategy() {
 #endif
 }
 Expression::EvaluationStrategy Expression::defaultEvaluationStrategy = chooseDefaultEvaluationStrategy();
+size_t Expression::tieredCompileThreshold = 0;
+
+static Expression::JitOptLevel chooseDefaultJitOptLevel() {
+    const char* env = getenv("SE_EXPR_JIT_OPT");
+    if (env && env[0] >= '0' && env[0] <= '3' && !env[1]) return Expression::JitOptLevel(env[0] - '0');
+    if (env && !strcmp(env, "adaptive")) return Expression::JitAdaptive;
+    return Expression::JitO3;
+}
+Expression::JitOptLevel Expression::defaultJitOptLevel = chooseDefaultJitOptLevel();
+int Expression::jitAdaptiveThreshold = 100;
+bool Expression::interpreterFusion = true;
+bool Expression::interpreterSlotReuse = true;
+int Expression::interpreterInlineThreshold = 64;
+bool Expression::interpreterFolding = true;
+bool Expression::interpreterHoisting = true;
+
+#if defined(SEEXPR_ENABLE_LLVM)
+/// Thread generating and compiling the LLVM code of UseTiered expressions in the order they were queued. It starts
+/// with the first expression queued, which also registers the atexit handler stopping and joining it. That handler
+/// runs before the static objects existing by then are destroyed, and before LLVM shuts down.
+class ExprTieredCompiler {
+  public:
+    static ExprTieredCompiler& instance() {
+        // never destroyed, expressions destroyed after the thread stopped still cancel their compilation
+        static ExprTieredCompiler* compiler = new ExprTieredCompiler;
+        return *compiler;
+    }
+
+    /// Queues expr, unless the thread was stopped (expr then stays on the interpreter)
+    void enqueue(const Expression* expr) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopped) return;
+        if (!_thread.joinable()) {
+            _thread = std::thread(&ExprTieredCompiler::run, this);
+            std::atexit([] { instance().stop(); });
+        }
+        _pending.push_back(expr);
+        _queued.notify_one();
+    }
+
+    /// Removes expr from the queue, waiting for it to finish if it is being compiled
+    void cancel(const Expression* expr) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _pending.erase(std::remove(_pending.begin(), _pending.end(), expr), _pending.end());
+        _compiled.wait(lock, [this, expr] { return _compiling != expr; });
+    }
+
+    /// Drops the queued expressions, lets the one being compiled finish and joins the thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+            _pending.clear();
+        }
+        _queued.notify_one();
+        if (_thread.joinable()) _thread.join();
+    }
+
+  private:
+    ExprTieredCompiler() : _stopped(false), _compiling(nullptr) {}
+
+    void run() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _queued.wait(lock, [this] { return _stopped || !_pending.empty(); });
+            if (_stopped) return;
+            const Expression* expr = _compiling = _pending.front();
+            _pending.pop_front();
+            lock.unlock();
+            expr->compileTiered();
+            lock.lock();
+            _compiling = nullptr;
+            _compiled.notify_all();
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _queued, _compiled;
+    std::deque<const Expression*> _pending;
+    std::thread _thread;
+    bool _stopped;
+    const Expression* _compiling;
+};
+
+/// Captures the external variables below node for code generated on the tiered compiler thread
+static void captureVars(const ExprNode* node) {
+    if (const ExprVarNode* varNode = dynamic_cast<const ExprVarNode*>(node)) varNode->captureVar();
+    for (int c = 0; c < node->numChildren(); c++) captureVars(node->child(c));
+}
+#endif
 
 class TypePrintExaminer : public SeExpr2::Examiner<true> {
   public:
@@ -91,7 +189,8 @@ bool TypePrintExaminer::examine(const ExprNode* examinee) {
 
 Expression::Expression(Expression::EvaluationStrategy evaluationStrategy)
     : _wantVec(true), _expression(""), _evaluationStrategy(evaluationStrategy), _context(&Context::global()),
-      _desiredReturnType(ExprType().FP(3).Varying()), _parseTree(nullptr), _isValid(false), _parsed(false), _prepped(false),
+      _desiredReturnType(ExprType().FP(3).Varying()), _parseTree(nullptr), _isValid(false), _parsed(false), _typesPrepped(false),
+      _prepped(false),
       _interpreter(nullptr), _llvmEvaluator(new LLVMEvaluator()) {
     ExprFunc::init();
 }
@@ -101,7 +200,8 @@ Expression::Expression(const std::string& e,
                        EvaluationStrategy evaluationStrategy,
                        const Context& context)
     : _wantVec(true), _expression(e), _evaluationStrategy(evaluationStrategy), _context(&context),
-      _desiredReturnType(type), _parseTree(nullptr), _isValid(false), _parsed(false), _prepped(false), _interpreter(nullptr),
+      _desiredReturnType(type), _parseTree(nullptr), _isValid(false), _parsed(false), _typesPrepped(false),
+      _prepped(false), _interpreter(nullptr),
       _llvmEvaluator(new LLVMEvaluator()) {
     ExprFunc::init();
 }
@@ -114,6 +214,7 @@ Expression::~Expression() {
 void Expression::debugPrintInterpreter() const {
     if (_interpreter) {
         _interpreter->print();
+        _interpreter->printCode();
         std::cerr << "return slot " << _returnSlot << std::endl;
     }
 }
@@ -132,16 +233,22 @@ void Expression::debugPrintParseTree() const {
 }
 
 void Expression::reset() {
+#if defined(SEEXPR_ENABLE_LLVM)
+    if (_llvmQueued) ExprTieredCompiler::instance().cancel(this);
+#endif
+    _llvmQueued = false;
+    _llvmReady = false;
+    _llvmFailed = false;
+    _tieredEvaluations = 0;
     delete _llvmEvaluator;
     _llvmEvaluator = new LLVMEvaluator();
     delete _parseTree;
     _parseTree = nullptr;
-    if (_evaluationStrategy == UseInterpreter) {
-        delete _interpreter;
-        _interpreter = nullptr;
-    }
+    delete _interpreter;
+    _interpreter = nullptr;
     _isValid = 0;
     _parsed = 0;
+    _typesPrepped = 0;
     _prepped = 0;
     _parseErrorCode = ErrorCode::None;
     _parseErrorIds.clear();
@@ -154,6 +261,27 @@ void Expression::reset() {
     _comments.clear();
 }
 
+void Expression::specialize(const std::map<std::string, std::vector<double> >& values) {
+    reset();
+    _specializedVars.clear();
+    for (const auto& value : values) _specializedVars[value.first].reset(new ExprConstantVarRef(value.second));
+}
+
+ExprConstantVarRef* Expression::specializedVar(const std::string& name) const {
+    auto it = _specializedVars.find(name);
+    return it != _specializedVars.end() ? it->second.get() : nullptr;
+}
+
+void ExprConstantVarRef::eval(double* result) { std::copy(_values.begin(), _values.end(), result); }
+
+void ExprConstantVarRef::eval(const char** resultStr) { assert(false); }
+
+void ExprPointerVarRef::eval(double* result) {
+    for (int k = 0; k < type().dim(); k++) result[k] = _data[k * _stride];
+}
+
+void ExprPointerVarRef::eval(const char** resultStr) { assert(false); }
+
 void Expression::setContext(const Context& context) {
     reset();
     _context = &context;
@@ -164,6 +292,45 @@ void Expression::setDesiredReturnType(const ExprType& type) {
     _desiredReturnType = type;
 }
 
+void Expression::setJitOptLevel(JitOptLevel level) {
+    reset();
+    _jitOptLevel = level;
+}
+
+double Expression::jitCompileSeconds() const { return useLLVM() ? _llvmEvaluator->compileSeconds() : 0; }
+
+bool Expression::jitCodeCached() const { return useLLVM() && _llvmEvaluator->loadedFromCache(); }
+
+bool Expression::jitLoopVectorized() const { return useLLVM() && _llvmEvaluator->loopVectorized(); }
+
+std::string Expression::jitVectorizeRemarks() const {
+    return useLLVM() ? _llvmEvaluator->vectorizeRemarks() : std::string();
+}
+
+int Expression::jitLaneWidth() const { return useLLVM() ? _llvmEvaluator->laneWidth() : 0; }
+
+std::vector<std::string> Expression::jitInlinedBuiltins() const {
+    return useLLVM() ? _llvmEvaluator->inlinedBuiltins() : std::vector<std::string>();
+}
+
+bool Expression::jitBuiltinsBitcode() {
+#if defined(SEEXPR_ENABLE_LLVM) && defined(SEEXPR_ENABLE_BUILTIN_BITCODE)
+    return true;
+#else
+    return false;
+#endif
+}
+
+double Expression::totalJitCompileSeconds() { return LLVMEvaluator::totalCompileSeconds(); }
+
+size_t Expression::jitCodeBytes() const { return useLLVM() ? _llvmEvaluator->codeBytes() : 0; }
+
+size_t Expression::totalJitCodeBytes() { return LLVMEvaluator::residentBytes(); }
+
+void Expression::setJitCodeBudget(size_t bytes) { LLVMEvaluator::setCodeBudget(bytes); }
+
+size_t Expression::jitCodeBudget() { return LLVMEvaluator::codeBudget(); }
+
 void Expression::setVarBlockCreator(const VarBlockCreator* creator) {
     reset();
     _varBlockCreator = creator;
@@ -204,12 +371,9 @@ void Expression::parse() const {
     }
 }
 
-void Expression::prep() const {
-    if (_prepped) return;
-#ifdef SEEXPR_PERFORMANCE
-    PrintTiming timer("[ PREP     ] v2 prep time: ");
-#endif
-    _prepped = true;
+void Expression::prepTypes() const {
+    if (_typesPrepped) return;
+    _typesPrepped = true;
     parseIfNeeded();
 
     bool error = false;
@@ -227,38 +391,6 @@ void Expression::prep() const {
         _parseTree->addError(ErrorCode::ExpressionIncompatibleTypes, { _parseTree->type().toString(), _desiredReturnType.toString() });
     } else {
         _isValid = true;
-
-        if (_evaluationStrategy == UseInterpreter) {
-            if (debugging) {
-                debugPrintParseTree();
-                std::cerr << "Eval strategy is interpreter" << std::endl;
-            }
-            assert(!_interpreter);
-            _interpreter = new Interpreter;
-            _returnSlot = _parseTree->buildInterpreter(_interpreter);
-            if (_desiredReturnType.isFP()) {
-                int dimWanted = _desiredReturnType.dim();
-                int dimHave = _parseTree->type().dim();
-                if (dimWanted > dimHave) {
-                    _interpreter->addOp(getTemplatizedOp<Promote>(dimWanted));
-                    int finalOp = _interpreter->allocFP(dimWanted);
-                    _interpreter->addOperand(_returnSlot);
-                    _interpreter->addOperand(finalOp);
-                    _returnSlot = finalOp;
-                    _interpreter->endOp();
-                }
-            }
-            if (debugging) _interpreter->print();
-        } else {  // useLLVM
-            if (debugging) {
-                std::cerr << "Eval strategy is llvm" << std::endl;
-                debugPrintParseTree();
-            }
-            if (!_llvmEvaluator->prepLLVM(_parseTree, _desiredReturnType)) {
-                error = true;
-            }
-        }
-
         // TODO: need promote
         _returnType = _parseTree->type();
     }
@@ -289,14 +421,409 @@ void Expression::prep() const {
     }
 
     if (debugging) {
-        std::cerr << "ending with isValid " << _isValid << std::endl;
+        std::cerr << "ending type check with isValid " << _isValid << std::endl;
         std::cerr << "parse error \n" << _parseError << std::endl;
     }
 }
 
+void Expression::prep() const {
+    if (_prepped) return;
+#ifdef SEEXPR_PERFORMANCE
+    PrintTiming timer("[ PREP     ] v2 prep time: ");
+#endif
+    _prepped = true;
+    prepTypes();
+    if (!_isValid) return;
+
+    if (_evaluationStrategy != UseLLVM) {
+        if (debugging) {
+            debugPrintParseTree();
+            std::cerr << "Eval strategy is " << (_evaluationStrategy == UseTiered ? "tiered" : "interpreter")
+                      << std::endl;
+        }
+        buildInterpreter();
+        if (_evaluationStrategy == UseTiered && tieredCompileThreshold == 0) queueTieredCompile();
+    } else {  // useLLVM
+        if (debugging) {
+            std::cerr << "Eval strategy is llvm" << std::endl;
+            debugPrintParseTree();
+        }
+        _llvmEvaluator->setOptLevel(_jitOptLevel);
+        if (!_llvmEvaluator->prepLLVM(_parseTree, _desiredReturnType, _varBlockCreator)) {
+            _isValid = false;
+            _returnType = ExprType().Error();
+        }
+    }
+
+    if (debugging) std::cerr << "ending with isValid " << _isValid << std::endl;
+}
+
+void Expression::buildInterpreter() const {
+    assert(!_interpreter);
+    _interpreter = new Interpreter;
+    _interpreter->setFolding(interpreterFolding);
+    _interpreter->setHoisting(interpreterHoisting);
+    _returnSlot = _parseTree->buildInterpreter(_interpreter);
+    if (_desiredReturnType.isFP()) {
+        int dimWanted = _desiredReturnType.dim();
+        int dimHave = _parseTree->type().dim();
+        if (dimWanted > dimHave) {
+            _interpreter->addOp(getTemplatizedOp<Promote>(dimWanted));
+            int finalOp = _interpreter->allocFP(dimWanted);
+            _interpreter->addOperand(_returnSlot);
+            _interpreter->addOperand(finalOp);
+            _returnSlot = finalOp;
+            _interpreter->endOp();
+        }
+    }
+    if (interpreterFusion) _interpreter->fuseOps();
+    if (interpreterSlotReuse) _interpreter->allocateSlots(_returnSlot, _parseTree->type().isFP());
+    _interpreter->finalize();
+    if (debugging) {
+        _interpreter->print();
+        _interpreter->printCode();
+    }
+}
+
+void Expression::fallBackToInterpreter() const {
+    std::lock_guard<std::mutex> lock(_fallbackMutex);
+    if (_llvmFailed.load()) return;
+    if (debugging)
+        std::cerr << "evicted LLVM code could not be loaded again, falling back to the interpreter" << std::endl;
+    if (!_interpreter) buildInterpreter();
+    _llvmFailed.store(true, std::memory_order_release);
+}
+
+void Expression::queueTieredCompile() const {
+#if defined(SEEXPR_ENABLE_LLVM)
+    // programs restored by loadProgram have nothing to compile
+    if (!_parseTree) return;
+    if (_llvmQueued.exchange(true)) return;
+    // The variables resolved by derived classes may be gone before reset() cancels the compilation, which it does
+    // before destroying the parse tree and the LLVM evaluator. Code generation reads copies of them instead.
+    captureVars(_parseTree);
+    ExprTieredCompiler::instance().enqueue(this);
+#endif
+}
+
+void Expression::compileTiered() const {
+    // past a threshold the expression is known to be hot
+    _llvmEvaluator->setOptLevel(_jitOptLevel, tieredCompileThreshold > 0);
+    if (_llvmEvaluator->generateLLVM(_parseTree, _desiredReturnType, _varBlockCreator) &&
+        _llvmEvaluator->compileLLVM()) {
+        _llvmReady.store(true, std::memory_order_release);
+    } else if (debugging) {
+        std::cerr << "tiered LLVM compilation failed, staying on the interpreter" << std::endl;
+    }
+}
+
+namespace {
+const char* const programMagic = "SeExpr2 program";
+
+//! Kinds of host data a saved program refers to
+enum ProgramBinding { VarBinding, BlockVarBinding, FuncBinding, PointerVarBinding, SimpleFuncBinding, FuncDataBinding };
+
+//! Collects the variable and function nodes below node
+void collectBindingNodes(const ExprNode* node, std::vector<const ExprNode*>& nodes) {
+    if (dynamic_cast<const ExprVarNode*>(node) || dynamic_cast<const ExprFuncNode*>(node)) nodes.push_back(node);
+    for (int c = 0; c < node->numChildren(); c++) collectBindingNodes(node->child(c), nodes);
+}
+
+void writeType(std::ostream& out, const ExprType& type) {
+    Utils::writeBinary(out, static_cast<int32_t>(type.type()));
+    Utils::writeBinary(out, static_cast<int32_t>(type.dim()));
+    Utils::writeBinary(out, static_cast<int32_t>(type.lifetime()));
+}
+
+bool readType(std::istream& in, ExprType& type) {
+    int32_t kind = 0, dim = 0, lifetime = 0;
+    if (!Utils::readBinary(in, kind) || !Utils::readBinary(in, dim) || !Utils::readBinary(in, lifetime)) return false;
+    if (kind < ExprType::tERROR || kind > ExprType::tNONE || dim < 1 || (kind != ExprType::tFP && dim != 1) ||
+        lifetime < ExprType::ltERROR || lifetime > ExprType::ltCONSTANT)
+        return false;
+    type = ExprType(static_cast<ExprType::Type>(kind), dim, static_cast<ExprType::Lifetime>(lifetime));
+    return true;
+}
+
+template <class T>
+void writeStrings(std::ostream& out, const T& strings) {
+    Utils::writeBinary(out, static_cast<int32_t>(strings.size()));
+    for (const std::string& str : strings) Utils::writeBinary(out, str);
+}
+
+bool readStrings(std::istream& in, std::vector<std::string>& strings) {
+    int32_t count = 0;
+    if (!Utils::readBinary(in, count) || count < 0) return false;
+    strings.resize(count);
+    for (std::string& str : strings)
+        if (!Utils::readBinary(in, str)) return false;
+    return true;
+}
+
+//! Reads the arguments saveProgram wrote for the call node to func and builds its data again from them
+bool readCallData(std::istream& in, const ExprFuncSimple* func, const ExprFuncNode* node, ExprFuncNode::Data*& data) {
+    int32_t nargs = 0;
+    if (!Utils::readBinary(in, nargs) || nargs != node->numChildren()) return false;
+    std::vector<ExprFuncNode::ConstantArg> constantArgs(nargs);
+    std::vector<int> argIndex(nargs);
+    std::vector<double> fp;
+    std::vector<char*> c;
+    // strings are passed the way the interpreter holds them, with their length before them
+    Interpreter strings;
+    for (int i = 0; i < nargs; i++) {
+        ExprFuncNode::ConstantArg& arg = constantArgs[i];
+        const ExprType& type = node->child(i)->type();
+        int32_t kind = 0;
+        if (!Utils::readBinary(in, kind) || kind < 0 || kind > 2 || (kind != 0) != type.isString()) return false;
+        arg.isString = kind != 0;
+        arg.isNull = kind == 2;
+        if (arg.isString) {
+            if (!Utils::readBinary(in, arg.str)) return false;
+            argIndex[i] = static_cast<int>(c.size());
+            c.push_back(arg.isNull ? nullptr : const_cast<char*>(strings.intern(arg.str)));
+        } else {
+            int dim = node->promote(i) ? node->promote(i) : type.dim();
+            if (!Utils::readBinary(in, arg.fp) || static_cast<int>(arg.fp.size()) != dim) return false;
+            argIndex[i] = static_cast<int>(fp.size());
+            fp.insert(fp.end(), arg.fp.begin(), arg.fp.end());
+        }
+    }
+    std::vector<double> fpResult(std::max(node->type().dim(), 1));
+    char* strResult = nullptr;
+    ExprFuncSimple::ArgHandle args(
+        nullptr, nargs, argIndex.data(), fp.data(), c.data(), fpResult.data(), &strResult);
+    node->setConstantArgs(std::move(constantArgs));
+    data = func->evalConstant(node, args);
+    node->setData(data);
+    return true;
+}
+}
+
+bool Expression::saveProgram(std::ostream& out) const {
+    using Utils::writeBinary;
+    prepIfNeeded();
+    if (!_isValid || !_interpreter || !_parseTree) return false;
+
+    // host data is saved by name and kind, loadProgram resolves it again
+    Interpreter::PtrBindings bindings;
+    int numBindings = 0, numRecords = 0, numCalls = 0;
+    std::ostringstream bindingData;
+    std::vector<const ExprNode*> nodes;
+    collectBindingNodes(_parseTree, nodes);
+    for (const ExprNode* node : nodes) {
+        if (const ExprVarNode* varNode = dynamic_cast<const ExprVarNode*>(node)) {
+            const ExprVarRef* var = varNode->var();
+            if (!var || !bindings.insert(std::make_pair(var, numBindings)).second) continue;
+            numBindings++;
+            numRecords++;
+            const auto* blockVar = dynamic_cast<const VarBlockCreator::Ref*>(var);
+            const auto* pointerVar = dynamic_cast<const ExprPointerVarRef*>(var);
+            writeBinary(bindingData,
+                        static_cast<int32_t>(blockVar ? BlockVarBinding : pointerVar ? PointerVarBinding : VarBinding));
+            writeBinary(bindingData, std::string(varNode->name()));
+            writeType(bindingData, var->type());
+            if (blockVar) {
+                writeBinary(bindingData, static_cast<int32_t>(blockVar->offset()));
+                writeBinary(bindingData, static_cast<int32_t>(blockVar->stride()));
+                writeBinary(bindingData, static_cast<int32_t>(blockVar->precision()));
+            } else if (pointerVar) {
+                // the program may hold the address of the value instead of the variable, it comes next
+                writeBinary(bindingData, static_cast<int32_t>(pointerVar->stride()));
+                bindings.insert(std::make_pair(pointerVar->data(), numBindings++));
+            }
+        } else {
+            const ExprFuncNode* funcNode = static_cast<const ExprFuncNode*>(node);
+            const ExprFunc* func = funcNode->func();
+            const ExprFuncX* funcx = func ? func->funcx() : nullptr;
+            int call = numCalls++;
+            if (const auto* standard = dynamic_cast<const ExprFuncStandard*>(funcx)) {
+                if (!bindings.insert(std::make_pair(standard->getFuncPointer(), numBindings)).second) continue;
+                numBindings++;
+                numRecords++;
+                writeBinary(bindingData, static_cast<int32_t>(FuncBinding));
+                writeBinary(bindingData, std::string(funcNode->name()));
+                writeBinary(bindingData, static_cast<int32_t>(standard->getFuncType()));
+            } else if (const auto* simple = dynamic_cast<const ExprFuncSimple*>(funcx)) {
+                if (bindings.insert(std::make_pair(simple, numBindings)).second) {
+                    numBindings++;
+                    numRecords++;
+                    writeBinary(bindingData, static_cast<int32_t>(SimpleFuncBinding));
+                    writeBinary(bindingData, std::string(funcNode->name()));
+                }
+                // the data of the call is saved as the arguments evalConstant built it from
+                if (!funcNode->getData()) continue;
+                bindings.insert(std::make_pair(funcNode->getData(), numBindings++));
+                numRecords++;
+                const std::vector<ExprFuncNode::ConstantArg>& args = funcNode->constantArgs();
+                writeBinary(bindingData, static_cast<int32_t>(FuncDataBinding));
+                writeBinary(bindingData, std::string(funcNode->name()));
+                writeBinary(bindingData, static_cast<int32_t>(call));
+                writeBinary(bindingData, static_cast<int32_t>(args.size()));
+                for (const ExprFuncNode::ConstantArg& arg : args) {
+                    writeBinary(bindingData, static_cast<int32_t>(arg.isString ? (arg.isNull ? 2 : 1) : 0));
+                    if (arg.isString)
+                        writeBinary(bindingData, arg.str);
+                    else
+                        writeBinary(bindingData, arg.fp);
+                }
+            }
+        }
+    }
+
+    std::ostringstream program;
+    if (!_interpreter->write(program, bindings)) return false;
+
+    writeBinary(out, std::string(programMagic));
+    writeBinary(out, static_cast<int32_t>(Interpreter::programVersion));
+    writeBinary(out, _expression);
+    writeType(out, _desiredReturnType);
+    writeType(out, _returnType);
+    writeBinary(out, static_cast<int32_t>(_returnSlot));
+    writeStrings(out, _vars);
+    writeStrings(out, _funcs);
+    writeStrings(out, _threadUnsafeFunctionCalls);
+    writeBinary(out, static_cast<int32_t>(_specializedVars.size()));
+    for (const auto& var : _specializedVars) {
+        writeBinary(out, var.first);
+        writeBinary(out, var.second->values());
+    }
+    writeBinary(out, static_cast<int32_t>(numRecords));
+    out << bindingData.str() << program.str();
+    return static_cast<bool>(out);
+}
+
+bool Expression::loadProgram(std::istream& in) {
+    using Utils::readBinary;
+    reset();
+    if (_evaluationStrategy == UseLLVM) return false;
+
+    std::string magic, expression;
+    int32_t version = 0, returnSlot = 0, numSpecialized = 0, numRecords = 0;
+    ExprType desiredType, returnType;
+    std::vector<std::string> vars, funcs, threadUnsafeCalls;
+    if (!readBinary(in, magic) || magic != programMagic || !readBinary(in, version) ||
+        version != Interpreter::programVersion)
+        return false;
+    if (!readBinary(in, expression) || !readType(in, desiredType) || !readType(in, returnType) ||
+        !readBinary(in, returnSlot) || !readStrings(in, vars) || !readStrings(in, funcs) ||
+        !readStrings(in, threadUnsafeCalls) || !readBinary(in, numSpecialized) || numSpecialized < 0)
+        return false;
+    if (desiredType != _desiredReturnType) return false;
+
+    std::map<std::string, std::unique_ptr<ExprConstantVarRef> > specializedVars;
+    for (int i = 0; i < numSpecialized; i++) {
+        std::string name;
+        std::vector<double> values;
+        if (!readBinary(in, name) || !readBinary(in, values)) return false;
+        specializedVars[name].reset(new ExprConstantVarRef(values));
+    }
+    // from here on the expression holds what was saved, fail() puts back what it had
+    const std::string text = _expression;
+    _specializedVars.swap(specializedVars);
+    auto fail = [&]() {
+        _expression = text;
+        _specializedVars.swap(specializedVars);
+        reset();
+        return false;
+    };
+    // the data of ExprFuncSimple calls belongs to their nodes, the expression is parsed again for those
+    std::vector<const ExprFuncNode*> calls;
+
+    // resolve the host data the way prep does
+    if (!readBinary(in, numRecords) || numRecords < 0) return fail();
+    std::vector<Interpreter::ReadBinding> bindings;
+    for (int i = 0; i < numRecords; i++) {
+        int32_t kind = 0;
+        std::string name;
+        if (!readBinary(in, kind) || !readBinary(in, name)) return fail();
+        if (kind == VarBinding || kind == BlockVarBinding || kind == PointerVarBinding) {
+            ExprType type;
+            if (!readType(in, type)) return fail();
+            ExprVarRef* var = specializedVar(name);
+            if (!var) var = resolveVar(name);
+            if (!var && _varBlockCreator) var = _varBlockCreator->resolveVar(name);
+            if (!var || var->type() != type) return fail();
+            const auto* blockVar = dynamic_cast<const VarBlockCreator::Ref*>(var);
+            const auto* pointerVar = dynamic_cast<const ExprPointerVarRef*>(var);
+            if ((kind == BlockVarBinding) != (blockVar != nullptr) ||
+                (kind == PointerVarBinding) != (pointerVar != nullptr))
+                return fail();
+            if (blockVar) {
+                int32_t offset = 0, stride = 0, precision = 0;
+                if (!readBinary(in, offset) || !readBinary(in, stride) || !readBinary(in, precision)) return fail();
+                if (blockVar->offset() != static_cast<uint32_t>(offset) ||
+                    blockVar->stride() != static_cast<uint32_t>(stride) ||
+                    static_cast<int32_t>(blockVar->precision()) != precision)
+                    return fail();
+            }
+            bindings.push_back(Interpreter::ReadBinding(var, Interpreter::Operand::VarRef));
+            if (pointerVar) {
+                int32_t stride = 0;
+                if (!readBinary(in, stride) || stride != pointerVar->stride()) return fail();
+                bindings.push_back(
+                    Interpreter::ReadBinding(const_cast<double*>(pointerVar->data()), Interpreter::Operand::VarValues));
+            }
+        } else if (kind == FuncBinding) {
+            int32_t funcType = 0;
+            if (!readBinary(in, funcType)) return fail();
+            const ExprFunc* func = resolveFunc(name);
+            if (!func) func = ExprFunc::lookup(name);
+            const auto* standard = func ? dynamic_cast<const ExprFuncStandard*>(func->funcx()) : nullptr;
+            if (!standard || static_cast<int32_t>(standard->getFuncType()) != funcType) return fail();
+            bindings.push_back(Interpreter::ReadBinding(standard->getFuncPointer(), Interpreter::Operand::StandardFunc));
+        } else if (kind == SimpleFuncBinding) {
+            const ExprFunc* func = resolveFunc(name);
+            if (!func) func = ExprFunc::lookup(name);
+            const auto* simple = func ? dynamic_cast<const ExprFuncSimple*>(func->funcx()) : nullptr;
+            if (!simple) return fail();
+            bindings.push_back(
+                Interpreter::ReadBinding(const_cast<ExprFuncSimple*>(simple), Interpreter::Operand::SimpleFunc));
+        } else if (kind == FuncDataBinding) {
+            if (!_parseTree) {
+                _expression = expression;
+                prepTypes();
+                if (!_isValid) return fail();
+                std::vector<const ExprNode*> nodes;
+                collectBindingNodes(_parseTree, nodes);
+                for (const ExprNode* node : nodes)
+                    if (const auto* funcNode = dynamic_cast<const ExprFuncNode*>(node)) calls.push_back(funcNode);
+            }
+            int32_t call = 0;
+            if (!readBinary(in, call) || call < 0 || call >= static_cast<int32_t>(calls.size())) return fail();
+            const ExprFuncNode* node = calls[call];
+            const ExprFunc* func = node->func();
+            const auto* simple = func ? dynamic_cast<const ExprFuncSimple*>(func->funcx()) : nullptr;
+            ExprFuncNode::Data* data = nullptr;
+            if (!simple || name != node->name() || node->getData() || !readCallData(in, simple, node, data))
+                return fail();
+            bindings.push_back(Interpreter::ReadBinding(data, Interpreter::Operand::FuncData));
+        } else {
+            return fail();
+        }
+    }
+
+    std::unique_ptr<Interpreter> interpreter(new Interpreter);
+    if (!interpreter->read(in, bindings)) return fail();
+    if (returnSlot < 0 || returnSlot + (returnType.isFP() ? returnType.dim() : 1) >
+                              static_cast<int>(returnType.isFP() ? interpreter->d.size() : interpreter->s.size()))
+        return fail();
+
+    _expression = expression;
+    _vars.insert(vars.begin(), vars.end());
+    _funcs.insert(funcs.begin(), funcs.end());
+    _threadUnsafeFunctionCalls = threadUnsafeCalls;
+    _returnType = returnType;
+    _returnSlot = returnSlot;
+    _interpreter = interpreter.release();
+    _parsed = _typesPrepped = _prepped = _isValid = true;
+    return true;
+}
+
 bool Expression::isVec() const {
     prepIfNeeded();
-    return _isValid ? _parseTree->isVec() : _wantVec;
+    if (!_isValid) return _wantVec;
+    // programs restored by loadProgram may have no parse tree, answer like one (nothing sets its isVec)
+    return _parseTree && _parseTree->isVec();
 }
 
 const ExprType& Expression::returnType() const {
@@ -307,49 +834,172 @@ const ExprType& Expression::returnType() const {
 const double* Expression::evalFP(VarBlock* varBlock) const {
     prepIfNeeded();
     if (_isValid) {
-        if (_evaluationStrategy == UseInterpreter) {
+        if (!useLLVM()) {
+            countTieredEvaluations(1);
             _interpreter->eval(varBlock);
             return (varBlock && varBlock->threadSafe) ? &(varBlock->d[_returnSlot]) : &_interpreter->d[_returnSlot];
         } else {  // useLLVM
-            return _llvmEvaluator->evalFP(varBlock);
+            if (const double* result = _llvmEvaluator->evalFP(varBlock)) return result;
+            fallBackToInterpreter();
+            return evalFP(varBlock);
         }
     }
     static double noCrash[16] = {};
     return noCrash;
 }
 
+//! Whether results stored to the variable block entry outputVarBlockOffset are floats
+static bool floatOutput(const VarBlockCreator* creator, int outputVarBlockOffset) {
+    return creator && creator->precision(outputVarBlockOffset) == VarBlockCreator::Precision::Float;
+}
+
 void Expression::evalMultiple(VarBlock* varBlock, int outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) const {
     prepIfNeeded();
     if (_isValid) {
-        if (_evaluationStrategy == UseInterpreter) {
+        if (!useLLVM()) {
+            countTieredEvaluations(rangeEnd - rangeStart);
             // TODO: need strings to work
             int dim = _desiredReturnType.dim();
-            // double* iHack=reinterpret_cast<double**>(varBlock->data())[outputVarBlockOffset];
-            double* destBase = reinterpret_cast<double**>(varBlock->data())[outputVarBlockOffset];
-            for (size_t i = rangeStart; i < rangeEnd; i++) {
-                varBlock->indirectIndex = static_cast<int>(i);
-                const double* f = evalFP(varBlock);
-                for (int k = 0; k < dim; k++) {
-                    destBase[dim * i + k] = f[k];
-                }
-            }
+            char* destBase = varBlock->data()[outputVarBlockOffset];
+            if (floatOutput(_varBlockCreator, outputVarBlockOffset))
+                _interpreter->evalBatch(varBlock, rangeStart, rangeEnd, _returnSlot, dim, reinterpret_cast<float*>(destBase));
+            else
+                _interpreter->evalBatch(varBlock, rangeStart, rangeEnd, _returnSlot, dim, reinterpret_cast<double*>(destBase));
         } else {  // useLLVM
             _llvmEvaluator->evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+            if (!_llvmEvaluator->failed()) return;
+            fallBackToInterpreter();
+            evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
         }
     }
 }
 
+void Expression::evalParallel(VarBlock* varBlock,
+                              int outputVarBlockOffset,
+                              size_t rangeStart,
+                              size_t rangeEnd,
+                              ExprExecutor* executor) const {
+    prepIfNeeded();
+    if (!_isValid || rangeEnd <= rangeStart) return;
+    if (!executor) executor = &ExprThreadPool::global();
+    int numWorkers = executor->numWorkers();
+    if (!isThreadSafe() || numWorkers <= 1) {
+        evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+        return;
+    }
+
+    // chunks small enough to stay in cache, but at least a few per worker so stealing can balance the load
+    const size_t maxChunkSize = 4096;
+    size_t numPoints = rangeEnd - rangeStart;
+    size_t chunkSize = std::min(maxChunkSize, numPoints / (4 * numWorkers));
+    chunkSize = std::max(size_t(1), (chunkSize + Interpreter::batchSize - 1) / Interpreter::batchSize) *
+                Interpreter::batchSize;
+    size_t numChunks = (numPoints + chunkSize - 1) / chunkSize;
+
+    std::vector<std::unique_ptr<ExprEvaluator> > evaluators(numWorkers);
+    executor->run(numChunks, [&](size_t chunk, int worker) {
+        std::unique_ptr<ExprEvaluator>& evaluator = evaluators[worker];
+        if (!evaluator) evaluator.reset(new ExprEvaluator(*this));
+        size_t chunkStart = rangeStart + chunk * chunkSize;
+        evaluator->evalMultiple(varBlock, outputVarBlockOffset, chunkStart, std::min(rangeEnd, chunkStart + chunkSize));
+    });
+}
+
 const char* Expression::evalStr(VarBlock* varBlock) const {
     prepIfNeeded();
     if (_isValid) {
-        if (_evaluationStrategy == UseInterpreter) {
+        if (!useLLVM()) {
+            countTieredEvaluations(1);
             _interpreter->eval(varBlock);
             return (varBlock && varBlock->threadSafe) ? varBlock->s[_returnSlot] : _interpreter->s[_returnSlot];
         } else {  // useLLVM
-            return _llvmEvaluator->evalStr(varBlock);
+            const char* result = _llvmEvaluator->evalStr(varBlock);
+            if (!_llvmEvaluator->failed()) return result;
+            fallBackToInterpreter();
+            return evalStr(varBlock);
+        }
+    }
+    return nullptr;
+}
+
+ExprEvaluator Expression::createEvaluator() const {
+    prepIfNeeded();
+    return ExprEvaluator(*this);
+}
+
+ExprEvaluator::ExprEvaluator(const Expression& expression) : _expression(&expression), _state(new EvalState) {
+    if (expression._interpreter) expression._interpreter->initState(*_state);
+    if (expression._evaluationStrategy != Expression::UseInterpreter) {
+        // the JIT path only needs somewhere of its own to put the result
+        _state->nativeD.resize(std::max(expression._desiredReturnType.dim(), 1));
+        _state->nativeS.resize(1);
+    }
+}
+
+ExprEvaluator::ExprEvaluator(ExprEvaluator&& other) = default;
+
+void ExprEvaluator::fallBackToInterpreter() {
+    _expression->fallBackToInterpreter();
+    // states made for LLVM evaluation have none of the interpreter's slots
+    if (_state->s.empty()) _expression->_interpreter->initState(*_state);
+}
+
+ExprEvaluator::~ExprEvaluator() {}
+
+const double* ExprEvaluator::evalFP(VarBlock* varBlock) {
+    const Expression& expr = *_expression;
+    if (expr._isValid) {
+        if (!expr.useLLVM()) {
+            expr.countTieredEvaluations(1);
+            expr._interpreter->eval(*_state, varBlock);
+            return &_state->d[expr._returnSlot];
+        } else {  // useLLVM
+            if (const double* result = expr._llvmEvaluator->evalFP(varBlock, _state->nativeD.data())) return result;
+            fallBackToInterpreter();
+            return evalFP(varBlock);
+        }
+    }
+    static double noCrash[16] = {};
+    return noCrash;
+}
+
+const char* ExprEvaluator::evalStr(VarBlock* varBlock) {
+    const Expression& expr = *_expression;
+    if (expr._isValid) {
+        if (!expr.useLLVM()) {
+            expr.countTieredEvaluations(1);
+            expr._interpreter->eval(*_state, varBlock);
+            return _state->s[expr._returnSlot];
+        } else {  // useLLVM
+            const char* result = expr._llvmEvaluator->evalStr(varBlock, _state->nativeS.data());
+            if (!expr._llvmEvaluator->failed()) return result;
+            fallBackToInterpreter();
+            return evalStr(varBlock);
         }
     }
     return nullptr;
 }
 
+void ExprEvaluator::evalMultiple(VarBlock* varBlock, int outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) {
+    const Expression& expr = *_expression;
+    if (expr._isValid) {
+        if (!expr.useLLVM()) {
+            expr.countTieredEvaluations(rangeEnd - rangeStart);
+            int dim = expr._desiredReturnType.dim();
+            char* destBase = varBlock->data()[outputVarBlockOffset];
+            if (floatOutput(expr._varBlockCreator, outputVarBlockOffset))
+                expr._interpreter->evalBatch(
+                    *_state, varBlock, rangeStart, rangeEnd, expr._returnSlot, dim, reinterpret_cast<float*>(destBase));
+            else
+                expr._interpreter->evalBatch(
+                    *_state, varBlock, rangeStart, rangeEnd, expr._returnSlot, dim, reinterpret_cast<double*>(destBase));
+        } else {  // useLLVM
+            expr._llvmEvaluator->evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+            if (!expr._llvmEvaluator->failed()) return;
+            fallBackToInterpreter();
+            evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+        }
+    }
+}
+
 }  // end namespace SeExpr2/
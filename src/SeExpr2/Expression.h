@@ -17,11 +17,15 @@
 #ifndef Expression_h
 #define Expression_h
 
+#include <atomic>
+#include <iosfwd>
 #include <string>
 #include <map>
 #include <set>
 #include <vector>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <stdint.h>
 
 #include "Context.h"
@@ -70,9 +74,81 @@ class ExprVarRef {
     ExprType _type;
 };
 
+//! Variable reference with fixed values, used by Expression::specialize
+class ExprConstantVarRef : public ExprVarRef {
+  public:
+    ExprConstantVarRef(const std::vector<double>& values)
+        : ExprVarRef(ExprType().FP(static_cast<int>(values.size())).Constant()), _values(values) {}
+
+    const std::vector<double>& values() const { return _values; }
+
+    void eval(double* result);
+    void eval(const char** resultStr);
+
+  private:
+    std::vector<double> _values;
+};
+
+//! Variable reference to a value the host keeps at a fixed address. The evaluators read it from there instead of
+//! calling eval, the interpreter with a plain copy and LLVM code with loads from the address.
+class ExprPointerVarRef : public ExprVarRef {
+  public:
+    /// Component k of the value is data[k*stride]. The data must stay valid (and in place) while expressions
+    /// using the variable are evaluated.
+    ExprPointerVarRef(const ExprType& type, const double* data, int stride = 1)
+        : ExprVarRef(type), _data(data), _stride(stride) {
+        assert(type.isFP());
+    }
+
+    const double* data() const { return _data; }
+    int stride() const { return _stride; }
+
+    void eval(double* result);
+    void eval(const char** resultStr);
+
+  private:
+    const double* _data;
+    int _stride;
+};
+
 class LLVMEvaluator;
 class VarBlock;
 class VarBlockCreator;
+class ExprExecutor;
+struct EvalState;
+
+/// Per thread handle to evaluate a prepared Expression (see Expression::createEvaluator).
+/// The compiled program is shared with the expression and only the working data is owned by
+/// the evaluator, so any number of evaluators can evaluate the same expression concurrently.
+/// An evaluator must not outlive its expression and is invalidated when the expression is reset.
+class ExprEvaluator {
+  public:
+    ExprEvaluator(ExprEvaluator&& other);
+    ~ExprEvaluator();
+
+    /// Don't allow copying and operator='ing'
+    ExprEvaluator(const ExprEvaluator&) = delete;
+    ExprEvaluator& operator=(const ExprEvaluator&) = delete;
+
+    /** Evaluates and returns float (check returnType()!) */
+    const double* evalFP(VarBlock* varBlock = nullptr);
+
+    /** Evaluates and returns string (check returnType()!) */
+    const char* evalStr(VarBlock* varBlock = nullptr);
+
+    /// Evaluate multiple blocks
+    void evalMultiple(VarBlock* varBlock, int outputVarBlockOffset, size_t rangeStart, size_t rangeEnd);
+
+  private:
+    friend class Expression;
+    ExprEvaluator(const Expression& expression);
+
+    /// Switches the expression to the interpreter after its LLVM code was lost, giving the state its slots
+    void fallBackToInterpreter();
+
+    const Expression* _expression;
+    std::unique_ptr<EvalState> _state;
+};
 
 /// main expression class
 class Expression {
@@ -80,10 +156,42 @@ class Expression {
     //! Types of evaluation strategies that are available
     enum EvaluationStrategy {
         UseInterpreter,
-        UseLLVM
+        UseLLVM,
+        //! Evaluate with the interpreter until LLVM has compiled the expression in the background. The functions
+        //! derived classes resolve must outlive the expression, its code may be generated while it is destroyed.
+        UseTiered
     };
     //! What evaluation strategy to use by default
     static EvaluationStrategy defaultEvaluationStrategy;
+    //! Number of points a UseTiered expression evaluates before it is queued for compilation (0 queues it at prep)
+    static size_t tieredCompileThreshold;
+    //! Optimization levels of LLVM compilation
+    enum JitOptLevel {
+        JitO0,
+        JitO1,
+        JitO2,
+        JitO3,
+        //! -O3 for expressions of at least jitAdaptiveThreshold parse tree nodes and for UseTiered expressions
+        //! compiled once they passed a nonzero tieredCompileThreshold, -O1 otherwise. UseLLVM expressions are
+        //! compiled before they are evaluated, so only their size counts. Opt-in: small UseLLVM expressions in hot
+        //! loops lose the -O3 passes.
+        JitAdaptive
+    };
+    //! Optimization level of new expressions, JitO3 unless SE_EXPR_JIT_OPT is set to 0, 1, 2, 3 or adaptive
+    static JitOptLevel defaultJitOptLevel;
+    //! Size from which JitAdaptive compiles expressions at -O3
+    static int jitAdaptiveThreshold;
+    //! Whether interpreter programs get common sequences of ops fused into superinstructions
+    static bool interpreterFusion;
+    //! Whether temporaries of interpreter programs share slots when their live ranges do not overlap
+    static bool interpreterSlotReuse;
+    //! Local functions (def) whose body has at most this many nodes are built at every call site by the interpreter
+    //! instead of being called
+    static int interpreterInlineThreshold;
+    //! Whether interpreter programs compute constant values once when they are built
+    static bool interpreterFolding;
+    //! Whether interpreter programs compute uniform values once per evalMultiple call instead of once per point
+    static bool interpreterHoisting;
     //! Whether to debug expressions
     static bool debugging;
 
@@ -197,6 +305,15 @@ class Expression {
     /// Evaluate multiple blocks
     void evalMultiple(VarBlock* varBlock, int outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) const;
 
+    /** Like evalMultiple, but splits the range into chunks evaluated concurrently by executor (by default a
+        process wide ExprThreadPool), each worker using its own ExprEvaluator. Expressions that are not
+        thread safe are evaluated by evalMultiple on the calling thread. */
+    void evalParallel(VarBlock* varBlock,
+                      int outputVarBlockOffset,
+                      size_t rangeStart,
+                      size_t rangeEnd,
+                      ExprExecutor* executor = nullptr) const;
+
     // TODO: make this deprecated
     /** Evaluates and returns float (check returnType()!) */
     const double* evalFP(VarBlock* varBlock = nullptr) const;
@@ -205,9 +322,85 @@ class Expression {
     /** Evaluates and returns string (check returnType()!) */
     const char* evalStr(VarBlock* varBlock = nullptr) const;
 
+    /** Create a handle holding the working data needed to evaluate this expression from one thread.
+        Unlike evalFP/evalStr/evalMultiple, evaluating through different evaluators is thread safe
+        (as long as the expression's functions are, see isThreadSafe()). */
+    ExprEvaluator createEvaluator() const;
+
     /** Reset expr - force reparse/rebind */
     void reset();
 
+    /** Set the optimization level of LLVM compilation. This invalidates the prepared expression. */
+    void setJitOptLevel(JitOptLevel level);
+
+    JitOptLevel jitOptLevel() const { return _jitOptLevel; }
+
+    /** Seconds LLVM took to compile the expression, 0 if it is not evaluated with LLVM (yet) */
+    double jitCompileSeconds() const;
+
+    /** Whether the LLVM code of the expression was loaded from the on-disk JIT cache (see SE_EXPR_JIT_CACHE) */
+    bool jitCodeCached() const;
+
+    /** Whether LLVM vectorized the loop evalMultiple runs over the points. The loop only asks for it, loops calling
+        functions without a vector version (most of the standard functions) stay scalar, see jitVectorizeRemarks.
+        Loops with lane-wide code (see jitLaneWidth) keep the points left over after the last group scalar. */
+    bool jitLoopVectorized() const;
+
+    /** What the LLVM loop vectorizer reported about that loop, one remark per line */
+    std::string jitVectorizeRemarks() const;
+
+    /** Number of points (4 or 8) the LLVM code of evalMultiple computes at once with vector instructions, or 0 when
+        it computes one point at a time. Every node is then computed for the whole group, except for standard
+        function calls which are made for one point after the other. Expressions with if statements, strings,
+        custom functions or variables not in a VarBlock, and code compiled at JitO0, take one point at a time. */
+    int jitLaneWidth() const;
+
+    /** The standard functions the LLVM code took from the builtins bitcode and inlined, so the optimizer saw
+        through their calls. Empty when the code was loaded from the JIT cache. */
+    std::vector<std::string> jitInlinedBuiltins() const;
+
+    /** Whether the bitcode of the builtins was embedded when building the library (it takes clang and llvm-link) */
+    static bool jitBuiltinsBitcode();
+
+    /** Seconds spent in LLVM compilation by all expressions of the process */
+    static double totalJitCompileSeconds();
+
+    /** Bytes of LLVM compiled code and data the expression holds, 0 if it holds none (not compiled or evicted) */
+    size_t jitCodeBytes() const;
+
+    /** Bytes of LLVM compiled code and data held by the process, with the objects LLVM keeps of it */
+    static size_t totalJitCodeBytes();
+
+    /** Limit the LLVM compiled code held by the process to about bytes (0, the default unless SE_EXPR_JIT_BUDGET
+        is set, means no limit). Over the limit the code of the least recently evaluated expressions is evicted,
+        to be compiled again when they are next evaluated. Code that is being evaluated is never evicted. */
+    static void setJitCodeBudget(size_t bytes);
+    static size_t jitCodeBudget();
+
+    /** Save the prepared interpreter program of the expression so that loadProgram can restore it without
+        building it again. Calls to ExprFuncSimple based functions are saved with the constant arguments their
+        data was built from. Returns false if the expression is not valid, is evaluated with LLVM only (UseLLVM
+        builds no interpreter program) or its program holds data that cannot be saved. */
+    bool saveProgram(std::ostream& out) const;
+
+    /** Replace the expression by a program written by saveProgram. Variables and functions are resolved again
+        like prep does and must have the types (and variable block layout) they had when the program was saved,
+        as must the desired return type. If the program calls ExprFuncSimple based functions the expression is
+        parsed and type checked again so that their data can be rebuilt by evalConstant. Returns false for
+        expressions evaluated with UseLLVM, which have no interpreter to load the program into, and returns false
+        and leaves the expression reset if the program cannot be used. reset() goes back to parsing the
+        expression's text. */
+    bool loadProgram(std::istream& in);
+
+    /** Treat the given variables as constants with the given values (overriding resolveVar and the variable
+        block) and prepare the expression again. What only depends on constants is computed once when the
+        expression is prepared and branches that cannot be taken are dropped. An empty map removes the
+        specialization. */
+    void specialize(const std::map<std::string, std::vector<double> >& values);
+
+    /** Return the constant a variable is specialized to or nullptr */
+    ExprConstantVarRef* specializedVar(const std::string& name) const;
+
     /** override resolveVar to add external variables */
     virtual ExprVarRef* resolveVar(const std::string&) const { return 0; }
 
@@ -244,6 +437,10 @@ class Expression {
     const VarBlockCreator* varBlockCreator() const { return _varBlockCreator; }
 
   private:
+    friend class ExprEvaluator;
+    friend class ExprTieredCompiler;
+    friend class ExprKernel;
+
     /** No definition by design. */
     Expression(const Expression& e);
     Expression& operator=(const Expression& e);
@@ -256,10 +453,40 @@ class Expression {
         if (!_parsed) parse();
     }
 
+    /** Bind vars/functions and check the types, but don't build code (ExprKernel compiles the stages itself) */
+    void prepTypes() const;
+
     /** Prepare expression (bind vars/functions, etc.)
     and remember error if any */
     void prep() const;
 
+    /** Build the interpreter program of the prepped parse tree */
+    void buildInterpreter() const;
+
+    /** True if evaluation goes through the LLVM evaluator */
+    bool useLLVM() const {
+        return (_evaluationStrategy == UseLLVM ||
+                (_evaluationStrategy == UseTiered && _llvmReady.load(std::memory_order_acquire))) &&
+               !_llvmFailed.load(std::memory_order_acquire);
+    }
+
+    /** Evaluate with an interpreter (built now if there is none) from now on, because code the LLVM code cache
+        evicted could not be loaded again */
+    void fallBackToInterpreter() const;
+
+    /** Counts points evaluated by the interpreter and queues UseTiered compilation past the threshold */
+    void countTieredEvaluations(size_t numPoints) const {
+        if (_evaluationStrategy == UseTiered && !_llvmQueued.load(std::memory_order_relaxed) &&
+            _tieredEvaluations.fetch_add(numPoints, std::memory_order_relaxed) + numPoints >= tieredCompileThreshold)
+            queueTieredCompile();
+    }
+
+    /** Queue the LLVM compilation of a UseTiered expression (once) */
+    void queueTieredCompile() const;
+
+    /** Generate and compile the code from the tiered compiler thread, switching evaluation over on success */
+    void compileTiered() const;
+
     /** True if the expression wants a vector */
     bool _wantVec;
 
@@ -271,6 +498,9 @@ class Expression {
 
     EvaluationStrategy _evaluationStrategy;
 
+    /** Optimization level of LLVM compilation */
+    JitOptLevel _jitOptLevel = defaultJitOptLevel;
+
     /** Context for out of band function parameters */
     const Context* _context;
 
@@ -291,8 +521,8 @@ class Expression {
   private:
     /** Flag if we are valid or not */
     mutable bool _isValid;
-    /** Flag set once expr is parsed/prepped (parsing is automatic and lazy) */
-    mutable bool _parsed, _prepped;
+    /** Flag set once expr is parsed/type checked/prepped (parsing is automatic and lazy) */
+    mutable bool _parsed, _typesPrepped, _prepped;
 
     /** Cached parse error (returned by isValid) */
     mutable ErrorCode _parseErrorCode;
@@ -325,9 +555,21 @@ class Expression {
     // LLVM evaluation layer
     mutable LLVMEvaluator* _llvmEvaluator;
 
+    /** UseTiered state: compilation was queued, LLVM evaluation is ready, points evaluated so far */
+    mutable std::atomic<bool> _llvmQueued{false};
+    mutable std::atomic<bool> _llvmReady{false};
+    mutable std::atomic<size_t> _tieredEvaluations{0};
+
+    /** Set once LLVM evaluation fell back to the interpreter, which the mutex guards building */
+    mutable std::atomic<bool> _llvmFailed{false};
+    mutable std::mutex _fallbackMutex;
+
     // Var block creator
     const VarBlockCreator* _varBlockCreator = 0;
 
+    /** Variables treated as constants (see specialize) */
+    std::map<std::string, std::unique_ptr<ExprConstantVarRef> > _specializedVars;
+
     /* internal */ public:
 
     //! add local variable (this is for internal use)
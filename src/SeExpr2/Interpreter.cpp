@@ -15,12 +15,18 @@
  http://www.apache.org/licenses/LICENSE-2.0
 */
 #include "ExprNode.h"
+#include "ExprFunc.h"
+#include "ExprFuncStandard.h"
 #include "Interpreter.h"
 #include "VarBlock.h"
 #include "Platform.h"
+#include "Utils.h"
 #include <iostream>
 #include <cstdio>
 #include <algorithm>
+#include <new>
+#include <atomic>
+#include <set>
 #if !defined(WINDOWS)
 #include <dlfcn.h>
 #endif
@@ -53,27 +59,598 @@ void Interpreter::eval(VarBlock* block, bool debug) {
         str[1] = reinterpret_cast<char*>(static_cast<size_t>(block->indirectIndex));
     }
 
-    int pc = _pcStart;
-    int end = static_cast<int>(ops.size());
-    while (pc < end) {
+    if (!isFinalized()) finalize();
+    run(fp, str, callStack, debug, _pcStart, static_cast<int>(ops.size()));
+}
+
+void Interpreter::initState(EvalState& state) const {
+    state.d = d;
+    state.s = s;
+    // string ops write into buffers of the state so that evaluations in other threads do not share them
+    std::unordered_map<const char*, size_t> buffers;
+    for (size_t k = 0; k < _stringBuffers.size(); k++)
+        buffers[reinterpret_cast<const char*>(&_stringBuffers[k])] = k;
+    state.strings.assign(_stringBuffers.size(), StringBuffer());
+    for (char*& str : state.s) {
+        auto it = buffers.find(str);
+        if (it != buffers.end()) str = reinterpret_cast<char*>(&state.strings[it->second]);
+    }
+    state.callStack.clear();
+    state.batchD.clear();
+    state.batchS.clear();
+}
+
+void Interpreter::eval(EvalState& state, VarBlock* block) const {
+    assert(state.d.size() == d.size() && state.s.size() == s.size() && "EvalState was not initialized for this program");
+    char** str = state.s.data();
+    if (block) {
+        str[0] = reinterpret_cast<char*>(block->data());
+        str[1] = reinterpret_cast<char*>(static_cast<size_t>(block->indirectIndex));
+    }
+    run(state.d.data(), str, state.callStack, false, _pcStart, static_cast<int>(ops.size()));
+}
+
+void Interpreter::finalize() {
+    static const int headerLength = sizeof(Instruction) / sizeof(int);
+    static const int alignment = alignof(Instruction) / sizeof(int);
+    static_assert(sizeof(Instruction) % sizeof(int) == 0, "Instruction header must be made of ints");
+
+    _code.clear();
+    _codeOffsets.clear();
+    for (size_t pc = 0; pc < ops.size(); pc++) {
+        int begin = ops[pc].second;
+        int end = pc + 1 < ops.size() ? ops[pc + 1].second : static_cast<int>(opData.size());
+        // pad the operands so that every header stays aligned
+        int length = headerLength + (end - begin + alignment - 1) / alignment * alignment;
+        int offset = static_cast<int>(_code.size());
+        _codeOffsets.push_back(offset);
+        _code.resize(offset + length, 0);
+        new (&_code[offset]) Instruction{ops[pc].first, batchOps[pc], length};
+        std::copy(opData.begin() + begin, opData.begin() + end, _code.begin() + offset + headerLength);
+    }
+    _codeOffsets.push_back(static_cast<int>(_code.size()));
+
+    std::set<int> prologueWrites;
+    std::vector<Operand> operands;
+    for (int pc = _pcStart; pc < _bodyStart; pc++) {
+        int begin = ops[pc].second;
+        int end = pc + 1 < static_cast<int>(ops.size()) ? ops[pc + 1].second : static_cast<int>(opData.size());
+        const OpInfo* info = opInfo(ops[pc].first);
+        operands.clear();
+        if (!info || !info->operands || !info->operands(*this, &opData[begin], end - begin, operands)) {
+            prologueWrites.clear();
+            break;
+        }
+        for (const Operand& operand : operands)
+            if (operand.kind == Operand::FPWrite)
+                for (int k = 0; k < operand.width; k++) prologueWrites.insert(opData[begin + operand.index] + k);
+    }
+    _prologueWrites.assign(prologueWrites.begin(), prologueWrites.end());
+}
+
+void Interpreter::run(double* fp, char** str, std::vector<int>& callStack, bool debug, int beginPC, int endPC) const {
+    assert(isFinalized() && "Interpreter::finalize was not called after building the program");
+    // ops never modify their operands, the program can be shared by concurrent evaluations.
+    // Straight line code walks the instruction stream, only jumps go through the offset table.
+    int pc = beginPC;
+    const Instruction* ip = instruction(pc);
+    while (pc < endPC) {
         if (debug) {
             std::cerr << "Running op at " << pc << std::endl;
-            print(pc);
+            printCode(pc);
+        }
+        int step = ip->op(ip->operands(), fp, str, callStack);
+        pc += step;
+        ip = step == 1 ? ip->next() : instruction(pc);
+    }
+}
+
+void Interpreter::runBatchOps(double* fp, char** str, Batch& batch, int beginPC, int endPC) const {
+    int pc = beginPC;
+    const Instruction* ip = instruction(pc);
+    while (pc < endPC) {
+        // leave the branches ending here
+        while (!batch.branches.empty() && batch.branches.back().endPC == pc) {
+            batch.mask = batch.branches.back().parentMask;
+            batch.branches.pop_back();
+        }
+        batch.pc = pc;
+        int step = ip->batch(ip->operands(), fp, str, batch);
+        pc += step;
+        ip = step == 1 ? ip->next() : instruction(pc);
+    }
+}
+
+template <class T>
+void Interpreter::evalBatch(VarBlock* block,
+                            size_t rangeStart,
+                            size_t rangeEnd,
+                            int resultSlot,
+                            int resultDim,
+                            T* dest) {
+    if (!isFinalized()) finalize();
+    if (_unbatchedOps > 0) {
+        // some op can only be run a point at a time
+        for (size_t i = rangeStart; i < rangeEnd; i++) {
+            block->indirectIndex = static_cast<int>(i);
+            eval(block);
+            const double* result = (block->threadSafe ? block->d.data() : d.data()) + resultSlot;
+            for (int k = 0; k < resultDim; k++) dest[resultDim * i + k] = static_cast<T>(result[k]);
+        }
+        return;
+    }
+
+    if (block->threadSafe)
+        runBatch(block->d, block->s, s, true, block, rangeStart, rangeEnd, resultSlot, resultDim, dest);
+    else
+        runBatch(_batchD, _batchS, s, true, block, rangeStart, rangeEnd, resultSlot, resultDim, dest);
+}
+
+template <class T>
+void Interpreter::evalBatch(EvalState& state,
+                            VarBlock* block,
+                            size_t rangeStart,
+                            size_t rangeEnd,
+                            int resultSlot,
+                            int resultDim,
+                            T* dest) const {
+    if (_unbatchedOps > 0) {
+        // some op can only be run a point at a time, the prologue is still run once
+        char** str = state.s.data();
+        str[0] = reinterpret_cast<char*>(block->data());
+        str[1] = reinterpret_cast<char*>(rangeStart);
+        run(state.d.data(), str, state.callStack, false, _pcStart, _bodyStart);
+        for (size_t i = rangeStart; i < rangeEnd; i++) {
+            str[1] = reinterpret_cast<char*>(i);
+            run(state.d.data(), str, state.callStack, false, _bodyStart, static_cast<int>(ops.size()));
+            const double* result = state.d.data() + resultSlot;
+            for (int k = 0; k < resultDim; k++) dest[resultDim * i + k] = static_cast<T>(result[k]);
+        }
+        return;
+    }
+
+    // the state belongs to this program, so its frame only needs to be filled the first time
+    bool fillFrame = state.batchD.size() != d.size() * batchSize;
+    runBatch(state.batchD, state.batchS, state.s, fillFrame, block, rangeStart, rangeEnd, resultSlot, resultDim, dest);
+}
+
+template <class T>
+void Interpreter::runBatch(std::vector<double>& frame,
+                           std::vector<char*>& strFrame,
+                           const std::vector<char*>& strData,
+                           bool fillFrame,
+                           VarBlock* block,
+                           size_t rangeStart,
+                           size_t rangeEnd,
+                           int resultSlot,
+                           int resultDim,
+                           T* dest) const {
+    // every slot of the batch frame gets batchSize copies of the program's data
+    if (fillFrame) {
+        frame.resize(d.size() * batchSize);
+        for (size_t k = 0; k < d.size(); k++) std::fill_n(frame.data() + k * batchSize, batchSize, d[k]);
+        strFrame.assign(strData.begin(), strData.end());
+    }
+    double* fp = frame.data();
+    char** str = strFrame.data();
+    str[0] = reinterpret_cast<char*>(block->data());
+
+    assert(isFinalized() && "Interpreter::finalize was not called after building the program");
+    Batch batch;
+    // the prologue only computes values that are the same for every point, run it once
+    batch.lanes = _prologueWrites.empty() ? batchSize : 1;
+    batch.mask = nullptr;
+    str[1] = reinterpret_cast<char*>(rangeStart);
+    runBatchOps(fp, str, batch, _pcStart, _bodyStart);
+    for (int slot : _prologueWrites) std::fill_n(batchSlot(fp, slot) + 1, batchSize - 1, *batchSlot(fp, slot));
+
+    int end = static_cast<int>(ops.size());
+    for (size_t batchStart = rangeStart; batchStart < rangeEnd; batchStart += batchSize) {
+        batch.lanes = static_cast<int>(std::min(rangeEnd - batchStart, static_cast<size_t>(batchSize)));
+        batch.mask = nullptr;
+        batch.branches.clear();
+        str[1] = reinterpret_cast<char*>(batchStart);
+        runBatchOps(fp, str, batch, _bodyStart, end);
+
+        for (int k = 0; k < resultDim; k++) {
+            const double* result = batchSlot(fp, resultSlot + k);
+            T* out = dest + resultDim * batchStart + k;
+            for (int l = 0; l < batch.lanes; l++) out[resultDim * l] = static_cast<T>(result[l]);
+        }
+    }
+}
+
+template void Interpreter::evalBatch(VarBlock*, size_t, size_t, int, int, double*);
+template void Interpreter::evalBatch(VarBlock*, size_t, size_t, int, int, float*);
+template void Interpreter::evalBatch(EvalState&, VarBlock*, size_t, size_t, int, int, double*) const;
+template void Interpreter::evalBatch(EvalState&, VarBlock*, size_t, size_t, int, int, float*) const;
+
+const char* Interpreter::intern(const std::string& str) {
+    StringBuffer& buffer = _strings[str];
+    if (buffer.empty()) concatenate(buffer, str.c_str(), str.size(), "", 0);
+    return buffer.data() + sizeof(size_t);
+}
+
+int Interpreter::allocStringBuffer() {
+    int loc = allocPtr();
+    _stringBuffers.emplace_back();
+    s[loc] = reinterpret_cast<char*>(&_stringBuffers.back());
+    return loc;
+}
+
+const char* Interpreter::concatenate(StringBuffer& buffer,
+                                     const char* str1,
+                                     size_t len1,
+                                     const char* str2,
+                                     size_t len2) {
+    size_t length = len1 + len2;
+    if (buffer.size() < sizeof(size_t) + length + 1) buffer.resize(sizeof(size_t) + length + 1);
+    char* out = buffer.data() + sizeof(size_t);
+    memcpy(buffer.data(), &length, sizeof(size_t));
+    memcpy(out, str1, len1);
+    memcpy(out + len1, str2, len2);
+    out[length] = '\0';
+    return out;
+}
+
+bool Interpreter::lengthPrefixed(const ExprNode* node) {
+    if (dynamic_cast<const ExprStrNode*>(node)) return true;
+    const ExprBinaryOpNode* binary = dynamic_cast<const ExprBinaryOpNode*>(node);
+    return binary && binary->type().isString();
+}
+
+bool Interpreter::foldable(const ExprNode* node) const {
+    if (!_folding) return false;
+    if (!node->type().isLifetimeConstant()) return false;
+    if (!node->type().isFP() && !lengthPrefixed(node)) return false;
+    // a variable merged from branches only has its value once the taken branch is known
+    if (const ExprVarNode* var = dynamic_cast<const ExprVarNode*>(node))
+        if (dynamic_cast<const ExprLocalVarPhi*>(var->localVar())) return false;
+    // functions resolved by the expression may have side effects, only registered functions are folded
+    if (const ExprFuncNode* func = dynamic_cast<const ExprFuncNode*>(node))
+        if (!func->func() || func->func() != ExprFunc::lookup(func->name())) return false;
+    for (int c = 0; c < node->numChildren(); c++)
+        if (!foldable(node->child(c))) return false;
+    return true;
+}
+
+Interpreter::FoldScope::FoldScope(Interpreter* interpreter, const ExprNode* node)
+    : _interpreter(interpreter), _active(interpreter->_foldDepth > 0 || interpreter->foldable(node)),
+      _pc(interpreter->nextPC()), _dataSize(static_cast<int>(interpreter->opData.size())) {
+    if (_active) _interpreter->_foldDepth++;
+}
+
+Interpreter::FoldScope::~FoldScope() {
+    if (!_active) return;
+    Interpreter& program = *_interpreter;
+    program._foldDepth--;
+    // ops that are not run when added (jumps and the assignments of their branches) still have to be, the
+    // children of the node were already folded so this only runs the node's own ops
+    int end = program.nextPC();
+    for (int pc = _pc; pc < end;) {
+        const std::pair<OpF, int>& op = program.ops[pc];
+        pc += op.first(&program.opData[op.second], program.d.data(), program.s.data(), program.callStack);
+    }
+    for (int pc = _pc; pc < end; pc++)
+        if (!program.batchOps[pc]) program._unbatchedOps--;
+    program.ops.resize(_pc);
+    program.opData.resize(_dataSize);
+    program.batchOps.resize(_pc);
+}
+
+bool Interpreter::hoistable(const ExprNode* node) const {
+    if (!_hoisting || _branchDepth > 0) return false;
+    if (node->type().isLifetimeVarying() || node->type().isLifetimeError()) return false;
+    // the lifetime of a variable assigned in a branch does not include the condition
+    if (const ExprVarNode* var = dynamic_cast<const ExprVarNode*>(node))
+        if (var->localVar() && !prologueVars.count(var->localVar())) return false;
+    for (int c = 0; c < node->numChildren(); c++)
+        if (!hoistable(node->child(c))) return false;
+    return true;
+}
+
+void Interpreter::swapPrologue() {
+    ops.swap(_otherOps);
+    opData.swap(_otherOpData);
+    batchOps.swap(_otherBatchOps);
+    _inPrologue = !_inPrologue;
+}
+
+Interpreter::PrologueScope::PrologueScope(Interpreter* interpreter, const ExprNode* node)
+    : _interpreter(interpreter), _active(!interpreter->_inPrologue && interpreter->hoistable(node)) {
+    if (_active) _interpreter->swapPrologue();
+}
+
+Interpreter::PrologueScope::~PrologueScope() {
+    if (_active) _interpreter->swapPrologue();
+}
+
+void Interpreter::endPrologue() {
+    assert(!_inPrologue && !_startedOp);
+    if (_otherOps.empty()) return;
+    assert(_pcStart == 0 && "procedures cannot be combined with a prologue");
+    // jumps are relative, so only the operand offsets of the body move
+    int dataSize = static_cast<int>(_otherOpData.size());
+    for (auto& op : ops) op.second += dataSize;
+    ops.insert(ops.begin(), _otherOps.begin(), _otherOps.end());
+    opData.insert(opData.begin(), _otherOpData.begin(), _otherOpData.end());
+    batchOps.insert(batchOps.begin(), _otherBatchOps.begin(), _otherBatchOps.end());
+    _bodyStart = static_cast<int>(_otherOps.size());
+    _otherOps.clear();
+    _otherOpData.clear();
+    _otherBatchOps.clear();
+}
+
+namespace {
+typedef std::map<Interpreter::OpF, Interpreter::OpInfo> OpRegistry;
+OpRegistry& opRegistry() {
+    static OpRegistry registry;
+    return registry;
+}
+}
+
+void Interpreter::registerOp(OpF op, const std::string& name, BatchOpF batch, OperandsF operands) {
+    OpInfo& info = opRegistry()[op];
+    info.name = name;
+    info.batch = batch;
+    info.operands = operands;
+}
+
+const Interpreter::OpInfo* Interpreter::opInfo(OpF op) {
+    const OpRegistry& registry = opRegistry();
+    OpRegistry::const_iterator it = registry.find(op);
+    return it != registry.end() ? &it->second : nullptr;
+}
+
+namespace {
+//! Registered ops by name, ops sharing their name with another one are mapped to nullptr
+std::map<std::string, Interpreter::OpF> opsByName() {
+    std::map<std::string, Interpreter::OpF> ops;
+    for (const auto& entry : opRegistry()) {
+        auto inserted = ops.insert(std::make_pair(entry.second.name, entry.first));
+        if (!inserted.second) inserted.first->second = nullptr;
+    }
+    return ops;
+}
+
+//! How the pointer data of a program is saved by Interpreter::write
+enum PtrTag { NullPtr, StringBufferPtr, StringPtr, BoundPtr };
+}
+
+bool Interpreter::write(std::ostream& out, const PtrBindings& bindings) const {
+    using Utils::writeBinary;
+    if (!isFinalized()) return false;
+    std::map<std::string, OpF> byName = opsByName();
+    int numOps = static_cast<int>(ops.size());
+    auto operandsEnd = [this, numOps](int pc) {
+        return pc + 1 < numOps ? ops[pc + 1].second : static_cast<int>(opData.size());
+    };
+
+    // pointer slots that ops write do not need the value left by the build if it cannot be saved
+    std::vector<char> ptrWritten(s.size(), 0);
+    std::vector<Operand> operands;
+    for (int pc = 0; pc < numOps; pc++) {
+        const OpInfo* info = opInfo(ops[pc].first);
+        if (!info || byName[info->name] != ops[pc].first) return false;
+        if (batchOps[pc] && batchOps[pc] != info->batch) return false;
+        int begin = ops[pc].second;
+        operands.clear();
+        // read only accepts ops describing their operands
+        if (!info->operands || !info->operands(*this, opData.data() + begin, operandsEnd(pc) - begin, operands))
+            return false;
+        for (const Operand& operand : operands)
+            if (operand.kind == Operand::PtrWrite) ptrWritten[opData[begin + operand.index]] = 1;
+    }
+
+    std::map<const char*, int> buffers;
+    std::set<const char*> strings;
+    for (size_t k = 0; k < _stringBuffers.size(); k++) {
+        buffers[reinterpret_cast<const char*>(&_stringBuffers[k])] = static_cast<int>(k);
+        if (!_stringBuffers[k].empty()) strings.insert(_stringBuffers[k].data() + sizeof(size_t));
+    }
+    for (const auto& str : _strings) strings.insert(str.second.data() + sizeof(size_t));
+
+    writeBinary(out, d);
+    writeBinary(out, static_cast<int32_t>(s.size()));
+    for (size_t k = 0; k < s.size(); k++) {
+        const char* ptr = s[k];
+        // the first two slots are set to the variable block by every evaluation
+        if (k < 2 || !ptr) {
+            writeBinary(out, static_cast<int32_t>(NullPtr));
+        } else if (buffers.count(ptr)) {
+            writeBinary(out, static_cast<int32_t>(StringBufferPtr));
+            writeBinary(out, static_cast<int32_t>(buffers[ptr]));
+        } else if (strings.count(ptr)) {
+            writeBinary(out, static_cast<int32_t>(StringPtr));
+            writeBinary(out, std::string(ptr, stringLength(ptr)));
+        } else if (bindings.count(ptr)) {
+            writeBinary(out, static_cast<int32_t>(BoundPtr));
+            writeBinary(out, static_cast<int32_t>(bindings.find(ptr)->second));
+        } else if (ptrWritten[k]) {
+            writeBinary(out, static_cast<int32_t>(NullPtr));
+        } else {
+            return false;
         }
-        const std::pair<OpF, int>& op = ops[pc];
-        int* opCurr = &opData[0] + op.second;
-        pc += op.first(opCurr, fp, str, callStack);
     }
+    writeBinary(out, static_cast<int32_t>(numOps));
+    for (int pc = 0; pc < numOps; pc++) {
+        writeBinary(out, opInfo(ops[pc].first)->name);
+        writeBinary(out, static_cast<int32_t>(ops[pc].second));
+        writeBinary(out, static_cast<int32_t>(batchOps[pc] != nullptr));
+    }
+    writeBinary(out, opData);
+    writeBinary(out, static_cast<int32_t>(_pcStart));
+    writeBinary(out, static_cast<int32_t>(_bodyStart));
+    return static_cast<bool>(out);
+}
+
+bool Interpreter::read(std::istream& in, const std::vector<ReadBinding>& bindings) {
+    using Utils::readBinary;
+    int32_t numPtrs = 0;
+    if (!readBinary(in, d) || !readBinary(in, numPtrs) || numPtrs < 2) return false;
+    s.assign(numPtrs, nullptr);
+    _strings.clear();
+    _stringBuffers.clear();
+    _slotTargets.assign(numPtrs, -1);
+    for (int k = 0; k < numPtrs; k++) {
+        int32_t tag = 0, index = 0;
+        std::string str;
+        if (!readBinary(in, tag)) return false;
+        switch (tag) {
+            case NullPtr:
+                break;
+            case StringBufferPtr:
+                if (!readBinary(in, index) || index < 0 || index >= numPtrs) return false;
+                // growing a deque at its end keeps the buffers already pointed to in place
+                if (index >= static_cast<int>(_stringBuffers.size())) _stringBuffers.resize(index + 1);
+                s[k] = reinterpret_cast<char*>(&_stringBuffers[index]);
+                _slotTargets[k] = Operand::StringBuffer;
+                break;
+            case StringPtr:
+                if (!readBinary(in, str)) return false;
+                s[k] = const_cast<char*>(intern(str));
+                _slotTargets[k] = Operand::PrefixedString;
+                break;
+            case BoundPtr:
+                if (!readBinary(in, index) || index < 0 || index >= static_cast<int>(bindings.size())) return false;
+                s[k] = static_cast<char*>(bindings[index].first);
+                _slotTargets[k] = bindings[index].second;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    std::map<std::string, OpF> byName = opsByName();
+    int32_t numOps = 0;
+    if (!readBinary(in, numOps) || numOps < 0) return false;
+    ops.clear();
+    batchOps.clear();
+    _unbatchedOps = 0;
+    for (int pc = 0; pc < numOps; pc++) {
+        std::string name;
+        int32_t offset = 0, batched = 0;
+        if (!readBinary(in, name) || !readBinary(in, offset) || !readBinary(in, batched)) return false;
+        OpF op = byName[name];
+        if (!op) return false;
+        BatchOpF batch = batched ? opInfo(op)->batch : nullptr;
+        if (batched && !batch) return false;
+        ops.push_back(std::make_pair(op, static_cast<int>(offset)));
+        batchOps.push_back(batch);
+        if (!batch) _unbatchedOps++;
+    }
+    int32_t pcStart = 0, bodyStart = 0;
+    if (!readBinary(in, opData) || !readBinary(in, pcStart) || !readBinary(in, bodyStart)) return false;
+    if (pcStart < 0 || pcStart > bodyStart || bodyStart > numOps) return false;
+    _pcStart = pcStart;
+    _bodyStart = bodyStart;
+
+    // check that the operands of every op stay within the program, ops that cannot tell what they access are
+    // not run from saved data
+    std::vector<Operand> operands, ptrReads;
+    // which pointer slots ops write strings to, and whether all of those strings have their length prefixed
+    enum { Unwritten, PrefixedWrites, Written };
+    std::vector<int> written(numPtrs, Unwritten);
+    for (int pc = 0; pc < numOps; pc++) {
+        int begin = ops[pc].second;
+        int end = pc + 1 < numOps ? ops[pc + 1].second : static_cast<int>(opData.size());
+        if (begin < 0 || begin > end || end > static_cast<int>(opData.size())) return false;
+        const OpInfo* info = opInfo(ops[pc].first);
+        operands.clear();
+        if (!info->operands || !info->operands(*this, opData.data() + begin, end - begin, operands)) return false;
+        for (Operand& operand : operands) {
+            if (operand.index < 0 || operand.index >= end - begin || operand.width < 1) return false;
+            int slot = opData[begin + operand.index];
+            int size = operand.kind == Operand::FPRead || operand.kind == Operand::FPWrite ? static_cast<int>(d.size())
+                                                                                          : numPtrs;
+            if (slot < 0 || slot + operand.width > size) return false;
+            if (operand.kind == Operand::PtrWrite) {
+                // ops only compute strings, which must not replace what other ops take the slot for
+                if (_slotTargets[slot] != -1 && _slotTargets[slot] != Operand::PrefixedString) return false;
+                bool prefixed = operand.target == Operand::PrefixedString && written[slot] != Written;
+                written[slot] = prefixed ? PrefixedWrites : Written;
+            } else if (operand.kind == Operand::PtrRead) {
+                operand.index = slot;
+                ptrReads.push_back(operand);
+            }
+        }
+    }
+    // strings are either saved or written by ops, everything else must be bound to what the op takes it for
+    for (const Operand& read : ptrReads) {
+        int slot = read.index, target = _slotTargets[slot];
+        switch (read.target) {
+            case Operand::String:
+                if (target != Operand::PrefixedString && (target != -1 || written[slot] == Unwritten)) return false;
+                break;
+            case Operand::PrefixedString:
+                if ((target != Operand::PrefixedString && target != -1) || written[slot] == Written ||
+                    (target == -1 && written[slot] == Unwritten))
+                    return false;
+                break;
+            case Operand::FuncData:
+                // evalConstant may not have made any data
+                if ((target != Operand::FuncData && target != -1) || written[slot] != Unwritten) return false;
+                break;
+            default:
+                if (target != read.target || written[slot] != Unwritten) return false;
+        }
+    }
+    if (!validJumps()) return false;
+
+    _startedOp = false;
+    _fpBlocks.clear();
+    _ptrBlocks.clear();
+    _fpSlotsBefore = _ptrSlotsBefore = 0;
+    varToLoc.clear();
+    prologueVars.clear();
+    callStack.clear();
+    finalize();
+    return true;
+}
+
+namespace {
+struct Fusion {
+    Interpreter::OpF fused;
+    Interpreter::BatchOpF batch;
+};
+typedef std::map<std::pair<Interpreter::OpF, Interpreter::OpF>, Fusion> FusionRegistry;
+FusionRegistry& fusionRegistry() {
+    static FusionRegistry registry;
+    return registry;
+}
+std::atomic<size_t> numFusionsApplied(0);
+}
+
+void Interpreter::registerFusion(OpF first,
+                                 OpF second,
+                                 OpF fused,
+                                 BatchOpF fusedBatch,
+                                 OperandsF fusedOperands,
+                                 const std::string& name) {
+    Fusion& fusion = fusionRegistry()[std::make_pair(first, second)];
+    fusion.fused = fused;
+    fusion.batch = fusedBatch;
+    registerOp(fused, name, fusedBatch, fusedOperands);
+}
+
+size_t Interpreter::fusionsApplied() { return numFusionsApplied; }
+
+namespace {
+//! Readable name of an op for debug printing
+const char* opName(Interpreter::OpF op) {
+    if (const Interpreter::OpInfo* opInfo = Interpreter::opInfo(op)) return opInfo->name.c_str();
+#if !defined(WINDOWS)
+    Dl_info info;
+    if (dladdr((void*)op, &info) && info.dli_sname) return info.dli_sname;
+#endif
+    return "";
+}
 }
 
 void Interpreter::print(int pc) const {
     std::cerr << "---- ops     ----------------------" << std::endl;
     for (size_t i = 0; i < ops.size(); i++) {
-        const char* name = "";
-#if !defined(WINDOWS)
-        Dl_info info;
-        if (dladdr((void*)ops[i].first, &info)) name = info.dli_sname;
-#endif
+        const char* name = opName(ops[i].first);
         fprintf(stderr, "%s %s %p (", pc == (int)i ? "-->" : "   ", name, ops[i].first);
         int nextGuy = (i == ops.size() - 1 ? static_cast<int>(opData.size()) : ops[i + 1].second);
         for (int k = ops[i].second; k < nextGuy; k++) {
@@ -101,6 +678,33 @@ void Interpreter::print(int pc) const {
     }
 }
 
+void Interpreter::printCode(int pc) const {
+    std::cerr << "---- code    ----------------------" << std::endl;
+    if (!isFinalized()) {
+        std::cerr << "not finalized" << std::endl;
+        return;
+    }
+    for (size_t i = 0; i < ops.size(); i++) {
+        const Instruction* ip = instruction(static_cast<int>(i));
+        int numOperands = (i + 1 < ops.size() ? ops[i + 1].second : static_cast<int>(opData.size())) - ops[i].second;
+        fprintf(stderr,
+                "%s %4d @%-5d %s%s (",
+                pc == (int)i ? "-->" : "   ",
+                (int)i,
+                _codeOffsets[i],
+                opName(ip->op),
+                ip->batch ? "" : " [unbatched]");
+        for (int k = 0; k < numOperands; k++) fprintf(stderr, " %d", ip->operands()[k]);
+        fprintf(stderr, ")\n");
+    }
+    std::cerr << "code size " << _code.size() * sizeof(int) << " bytes, start at " << _pcStart << ", body at "
+              << _bodyStart << ", " << _numFusions
+              << " fusions" << std::endl;
+    std::cerr << "fp slots " << d.size() << ", pointer slots " << s.size();
+    if (_fpSlotsBefore) std::cerr << " (" << _fpSlotsBefore << " and " << _ptrSlotsBefore << " before allocateSlots)";
+    std::cerr << std::endl;
+}
+
 // template Interpreter::OpF* getTemplatizedOp<Promote<1> >(int);
 // template Interpreter::OpF* getTemplatizedOp<Promote<2> >(int);
 // template Interpreter::OpF* getTemplatizedOp<Promote<3> >(int);
@@ -150,38 +754,35 @@ static Interpreter::OpF getTemplatizedOp2(int i) {
 }
 
 namespace {
+typedef Interpreter::Operand Operand;
 
 //! Binary operator for strings. Currently only handle '+'
+//! (opData[4] and opData[5] tell whether the length of the inputs is stored before them)
 struct BinaryStringOp {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
-        // get the operand data
-        char*& out = *(char**)c[opData[0]];
-        char* in1 = c[opData[1]];
-        char* in2 = c[opData[2]];
-
-        // delete previous data and allocate a new buffer, only if needed
-        // NOTE: this is more efficient, but might consume more memory...
-        // Maybe make this behaviour configurable ?
-        size_t len1 = strlen(in1);
-        size_t len2 = strlen(in2);
-        if (out == 0 || len1 + len2 + 1 > strlen(out))
-        {
-            delete [] out;
-            out = new char [len1 + len2 + 1];
-        }
-
-        // clear previous evaluation content
-        memset(out, 0, len1 + len2 + 1);
-
-        // concatenate strings
-        strcat(out, in1);
-        strcat(out + len1, in2);
-        out[len1 + len2] = '\0';
+        StringBuffer& buffer = *reinterpret_cast<StringBuffer*>(c[opData[0]]);
+        const char* in1 = c[opData[1]];
+        const char* in2 = c[opData[2]];
+        size_t len1 = opData[4] ? Interpreter::stringLength(in1) : strlen(in1);
+        size_t len2 = opData[5] ? Interpreter::stringLength(in2) : strlen(in2);
+        c[opData[3]] = const_cast<char*>(Interpreter::concatenate(buffer, in1, len1, in2, len2));
+        return 1;
+    }
 
-        // copy to the output
-        c[opData[3]] = out;
+    // strings are the same for every lane of a batch, so concatenate once
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        std::vector<int> callStack;
+        return f(opData, fp, c, callStack);
+    }
 
-        return 1;
+    static bool operands(const Interpreter&, const int* opData, int numOperands, std::vector<Operand>& operands) {
+        if (numOperands != 6 || (opData[4] != 0 && opData[4] != 1) || (opData[5] != 0 && opData[5] != 1))
+            return false;
+        operands.push_back(Operand::ptrRead(0, Operand::StringBuffer));
+        operands.push_back(Operand::ptrRead(1, opData[4] ? Operand::PrefixedString : Operand::String));
+        operands.push_back(Operand::ptrRead(2, opData[5] ? Operand::PrefixedString : Operand::String));
+        operands.push_back(Operand::ptrWrite(3, Operand::PrefixedString));
+        return true;
     }
 };
 
@@ -193,6 +794,56 @@ struct BinaryOp {
         return a - floor(a / b) * b;
     }
 
+    static double apply(double a, double b) {
+        switch (op) {
+            case '+':
+                return a + b;
+            case '-':
+                return a - b;
+            case '*':
+                return a * b;
+            case '/':
+                return a / b;
+            case '%':
+                return niceMod(a, b);
+            case '^':
+                return pow(a, b);
+            // these only make sense with d==1
+            case '<':
+                return a < b;
+            case '>':
+                return a > b;
+            case 'l':
+                return a <= b;
+            case 'g':
+                return a >= b;
+            case '&':
+                return a && b;
+            case '|':
+                return a || b;
+            default:
+                assert(false);
+        }
+        return 0;
+    }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0, d));
+        operands.push_back(Operand::fpRead(1, d));
+        operands.push_back(Operand::fpWrite(2, d));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        for (int k = 0; k < d; k++) {
+            const double* in1 = Interpreter::batchSlot(fp, opData[0] + k);
+            const double* in2 = Interpreter::batchSlot(fp, opData[1] + k);
+            double* out = Interpreter::batchSlot(fp, opData[2] + k);
+            for (int l = 0; l < batch.lanes; l++) out[l] = apply(in1[l], in2[l]);
+        }
+        return 1;
+    }
+
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
         double* in1 = fp + opData[0];
         double* in2 = fp + opData[1];
@@ -273,6 +924,35 @@ struct UnaryOp {
         }
         return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0, d));
+        operands.push_back(Operand::fpWrite(1, d));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        for (int k = 0; k < d; k++) {
+            const double* in = Interpreter::batchSlot(fp, opData[0] + k);
+            double* out = Interpreter::batchSlot(fp, opData[1] + k);
+            for (int l = 0; l < batch.lanes; l++) {
+                switch (op) {
+                    case '-':
+                        out[l] = -in[l];
+                        break;
+                    case '~':
+                        out[l] = 1 - in[l];
+                        break;
+                    case '!':
+                        out[l] = !in[l];
+                        break;
+                    default:
+                        assert(false);
+                }
+            }
+        }
+        return 1;
+    }
 };
 
 //! Subscripts
@@ -288,6 +968,26 @@ struct Subscript {
             fp[out] = fp[tuple + subscript];
         return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0, d));
+        operands.push_back(Operand::fpRead(1));
+        operands.push_back(Operand::fpWrite(2));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* subscripts = Interpreter::batchSlot(fp, opData[1]);
+        double* out = Interpreter::batchSlot(fp, opData[2]);
+        for (int l = 0; l < batch.lanes; l++) {
+            int subscript = int(subscripts[l]);
+            if (subscript >= d || subscript < 0)
+                out[l] = 0;
+            else
+                out[l] = Interpreter::batchSlot(fp, opData[0] + subscript)[l];
+        }
+        return 1;
+    }
 };
 
 //! build a vector tuple from a bunch of numbers
@@ -300,6 +1000,21 @@ struct Tuple {
         }
         return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        for (int k = 0; k < d; k++) operands.push_back(Operand::fpRead(k));
+        operands.push_back(Operand::fpWrite(d, d));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        for (int k = 0; k < d; k++) {
+            const double* in = Interpreter::batchSlot(fp, opData[k]);
+            double* out = Interpreter::batchSlot(fp, opData[d] + k);
+            for (int l = 0; l < batch.lanes; l++) out[l] = in[l];
+        }
+        return 1;
+    }
 };
 
 //! Assign a floating point to another (NOTE: if src and dest have different dimensions, use Promote)
@@ -313,6 +1028,27 @@ struct AssignOp {
         }
         return 1;
     }
+
+    // only the active lanes are written so both sides of a branch can merge into the same variable
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        for (int k = 0; k < d; k++) {
+            const double* in = Interpreter::batchSlot(fp, opData[0] + k);
+            double* out = Interpreter::batchSlot(fp, opData[1] + k);
+            if (batch.mask) {
+                for (int l = 0; l < batch.lanes; l++)
+                    if (batch.mask[l]) out[l] = in[l];
+            } else {
+                for (int l = 0; l < batch.lanes; l++) out[l] = in[l];
+            }
+        }
+        return 1;
+    }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0, d));
+        operands.push_back(Operand::fpWrite(1, d));
+        return true;
+    }
 };
 
 //! Assigns a string from one position to another
@@ -323,9 +1059,38 @@ struct AssignStrOp {
         c[out] = c[in];
         return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::ptrRead(0));
+        operands.push_back(Operand::ptrWrite(1));
+        return true;
+    }
 };
 
+//! Enters a branch in a batch. Lanes whose cond differs from jumpIf run the ops up to the next JmpRelative,
+//! the others run the ops from destJump up to destEnd. A side no lane takes is skipped entirely.
+int enterBatchBranch(Interpreter::Batch& batch, const double* cond, bool jumpIf, int destJump, int destEnd) {
+    batch.branches.emplace_back();
+    Interpreter::Batch::Branch& branch = batch.branches.back();
+    branch.endPC = batch.pc + destEnd;
+    branch.parentMask = batch.mask;
+    int thenLanes = 0, elseLanes = 0;
+    for (int l = 0; l < batch.lanes; l++) {
+        bool active = batch.active(l);
+        bool taken = active && (bool)cond[l] != jumpIf;
+        branch.thenMask[l] = taken;
+        branch.elseMask[l] = active && !taken;
+        thenLanes += taken;
+        elseLanes += active && !taken;
+    }
+    branch.elseTaken = elseLanes > 0;
+    if (thenLanes == 0) return destJump;  // the else side has the same lanes as the parent
+    if (elseLanes > 0) batch.mask = branch.thenMask;
+    return 1;
+}
+
 //! Jumps relative to current executing pc if cond is true
+//! (opData[2] is the end of the branch relative to this op, only used by batches)
 struct CondJmpRelativeIfFalse {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
         bool cond = (bool)fp[opData[0]];
@@ -334,9 +1099,19 @@ struct CondJmpRelativeIfFalse {
         else
             return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        return enterBatchBranch(batch, Interpreter::batchSlot(fp, opData[0]), false, opData[1], opData[2]);
+    }
 };
 
 //! Jumps relative to current executing pc if cond is true
+//! (opData[2] is the end of the branch relative to this op, only used by batches)
 struct CondJmpRelativeIfTrue {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
         bool cond = (bool)fp[opData[0]];
@@ -345,11 +1120,34 @@ struct CondJmpRelativeIfTrue {
         else
             return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        return enterBatchBranch(batch, Interpreter::batchSlot(fp, opData[0]), true, opData[1], opData[2]);
+    }
 };
 
 //! Jumps relative to current executing pc unconditionally
 struct JmpRelative {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) { return opData[0]; }
+
+    // ends the then side of the innermost branch of a batch, continuing with the else side if any lane takes it
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        Interpreter::Batch::Branch& branch = batch.branches.back();
+        if (!branch.elseTaken) {
+            batch.mask = branch.parentMask;
+            batch.branches.pop_back();
+            return opData[0];
+        }
+        batch.mask = branch.elseMask;
+        return 1;
+    }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>&) { return true; }
 };
 
 //! Evaluates an external variable
@@ -363,6 +1161,62 @@ struct EvalVar {
         }
         return 1;
     }
+
+    static bool operands(const Interpreter& program,
+                         const int* opData,
+                         int numOperands,
+                         std::vector<Operand>& operands) {
+        if (numOperands < 2 || opData[0] < 0 || opData[0] >= static_cast<int>(program.s.size())) return false;
+        if (!program.holds(opData[0], Operand::VarRef)) return false;
+        const ExprVarRef* ref = reinterpret_cast<const ExprVarRef*>(program.s[opData[0]]);
+        if (!ref) return false;
+        operands.push_back(Operand::ptrRead(0, Operand::VarRef));
+        operands.push_back(ref->type().isFP() ? Operand::fpWrite(1, ref->type().dim()) : Operand::ptrWrite(1));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        ExprVarRef* ref = reinterpret_cast<ExprVarRef*>(c[opData[0]]);
+        if (ref->type().isFP()) {
+            int dim = ref->type().dim();
+            double* value = static_cast<double*>(alloca(dim * sizeof(double)));
+            for (int l = 0; l < batch.lanes; l++) {
+                if (!batch.active(l)) continue;
+                ref->eval(value);
+                for (int k = 0; k < dim; k++) Interpreter::batchSlot(fp, opData[1] + k)[l] = value[k];
+            }
+        } else {
+            ref->eval(const_cast<const char**>(c + opData[1]));
+        }
+        return 1;
+    }
+};
+
+//! Copies an external variable the host keeps at a fixed address (see ExprPointerVarRef)
+template <int dim>
+struct EvalPointerVar {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const double* data = reinterpret_cast<const double*>(c[opData[0]]);
+        for (int k = 0; k < dim; k++) fp[opData[1] + k] = data[k * opData[2]];
+        return 1;
+    }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::ptrRead(0, Operand::VarValues));
+        operands.push_back(Operand::fpWrite(1, dim));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* data = reinterpret_cast<const double*>(c[opData[0]]);
+        for (int k = 0; k < dim; k++) {
+            double value = data[k * opData[2]];
+            double* out = Interpreter::batchSlot(fp, opData[1] + k);
+            for (int l = 0; l < batch.lanes; l++)
+                if (batch.active(l)) out[l] = value;
+        }
+        return 1;
+    }
 };
 
 //! Evaluates an external variable using a variable block
@@ -378,17 +1232,17 @@ struct EvalVarBlock {
     }
 };
 
-//! Evaluates an external variable using a variable block
-template <char uniform, int dim>
-struct EvalVarBlockIndirect {
+//! Evaluates an external variable using a variable block, whose values are stored as T
+template <class T, char uniform, int dim>
+struct EvalVarBlockIndirectT {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
         if (c[0]) {
             int stride = opData[2];
             int outputVarBlockOffset = opData[0];
             int destIndex = opData[1];
             size_t indirectIndex = reinterpret_cast<size_t>(c[1]);
-            double* basePointer =
-                reinterpret_cast<double**>(c[0])[outputVarBlockOffset] + (uniform ? 0 : (stride * indirectIndex));
+            const T* basePointer =
+                reinterpret_cast<T**>(c[0])[outputVarBlockOffset] + (uniform ? 0 : (stride * indirectIndex));
             double* destPointer = fp + destIndex;
             for (int i = 0; i < dim; i++) destPointer[i] = basePointer[i];
         } else {
@@ -398,8 +1252,33 @@ struct EvalVarBlockIndirect {
         }
         return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpWrite(1, dim));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        int stride = opData[2];
+        size_t batchStart = reinterpret_cast<size_t>(c[1]);
+        const T* basePointer = reinterpret_cast<T**>(c[0])[opData[0]] + (uniform ? 0 : (stride * batchStart));
+        for (int i = 0; i < dim; i++) {
+            double* dest = Interpreter::batchSlot(fp, opData[1] + i);
+            if (uniform) {
+                for (int l = 0; l < batch.lanes; l++) dest[l] = basePointer[i];
+            } else {
+                for (int l = 0; l < batch.lanes; l++) dest[l] = basePointer[stride * l + i];
+            }
+        }
+        return 1;
+    }
 };
 
+template <char uniform, int dim>
+using EvalVarBlockIndirect = EvalVarBlockIndirectT<double, uniform, dim>;
+template <char uniform, int dim>
+using EvalFloatVarBlockIndirect = EvalVarBlockIndirectT<float, uniform, dim>;
+
 template <char op, int d>
 struct CompareEqOp {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
@@ -424,6 +1303,24 @@ struct CompareEqOp {
         *out = result;
         return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0, d));
+        operands.push_back(Operand::fpRead(1, d));
+        operands.push_back(Operand::fpWrite(2));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        double* out = Interpreter::batchSlot(fp, opData[2]);
+        for (int l = 0; l < batch.lanes; l++) {
+            bool eq = true;
+            for (int k = 0; k < d; k++)
+                eq &= Interpreter::batchSlot(fp, opData[0] + k)[l] == Interpreter::batchSlot(fp, opData[1] + k)[l];
+            out[l] = op == '=' ? eq : !eq;
+        }
+        return 1;
+    }
 };
 
 template <char op>
@@ -435,23 +1332,218 @@ struct CompareEqOp<op, 3> {
         if (op == '!') fp[opData[2]] = !eq;
         return 1;
     }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Operand>& operands) {
+        operands.push_back(Operand::fpRead(0, 3));
+        operands.push_back(Operand::fpRead(1, 3));
+        operands.push_back(Operand::fpWrite(2));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* a0 = Interpreter::batchSlot(fp, opData[0]);
+        const double* a1 = Interpreter::batchSlot(fp, opData[0] + 1);
+        const double* a2 = Interpreter::batchSlot(fp, opData[0] + 2);
+        const double* b0 = Interpreter::batchSlot(fp, opData[1]);
+        const double* b1 = Interpreter::batchSlot(fp, opData[1] + 1);
+        const double* b2 = Interpreter::batchSlot(fp, opData[1] + 2);
+        double* out = Interpreter::batchSlot(fp, opData[2]);
+        for (int l = 0; l < batch.lanes; l++) {
+            bool eq = a0[l] == b0[l] && a1[l] == b1[l] && a2[l] == b2[l];
+            out[l] = op == '=' ? eq : !eq;
+        }
+        return 1;
+    }
 };
 
 template <char op, int d>
 struct StrCompareEqOp {
-    // TODO: this should rely on tokenization and not use strcmp
-    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
-        switch (op) {
-            case '=':
-                fp[opData[2]] = strcmp(c[opData[0]], c[opData[1]]) == 0;
-                break;
-            case '!':
-                fp[opData[2]] = strcmp(c[opData[0]], c[opData[1]]) != 0;
-                break;
+    //! Interned strings are equal if they are the same, strings with a known length only need a memcmp when
+    //! their lengths match (opData[3] and opData[4] tell whether the length of the inputs is stored before them)
+    static bool equal(const int* opData, char** c) {
+        const char* in1 = c[opData[0]];
+        const char* in2 = c[opData[1]];
+        if (in1 == in2) return true;
+        if (opData[3] && opData[4]) {
+            size_t length = Interpreter::stringLength(in1);
+            return length == Interpreter::stringLength(in2) && memcmp(in1, in2, length) == 0;
         }
+        return strcmp(in1, in2) == 0;
+    }
+
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        fp[opData[2]] = equal(opData, c) == (op == '=');
         return 1;
     }
+
+    // strings are the same for every lane of a batch, so compare once
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        bool eq = equal(opData, c);
+        double* out = Interpreter::batchSlot(fp, opData[2]);
+        for (int l = 0; l < batch.lanes; l++) out[l] = op == '=' ? eq : !eq;
+        return 1;
+    }
+
+    static bool operands(const Interpreter&, const int* opData, int numOperands, std::vector<Operand>& operands) {
+        if (numOperands != 5 || (opData[3] != 0 && opData[3] != 1) || (opData[4] != 0 && opData[4] != 1))
+            return false;
+        operands.push_back(Operand::ptrRead(0, opData[3] ? Operand::PrefixedString : Operand::String));
+        operands.push_back(Operand::ptrRead(1, opData[4] ? Operand::PrefixedString : Operand::String));
+        operands.push_back(Operand::fpWrite(2));
+        return true;
+    }
+};
+
+//! Superinstruction running op a and then op b (opData[0] is the offset of b's operands)
+template <Interpreter::OpF a, Interpreter::BatchOpF aBatch, Interpreter::OpF b, Interpreter::BatchOpF bBatch>
+struct FusedOp {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        a(opData + 1, fp, c, callStack);
+        return b(opData + opData[0], fp, c, callStack);
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        aBatch(opData + 1, fp, c, batch);
+        return bBatch(opData + opData[0], fp, c, batch);
+    }
+
+    static bool operands(const Interpreter& program,
+                         const int* opData,
+                         int numOperands,
+                         std::vector<Operand>& operands) {
+        const Interpreter::OpInfo* aInfo = Interpreter::opInfo(a);
+        const Interpreter::OpInfo* bInfo = Interpreter::opInfo(b);
+        if (!aInfo || !aInfo->operands || !bInfo || !bInfo->operands) return false;
+        if (numOperands < 1 || opData[0] < 1 || opData[0] > numOperands) return false;
+        size_t first = operands.size();
+        if (!aInfo->operands(program, opData + 1, opData[0] - 1, operands)) return false;
+        for (size_t i = first; i < operands.size(); i++) operands[i].index += 1;
+        size_t second = operands.size();
+        if (!bInfo->operands(program, opData + opData[0], numOperands - opData[0], operands)) return false;
+        for (size_t i = second; i < operands.size(); i++) operands[i].index += opData[0];
+        return true;
+    }
 };
+
+//! Registers the fusion of op a followed by op b
+template <Interpreter::OpF a, Interpreter::BatchOpF aBatch, Interpreter::OpF b, Interpreter::BatchOpF bBatch>
+void registerFusion(const std::string& name) {
+    typedef FusedOp<a, aBatch, b, bBatch> Fused;
+    Interpreter::registerFusion(a, b, Fused::f, Fused::batch, Fused::operands, name);
+}
+
+//! Registers the fusion of op A followed by op B
+template <class A, class B>
+void registerFusion(const std::string& name) {
+    registerFusion<A::f, A::batch, B::f, B::batch>(name);
+}
+
+//! Registers the fusions of the ops producing an FP[d] with the arithmetic on it
+template <int d>
+void registerArithmeticFusions() {
+    std::string dim = std::to_string(d);
+    // loading a variable and using it right away
+    registerFusion<EvalVarBlockIndirect<0, d>, BinaryOp<'+', d> >("EvalVarBlockIndirect+Add<" + dim + ">");
+    registerFusion<EvalVarBlockIndirect<0, d>, BinaryOp<'-', d> >("EvalVarBlockIndirect+Sub<" + dim + ">");
+    registerFusion<EvalVarBlockIndirect<0, d>, BinaryOp<'*', d> >("EvalVarBlockIndirect+Mul<" + dim + ">");
+    registerFusion<EvalVarBlockIndirect<0, d>, BinaryOp<'/', d> >("EvalVarBlockIndirect+Div<" + dim + ">");
+    registerFusion<EvalVarBlockIndirect<1, d>, BinaryOp<'+', d> >("EvalVarBlockIndirectUniform+Add<" + dim + ">");
+    registerFusion<EvalVarBlockIndirect<1, d>, BinaryOp<'-', d> >("EvalVarBlockIndirectUniform+Sub<" + dim + ">");
+    registerFusion<EvalVarBlockIndirect<1, d>, BinaryOp<'*', d> >("EvalVarBlockIndirectUniform+Mul<" + dim + ">");
+    registerFusion<EvalVarBlockIndirect<1, d>, BinaryOp<'/', d> >("EvalVarBlockIndirectUniform+Div<" + dim + ">");
+    // promoting a scalar operand
+    registerFusion<Promote<d>, BinaryOp<'+', d> >("Promote+Add<" + dim + ">");
+    registerFusion<Promote<d>, BinaryOp<'-', d> >("Promote+Sub<" + dim + ">");
+    registerFusion<Promote<d>, BinaryOp<'*', d> >("Promote+Mul<" + dim + ">");
+    registerFusion<Promote<d>, BinaryOp<'/', d> >("Promote+Div<" + dim + ">");
+    // multiply add
+    registerFusion<BinaryOp<'*', d>, BinaryOp<'+', d> >("Mul+Add<" + dim + ">");
+    registerFusion<BinaryOp<'*', d>, BinaryOp<'-', d> >("Mul+Sub<" + dim + ">");
+}
+
+void registerFusions() {
+    // scalar and 3d vector are the types that matter, FP[2] and FP[4..16] keep their plain ops
+    registerArithmeticFusions<1>();
+    registerArithmeticFusions<3>();
+    // subscripting the result of a vector function
+    registerFusion<Func1VVOp, Func1VVOpBatch, Subscript<3>::f, Subscript<3>::batch>("Func1VVOp+Subscript<3>");
+    registerFusion<Func2VVOp, Func2VVOpBatch, Subscript<3>::f, Subscript<3>::batch>("Func2VVOp+Subscript<3>");
+}
+
+//! Registers T<d> for all the dimensions supported by getTemplatizedOp
+template <template <int d> class T, int d = 1>
+struct RegisterTemplatizedOp {
+    static void apply(const std::string& name) {
+        Interpreter::registerOp(T<d>::f, name + "<" + std::to_string(d) + ">", T<d>::batch, T<d>::operands);
+        RegisterTemplatizedOp<T, d + 1>::apply(name);
+    }
+};
+
+template <template <int d> class T>
+struct RegisterTemplatizedOp<T, 17> {
+    static void apply(const std::string&) {}
+};
+
+//! Registers T<c,d> for all the dimensions supported by getTemplatizedOp2
+template <char c, template <char c1, int d> class T, int d = 1>
+struct RegisterTemplatizedOp2 {
+    static void apply(const std::string& name) {
+        std::string arg = c < ' ' ? std::to_string(static_cast<int>(c)) : std::string(1, c);
+        Interpreter::registerOp(
+            T<c, d>::f, name + "<" + arg + "," + std::to_string(d) + ">", T<c, d>::batch, T<c, d>::operands);
+        RegisterTemplatizedOp2<c, T, d + 1>::apply(name);
+    }
+};
+
+template <char c, template <char c1, int d> class T>
+struct RegisterTemplatizedOp2<c, T, 17> {
+    static void apply(const std::string&) {}
+};
+
+bool registerInterpreterOps() {
+    RegisterTemplatizedOp<Promote>::apply("Promote");
+    RegisterTemplatizedOp<Subscript>::apply("Subscript");
+    RegisterTemplatizedOp<Tuple>::apply("Tuple");
+    RegisterTemplatizedOp<AssignOp>::apply("AssignOp");
+    RegisterTemplatizedOp<EvalPointerVar>::apply("EvalPointerVar");
+    RegisterTemplatizedOp2<'+', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'-', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'*', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'/', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'%', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'^', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'<', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'>', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'l', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'g', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'&', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'|', BinaryOp>::apply("BinaryOp");
+    RegisterTemplatizedOp2<'-', UnaryOp>::apply("UnaryOp");
+    RegisterTemplatizedOp2<'~', UnaryOp>::apply("UnaryOp");
+    RegisterTemplatizedOp2<'!', UnaryOp>::apply("UnaryOp");
+    RegisterTemplatizedOp2<'=', CompareEqOp>::apply("CompareEqOp");
+    RegisterTemplatizedOp2<'!', CompareEqOp>::apply("CompareEqOp");
+    RegisterTemplatizedOp2<'=', StrCompareEqOp>::apply("StrCompareEqOp");
+    RegisterTemplatizedOp2<'!', StrCompareEqOp>::apply("StrCompareEqOp");
+    RegisterTemplatizedOp2<0, EvalVarBlockIndirect>::apply("EvalVarBlockIndirect");
+    RegisterTemplatizedOp2<1, EvalVarBlockIndirect>::apply("EvalVarBlockIndirect");
+    RegisterTemplatizedOp2<0, EvalFloatVarBlockIndirect>::apply("EvalFloatVarBlockIndirect");
+    RegisterTemplatizedOp2<1, EvalFloatVarBlockIndirect>::apply("EvalFloatVarBlockIndirect");
+    Interpreter::registerOp(BinaryStringOp::f, "BinaryStringOp", BinaryStringOp::batch, BinaryStringOp::operands);
+    Interpreter::registerOp(EvalVar::f, "EvalVar", EvalVar::batch, EvalVar::operands);
+    Interpreter::registerOp(CondJmpRelativeIfFalse::f,
+                            "CondJmpRelativeIfFalse",
+                            CondJmpRelativeIfFalse::batch,
+                            CondJmpRelativeIfFalse::operands);
+    Interpreter::registerOp(
+        CondJmpRelativeIfTrue::f, "CondJmpRelativeIfTrue", CondJmpRelativeIfTrue::batch, CondJmpRelativeIfTrue::operands);
+    Interpreter::registerOp(JmpRelative::f, "JmpRelative", JmpRelative::batch, JmpRelative::operands);
+    // strings are shared by all the lanes of a batch, so assigning one is run a point at a time
+    Interpreter::registerOp(AssignStrOp::f, "AssignStrOp", nullptr, AssignStrOp::operands);
+    registerFusions();
+    return true;
+}
+const bool interpreterOpsRegistered = registerInterpreterOps();
 }
 
 namespace {
@@ -469,7 +1561,303 @@ int ProcedureCall(int* opData, double* fp, char** c, std::vector<int>& callStack
 }
 }
 
+bool Interpreter::validJumps() const {
+    int numOps = static_cast<int>(ops.size());
+    auto numOperands = [this, numOps](int pc) {
+        return (pc + 1 < numOps ? ops[pc + 1].second : static_cast<int>(opData.size())) - ops[pc].second;
+    };
+
+    // A branch is entered by a conditional jump to its else side, its then side ends with a jump to its end.
+    // Branches nest within the side they are entered from, and within the section of the program (the code
+    // before pcStart, the prologue or the body) they start in.
+    std::vector<std::pair<int, int> > branches;  // pc of the jump ending the then side, end of the branch
+    for (int pc = 0; pc <= numOps; pc++) {
+        while (!branches.empty() && branches.back().second == pc) branches.pop_back();
+        if (pc == numOps) break;
+        OpF op = ops[pc].first;
+        const int* operands = &opData[ops[pc].second];
+        if (op == CondJmpRelativeIfFalse::f || op == CondJmpRelativeIfTrue::f) {
+            int limit = pc < _pcStart ? _pcStart : pc < _bodyStart ? _bodyStart : numOps;
+            if (!branches.empty()) limit = pc < branches.back().first ? branches.back().first : branches.back().second;
+            if (numOperands(pc) < 3) return false;
+            int thenEnd = pc + operands[1] - 1, end = pc + operands[2];
+            if (thenEnd <= pc || end <= thenEnd || end > limit) return false;
+            if (ops[thenEnd].first != JmpRelative::f || numOperands(thenEnd) < 1 ||
+                thenEnd + opData[ops[thenEnd].second] != end)
+                return false;
+            branches.push_back(std::make_pair(thenEnd, end));
+        } else if (op == JmpRelative::f) {
+            if (branches.empty() || branches.back().first != pc) return false;
+        }
+    }
+    return true;
+}
+
+int Interpreter::fuseOps() {
+    const FusionRegistry& registry = fusionRegistry();
+    int numOps = static_cast<int>(ops.size());
+    auto operandsEnd = [this, numOps](int pc) {
+        return pc + 1 < numOps ? ops[pc + 1].second : static_cast<int>(opData.size());
+    };
+
+    // ops can only be fused if no jump lands between them
+    std::vector<char> isTarget(numOps + 1, 0);
+    isTarget[_pcStart] = isTarget[_bodyStart] = true;
+    for (int pc = 0; pc < numOps; pc++) {
+        OpF op = ops[pc].first;
+        const int* operands = &opData[ops[pc].second];
+        if (op == CondJmpRelativeIfFalse::f || op == CondJmpRelativeIfTrue::f) {
+            isTarget[pc + operands[1]] = isTarget[pc + operands[2]] = true;
+        } else if (op == JmpRelative::f) {
+            isTarget[pc + operands[0]] = true;
+        } else if (op == ProcedureCall || op == ProcedureReturn) {
+            // return addresses are absolute, leave procedures alone
+            return 0;
+        }
+    }
+
+    std::vector<std::pair<OpF, int> > newOps;
+    std::vector<BatchOpF> newBatchOps;
+    std::vector<int> newOpData;
+    std::vector<int> newPC(numOps + 1);
+    int fusions = 0;
+    for (int pc = 0; pc < numOps; pc++) {
+        newPC[pc] = static_cast<int>(newOps.size());
+        FusionRegistry::const_iterator fusion = registry.end();
+        if (pc + 1 < numOps && !isTarget[pc + 1] && batchOps[pc] && batchOps[pc + 1])
+            fusion = registry.find(std::make_pair(ops[pc].first, ops[pc + 1].first));
+
+        newOps.push_back(std::make_pair(ops[pc].first, static_cast<int>(newOpData.size())));
+        newBatchOps.push_back(batchOps[pc]);
+        if (fusion != registry.end()) {
+            newOps.back().first = fusion->second.fused;
+            newBatchOps.back() = fusion->second.batch;
+            newOpData.push_back(1 + operandsEnd(pc) - ops[pc].second);
+            newOpData.insert(newOpData.end(), opData.begin() + ops[pc].second, opData.begin() + operandsEnd(pc));
+            pc++;
+            newPC[pc] = newPC[pc - 1];
+            fusions++;
+        }
+        newOpData.insert(newOpData.end(), opData.begin() + ops[pc].second, opData.begin() + operandsEnd(pc));
+    }
+    newPC[numOps] = static_cast<int>(newOps.size());
+    if (!fusions) return 0;
+
+    // jumps are never fused, relink them to the new pcs
+    for (int pc = 0; pc < numOps; pc++) {
+        OpF op = ops[pc].first;
+        const int* operands = &opData[ops[pc].second];
+        int* newOperands = &newOpData[newOps[newPC[pc]].second];
+        if (op == CondJmpRelativeIfFalse::f || op == CondJmpRelativeIfTrue::f) {
+            newOperands[1] = newPC[pc + operands[1]] - newPC[pc];
+            newOperands[2] = newPC[pc + operands[2]] - newPC[pc];
+        } else if (op == JmpRelative::f) {
+            newOperands[0] = newPC[pc + operands[0]] - newPC[pc];
+        }
+    }
+
+    ops.swap(newOps);
+    batchOps.swap(newBatchOps);
+    opData.swap(newOpData);
+    _pcStart = newPC[_pcStart];
+    _bodyStart = newPC[_bodyStart];
+    _numFusions += fusions;
+    numFusionsApplied += fusions;
+    return fusions;
+}
+
+namespace {
+//! Slots allocated together by one allocFP or allocPtr, and the ops using them
+struct SlotBlock {
+    int start, size;
+    /// First and last op accessing the block (-1 if none)
+    int first, last;
+    /// Whether the block keeps slots of its own, because its initial value is used
+    bool pinned;
+    int newStart;
+};
+
+//! The blocks of one of the program's data (d or s)
+struct SlotSpace {
+    std::vector<SlotBlock> blocks;
+    /// Block of every slot
+    std::vector<int> blockOf;
+    /// Whether the op run so far wrote the slot
+    std::vector<char> written;
+
+    SlotSpace(const std::vector<int>& starts, int numSlots) : blockOf(numSlots, -1), written(numSlots, false) {
+        for (size_t b = 0; b < starts.size(); b++) {
+            int end = b + 1 < starts.size() ? starts[b + 1] : numSlots;
+            blocks.push_back(SlotBlock{starts[b], end - starts[b], -1, -1, false, -1});
+            for (int k = starts[b]; k < end; k++) blockOf[k] = static_cast<int>(b);
+        }
+    }
+
+    //! Return the block holding [slot,slot+width) or nullptr if there is none
+    SlotBlock* block(int slot, int width) {
+        if (slot < 0 || width < 1 || slot + width > static_cast<int>(blockOf.size())) return nullptr;
+        int b = blockOf[slot];
+        return b >= 0 && blockOf[slot + width - 1] == b ? &blocks[b] : nullptr;
+    }
+
+    void access(SlotBlock* block, int pc, int slot, int width, bool write) {
+        if (block->first < 0) block->first = pc;
+        block->last = pc;
+        for (int k = slot; k < slot + width; k++) {
+            if (write)
+                written[k] = true;
+            else if (!written[k])
+                block->pinned = true;
+        }
+    }
+
+    //! Assign the new slots, blocks never accessed are kept as is. Returns the new number of slots
+    int allocate() {
+        int numSlots = 0;
+        std::vector<SlotBlock*> temporaries;
+        for (auto& block : blocks) {
+            if (block.pinned || block.first < 0) {
+                block.newStart = numSlots;
+                numSlots += block.size;
+            } else {
+                temporaries.push_back(&block);
+            }
+        }
+        std::stable_sort(temporaries.begin(), temporaries.end(), [](const SlotBlock* a, const SlotBlock* b) {
+            return a->first < b->first;
+        });
+
+        // linear scan, a block becomes free after the op of its last access (ops may read and write different
+        // slots of the same block, so blocks used by the same op never share slots)
+        auto endsLater = [](const SlotBlock* a, const SlotBlock* b) { return a->last > b->last; };
+        std::vector<SlotBlock*> live;
+        std::map<int, std::vector<int> > freeBySize;
+        for (SlotBlock* block : temporaries) {
+            while (!live.empty() && live.front()->last < block->first) {
+                freeBySize[live.front()->size].push_back(live.front()->newStart);
+                std::pop_heap(live.begin(), live.end(), endsLater);
+                live.pop_back();
+            }
+            std::vector<int>& free = freeBySize[block->size];
+            if (free.empty()) {
+                block->newStart = numSlots;
+                numSlots += block->size;
+            } else {
+                block->newStart = free.back();
+                free.pop_back();
+            }
+            live.push_back(block);
+            std::push_heap(live.begin(), live.end(), endsLater);
+        }
+        return numSlots;
+    }
+
+    int newSlot(int slot) const {
+        const SlotBlock& block = blocks[blockOf[slot]];
+        return block.newStart + slot - block.start;
+    }
+
+    //! Move the initial values of the blocks that keep them
+    template <class T>
+    void move(std::vector<T>& data, int numSlots, std::vector<int>& starts) const {
+        std::vector<T> newData(numSlots, T());
+        std::set<int> newStarts;
+        for (const SlotBlock& block : blocks) {
+            if (block.pinned || block.first < 0)
+                std::copy(data.begin() + block.start,
+                          data.begin() + block.start + block.size,
+                          newData.begin() + block.newStart);
+            newStarts.insert(block.newStart);
+        }
+        data.swap(newData);
+        starts.assign(newStarts.begin(), newStarts.end());
+    }
+};
+}
+
+bool Interpreter::allocateSlots(int& resultSlot, bool resultIsFP) {
+    int numOps = static_cast<int>(ops.size());
+    SlotSpace fpSpace(_fpBlocks, static_cast<int>(d.size()));
+    SlotSpace ptrSpace(_ptrBlocks, static_cast<int>(s.size()));
+    // the variable block pointer and index are set by the evaluation
+    ptrSpace.blocks[0].pinned = true;
+
+    std::vector<Operand> operands;
+    std::vector<int> operandsBegin(numOps + 1);
+    for (int pc = 0; pc < numOps; pc++) {
+        operandsBegin[pc] = static_cast<int>(operands.size());
+        int begin = ops[pc].second;
+        int end = pc + 1 < numOps ? ops[pc + 1].second : static_cast<int>(opData.size());
+        const OpInfo* info = opInfo(ops[pc].first);
+        if (!info || !info->operands || !info->operands(*this, &opData[begin], end - begin, operands)) return false;
+
+        for (int i = operandsBegin[pc]; i < static_cast<int>(operands.size()); i++) {
+            const Operand& operand = operands[i];
+            bool fp = operand.kind == Operand::FPRead || operand.kind == Operand::FPWrite;
+            bool write = operand.kind == Operand::FPWrite || operand.kind == Operand::PtrWrite;
+            int slot = opData[begin + operand.index];
+            SlotSpace& space = fp ? fpSpace : ptrSpace;
+            SlotBlock* block = space.block(slot, operand.width);
+            if (!block) return false;
+            space.access(block, pc, slot, operand.width, write);
+        }
+    }
+    operandsBegin[numOps] = static_cast<int>(operands.size());
+    // the body is run again for every point, values computed by the prologue must outlive all of it
+    for (SlotSpace* space : {&fpSpace, &ptrSpace})
+        for (SlotBlock& block : space->blocks)
+            if (block.first >= 0 && block.first < _bodyStart && block.last >= _bodyStart) block.last = numOps;
+
+    SlotSpace& resultSpace = resultIsFP ? fpSpace : ptrSpace;
+    SlotBlock* resultBlock = resultSpace.block(resultSlot, 1);
+    if (!resultBlock) return false;
+    resultBlock->pinned = true;
+
+    int numFP = fpSpace.allocate();
+    int numPtr = ptrSpace.allocate();
+
+    std::vector<int> newOpData(opData);
+    for (int pc = 0; pc < numOps; pc++) {
+        for (int i = operandsBegin[pc]; i < operandsBegin[pc + 1]; i++) {
+            const Operand& operand = operands[i];
+            bool fp = operand.kind == Operand::FPRead || operand.kind == Operand::FPWrite;
+            int index = ops[pc].second + operand.index;
+            newOpData[index] = (fp ? fpSpace : ptrSpace).newSlot(opData[index]);
+        }
+    }
+    opData.swap(newOpData);
+    resultSlot = resultSpace.newSlot(resultSlot);
+
+    _fpSlotsBefore = static_cast<int>(d.size());
+    _ptrSlotsBefore = static_cast<int>(s.size());
+    fpSpace.move(d, numFP, _fpBlocks);
+    ptrSpace.move(s, numPtr, _ptrBlocks);
+    return true;
+}
+
+namespace {
+int countNodes(const ExprNode* node) {
+    int count = 1;
+    for (int c = 0; c < node->numChildren(); c++) count += countNodes(node->child(c));
+    return count;
+}
+
+//! Promote the value at operand to dim components, returning where the promoted value is
+int promoteOperand(Interpreter* interpreter, int operand, int dim) {
+    int promoted = interpreter->allocFP(dim);
+    interpreter->addOp(getTemplatizedOp<Promote>(dim));
+    interpreter->addOperand(operand);
+    interpreter->addOperand(promoted);
+    interpreter->endOp();
+    return promoted;
+}
+}
+
+bool ExprLocalFunctionNode::inlined() const { return countNodes(child(1)) <= Expression::interpreterInlineThreshold; }
+
 int ExprLocalFunctionNode::buildInterpreter(Interpreter* interpreter) const {
+    // the body of small functions is built at every call site instead
+    if (inlined()) return 0;
     _procedurePC = interpreter->nextPC();
     int lastOperand = 0;
     for (int c = 0; c < numChildren(); c++) lastOperand = child(c)->buildInterpreter(interpreter);
@@ -485,31 +1873,36 @@ int ExprLocalFunctionNode::buildInterpreter(Interpreter* interpreter) const {
 }
 
 int ExprLocalFunctionNode::buildInterpreterForCall(const ExprFuncNode* callerNode, Interpreter* interpreter) const {
+    if (inlined()) {
+        // The parameters are read where the arguments were computed, without a call or copies. They are bound
+        // once all arguments are built, since these may inline the function too. The variables the body assigns
+        // get new slots at every call site.
+        std::vector<int> operands;
+        for (int c = 0; c < callerNode->numChildren(); c++) {
+            int operand = callerNode->child(c)->buildInterpreter(interpreter);
+            if (callerNode->promote(c) != 0) operand = promoteOperand(interpreter, operand, callerNode->promote(c));
+            operands.push_back(operand);
+        }
+        for (int c = 0; c < callerNode->numChildren(); c++)
+            interpreter->varToLoc[static_cast<const ExprVarNode*>(prototype()->arg(c))->localVar()] = operands[c];
+        int result = child(1)->buildInterpreter(interpreter);
+        return _promote ? promoteOperand(interpreter, result, _promote) : result;
+    }
+
+    // all arguments are evaluated before they are copied to the parameters, since they may call the function too
     std::vector<int> operands;
     for (int c = 0; c < callerNode->numChildren(); c++) {
-        const ExprNode* child = callerNode->child(c);
-        // evaluate the argument
         int operand = callerNode->child(c)->buildInterpreter(interpreter);
-        if (child->type().isFP()) {
-            if (callerNode->promote(c) != 0) {
-                // promote the argument to the needed type
-                interpreter->addOp(getTemplatizedOp<Promote>(callerNode->promote(c)));
-                // int promotedOperand=interpreter->allocFP(callerNode->promote(c));
-                interpreter->addOperand(operand);
-                interpreter->addOperand(prototype()->interpreterOps(c));
-                interpreter->endOp();
-            } else {
-                interpreter->addOp(getTemplatizedOp<AssignOp>(child->type().dim()));
-                interpreter->addOperand(operand);
-                interpreter->addOperand(prototype()->interpreterOps(c));
-                interpreter->endOp();
-            }
-        } else {
-            // TODO: string
-            assert(false);
-        }
+        if (callerNode->promote(c) != 0) operand = promoteOperand(interpreter, operand, callerNode->promote(c));
         operands.push_back(operand);
     }
+    for (int c = 0; c < callerNode->numChildren(); c++) {
+        ExprType type = prototype()->argType(c);
+        interpreter->addOp(type.isFP() ? getTemplatizedOp<AssignOp>(type.dim()) : AssignStrOp::f);
+        interpreter->addOperand(operands[c]);
+        interpreter->addOperand(prototype()->interpreterOps(c));
+        interpreter->endOp(type.isFP());
+    }
     int outoperand = -1;
     if (callerNode->type().isFP())
         outoperand = interpreter->allocFP(callerNode->type().dim());
@@ -526,11 +1919,17 @@ int ExprLocalFunctionNode::buildInterpreterForCall(const ExprFuncNode* callerNod
     // set return address
     interpreter->opData[returnAddress] = interpreter->nextPC();
 
-    // TODO: copy result back and string
-    interpreter->addOp(getTemplatizedOp<AssignOp>(callerNode->type().dim()));
+    // copy the result out before another call overwrites it
+    if (callerNode->type().isFP() && _promote) {
+        interpreter->addOp(getTemplatizedOp<Promote>(_promote));
+    } else if (callerNode->type().isFP()) {
+        interpreter->addOp(getTemplatizedOp<AssignOp>(callerNode->type().dim()));
+    } else {
+        interpreter->addOp(AssignStrOp::f);
+    }
     interpreter->addOperand(_returnedDataOp);
     interpreter->addOperand(outoperand);
-    interpreter->endOp();
+    interpreter->endOp(callerNode->type().isFP());
 
     return outoperand;
 }
@@ -548,11 +1947,13 @@ int ExprNumNode::buildInterpreter(Interpreter* interpreter) const {
 
 int ExprStrNode::buildInterpreter(Interpreter* interpreter) const {
     int loc = interpreter->allocPtr();
-    interpreter->s[loc] = const_cast<char*>(_str.c_str());
+    interpreter->s[loc] = const_cast<char*>(interpreter->intern(_str));
     return loc;
 }
 
 int ExprVecNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     std::vector<int> locs;
     for (int k = 0; k < numChildren(); k++) {
         const ExprNode* c = child(k);
@@ -567,6 +1968,8 @@ int ExprVecNode::buildInterpreter(Interpreter* interpreter) const {
 }
 
 int ExprBinaryOpNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     const ExprNode* child0 = child(0), *child1 = child(1);
     int dim0 = child0->type().dim(), dim1 = child1->type().dim(), dimout = type().dim();
     int op0 = child0->buildInterpreter(interpreter);
@@ -621,9 +2024,7 @@ int ExprBinaryOpNode::buildInterpreter(Interpreter* interpreter) const {
         switch (_op) {
             case '+': {
                 interpreter->addOp(BinaryStringOp::f);
-                int intermediateOp = interpreter->allocPtr();
-                interpreter->s[intermediateOp] = (char*)(&_out);
-                interpreter->addOperand(intermediateOp);
+                interpreter->addOperand(interpreter->allocStringBuffer());
                 break;
             }
             default:
@@ -642,6 +2043,10 @@ int ExprBinaryOpNode::buildInterpreter(Interpreter* interpreter) const {
     interpreter->addOperand(op0);
     interpreter->addOperand(op1);
     interpreter->addOperand(op2);
+    if (isString) {
+        interpreter->addOperand(Interpreter::lengthPrefixed(child0));
+        interpreter->addOperand(Interpreter::lengthPrefixed(child1));
+    }
 
     // NOTE: one of the operand can be a function. If it's the case for
     // strings, since functions are not immediately executed (they have
@@ -656,6 +2061,8 @@ int ExprBinaryOpNode::buildInterpreter(Interpreter* interpreter) const {
 }
 
 int ExprUnaryOpNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     const ExprNode* child0 = child(0);
     int dimout = type().dim();
     int op0 = child0->buildInterpreter(interpreter);
@@ -682,6 +2089,8 @@ int ExprUnaryOpNode::buildInterpreter(Interpreter* interpreter) const {
 }
 
 int ExprSubscriptNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     const ExprNode* child0 = child(0), *child1 = child(1);
     int dimin = child0->type().dim();
     int op0 = child0->buildInterpreter(interpreter);
@@ -705,6 +2114,8 @@ int ExprVarNode::buildInterpreter(Interpreter* interpreter) const {
         else
             throw std::runtime_error("Unallocated variable encountered.");
     } else if (const ExprVarRef* var = _var) {
+        Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
         ExprType type = var->type();
         int destLoc = -1;
         if (type.isFP()) {
@@ -714,14 +2125,27 @@ int ExprVarNode::buildInterpreter(Interpreter* interpreter) const {
             destLoc = interpreter->allocPtr();
         if (const auto* blockVarRef = dynamic_cast<const VarBlockCreator::Ref*>(var)) {
             // TODO: handle strings
-            if (blockVarRef->type().isLifetimeUniform())
-                interpreter->addOp(getTemplatizedOp2<1, EvalVarBlockIndirect>(type.dim()));
+            bool uniform = blockVarRef->type().isLifetimeUniform();
+            if (blockVarRef->precision() == VarBlockCreator::Precision::Float)
+                interpreter->addOp(uniform ? getTemplatizedOp2<1, EvalFloatVarBlockIndirect>(type.dim())
+                                           : getTemplatizedOp2<0, EvalFloatVarBlockIndirect>(type.dim()));
             else
-                interpreter->addOp(getTemplatizedOp2<0, EvalVarBlockIndirect>(type.dim()));
+                interpreter->addOp(uniform ? getTemplatizedOp2<1, EvalVarBlockIndirect>(type.dim())
+                                           : getTemplatizedOp2<0, EvalVarBlockIndirect>(type.dim()));
             interpreter->addOperand(blockVarRef->offset());
             interpreter->addOperand(destLoc);
             interpreter->addOperand(blockVarRef->stride());
             interpreter->endOp();
+        } else if (dynamic_cast<const ExprPointerVarRef*>(var) && type.dim() <= 16) {
+            // copied directly (getTemplatizedOp has ops for up to 16 components)
+            const auto* pointerVarRef = static_cast<const ExprPointerVarRef*>(var);
+            int dataLoc = interpreter->allocPtr();
+            interpreter->s[dataLoc] = const_cast<char*>(reinterpret_cast<const char*>(pointerVarRef->data()));
+            interpreter->addOp(getTemplatizedOp<EvalPointerVar>(type.dim()));
+            interpreter->addOperand(dataLoc);
+            interpreter->addOperand(destLoc);
+            interpreter->addOperand(pointerVarRef->stride());
+            interpreter->endOp();
         } else {
             int varRefLoc = interpreter->allocPtr();
             interpreter->addOp(EvalVar::f);
@@ -743,6 +2167,9 @@ int ExprLocalVar::buildInterpreter(Interpreter* interpreter) const {
 int ExprAssignNode::buildInterpreter(Interpreter* interpreter) const {
     int loc = _localVar->buildInterpreter(interpreter);
     assert(loc != -1 && "Invalid type found");
+    // a uniform value assigned outside of branches only needs to be assigned once
+    Interpreter::PrologueScope prologue(interpreter, child(0));
+    if (prologue.active()) interpreter->prologueVars.insert(_localVar);
 
     ExprType child0Type = child(0)->type();
     int op0 = child(0)->buildInterpreter(interpreter);
@@ -797,12 +2224,28 @@ int ExprIfThenElseNode::buildInterpreter(Interpreter* interpreter) const {
         }
     }
 
+    if (interpreter->foldable(child(0))) {
+        // only the side that is taken is needed
+        bool condition = interpreter->d[condop] != 0;
+        (condition ? child(1) : child(2))->buildInterpreter(interpreter);
+        for (auto& it : merges) {
+            ExprLocalVarPhi* finalVar = it.second;
+            if (finalVar->valid()) {
+                copyVarToPromotedPosition(
+                    interpreter, condition ? finalVar->_thenVar : finalVar->_elseVar, finalVar);
+            }
+        }
+        return -1;
+    }
+
     // Setup the conditional jump
     interpreter->addOp(CondJmpRelativeIfFalse::f);
     interpreter->addOperand(condop);
     int destFalse = interpreter->addOperand(0);
+    int destBranchEnd = interpreter->addOperand(0);
     interpreter->endOp();
 
+    Interpreter::BranchScope branch(interpreter);
     // Then block (build interpreter and copy variables out then jump to end)
     child(1)->buildInterpreter(interpreter);
     for (auto& it : merges) {
@@ -828,11 +2271,14 @@ int ExprIfThenElseNode::buildInterpreter(Interpreter* interpreter) const {
     // Patch the jump addresses in the conditional
     interpreter->opData[destFalse] = child2PC - basePC;
     interpreter->opData[destEnd] = interpreter->nextPC() - (child2PC - 1);
+    interpreter->opData[destBranchEnd] = interpreter->nextPC() - basePC;
 
     return -1;
 }
 
 int ExprCompareNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     const ExprNode* child0 = child(0), *child1 = child(1);
     assert(type().dim() == 1 && type().isFP());
 
@@ -848,8 +2294,10 @@ int ExprCompareNode::buildInterpreter(Interpreter* interpreter) const {
         interpreter->addOp(_op == '&' ? CondJmpRelativeIfFalse::f : CondJmpRelativeIfTrue::f);
         interpreter->addOperand(op0);
         int destFalse = interpreter->addOperand(0);
+        int destBranchEnd = interpreter->addOperand(0);
         interpreter->endOp();
         // this is the no-branch case (op1=true for & and op0=false for |), so eval op1
+        Interpreter::BranchScope branch(interpreter);
         int op1 = child1->buildInterpreter(interpreter);
         // combine with &
         interpreter->addOp(_op == '&' ? getTemplatizedOp2<'&', BinaryOp>(1) : getTemplatizedOp2<'|', BinaryOp>(1));
@@ -871,6 +2319,7 @@ int ExprCompareNode::buildInterpreter(Interpreter* interpreter) const {
         // fix PC relative jump addressses
         interpreter->opData[destFalse] = falseConditionPC - basePC;
         interpreter->opData[destEnd] = interpreter->nextPC() - (falseConditionPC - 1);
+        interpreter->opData[destBranchEnd] = interpreter->nextPC() - basePC;
 
         return op2;
 
@@ -913,11 +2362,9 @@ int ExprPrototypeNode::buildInterpreter(Interpreter* interpreter) const {
     for (int c = 0; c < numChildren(); c++) {
         if (const ExprVarNode* childVarNode = dynamic_cast<const ExprVarNode*>(child(c))) {
             ExprType childType = childVarNode->type();
-            if (childType.isFP()) {
-                int operand = interpreter->allocFP(childType.dim());
-                _interpreterOps.push_back(operand);
-                interpreter->varToLoc[childVarNode->localVar()] = operand;
-            }
+            int operand = childType.isFP() ? interpreter->allocFP(childType.dim()) : interpreter->allocPtr();
+            _interpreterOps.push_back(operand);
+            interpreter->varToLoc[childVarNode->localVar()] = operand;
         } else {
             assert(false);
         }
@@ -929,6 +2376,8 @@ int ExprPrototypeNode::buildInterpreter(Interpreter* interpreter) const {
 }
 
 int ExprCompareEqNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     const ExprNode* child0 = child(0), *child1 = child(1);
     int op0 = child0->buildInterpreter(interpreter);
     int op1 = child1->buildInterpreter(interpreter);
@@ -973,23 +2422,47 @@ int ExprCompareEqNode::buildInterpreter(Interpreter* interpreter) const {
     interpreter->addOperand(op0);
     interpreter->addOperand(op1);
     interpreter->addOperand(op2);
+    if (child0->type().isString()) {
+        interpreter->addOperand(Interpreter::lengthPrefixed(child0));
+        interpreter->addOperand(Interpreter::lengthPrefixed(child1));
+    }
     interpreter->endOp(child0->type().isString() == false);
     return op2;
 }
 
 int ExprCondNode::buildInterpreter(Interpreter* interpreter) const {
+    Interpreter::PrologueScope prologue(interpreter, this);
+    Interpreter::FoldScope fold(interpreter, this);
     int opOut = -1;
     // TODO: handle strings!
     int dimout = type().dim();
 
     // conditional
     int condOp = child(0)->buildInterpreter(interpreter);
+    if (interpreter->foldable(child(0))) {
+        // only the side that is taken is needed
+        int opTaken = (interpreter->d[condOp] ? child(1) : child(2))->buildInterpreter(interpreter);
+        if (type().isFP()) {
+            opOut = interpreter->allocFP(dimout);
+            interpreter->addOp(getTemplatizedOp<AssignOp>(dimout));
+        } else if (type().isString()) {
+            opOut = interpreter->allocPtr();
+            interpreter->addOp(AssignStrOp::f);
+        } else
+            assert(false);
+        interpreter->addOperand(opTaken);
+        interpreter->addOperand(opOut);
+        interpreter->endOp(type().isFP());
+        return opOut;
+    }
     int basePC = (interpreter->nextPC());
     interpreter->addOp(CondJmpRelativeIfFalse::f);
     interpreter->addOperand(condOp);
     int destFalse = interpreter->addOperand(0);
+    int destBranchEnd = interpreter->addOperand(0);
     interpreter->endOp();
 
+    Interpreter::BranchScope branch(interpreter);
     // true way of working
     int op1 = child(1)->buildInterpreter(interpreter);
     if (type().isFP())
@@ -1025,6 +2498,7 @@ int ExprCondNode::buildInterpreter(Interpreter* interpreter) const {
     // patch up relative jumps
     interpreter->opData[destFalse] = child2PC - basePC;
     interpreter->opData[destEnd] = interpreter->nextPC() - (child2PC - 1);
+    interpreter->opData[destBranchEnd] = interpreter->nextPC() - basePC;
 
     // allocate output
     if (type().isFP())
@@ -1049,10 +2523,20 @@ int ExprBlockNode::buildInterpreter(Interpreter* interpreter) const {
 
 int ExprModuleNode::buildInterpreter(Interpreter* interpreter) const {
     int lastIdx = 0;
+    // local functions that are called use absolute return addresses, they do not mix with a prologue or with ops
+    // being dropped
+    for (int c = 0; c < numChildren() - 1; c++) {
+        const ExprLocalFunctionNode* function = dynamic_cast<const ExprLocalFunctionNode*>(child(c));
+        if (function && !function->inlined()) {
+            interpreter->setHoisting(false);
+            interpreter->setFolding(false);
+        }
+    }
     for (int c = 0; c < numChildren(); c++) {
         if (c == numChildren() - 1) interpreter->setPCStart(interpreter->nextPC());
         lastIdx = child(c)->buildInterpreter(interpreter);
     }
+    interpreter->endPrologue();
     return lastIdx;
 }
 }
@@ -18,21 +18,39 @@
 #define _Interpreter_h_
 
 #include <vector>
+#include <iosfwd>
 #include <stack>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <cstring>
 
 namespace SeExpr2 {
 class ExprLocalVar;
+class ExprNode;
+class VarBlock;
 
-//! Promotes a FP[1] to FP[d]
-template <int d>
-struct Promote {
-    // TODO: this needs a name that is prefixed by Se!
-    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
-        int posIn = opData[0];
-        int posOut = opData[1];
-        for (int k = posOut; k < posOut + d; k++) fp[k] = fp[posIn];
-        return 1;
-    }
+/// Storage of a string computed by the interpreter, see Interpreter::allocStringBuffer
+typedef std::vector<char> StringBuffer;
+
+/// Per thread working data of an Interpreter program. It is sized from the program once
+/// and can then be reused by any number of evaluations from the same thread.
+struct EvalState {
+    /// Working copy of the program's double data
+    std::vector<double> d;
+    /// Working copy of the program's pointer data
+    std::vector<char*> s;
+    std::vector<int> callStack;
+    /// Buffers of the program's string ops, s points to these instead of the program's own
+    std::deque<StringBuffer> strings;
+    /// Batch frame used by Interpreter::evalBatch
+    std::vector<double> batchD;
+    std::vector<char*> batchS;
+    /// Result storage for evaluation through the LLVM evaluator
+    std::vector<double> nativeD;
+    std::vector<char*> nativeS;
 };
 
 /// Non-LLVM manual interpreter. This is a simple computation machine. There are no dynamic activation records
@@ -49,21 +67,173 @@ class Interpreter {
     /// Not needed for eval only building
     typedef std::map<const ExprLocalVar*, int> VarToLoc;
     VarToLoc varToLoc;
+    /// Local variables whose assignment was hoisted into the prologue
+    std::set<const ExprLocalVar*> prologueVars;
 
     /// Op function pointer arguments are (int* currOpData,double* currD,char** c,std::stack<int>& callStackurrS)
     typedef int (*OpF)(int*, double*, char**, std::vector<int>&);
 
+    /// Number of points evaluated together by evalBatch
+    static const int batchSize = 32;
+
+    /// Per batch information handed to batch ops
+    struct Batch {
+        /// A conditional branch entered by some lanes of the batch
+        struct Branch {
+            /// pc where the branch ends and parentMask becomes current again
+            int endPC;
+            /// Whether any lane takes the else side
+            bool elseTaken;
+            const char* parentMask;
+            char thenMask[batchSize];
+            char elseMask[batchSize];
+        };
+
+        /// Number of valid lanes in the batch (at most batchSize)
+        int lanes;
+        /// pc of the op being run
+        int pc;
+        /// Lanes that are active in the current branch (nullptr if all of them are)
+        const char* mask;
+        /// Branches entered and not left yet, innermost last (a deque keeps the masks in place)
+        std::deque<Branch> branches;
+
+        bool active(int l) const { return !mask || mask[l]; }
+    };
+
+    /// Batch op function pointer arguments are (int* currOpData,double* currD,char** c,Batch& batch)
+    /// currD holds batchSize lanes per slot, i.e. lane l of slot k is at currD[k*batchSize+l]
+    typedef int (*BatchOpF)(int*, double*, char**, Batch&);
+
+    /// Return the lanes of slot k in a batch frame
+    static double* batchSlot(double* fp, int k) { return fp + k * batchSize; }
+
+    /// Slot operand of an op: the op reads or writes width consecutive slots starting at the slot in opData[index]
+    struct Operand {
+        enum Kind { FPRead, FPWrite, PtrRead, PtrWrite };
+        /// What a pointer slot operand points to (checked by read)
+        enum Target {
+            String,
+            /// String from intern or concatenate, whose length is stored before it
+            PrefixedString,
+            /// Buffer from allocStringBuffer
+            StringBuffer,
+            VarRef,
+            /// Values of an ExprPointerVarRef
+            VarValues,
+            /// Function of an ExprFuncStandard
+            StandardFunc,
+            SimpleFunc,
+            /// ExprFuncNode::Data of an ExprFuncSimple call, which may be null
+            FuncData
+        };
+        Kind kind;
+        int index;
+        int width;
+        Target target;
+
+        static Operand fpRead(int index, int width = 1) { return Operand{FPRead, index, width, String}; }
+        static Operand fpWrite(int index, int width = 1) { return Operand{FPWrite, index, width, String}; }
+        static Operand ptrRead(int index, Target target = String) { return Operand{PtrRead, index, 1, target}; }
+        static Operand ptrWrite(int index, Target target = String) { return Operand{PtrWrite, index, 1, target}; }
+    };
+
+    /// Operand description function arguments are (const Interpreter& program,int* currOpData,int numOperands,
+    /// std::vector<Operand>& operands), it appends the slot operands of the op in the order the op accesses them
+    /// (other operands are literals) and returns false if they cannot be described
+    typedef bool (*OperandsF)(const Interpreter&, const int*, int, std::vector<Operand>&);
+
+    /// Information about an op that is shared by every program using it
+    struct OpInfo {
+        std::string name;
+        BatchOpF batch;
+        /// nullptr if the op does not describe its operands
+        OperandsF operands;
+    };
+
+    /// Register the batch version (and a readable name and operand description) of an op, used by addOp(OpF)
+    static void registerOp(OpF op, const std::string& name, BatchOpF batch, OperandsF operands = nullptr);
+    /// Return the registered information of an op or nullptr
+    static const OpInfo* opInfo(OpF op);
+    /// Register a superinstruction running first and then second, used by fuseOps. Its operands are the
+    /// offset of second's operands followed by the operands of both ops.
+    static void registerFusion(OpF first,
+                               OpF second,
+                               OpF fused,
+                               BatchOpF fusedBatch,
+                               OperandsF fusedOperands,
+                               const std::string& name);
+    /// Number of fusions applied by fuseOps over all programs
+    static size_t fusionsApplied();
+
     std::vector<std::pair<OpF, int> > ops;
+    /// Batch version of every op (nullptr if the op can only be run a point at a time)
+    std::vector<BatchOpF> batchOps;
     std::vector<int> callStack;
 
+    /// Header of an instruction in the flat instruction stream, its operands follow it in the stream
+    struct Instruction {
+        OpF op;
+        BatchOpF batch;
+        /// Number of ints from this instruction to the next one
+        int length;
+
+        int* operands() const { return const_cast<int*>(reinterpret_cast<const int*>(this + 1)); }
+        const Instruction* next() const {
+            return reinterpret_cast<const Instruction*>(reinterpret_cast<const int*>(this) + length);
+        }
+    };
+
   private:
     bool _startedOp;
     int _pcStart;
+    /// Flat instruction stream built by finalize(), ops with their operands inline
+    std::vector<int> _code;
+    /// Offset in _code of the instruction for every pc (plus one past the last one)
+    std::vector<int> _codeOffsets;
+    /// Number of ops without a batch version
+    int _unbatchedOps;
+    /// Number of fusions applied by fuseOps
+    int _numFusions;
+    /// First slot of every allocFP and allocPtr block
+    std::vector<int> _fpBlocks, _ptrBlocks;
+    /// Number of fp and pointer slots before allocateSlots (0 if it was not run)
+    int _fpSlotsBefore, _ptrSlotsBefore;
+    /// Whether constant nodes are folded while building
+    bool _folding;
+    /// Number of enclosing nodes being folded
+    int _foldDepth;
+    /// Whether uniform code is hoisted into the prologue while building
+    bool _hoisting;
+    /// Number of enclosing conditionally run parts of the program being built
+    int _branchDepth;
+    /// Prologue ops while the body is being built (and the body ops while the prologue is)
+    std::vector<std::pair<OpF, int> > _otherOps;
+    std::vector<int> _otherOpData;
+    std::vector<BatchOpF> _otherBatchOps;
+    bool _inPrologue;
+    /// pc of the first body op, ops before it form the prologue that is run once per evalBatch call
+    int _bodyStart;
+    /// fp slots written by the prologue, so that evalBatch can run it on one lane and copy them to the others
+    /// (empty if some prologue op does not describe its operands, the prologue then runs on every lane)
+    std::vector<int> _prologueWrites;
+    /// Batch frame used when evaluating batches without a thread safe VarBlock
+    std::vector<double> _batchD;
+    std::vector<char*> _batchS;
+    /// Strings returned by intern, keyed by their contents
+    std::unordered_map<std::string, StringBuffer> _strings;
+    /// Buffers returned by allocStringBuffer (a deque keeps them in place as more are added)
+    std::deque<StringBuffer> _stringBuffers;
+    /// What every pointer slot loaded by read holds (-1 for nothing), empty for built programs
+    std::vector<int> _slotTargets;
 
   public:
-    Interpreter() : _startedOp(false) {
+    Interpreter()
+        : _startedOp(false), _pcStart(0), _unbatchedOps(0), _numFusions(0), _fpSlotsBefore(0), _ptrSlotsBefore(0),
+          _folding(false), _foldDepth(0), _hoisting(false), _branchDepth(0), _inPrologue(false), _bodyStart(0) {
         s.push_back(nullptr);  // reserved for double** of variable block
         s.push_back(nullptr);  // reserved for double** of variable block
+        _ptrBlocks.push_back(0);
     }
 
     /// Return the position that the next instruction will be placed at
@@ -71,12 +241,20 @@ class Interpreter {
 
     ///! adds an operator to the program (pointing to the data at the current location)
     int addOp(OpF op) {
+        const OpInfo* info = opInfo(op);
+        return addOp(op, info ? info->batch : nullptr);
+    }
+
+    ///! adds an operator with an explicit batch version (nullptr if it cannot be batched)
+    int addOp(OpF op, BatchOpF batchOp) {
         if (_startedOp) {
             assert(false && "addOp called within another addOp");
         }
         _startedOp = true;
         int pc = static_cast<int>(ops.size());
         ops.push_back(std::make_pair(op, static_cast<int>(opData.size())));
+        batchOps.push_back(batchOp);
+        if (!batchOp) _unbatchedOps++;
         return pc;
     }
 
@@ -103,6 +281,7 @@ class Interpreter {
     ///! Allocate a floating point set of data of dimension n
     int allocFP(int n) {
         int ret = static_cast<int>(d.size());
+        if (n > 0) _fpBlocks.push_back(ret);
         for (int k = 0; k < n; k++) d.push_back(0);
         return ret;
     }
@@ -110,16 +289,198 @@ class Interpreter {
     /// Allocate a pointer location (can be anything, but typically space for char*)
     int allocPtr() {
         int ret = static_cast<int>(s.size());
+        _ptrBlocks.push_back(ret);
         s.push_back(0);
         return ret;
     }
 
+    /// Return a copy of str owned by the program and stored after its length (see stringLength). Equal strings
+    /// share their copy, so strings returned by intern can be compared by address.
+    const char* intern(const std::string& str);
+    /// Allocate a pointer location holding a buffer owned by the program, for string ops that compute a new string
+    /// every evaluation (the buffer only grows, so it stops allocating once the longest result was seen)
+    int allocStringBuffer();
+    /// Store str1 followed by str2 in buffer after their length and return the result
+    static const char* concatenate(StringBuffer& buffer, const char* str1, size_t len1, const char* str2, size_t len2);
+    /// Length of a string returned by intern or concatenate, without looking for its end
+    static size_t stringLength(const char* str) {
+        size_t length;
+        memcpy(&length, str - sizeof(size_t), sizeof(size_t));
+        return length;
+    }
+    /// Whether the string computed by node is known to come from intern or concatenate
+    static bool lengthPrefixed(const ExprNode* node);
+
     /// Evaluate program
     void eval(VarBlock* varBlock, bool debug = false);
+    /// Evaluate program for the points [rangeStart,rangeEnd) of varBlock, batchSize points at a time,
+    /// writing the resultDim values of resultSlot for point i to dest[resultDim*i+k] (T is double or float)
+    template <class T>
+    void evalBatch(VarBlock* varBlock, size_t rangeStart, size_t rangeEnd, int resultSlot, int resultDim, T* dest);
+
+    /// Size state to evaluate this program (only needed once per thread)
+    void initState(EvalState& state) const;
+    /// Evaluate program working on state instead of the program's data, results are left in state.d and state.s
+    void eval(EvalState& state, VarBlock* varBlock) const;
+    /// Batch evaluation working on state instead of the program's data
+    template <class T>
+    void evalBatch(EvalState& state,
+                   VarBlock* varBlock,
+                   size_t rangeStart,
+                   size_t rangeEnd,
+                   int resultSlot,
+                   int resultDim,
+                   T* dest) const;
     /// Debug by printing program
     void print(int pc = -1) const;
 
-    void setPCStart(int pcStart) { _pcStart = pcStart; }
+    void setPCStart(int pcStart) {
+        _pcStart = pcStart;
+        _bodyStart = pcStart;
+    }
+
+    /// Enable folding of constant nodes during the build (off by default). The program must not contain procedures.
+    void setFolding(bool folding) { _folding = folding; }
+    /// Whether the value of a node is known once it is built (ops are run as they are added), in which case its
+    /// ops can be dropped. Strings are only folded for literals and their concatenation.
+    bool foldable(const ExprNode* node) const;
+    /// Drop the ops of the enclosing node once it is built if it is foldable, keeping the value they computed
+    class FoldScope {
+      public:
+        FoldScope(Interpreter* interpreter, const ExprNode* node);
+        ~FoldScope();
+
+      private:
+        Interpreter* _interpreter;
+        bool _active;
+        int _pc;
+        int _dataSize;
+    };
+    /// Enable hoisting of uniform code into the prologue during the build (off by default). The program must
+    /// not contain procedures.
+    void setHoisting(bool hoisting) { _hoisting = hoisting; }
+    /// Whether a node may be built into the prologue: it does not vary per point, it is not conditionally run
+    /// and it only reads local variables that were themselves hoisted
+    bool hoistable(const ExprNode* node) const;
+    /// Add the ops of the enclosing node to the prologue if it is hoistable (and not already in the prologue)
+    class PrologueScope {
+      public:
+        PrologueScope(Interpreter* interpreter, const ExprNode* node);
+        ~PrologueScope();
+        /// Whether this scope moved the node into the prologue
+        bool active() const { return _active; }
+
+      private:
+        Interpreter* _interpreter;
+        bool _active;
+    };
+    /// Mark the enclosing part of the program as conditionally run, nothing in it is hoisted
+    class BranchScope {
+      public:
+        BranchScope(Interpreter* interpreter) : _interpreter(interpreter) { _interpreter->_branchDepth++; }
+        ~BranchScope() { _interpreter->_branchDepth--; }
+
+      private:
+        Interpreter* _interpreter;
+    };
+    /// Put the prologue in front of the body, must be called once the program is built
+    void endPrologue();
+    /// pc of the first op run for every point (after the prologue)
+    int bodyStart() const { return _bodyStart; }
+
+    /// Replace the registered sequences of ops by their superinstruction, returns the number of fusions applied.
+    /// Must be called on the complete program, before finalize()
+    int fuseOps();
+    /// Let temporaries whose live ranges do not overlap share slots, shrinking d and s. resultSlot (an fp slot if
+    /// resultIsFP, a pointer slot otherwise) is kept alive after the program and updated. Must be called on the
+    /// complete program, before finalize(). Returns false and leaves the program alone if some op does not
+    /// describe its operands.
+    bool allocateSlots(int& resultSlot, bool resultIsFP);
+    /// Build the flat instruction stream that is run by eval and evalBatch, must be called once the program
+    /// is complete (the non const eval functions call it if ops were added since)
+    void finalize();
+    /// Whether the instruction stream is up to date with ops
+    bool isFinalized() const { return _codeOffsets.size() == ops.size() + 1; }
+    /// Debug by printing the instruction stream
+    void printCode(int pc = -1) const;
+
+    /// Version of the data written by write, to be bumped whenever ops or their operands change
+    static const int programVersion = 2;
+    /// Pointers that the program may hold on behalf of the host (variable references, functions) and the
+    /// index they are saved as
+    typedef std::map<const void*, int> PtrBindings;
+    /// Save the complete program to out. Ops are saved by their registered name, strings by their contents and
+    /// other pointer data must be listed in bindings. Returns false if the program cannot be saved that way.
+    bool write(std::ostream& out, const PtrBindings& bindings) const;
+    /// Pointer bound by read and what it points to
+    typedef std::pair<void*, Operand::Target> ReadBinding;
+    /// Replace this program by one saved by write, bindings[i] being the pointer saved as index i, and finalize
+    /// it. Returns false if the data does not hold a valid program (the program must then be discarded): every
+    /// operand must stay within the program and every pointer slot must hold what the ops use it as.
+    bool read(std::istream& in, const std::vector<ReadBinding>& bindings);
+    /// Whether pointer slot may be used as target: always in built programs, read checks the ones it loads
+    bool holds(int slot, Operand::Target target) const {
+        if (_slotTargets.empty()) return true;
+        return slot >= 0 && slot < static_cast<int>(_slotTargets.size()) && _slotTargets[slot] == target;
+    }
+
+  private:
+    const Instruction* instruction(int pc) const {
+        return reinterpret_cast<const Instruction*>(_code.data() + _codeOffsets[pc]);
+    }
+    /// Swap the ops being built between the body and the prologue
+    void swapPrologue();
+    /// Whether every jump lands within the program the way branches are built (checked by read)
+    bool validJumps() const;
+    /// Run the ops [beginPC,endPC) of the program on the given working data
+    void run(double* fp, char** str, std::vector<int>& callStack, bool debug, int beginPC, int endPC) const;
+    /// Run the ops [beginPC,endPC) of the program on a batch
+    void runBatchOps(double* fp, char** str, Batch& batch, int beginPC, int endPC) const;
+    /// Run the program on batches of points using the given batch frame (filled from the program's data and strData
+    /// if fillFrame)
+    template <class T>
+    void runBatch(std::vector<double>& frame,
+                  std::vector<char*>& strFrame,
+                  const std::vector<char*>& strData,
+                  bool fillFrame,
+                  VarBlock* varBlock,
+                  size_t rangeStart,
+                  size_t rangeEnd,
+                  int resultSlot,
+                  int resultDim,
+                  T* dest) const;
+};
+
+//! Promotes a FP[1] to FP[d]
+template <int d>
+struct Promote {
+    // TODO: this needs a name that is prefixed by Se!
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        int posIn = opData[0];
+        int posOut = opData[1];
+        for (int k = posOut; k < posOut + d; k++) fp[k] = fp[posIn];
+        return 1;
+    }
+
+    static bool operands(const Interpreter&, const int*, int, std::vector<Interpreter::Operand>& operands) {
+        operands.push_back(Interpreter::Operand::fpRead(0));
+        operands.push_back(Interpreter::Operand::fpWrite(1, d));
+        return true;
+    }
+
+    static int batch(int* opData, double* fp, char** c, Interpreter::Batch& batch) {
+        const double* in = Interpreter::batchSlot(fp, opData[0]);
+        for (int k = 0; k < d; k++) {
+            double* out = Interpreter::batchSlot(fp, opData[1] + k);
+            if (batch.mask) {
+                for (int l = 0; l < batch.lanes; l++)
+                    if (batch.mask[l]) out[l] = in[l];
+            } else {
+                for (int l = 0; l < batch.lanes; l++) out[l] = in[l];
+            }
+        }
+        return 1;
+    }
 };
 
 //! Return the function f encapsulated in class T for the dynamic i converted to a static d.
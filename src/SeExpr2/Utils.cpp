@@ -17,6 +17,9 @@
 
 #include "Utils.h"
 
+#include <istream>
+#include <ostream>
+
 #if defined(SeExpr2_HAVE_CHARCONV_WITH_DOUBLES)
 #include <charconv>
 
@@ -165,6 +168,80 @@ int32_t SeExpr2::Utils::strtol(const std::string &num)
 
 #endif // defined(HAVE_CHARCONV_WITH_DOUBLES)
 
+namespace
+{
+template<class T>
+void writeValues(std::ostream &out, const T *values, int32_t count)
+{
+    SeExpr2::Utils::writeBinary(out, count);
+    out.write(reinterpret_cast<const char *>(values), count * sizeof(T));
+}
+
+template<class T>
+bool readValues(std::istream &in, std::vector<T> &values)
+{
+    int32_t count {0};
+    if (!SeExpr2::Utils::readBinary(in, count) || count < 0)
+        return false;
+    values.resize(count);
+    return count == 0 || static_cast<bool>(in.read(reinterpret_cast<char *>(values.data()), count * sizeof(T)));
+}
+}
+
+void SeExpr2::Utils::writeBinary(std::ostream &out, int32_t value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void SeExpr2::Utils::writeBinary(std::ostream &out, double value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void SeExpr2::Utils::writeBinary(std::ostream &out, const std::string &value)
+{
+    writeValues(out, value.data(), static_cast<int32_t>(value.size()));
+}
+
+void SeExpr2::Utils::writeBinary(std::ostream &out, const std::vector<int32_t> &values)
+{
+    writeValues(out, values.data(), static_cast<int32_t>(values.size()));
+}
+
+void SeExpr2::Utils::writeBinary(std::ostream &out, const std::vector<double> &values)
+{
+    writeValues(out, values.data(), static_cast<int32_t>(values.size()));
+}
+
+bool SeExpr2::Utils::readBinary(std::istream &in, int32_t &value)
+{
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+bool SeExpr2::Utils::readBinary(std::istream &in, double &value)
+{
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+bool SeExpr2::Utils::readBinary(std::istream &in, std::string &value)
+{
+    std::vector<char> chars;
+    if (!readValues(in, chars))
+        return false;
+    value.assign(chars.begin(), chars.end());
+    return true;
+}
+
+bool SeExpr2::Utils::readBinary(std::istream &in, std::vector<int32_t> &values)
+{
+    return readValues(in, values);
+}
+
+bool SeExpr2::Utils::readBinary(std::istream &in, std::vector<double> &values)
+{
+    return readValues(in, values);
+}
+
 // Dynamically dispatchable functions.
 // These have to be in a namespace, otherwise GCC chokes.
 // See https://stackoverflow.com/questions/19785010/gcc-function-multiversioning-and-namespaces
@@ -18,8 +18,10 @@
 #include <cfloat>
 #include <cmath>
 #include <cstdint>
+#include <iosfwd>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "ExprConfig.h"
 
@@ -45,5 +47,18 @@ namespace SeExpr2 {
         SeExpr2_SSE41 double_t round(double_t val);
         SeExpr2_SSE41 double_t floor(double_t val);
 #endif
+
+        // Native endian binary I/O used to save prepared programs, the read
+        // functions return false if the stream fails or holds a negative size.
+        void writeBinary(std::ostream &out, int32_t value);
+        void writeBinary(std::ostream &out, double value);
+        void writeBinary(std::ostream &out, const std::string &value);
+        void writeBinary(std::ostream &out, const std::vector<int32_t> &values);
+        void writeBinary(std::ostream &out, const std::vector<double> &values);
+        bool readBinary(std::istream &in, int32_t &value);
+        bool readBinary(std::istream &in, double &value);
+        bool readBinary(std::istream &in, std::string &value);
+        bool readBinary(std::istream &in, std::vector<int32_t> &values);
+        bool readBinary(std::istream &in, std::vector<double> &values);
     } //namespace Utils
 }  // namespace SeExpr2
@@ -55,6 +55,8 @@ class VarBlock {
 
     /// Get a reference to the data block pointer which can be modified
     double*& Pointer(uint32_t variableOffset) { return reinterpret_cast<double*&>(_dataPtrs[variableOffset]); }
+    /// Same for variables registered with VarBlockCreator::Precision::Float
+    float*& FloatPointer(uint32_t variableOffset) { return reinterpret_cast<float*&>(_dataPtrs[variableOffset]); }
     char**& CharPointer(uint32_t variableOffset) { return reinterpret_cast<char**&>(_dataPtrs[variableOffset]); }
 
     /// indirect index to add to pointer based data
@@ -62,6 +64,7 @@ class VarBlock {
     int indirectIndex;
 
     /// if true, interpreter's data will be copied to this instance before evaluation.
+    /// (evaluating through Expression::createEvaluator avoids this copy)
     bool threadSafe;
 
     /// copy of Interpreter's double data
@@ -83,32 +86,47 @@ class VarBlock {
 // a VarBlock which allows registering actual variable data
 class VarBlockCreator {
   public:
+    /// How the values of an FP variable are stored in the data block. Expressions still compute in double,
+    /// float variables are converted when they are read and when results are stored to them.
+    enum class Precision { Double, Float };
+
     /// Internally implemented var ref used by SeExpr
     class Ref : public ExprVarRef {
         uint32_t _offset;
         uint32_t _stride;
+        Precision _precision;
 
       public:
         uint32_t offset() const { return _offset; }
         uint32_t stride() const { return _stride; }
-        Ref(const ExprType& type, uint32_t offset, uint32_t stride)
-            : ExprVarRef(type), _offset(offset), _stride(stride) {}
+        Precision precision() const { return _precision; }
+        Ref(const ExprType& type, uint32_t offset, uint32_t stride, Precision precision = Precision::Double)
+            : ExprVarRef(type), _offset(offset), _stride(stride), _precision(precision) {}
         void eval(double*) override { assert(false); }
         void eval(const char**) override { assert(false); }
     };
 
     /// Register a variable and return a handle
-    int registerVariable(const std::string& name, const ExprType type) {
+    int registerVariable(const std::string& name, const ExprType type, Precision precision = Precision::Double) {
         if (_vars.find(name) != _vars.end()) {
             throw std::runtime_error("Already registered a variable named " + name);
         } else {
             int offset = _nextOffset;
             _nextOffset += 1;
-            _vars.insert(std::make_pair(name, Ref(type, offset, type.dim())));
+            _vars.insert(std::make_pair(name, Ref(type, offset, type.dim(), precision)));
+            _precisions.push_back(precision);
             return offset;
         }
     }
 
+    /// Number of variables registered so far (their offsets are [0,numVariables()))
+    int numVariables() const { return _nextOffset; }
+
+    /// Precision of the variable registered at offset
+    Precision precision(int offset) const {
+        return offset >= 0 && offset < _nextOffset ? _precisions[offset] : Precision::Double;
+    }
+
     /// Get an evaluation handle (one needed per thread)
     /// \param makeThreadSafe
     ///     If true, right before evaluating the expression, all data used
@@ -132,6 +150,7 @@ class VarBlockCreator {
   private:
     int _nextOffset = 0;
     std::map<std::string, Ref> _vars;
+    std::vector<Precision> _precisions;
 };
 
 }  // namespace
@@ -0,0 +1,30 @@
+# Copyright Disney Enterprises, Inc.  All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License
+# and the following modification to it: Section 6 Trademarks.
+# deleted and replaced with:
+#
+# 6. Trademarks. This License does not grant permission to use the
+# trade names, trademarks, service marks, or product names of the
+# Licensor and its affiliates, except as required for reproducing
+# the content of the NOTICE file.
+#
+# You may obtain a copy of the License at
+# http://www.apache.org/licenses/LICENSE-2.0
+
+# Writes the bitcode file INPUT to the C++ source OUTPUT as SeExpr2::builtinsBitcode
+# usage: cmake -DINPUT=<file.bc> -DOUTPUT=<file.cpp> -P embed-bitcode.cmake
+
+file(READ "${INPUT}" bitcode HEX)
+string(LENGTH "${bitcode}" hex_length)
+math(EXPR size "${hex_length} / 2")
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${bitcode}")
+string(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n    " bytes "${bytes}")
+
+file(WRITE "${OUTPUT}" "// Generated by embed-bitcode.cmake from ${INPUT}\n"
+                       "#include \"ExprBuiltinsBitcode.h\"\n\n"
+                       "namespace SeExpr2 {\n"
+                       "alignas(8) const unsigned char builtinsBitcode[] = {\n    ${bytes}\n};\n"
+                       "const size_t builtinsBitcodeSize = ${size};\n"
+                       "}\n")
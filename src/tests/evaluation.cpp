@@ -0,0 +1,1100 @@
+/*
+* Copyright Disney Enterprises, Inc.  All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License
+* and the following modification to it: Section 6 Trademarks.
+* deleted and replaced with:
+*
+* 6. Trademarks. This License does not grant permission to use the
+* trade names, trademarks, service marks, or product names of the
+* Licensor and its affiliates, except as required for reproducing
+* the content of the NOTICE file.
+*
+* You may obtain a copy of the License at
+* http://www.apache.org/licenses/LICENSE-2.0
+*/
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#include <SeExpr2/Expression.h>
+#include <SeExpr2/ExprExecutor.h>
+#include <SeExpr2/ExprFunc.h>
+#include <SeExpr2/ExprKernel.h>
+#include <SeExpr2/Interpreter.h>
+#include <SeExpr2/Utils.h>
+#include <SeExpr2/VarBlock.h>
+
+using namespace SeExpr2;
+
+namespace {
+
+int invocations = 0;
+double countInvocations(double x) {
+    invocations++;
+    return x;
+}
+ExprFunc countInvocationsFunc(countInvocations);
+
+//! Expression reading its variables from a variable block
+struct BlockExpression : public Expression {
+    BlockExpression(const std::string& str,
+                    const VarBlockCreator& creator,
+                    const ExprType& type,
+                    EvaluationStrategy strategy = Expression::UseInterpreter)
+        : Expression(str, type, strategy), _creator(creator) {
+        setVarBlockCreator(&creator);
+    }
+
+    ExprVarRef* resolveVar(const std::string& name) const { return _creator.resolveVar(name); }
+
+    ExprFunc* resolveFunc(const std::string& name) const {
+        return name == "countInvocations" ? &countInvocationsFunc : nullptr;
+    }
+
+    const VarBlockCreator& _creator;
+};
+
+//! Executor running the tasks in reverse order on the calling thread, pretending to have two workers
+struct ReverseExecutor : public ExprExecutor {
+    int numWorkers() const override { return 2; }
+    void run(size_t numTasks, const std::function<void(size_t, int)>& task) override {
+        for (size_t i = numTasks; i-- > 0;) task(i, static_cast<int>(i % 2));
+    }
+};
+
+//! Variable block data for a number of points
+struct BlockData {
+    static const int numPoints = 75;
+
+    BlockData()
+        : offP(creator.registerVariable("P", ExprType().FP(3).Varying())),
+          offU(creator.registerVariable("u", ExprType().FP(1).Varying())),
+          offS(creator.registerVariable("s", ExprType().FP(1).Uniform())),
+          offOut(creator.registerVariable("out", ExprType().FP(3).Varying())),
+          offTmp(creator.registerVariable("tmp", ExprType().FP(3).Varying())), P(numPoints * 3), u(numPoints),
+          s(1, 0.5), out(numPoints * 3), tmp(numPoints * 3), block(creator.create()) {
+        for (int i = 0; i < numPoints; i++) {
+            u[i] = (i - 30) * 0.05;
+            P[3 * i] = i * 0.1;
+            P[3 * i + 1] = 2 - u[i];
+            P[3 * i + 2] = i % 7;
+        }
+        block.Pointer(offP) = P.data();
+        block.Pointer(offU) = u.data();
+        block.Pointer(offS) = s.data();
+        block.Pointer(offOut) = out.data();
+        block.Pointer(offTmp) = tmp.data();
+    }
+
+    VarBlockCreator creator;
+    int offP, offU, offS, offOut, offTmp;
+    std::vector<double> P, u, s, out, tmp;
+    VarBlock block;
+};
+
+//! The interpreter and, when it is another one, the default evaluation strategy (LLVM in LLVM builds)
+std::vector<Expression::EvaluationStrategy> testedStrategies() {
+    std::vector<Expression::EvaluationStrategy> strategies(1, Expression::UseInterpreter);
+    if (Expression::defaultEvaluationStrategy != Expression::UseInterpreter)
+        strategies.push_back(Expression::defaultEvaluationStrategy);
+    return strategies;
+}
+
+//! Checks that evaluating all points at once gives the same result as evaluating them one by one with the
+//! interpreter, for each of the tested strategies
+void checkEvalMultiple(const std::string& str, int dim) {
+    for (Expression::EvaluationStrategy strategy : testedStrategies()) {
+        BlockData data;
+        ExprType type = ExprType().FP(dim).Varying();
+        BlockExpression multiple(str, data.creator, type, strategy);
+        ASSERT_TRUE(multiple.isValid()) << str;
+        multiple.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+
+        BlockExpression single(str, data.creator, type);
+        ASSERT_TRUE(single.isValid()) << str;
+        for (int i = 0; i < BlockData::numPoints; i++) {
+            data.block.indirectIndex = i;
+            const double* result = single.evalFP(&data.block);
+            for (int k = 0; k < dim; k++)
+                EXPECT_DOUBLE_EQ(result[k], data.out[dim * i + k]) << str << " point " << i << " strategy " << strategy;
+        }
+    }
+}
+}
+
+TEST(EvaluationTests, EvalMultiple) {
+    checkEvalMultiple("P*u+s", 3);
+    checkEvalMultiple("-P/2^u", 3);
+    checkEvalMultiple("a=u*2;b=[a,s,1]+P;b[1]", 1);
+    checkEvalMultiple("P[u*3]", 1);
+    checkEvalMultiple("[sin(u),cos(u)*s,clamp(u,0,.5)]", 3);
+    checkEvalMultiple("fit(u,-1,1,0,10)+max(u,s)", 1);
+    checkEvalMultiple("length(P)*cross(P,[0,1,0])", 3);
+    checkEvalMultiple("u<s", 1);
+    checkEvalMultiple("P==[0,2,0]", 1);
+    checkEvalMultiple("spline(u,0,1,2,3,4,5)", 1);
+    checkEvalMultiple("ccurve(u,0,[1,0,0],4,1,[0,1,0],4)", 3);
+    checkEvalMultiple("noise(P)+fbm(P*u,2)+dot(P,[u,1,s])+pow(abs(u),s)+smoothstep(u,-1,1)", 1);
+}
+
+TEST(EvaluationTests, LocalFunctions) {
+    // each expression gives the same as the one written without local functions
+    const std::vector<std::pair<std::string, std::string> > cases = {
+        {"def scale(FLOAT[3] v, FLOAT k) { v*k } scale(P,u)+scale(P,2)", "P*u+P*2"},
+        {"def f(FLOAT x) { a=x*2; a+1 } f(u)+f(f(s))", "(u*2+1)+((s*2+1)*2+1)"},
+        {"def g(FLOAT x, FLOAT y) { x-y } g(1,g(u,2))*g(g(u,s),P[0])", "(1-(u-2))*((u-s)-P[0])"},
+        {"def h(FLOAT x) { if(x>0){x=x*2;} x } [h(u),h(-u),h(s)]", "[u>0?u*2:u,-u>0?-u*2:-u,s*2]"},
+        {"def FLOAT[3] c(FLOAT x) { x } def d(FLOAT[3] x) { c(x[1])+x } d(u)", "[u,u,u]*2"},
+        {"def k(FLOAT UNIFORM x) { cos(x*3) } k(s)+u", "cos(s*3)+u"},
+        {"def m(FLOAT CONSTANT x) { x*3 } m(1+2)*u", "9*u"},
+        {"def n(STRING str, FLOAT x) { str==\"a\" ? x : -x } n(\"a\",u)+n(\"b\",s)", "u-s"},
+    };
+    const int threshold = Expression::interpreterInlineThreshold;
+    // inlined at every call site, then called as procedures by the interpreter
+    for (int inlineThreshold : {threshold, 0}) {
+        Expression::interpreterInlineThreshold = inlineThreshold;
+        for (const auto& test : cases)
+            for (Expression::EvaluationStrategy strategy : testedStrategies()) {
+                BlockData data;
+                BlockExpression expr(test.first, data.creator, ExprType().FP(3).Varying(), strategy);
+                BlockExpression reference(test.second, data.creator, ExprType().FP(3).Varying());
+                ASSERT_TRUE(expr.isValid()) << test.first;
+                ASSERT_TRUE(reference.isValid()) << test.second;
+                expr.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+                for (int i = 0; i < BlockData::numPoints; i++) {
+                    data.block.indirectIndex = i;
+                    const double* expected = reference.evalFP(&data.block);
+                    for (int k = 0; k < 3; k++)
+                        EXPECT_DOUBLE_EQ(expected[k], data.out[3 * i + k]) << test.first << " point " << i;
+                }
+            }
+    }
+    Expression::interpreterInlineThreshold = threshold;
+
+    BlockData data;
+    for (const char* str : {"def f(FLOAT x) { f(x) } f(u)", "def f(FLOAT x) { x } f(u,1)", "def f(FLOAT x) { x } f()",
+                            "def f(FLOAT CONSTANT x) { x } f(u)", "def FLOAT f(FLOAT x) { [x,1,2] } f(u)"}) {
+        BlockExpression expr(str, data.creator, ExprType().FP(3).Varying());
+        EXPECT_FALSE(expr.isValid()) << str;
+    }
+}
+
+TEST(EvaluationTests, EvalMultipleBranches) {
+    checkEvalMultiple("u>0 ? P : -P", 3);
+    checkEvalMultiple("u>100 ? P : [u,s,1]", 3);
+    checkEvalMultiple("u>-100 ? P : [u,s,1]", 3);
+    checkEvalMultiple("a=1;if(u<0){a=u*2;b=P;}else{b=P*a;}b*a", 3);
+    checkEvalMultiple("a=P;if(u<0){if(u<-1){a=a*2;}else{a=-a;}}else if(u>0.5){a=[u,u,u];}a", 3);
+    checkEvalMultiple("u>0 && P[2]>2 || u<-1", 1);
+    checkEvalMultiple("u>0 ? (P[0]>3 ? 1 : 2) : (P[2]<1 ? 3 : 4)", 1);
+}
+
+TEST(EvaluationTests, EvalMultipleMaskedCalls) {
+    BlockData data;
+    BlockExpression expr("u>0 ? countInvocations(u) : 0", data.creator, ExprType().FP(1).Varying());
+    ASSERT_TRUE(expr.isValid());
+    invocations = 0;
+    expr.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+    int positive = 0;
+    for (int i = 0; i < BlockData::numPoints; i++) positive += data.u[i] > 0;
+    EXPECT_EQ(invocations, positive);
+}
+
+namespace {
+//! Checks that expressions evaluate the same with and without an interpreter optimization
+void checkOptimization(bool& enabled, const std::vector<std::string>& exprs) {
+    for (const std::string& str : exprs) {
+        BlockData data;
+        ExprType type = ExprType().FP(3).Varying();
+        // expressions are prepared by isValid
+        enabled = false;
+        BlockExpression plain(str, data.creator, type);
+        ASSERT_TRUE(plain.isValid()) << str;
+        enabled = true;
+        BlockExpression optimized(str, data.creator, type);
+        ASSERT_TRUE(optimized.isValid()) << str;
+
+        optimized.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+        for (int i = 0; i < BlockData::numPoints; i++) {
+            data.block.indirectIndex = i;
+            const double* expected = plain.evalFP(&data.block);
+            const double* result = optimized.evalFP(&data.block);
+            for (int k = 0; k < 3; k++) {
+                EXPECT_DOUBLE_EQ(expected[k], result[k]) << str << " point " << i;
+                EXPECT_DOUBLE_EQ(expected[k], data.out[3 * i + k]) << str << " point " << i;
+            }
+        }
+    }
+}
+}
+
+TEST(EvaluationTests, Fusion) {
+    size_t fusionsBefore = Interpreter::fusionsApplied();
+    checkOptimization(Expression::interpreterFusion,
+                      {"P*u+s",
+                       "u>0 ? P*u-P : [u,s,1]*s",
+                       "a=P*s;if(u<0){a=a*u+P;}else{a=a/s;}a*2",
+                       "noise(P*u)[1]+cross(P,[0,1,0])[u*3]"});
+    EXPECT_GT(Interpreter::fusionsApplied(), fusionsBefore);
+}
+
+TEST(EvaluationTests, SlotReuse) {
+    checkOptimization(Expression::interpreterSlotReuse,
+                      {"a=P*u+s;b=a*a-P;c=cross(a,b);c/length(b)+a",
+                       "a=P;if(u<0){b=a*2;a=b+P*s;}else if(u>0.5){a=[u,u,u];}else{b=P*u;a=b-a;}a*(a+1)",
+                       "x=u>0 ? P*u : [s,u,1];y=u<-1 ? x*2 : x/2;x+y",
+                       "a=spline(u,0,1,2,3,4,5);b=ccurve(u,0,[1,0,0],4,1,[0,1,0],4);b*a+fit(u,-1,1,0,a)",
+                       "s=\"abc\"+\"def\";a=s==\"abcdef\" ? P : -P;a*u"});
+}
+
+TEST(EvaluationTests, Hoisting) {
+    checkOptimization(Expression::interpreterHoisting,
+                      {"a=s*2+1;b=[s,s*s,3]*cos(s);P*u*a+b",
+                       "a=s;if(u>0){a=s*3;}b=a*s+1;P*b+sin(s)",
+                       "x=u>0 ? s*2 : s;y=s>0 ? [s,1,2] : P;x*y+(s>0 && s<1)",
+                       "a=spline(s,0,1,2,3,4,5);b=ccurve(s,0,[1,0,0],4,1,[0,1,0],4);b*a+P*fit(u,-1,1,0,a)",
+                       "t=\"abc\"+\"def\";a=t==\"abcdef\" ? P : -P;a*s"});
+
+    // uniform calls are made once per evaluation instead of once per point
+    BlockData data;
+    BlockExpression expr("countInvocations(s)*u", data.creator, ExprType().FP(1).Varying());
+    ASSERT_TRUE(expr.isValid());
+    invocations = 0;
+    expr.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+    EXPECT_EQ(invocations, 1);
+}
+
+TEST(EvaluationTests, Folding) {
+    checkOptimization(Expression::interpreterFolding,
+                      {"a=sin(.3)*2;b=[1,2,3]*a;P*b+(1>2 ? 5 : cos(1))",
+                       "if(1<2){a=[1,0,0];}else{a=P;}b=a*u+a;if(a[0]>0 && 3){b=b*2;}b",
+                       "x=0 ? u : 3;y=(1 ? 2 : 3) ? [4,5,6] : P;P*x+y+(2==2)",
+                       "a=fit(.5,0,1,2,4);b=u>0 ? a : -a;c=a*2;[b,c,clamp(c,0,1)]*P"});
+}
+
+TEST(EvaluationTests, Specialize) {
+    const std::vector<std::string> exprs = {"s>1 ? P*s : -P*u", "if(s<1){a=P;}else{a=[u,s,1];}a*s+length(a)"};
+    for (const std::string& str : exprs) {
+        BlockData data;
+        ExprType type = ExprType().FP(3).Varying();
+        BlockExpression specialized(str, data.creator, type);
+        for (double value : {0.5, 2.}) {
+            specialized.specialize({{"s", {value}}});
+            ASSERT_TRUE(specialized.isValid()) << str;
+            EXPECT_TRUE(specialized.usesVar("s"));
+            specialized.evalMultiple(&data.block, data.offTmp, 0, BlockData::numPoints);
+
+            // the variable block value is ignored by the specialized expression
+            data.s[0] = value;
+            BlockExpression plain(str, data.creator, type);
+            plain.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+            data.s[0] = 0;
+            for (int k = 0; k < BlockData::numPoints * 3; k++) EXPECT_DOUBLE_EQ(data.out[k], data.tmp[k]) << str;
+        }
+
+        // an empty specialization reads the variable again
+        data.s[0] = 2;
+        specialized.specialize({});
+        specialized.evalMultiple(&data.block, data.offTmp, 0, BlockData::numPoints);
+        BlockExpression plain(str, data.creator, type);
+        plain.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+        for (int k = 0; k < BlockData::numPoints * 3; k++) EXPECT_DOUBLE_EQ(data.out[k], data.tmp[k]) << str;
+    }
+}
+
+TEST(EvaluationTests, FloatVariables) {
+    const std::string str = "a=P*u+s;u>0 ? a : cross(a,P)";
+    ExprType type = ExprType().FP(3).Varying();
+    const int numPoints = BlockData::numPoints;
+    BlockData data;
+    VarBlockCreator creator;
+    int offP = creator.registerVariable("P", ExprType().FP(3).Varying(), VarBlockCreator::Precision::Float);
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying(), VarBlockCreator::Precision::Float);
+    int offS = creator.registerVariable("s", ExprType().FP(1).Uniform(), VarBlockCreator::Precision::Float);
+    int offOut = creator.registerVariable("out", type, VarBlockCreator::Precision::Float);
+    std::vector<float> P(data.P.begin(), data.P.end()), u(data.u.begin(), data.u.end()), s(1, 0.3f), out(numPoints * 3);
+    VarBlock block = creator.create();
+    block.FloatPointer(offP) = P.data();
+    block.FloatPointer(offU) = u.data();
+    block.FloatPointer(offS) = s.data();
+    block.FloatPointer(offOut) = out.data();
+    BlockExpression expr(str, creator, type);
+    ASSERT_TRUE(expr.isValid());
+    expr.evalMultiple(&block, offOut, 0, numPoints);
+
+    // the same inputs stored as doubles give the same results
+    std::copy(P.begin(), P.end(), data.P.begin());
+    std::copy(u.begin(), u.end(), data.u.begin());
+    data.s[0] = s[0];
+    BlockExpression reference(str, data.creator, type);
+    reference.evalMultiple(&data.block, data.offOut, 0, numPoints);
+    for (int i = 0; i < numPoints; i++) {
+        block.indirectIndex = i;
+        const double* result = expr.evalFP(&block);
+        for (int k = 0; k < 3; k++) {
+            EXPECT_DOUBLE_EQ(data.out[3 * i + k], result[k]) << "point " << i;
+            EXPECT_FLOAT_EQ(static_cast<float>(data.out[3 * i + k]), out[3 * i + k]) << "point " << i;
+        }
+    }
+}
+
+TEST(EvaluationTests, SaveProgram) {
+    const std::vector<std::string> exprs = {"a=P*u;if(u>0){a=a+[s,1,2];}a*sin(s)",
+                                            "b=fit(u,-1,1,0,10);u>s ? [b,countInvocations(u),1] : P",
+                                            "x=clamp(u,0,.5)*2;P*x+length(P)+(1>2 ? 5 : cos(1))",
+                                            "ccurve(u,0,[1,0,0],4,1,[0,1,0],4)+curve(u*s,0,0,4,1,1,4)*P",
+                                            "sprintf(\"%d\",u*4)==\"1\" ? P*curve(u,0,0,4,1,s,4) : -P",
+                                            "def f(FLOAT[3] v, FLOAT k) { a=v*k; a+curve(k,0,0,4,1,1,4) } "
+                                            "f(P,u)+f(P,s)"};
+    ExprType type = ExprType().FP(3).Varying();
+    for (const std::string& str : exprs) {
+        BlockData data;
+        BlockExpression saved(str, data.creator, type);
+        saved.specialize({{"s", {0.25}}});
+        std::stringstream program;
+        ASSERT_TRUE(saved.saveProgram(program)) << str;
+        saved.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+
+        BlockExpression loaded("", data.creator, type);
+        ASSERT_TRUE(loaded.loadProgram(program)) << str;
+        EXPECT_TRUE(loaded.isValid());
+        EXPECT_EQ(str, loaded.getExpr());
+        EXPECT_TRUE(loaded.usesVar("u"));
+        EXPECT_EQ(saved.isVec(), loaded.isVec());
+        loaded.evalMultiple(&data.block, data.offTmp, 0, BlockData::numPoints);
+        for (int k = 0; k < BlockData::numPoints * 3; k++) EXPECT_DOUBLE_EQ(data.out[k], data.tmp[k]) << str;
+
+        // the program must match the desired type and hold all of its data
+        BlockExpression scalar("", data.creator, ExprType().FP(1).Varying());
+        program.clear();
+        program.seekg(0);
+        EXPECT_FALSE(scalar.loadProgram(program));
+        std::string truncated = program.str();
+        std::stringstream partial(truncated.substr(0, truncated.size() - 4));
+        EXPECT_FALSE(loaded.loadProgram(partial));
+    }
+}
+
+TEST(EvaluationTests, LoadCorruptedProgram) {
+    const std::string str = "u>0 ? P*s : -P";
+    ExprType type = ExprType().FP(3).Varying();
+    BlockData data;
+    BlockExpression saved(str, data.creator, type);
+    std::stringstream program;
+    ASSERT_TRUE(saved.saveProgram(program));
+    const std::string bytes = program.str();
+    auto int32At = [&bytes](size_t pos) {
+        int32_t value;
+        std::memcpy(&value, bytes.data() + pos, sizeof(value));
+        return value;
+    };
+
+    // the program ends with the operands of all the ops (a count and the values) and the pcs of the prologue
+    // and of the body, the operands of the conditional jump start at the offset saved after its name
+    const std::string jumpName = "CondJmpRelativeIfFalse";
+    size_t jumpRecord = bytes.find(jumpName);
+    ASSERT_NE(jumpRecord, std::string::npos);
+    int32_t jumpOperands = int32At(jumpRecord + jumpName.size());
+    size_t opData = 0;
+    for (size_t count = jumpOperands + 3; 4 * count + 12 <= bytes.size() && !opData; count++)
+        if (int32At(bytes.size() - 4 * count - 12) == static_cast<int32_t>(count)) opData = bytes.size() - 4 * count - 8;
+    ASSERT_NE(opData, 0u);
+    size_t jumpPos = opData + 4 * jumpOperands;
+
+    auto load = [&](size_t pos, int32_t value) {
+        std::string corrupted = bytes;
+        std::memcpy(&corrupted[pos], &value, sizeof(value));
+        std::stringstream in(corrupted);
+        BlockExpression loaded("", data.creator, type);
+        return loaded.loadProgram(in);
+    };
+    EXPECT_TRUE(load(jumpPos + 4, int32At(jumpPos + 4)));
+    // condition slot out of the program
+    EXPECT_FALSE(load(jumpPos, 1 << 20));
+    // else side before the jump, past the end of the program or not after the end of the then side
+    EXPECT_FALSE(load(jumpPos + 4, -1));
+    EXPECT_FALSE(load(jumpPos + 4, 1 << 20));
+    EXPECT_FALSE(load(jumpPos + 4, int32At(jumpPos + 4) - 1));
+    // branch end not where the then side jumps to
+    EXPECT_FALSE(load(jumpPos + 8, int32At(jumpPos + 8) + 1));
+    EXPECT_FALSE(load(jumpPos + 8, 1 << 20));
+}
+
+TEST(EvaluationTests, LoadProgramPointerSlots) {
+    //! Expression reading a string and a scalar through ExprVarRef::eval
+    struct StringExpression : public Expression {
+        struct VarRef : public ExprVarRef {
+            VarRef(const ExprType& type) : ExprVarRef(type) {}
+            void eval(double* result) { result[0] = 0.5; }
+            void eval(const char** result) { *result = "ab"; }
+        };
+
+        StringExpression(const std::string& str)
+            : Expression(str, ExprType().FP(1).Varying(), Expression::UseInterpreter),
+              name(ExprType().String().Varying()), x(ExprType().FP(1).Varying()) {}
+
+        ExprVarRef* resolveVar(const std::string& varName) const {
+            if (varName == "name") return &name;
+            if (varName == "x") return &x;
+            return nullptr;
+        }
+
+        mutable VarRef name, x;
+    };
+
+    const std::string str = "(name==\"ab\" ? sin(x) : cos(x)) + (\"c\"+name==\"cab\")";
+    StringExpression saved(str);
+    ASSERT_TRUE(saved.isValid());
+    const double expected = saved.evalFP()[0];
+    std::stringstream program;
+    ASSERT_TRUE(saved.saveProgram(program));
+    const std::string bytes = program.str();
+
+    // walk the saved program up to the pointer slots, then to the ops and their operands
+    using Utils::readBinary;
+    std::stringstream in(bytes);
+    std::string text;
+    int32_t value = 0;
+    std::vector<double> doubles;
+    std::vector<int32_t> ints;
+    auto skip = [&](int count) {
+        for (int i = 0; i < count; i++) ASSERT_TRUE(readBinary(in, value));
+    };
+    auto skipStrings = [&]() {
+        ASSERT_TRUE(readBinary(in, value));
+        for (int i = value; i > 0; i--) ASSERT_TRUE(readBinary(in, text));
+    };
+    ASSERT_TRUE(readBinary(in, text));  // magic
+    skip(1);                             // version
+    ASSERT_TRUE(readBinary(in, text));  // expression
+    skip(7);                             // desired and return types, return slot
+    skipStrings();
+    skipStrings();
+    skipStrings();
+    skip(1);  // no specialized variables
+    int32_t numRecords = 0;
+    ASSERT_TRUE(readBinary(in, numRecords));
+    std::vector<bool> funcBindings;
+    for (int i = 0; i < numRecords; i++) {
+        ASSERT_TRUE(readBinary(in, value));
+        ASSERT_TRUE(readBinary(in, text));
+        // variables (bound through ExprVarRef::eval) have a type, functions their function type
+        funcBindings.push_back(value == 2);
+        skip(value == 2 ? 1 : 3);
+    }
+    ASSERT_TRUE(readBinary(in, doubles));
+    int32_t numPtrs = 0;
+    ASSERT_TRUE(readBinary(in, numPtrs));
+    std::vector<size_t> boundSlots, bufferSlots;
+    for (int k = 0; k < numPtrs; k++) {
+        size_t pos = static_cast<size_t>(in.tellg());
+        ASSERT_TRUE(readBinary(in, value));
+        if (value == 3) boundSlots.push_back(pos);
+        if (value == 1) bufferSlots.push_back(pos);
+        if (value == 2)
+            ASSERT_TRUE(readBinary(in, text));
+        else if (value != 0)
+            skip(1);
+    }
+    int32_t numOps = 0;
+    ASSERT_TRUE(readBinary(in, numOps));
+    std::vector<std::pair<std::string, int32_t> > ops;
+    for (int pc = 0; pc < numOps; pc++) {
+        int32_t offset = 0;
+        ASSERT_TRUE(readBinary(in, text));
+        ASSERT_TRUE(readBinary(in, offset));
+        skip(1);
+        ops.push_back(std::make_pair(text, offset));
+    }
+    size_t opData = static_cast<size_t>(in.tellg()) + 4;
+    ASSERT_TRUE(readBinary(in, ints));
+    ASSERT_EQ(funcBindings.size(), 4u);
+    ASSERT_FALSE(boundSlots.empty());
+    ASSERT_EQ(bufferSlots.size(), 1u);
+
+    auto load = [&](size_t pos, std::vector<int32_t> values) {
+        std::string corrupted = bytes;
+        std::memcpy(&corrupted[pos], values.data(), values.size() * sizeof(int32_t));
+        std::stringstream corruptedIn(corrupted);
+        StringExpression loaded("");
+        return loaded.loadProgram(corruptedIn);
+    };
+    auto int32At = [&bytes](size_t pos) {
+        int32_t result;
+        std::memcpy(&result, bytes.data() + pos, sizeof(result));
+        return result;
+    };
+    StringExpression loaded("");
+    program.clear();
+    program.seekg(0);
+    ASSERT_TRUE(loaded.loadProgram(program));
+    EXPECT_DOUBLE_EQ(expected, loaded.evalFP()[0]);
+
+    // functions and variables are only used as what they are
+    for (size_t pos : boundSlots) {
+        int32_t index = int32At(pos + 4);
+        for (int32_t other = 0; other < numRecords; other++)
+            if (funcBindings[other] != funcBindings[index]) EXPECT_FALSE(load(pos + 4, {other}));
+        EXPECT_FALSE(load(pos, {1, 0}));
+    }
+    // the string buffer of the concatenation can't be a variable
+    EXPECT_FALSE(load(bufferSlots[0], {3, 0}));
+
+    // the flags telling whether strings have their length stored before them must match where the strings come from
+    int numStringOps = 0;
+    for (const auto& op : ops) {
+        int flags = op.first == "BinaryStringOp" ? 4 : op.first.compare(0, 15, "StrCompareEqOp<") == 0 ? 3 : 0;
+        if (!flags) continue;
+        numStringOps++;
+        for (int i = 0; i < 2; i++) {
+            size_t pos = opData + 4 * (op.second + flags + i);
+            int32_t flag = int32At(pos);
+            EXPECT_FALSE(load(pos, {2}));
+            // the variable is not length prefixed, the literals and the concatenation are (but need not be used so)
+            if (!flag) EXPECT_FALSE(load(pos, {1}));
+            if (flag) EXPECT_TRUE(load(pos, {0}));
+        }
+    }
+    EXPECT_EQ(numStringOps, 3);
+}
+
+TEST(EvaluationTests, PointerVariables) {
+    //! Expression reading P through eval and Q from where P is stored
+    struct PointerExpression : public Expression {
+        struct EvalVarRef : public ExprVarRef {
+            EvalVarRef(const double* data) : ExprVarRef(ExprType().FP(3).Varying()), _data(data) {}
+            void eval(double* result) {
+                for (int k = 0; k < 3; k++) result[k] = _data[2 * k];
+            }
+            void eval(const char** result) {}
+            const double* _data;
+        };
+
+        PointerExpression(const std::string& str,
+                          const double* data,
+                          EvaluationStrategy strategy = Expression::UseInterpreter)
+            : Expression(str, ExprType().FP(3).Varying(), strategy), P(data), Q(ExprType().FP(3).Varying(), data, 2) {}
+
+        ExprVarRef* resolveVar(const std::string& name) const {
+            if (name == "P") return &P;
+            if (name == "Q") return &Q;
+            return nullptr;
+        }
+
+        mutable EvalVarRef P;
+        mutable ExprPointerVarRef Q;
+    };
+
+    double data[6] = {};
+    PointerExpression reference("a=P*2+[1,0,length(P)];P[1]>0 ? a : -a", data);
+    ASSERT_TRUE(reference.isValid());
+    for (Expression::EvaluationStrategy strategy : testedStrategies()) {
+        PointerExpression pointer("a=Q*2+[1,0,length(Q)];Q[1]>0 ? a : -a", data, strategy);
+        ASSERT_TRUE(pointer.isValid());
+        for (int i = 0; i < 5; i++) {
+            for (int k = 0; k < 6; k++) data[k] = (i - 2) * 0.5 + k;
+            const double* expected = reference.evalFP();
+            const double* result = pointer.evalFP();
+            for (int k = 0; k < 3; k++) EXPECT_DOUBLE_EQ(expected[k], result[k]) << "iteration " << i;
+        }
+    }
+
+    // programs reading pointer variables are saved and loaded like any other
+    PointerExpression pointer("a=Q*2+[1,0,length(Q)];Q[1]>0 ? a : -a", data);
+    ASSERT_TRUE(pointer.isValid());
+    std::stringstream program;
+    ASSERT_TRUE(pointer.saveProgram(program));
+    PointerExpression loaded("", data);
+    ASSERT_TRUE(loaded.loadProgram(program));
+    const double* expected = reference.evalFP();
+    const double* result = loaded.evalFP();
+    for (int k = 0; k < 3; k++) EXPECT_DOUBLE_EQ(expected[k], result[k]);
+}
+
+TEST(EvaluationTests, ConcurrentEvaluators) {
+    const std::string str = "a=P*u;if(u>0){a=a+[s,1,2];}noise(a)+ccurve(u,0,[1,0,0],4,1,[0,1,0],4)";
+    const int numThreads = 8;
+    BlockData reference;
+    BlockExpression interpreted(str, reference.creator, ExprType().FP(3).Varying());
+    ASSERT_TRUE(interpreted.isValid());
+    interpreted.evalMultiple(&reference.block, reference.offOut, 0, BlockData::numPoints);
+
+    for (Expression::EvaluationStrategy strategy : testedStrategies()) {
+        BlockExpression expr(str, reference.creator, ExprType().FP(3).Varying(), strategy);
+        ASSERT_TRUE(expr.isValid());
+        std::vector<BlockData> data(numThreads);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; t++) {
+            threads.emplace_back([&expr, &data, t]() {
+                BlockData& threadData = data[t];
+                ExprEvaluator evaluator = expr.createEvaluator();
+                for (int repeat = 0; repeat < 20; repeat++) {
+                    if (repeat % 2) {
+                        evaluator.evalMultiple(&threadData.block, threadData.offOut, 0, BlockData::numPoints);
+                    } else {
+                        for (int i = 0; i < BlockData::numPoints; i++) {
+                            threadData.block.indirectIndex = i;
+                            const double* result = evaluator.evalFP(&threadData.block);
+                            for (int k = 0; k < 3; k++) threadData.out[3 * i + k] = result[k];
+                        }
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        for (int t = 0; t < numThreads; t++)
+            for (size_t i = 0; i < reference.out.size(); i++) EXPECT_DOUBLE_EQ(reference.out[i], data[t].out[i]);
+    }
+}
+
+TEST(EvaluationTests, TieredEvaluation) {
+    const std::string str = "a=[sin(u),P[1]*s,u*u];u>0 ? a : -a";
+    BlockData data;
+    BlockExpression tiered(str, data.creator, ExprType().FP(3).Varying(), Expression::UseTiered);
+    BlockExpression reference(str, data.creator, ExprType().FP(3).Varying());
+    ASSERT_TRUE(tiered.isValid());
+    ASSERT_TRUE(reference.isValid());
+    for (int repeat = 0; repeat < 20; repeat++) {
+        tiered.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+        for (int i = 0; i < BlockData::numPoints; i++) {
+            data.block.indirectIndex = i;
+            const double* expected = reference.evalFP(&data.block);
+            const double* result = tiered.evalFP(&data.block);
+            for (int k = 0; k < 3; k++) {
+                EXPECT_DOUBLE_EQ(expected[k], data.out[3 * i + k]);
+                EXPECT_DOUBLE_EQ(expected[k], result[k]);
+            }
+        }
+    }
+}
+
+TEST(EvaluationTests, TieredDestruction) {
+    //! Expression owning the variable it resolves, destroyed before its base class
+    struct OwningExpression : public Expression {
+        OwningExpression(const std::string& str, const double* data)
+            : Expression(str, ExprType().FP(3).Varying(), Expression::UseTiered), P(ExprType().FP(3).Varying(), data) {}
+
+        ExprVarRef* resolveVar(const std::string& name) const { return name == "P" ? &P : nullptr; }
+
+        mutable ExprPointerVarRef P;
+    };
+
+    // the background compilation must not read P once the expression is being destroyed
+    double data[3] = {1, 2, 3};
+    for (int i = 0; i < 50; i++) {
+        std::unique_ptr<OwningExpression> expr(new OwningExpression("a=P*" + std::to_string(i) + ";a+sin(P)", data));
+        ASSERT_TRUE(expr->isValid());
+        if (i % 2) {
+            const double* result = expr->evalFP();
+            EXPECT_DOUBLE_EQ(result[0], i + sin(1.));
+        }
+    }
+}
+
+TEST(EvaluationTests, JitOptLevels) {
+    const std::string str = "a=[sin(u),P[1]*s,u*u];u>0 ? a : -a";
+    BlockData data;
+    BlockExpression reference(str, data.creator, ExprType().FP(3).Varying(), Expression::UseInterpreter);
+    ASSERT_TRUE(reference.isValid());
+    EXPECT_EQ(reference.jitCompileSeconds(), 0);
+    // adaptive optimization is opt-in, existing LLVM users keep -O3
+    if (!getenv("SE_EXPR_JIT_OPT")) {
+        EXPECT_EQ(Expression::defaultJitOptLevel, Expression::JitO3);
+        EXPECT_EQ(reference.jitOptLevel(), Expression::JitO3);
+    }
+    for (Expression::JitOptLevel level :
+         {Expression::JitO0, Expression::JitO1, Expression::JitO2, Expression::JitO3, Expression::JitAdaptive}) {
+        BlockExpression expr(str, data.creator, ExprType().FP(3).Varying(),
+                             Expression::defaultEvaluationStrategy);
+        expr.setJitOptLevel(level);
+        EXPECT_EQ(expr.jitOptLevel(), level);
+        ASSERT_TRUE(expr.isValid());
+        for (int i = 0; i < BlockData::numPoints; i++) {
+            data.block.indirectIndex = i;
+            const double* expected = reference.evalFP(&data.block);
+            const double* result = expr.evalFP(&data.block);
+            for (int k = 0; k < 3; k++) EXPECT_DOUBLE_EQ(expected[k], result[k]);
+        }
+        if (Expression::defaultEvaluationStrategy == Expression::UseLLVM) {
+            EXPECT_GT(expr.jitCompileSeconds(), 0);
+            EXPECT_GE(Expression::totalJitCompileSeconds(), expr.jitCompileSeconds());
+        }
+    }
+}
+
+TEST(EvaluationTests, JitVectorizeRemarks) {
+    if (Expression::defaultEvaluationStrategy != Expression::UseLLVM) GTEST_SKIP();
+    BlockData data;
+    // the loop vectorizer reports on the loop of evalMultiple whatever it decided, as long as it runs
+    BlockExpression optimized("P*u+[s,0,1]", data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+    optimized.setJitOptLevel(Expression::JitO3);
+    ASSERT_TRUE(optimized.isValid());
+    if (!optimized.jitCodeCached()) {
+        EXPECT_FALSE(optimized.jitVectorizeRemarks().empty());
+    }
+    if (optimized.jitLoopVectorized()) {
+        EXPECT_NE(optimized.jitVectorizeRemarks().find("vectorized loop"), std::string::npos);
+    }
+    optimized.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+    for (int i = 0; i < BlockData::numPoints; i++)
+        EXPECT_DOUBLE_EQ(data.out[3 * i], data.P[3 * i] * data.u[i] + data.s[0]);
+
+    BlockExpression unoptimized("P*u+[s,0,1]", data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+    unoptimized.setJitOptLevel(Expression::JitO0);
+    ASSERT_TRUE(unoptimized.isValid());
+    EXPECT_FALSE(unoptimized.jitLoopVectorized());
+    EXPECT_TRUE(unoptimized.jitVectorizeRemarks().empty());
+}
+
+TEST(EvaluationTests, JitLaneWidth) {
+    if (Expression::defaultEvaluationStrategy != Expression::UseLLVM) GTEST_SKIP();
+    // groups of points are computed at once, the points left over at the end of the range one at a time
+    for (const char* str : {"P*u+s", "u>0 ? P : [u,s,1]", "a=u*2;b=[a,s,1]+P;b[u*3]+P[1]",
+                            "u<s && P[0]>1 || u==0 ? noise(P)*P : -P%2", "def f(FLOAT x) { x*x } f(u)+cross(P,1)"}) {
+        for (const auto& range : {std::make_pair(0, BlockData::numPoints), std::make_pair(3, 70)}) {
+            BlockData data;
+            BlockExpression expr(str, data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+            BlockExpression reference(str, data.creator, ExprType().FP(3).Varying(), Expression::UseInterpreter);
+            ASSERT_TRUE(expr.isValid()) << str;
+            ASSERT_TRUE(reference.isValid()) << str;
+            EXPECT_TRUE(expr.jitLaneWidth() == 4 || expr.jitLaneWidth() == 8) << str;
+            expr.evalMultiple(&data.block, data.offOut, range.first, range.second);
+            for (int i = 0; i < BlockData::numPoints; i++) {
+                data.block.indirectIndex = i;
+                const double* expected = reference.evalFP(&data.block);
+                bool inRange = i >= range.first && i < range.second;
+                for (int k = 0; k < 3; k++)
+                    EXPECT_DOUBLE_EQ(inRange ? expected[k] : 0, data.out[3 * i + k]) << str << " point " << i;
+            }
+        }
+    }
+
+    BlockData data;
+    for (const char* str : {"a=P;if(u<0){a=-a;}a", "\"a\"==\"b\" ? P : -P"}) {
+        BlockExpression expr(str, data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+        ASSERT_TRUE(expr.isValid()) << str;
+        EXPECT_EQ(expr.jitLaneWidth(), 0) << str;
+    }
+    BlockExpression unoptimized("P*u+s", data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+    unoptimized.setJitOptLevel(Expression::JitO0);
+    ASSERT_TRUE(unoptimized.isValid());
+    EXPECT_EQ(unoptimized.jitLaneWidth(), 0);
+}
+
+TEST(EvaluationTests, JitInlinedBuiltins) {
+    // the builtins bitcode is only embedded when clang and llvm-link were found next to LLVM at build time
+    if (Expression::defaultEvaluationStrategy != Expression::UseLLVM || !Expression::jitBuiltinsBitcode())
+        GTEST_SKIP();
+    BlockData data;
+    const std::string str = "noise(P*u)+[s,0,1]";
+    BlockExpression linked(str, data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+    BlockExpression reference(str, data.creator, ExprType().FP(3).Varying(), Expression::UseInterpreter);
+    linked.setJitOptLevel(Expression::JitO3);
+    ASSERT_TRUE(linked.isValid());
+    ASSERT_TRUE(reference.isValid());
+    if (!linked.jitCodeCached()) {
+        std::vector<std::string> inlined = linked.jitInlinedBuiltins();
+        EXPECT_NE(std::find(inlined.begin(), inlined.end(), "noise"), inlined.end());
+    }
+    linked.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+    for (int i = 0; i < BlockData::numPoints; i++) {
+        data.block.indirectIndex = i;
+        const double* expected = reference.evalFP(&data.block);
+        for (int k = 0; k < 3; k++) EXPECT_NEAR(expected[k], data.out[3 * i + k], 1e-12);
+    }
+}
+
+TEST(EvaluationTests, JitObjectCache) {
+    // run by the jitCache test, which sets SE_EXPR_JIT_CACHE
+    if (Expression::defaultEvaluationStrategy != Expression::UseLLVM || !getenv("SE_EXPR_JIT_CACHE")) GTEST_SKIP();
+    const std::string str = "a=P*u+[s,1,2];noise(a)*smoothstep(u,-1,1)";
+    BlockData data;
+    BlockExpression reference(str, data.creator, ExprType().FP(3).Varying());
+    ASSERT_TRUE(reference.isValid());
+    reference.evalMultiple(&data.block, data.offTmp, 0, BlockData::numPoints);
+
+    // the first expression stores its object (unless an earlier run did), the second one loads it
+    for (int i = 0; i < 2; i++) {
+        BlockExpression expr(str, data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+        ASSERT_TRUE(expr.isValid());
+        if (i) {
+            EXPECT_TRUE(expr.jitCodeCached());
+        }
+        expr.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+        for (size_t k = 0; k < data.out.size(); k++) EXPECT_DOUBLE_EQ(data.tmp[k], data.out[k]);
+    }
+
+#ifndef _WIN32
+    // a truncated object is not loaded: the expression is optimized and compiled again, and stores a valid object
+    const std::string directory = getenv("SE_EXPR_JIT_CACHE");
+    DIR* dir = opendir(directory.c_str());
+    ASSERT_TRUE(dir);
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > 2 && name.compare(name.size() - 2, 2, ".o") == 0)
+            fclose(fopen((directory + "/" + name).c_str(), "w"));
+    }
+    closedir(dir);
+    for (int i = 0; i < 2; i++) {
+        BlockExpression expr(str, data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+        ASSERT_TRUE(expr.isValid());
+        EXPECT_EQ(expr.jitCodeCached(), i == 1);
+        std::fill(data.out.begin(), data.out.end(), 0);
+        expr.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+        for (size_t k = 0; k < data.out.size(); k++) EXPECT_DOUBLE_EQ(data.tmp[k], data.out[k]);
+    }
+#endif
+}
+
+TEST(EvaluationTests, JitCodeFreed) {
+    if (Expression::defaultEvaluationStrategy != Expression::UseLLVM) GTEST_SKIP();
+    BlockData data;
+    BlockExpression kept("P*u+[s,0,1]", data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+    ASSERT_TRUE(kept.isValid());
+    size_t bytes = Expression::totalJitCodeBytes();
+
+    // the code of a destroyed expression is freed even though its engine keeps running the code of others
+    std::unique_ptr<BlockExpression> expr(
+        new BlockExpression("P*u+[s,1,1]", data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM));
+    ASSERT_TRUE(expr->isValid());
+    size_t exprBytes = expr->jitCodeBytes();
+    EXPECT_GT(exprBytes, 0u);
+    // (a new engine may have been created for it, with a little memory of its own)
+    size_t withExpr = Expression::totalJitCodeBytes();
+    EXPECT_GE(withExpr, bytes + exprBytes);
+    expr.reset();
+    // the engine keeps the object the code was loaded from
+    EXPECT_LE(Expression::totalJitCodeBytes(), withExpr - exprBytes);
+    EXPECT_GT(kept.jitCodeBytes(), 0u);
+    const double* result = kept.evalFP(&data.block);
+    EXPECT_DOUBLE_EQ(result[0], data.P[0] * data.u[0] + data.s[0]);
+}
+
+TEST(EvaluationTests, JitEngineRecycled) {
+    if (Expression::defaultEvaluationStrategy != Expression::UseLLVM) GTEST_SKIP();
+    BlockData data;
+    // enough expressions to fill the engine of the first one and start others
+    std::vector<std::unique_ptr<BlockExpression>> exprs;
+    for (int i = 0; i < 600; i++) {
+        exprs.emplace_back(new BlockExpression("P*u+[s," + std::to_string(i) + ",2]", data.creator,
+                                               ExprType().FP(3).Varying(), Expression::UseLLVM));
+        exprs.back()->setJitOptLevel(Expression::JitO0);
+        ASSERT_TRUE(exprs.back()->isValid());
+    }
+    EXPECT_GT(exprs[0]->jitCodeBytes(), 0u);
+    exprs.resize(1);
+
+    // with the others gone the first engine only runs the first expression, whose code moves to another engine
+    BlockExpression next("P*u+[s,-1,2]", data.creator, ExprType().FP(3).Varying(), Expression::UseLLVM);
+    ASSERT_TRUE(next.isValid());
+    EXPECT_EQ(exprs[0]->jitCodeBytes(), 0u);
+    const double* result = exprs[0]->evalFP(&data.block);
+    for (int k = 0; k < 3; k++) EXPECT_DOUBLE_EQ(result[k], data.P[k] * data.u[0] + (k ? 2 * (k - 1) : data.s[0]));
+    EXPECT_GT(exprs[0]->jitCodeBytes(), 0u);
+}
+
+TEST(EvaluationTests, JitCodeBudget) {
+    const bool jit = Expression::defaultEvaluationStrategy == Expression::UseLLVM;
+    const size_t budget = Expression::jitCodeBudget();
+    BlockData data;
+    std::vector<std::unique_ptr<BlockExpression>> exprs, references;
+    for (int i = 1; i <= 4; i++) {
+        std::string str = "P*u+[s," + std::to_string(i) + ",1]";
+        exprs.emplace_back(
+            new BlockExpression(str, data.creator, ExprType().FP(3).Varying(), Expression::defaultEvaluationStrategy));
+        references.emplace_back(
+            new BlockExpression(str, data.creator, ExprType().FP(3).Varying(), Expression::UseInterpreter));
+        ASSERT_TRUE(exprs.back()->isValid());
+        ASSERT_TRUE(references.back()->isValid());
+        if (jit) {
+            EXPECT_GT(exprs.back()->jitCodeBytes(), 0u);
+        }
+    }
+    if (jit) {
+        EXPECT_GT(Expression::totalJitCodeBytes(), 0u);
+    }
+
+    // nothing fits, so all code is evicted and compiled again when it is evaluated
+    Expression::setJitCodeBudget(1);
+    for (auto& expr : exprs) EXPECT_EQ(expr->jitCodeBytes(), 0u);
+    for (size_t e = 0; e < exprs.size(); e++) {
+        for (int i = 0; i < BlockData::numPoints; i++) {
+            data.block.indirectIndex = i;
+            const double* expected = references[e]->evalFP(&data.block);
+            const double* result = exprs[e]->evalFP(&data.block);
+            for (int k = 0; k < 3; k++) EXPECT_DOUBLE_EQ(expected[k], result[k]);
+        }
+        if (jit) {
+            EXPECT_GT(exprs[e]->jitCodeBytes(), 0u);
+        }
+    }
+    Expression::setJitCodeBudget(budget);
+}
+
+TEST(EvaluationTests, JitCodeBudgetWhileEvaluating) {
+    const size_t budget = Expression::jitCodeBudget();
+    const int numThreads = 4;
+    std::vector<BlockData> data(numThreads);
+    std::vector<std::unique_ptr<BlockExpression>> exprs;
+    for (int t = 0; t < numThreads; t++) {
+        std::string str = "a=P*u+[s," + std::to_string(t) + ",1];noise(a)*a";
+        exprs.emplace_back(new BlockExpression(str, data[t].creator, ExprType().FP(3).Varying(),
+                                               Expression::defaultEvaluationStrategy));
+        ASSERT_TRUE(exprs.back()->isValid());
+    }
+    std::vector<std::vector<double>> expected;
+    for (int t = 0; t < numThreads; t++) {
+        exprs[t]->evalMultiple(&data[t].block, data[t].offOut, 0, BlockData::numPoints);
+        expected.push_back(data[t].out);
+    }
+
+    // code is evicted and compiled again while other threads evaluate it, starting without a budget
+    Expression::setJitCodeBudget(0);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t]() {
+            BlockData& threadData = data[t];
+            while (!done) {
+                std::fill(threadData.out.begin(), threadData.out.end(), 0);
+                exprs[t]->evalMultiple(&threadData.block, threadData.offOut, 0, BlockData::numPoints);
+                for (size_t i = 0; i < threadData.out.size(); i++) EXPECT_DOUBLE_EQ(expected[t][i], threadData.out[i]);
+            }
+        });
+    }
+    for (int repeat = 0; repeat < 50; repeat++) {
+        Expression::setJitCodeBudget(1);
+        std::this_thread::yield();
+        Expression::setJitCodeBudget(0);
+    }
+    done = true;
+    for (auto& thread : threads) thread.join();
+    Expression::setJitCodeBudget(budget);
+}
+
+TEST(EvaluationTests, Kernel) {
+    const std::string firstStr = "P*u+[s,0,1]", secondStr = "u>0 ? tmp*2 : length(tmp)+noise(P)";
+    for (Expression::EvaluationStrategy strategy : testedStrategies()) {
+        BlockData data;
+        BlockExpression first(firstStr, data.creator, ExprType().FP(3).Varying(), strategy);
+        BlockExpression second(secondStr, data.creator, ExprType().FP(3).Varying(), strategy);
+        ExprKernel kernel;
+        kernel.add(first, data.offTmp);
+        kernel.add(second, data.offOut);
+        ASSERT_TRUE(kernel.isValid());
+        kernel.evalMultiple(&data.block, 0, BlockData::numPoints);
+        std::vector<double> fusedTmp = data.tmp, fusedOut = data.out;
+        // the stages are only compiled as part of the fused loop
+        EXPECT_EQ(first.jitCodeBytes(), 0u) << "strategy " << strategy;
+        EXPECT_EQ(second.jitCodeBytes(), 0u) << "strategy " << strategy;
+
+        BlockExpression firstReference(firstStr, data.creator, ExprType().FP(3).Varying());
+        BlockExpression secondReference(secondStr, data.creator, ExprType().FP(3).Varying());
+        firstReference.evalMultiple(&data.block, data.offTmp, 0, BlockData::numPoints);
+        secondReference.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+        for (size_t i = 0; i < data.out.size(); i++) {
+            EXPECT_DOUBLE_EQ(data.tmp[i], fusedTmp[i]) << "strategy " << strategy;
+            EXPECT_DOUBLE_EQ(data.out[i], fusedOut[i]) << "strategy " << strategy;
+        }
+
+        // evicted fused code is loaded again without the stages
+        const size_t budget = Expression::jitCodeBudget();
+        Expression::setJitCodeBudget(1);
+        std::fill(data.out.begin(), data.out.end(), 0);
+        kernel.evalMultiple(&data.block, 0, BlockData::numPoints);
+        Expression::setJitCodeBudget(budget);
+        for (size_t i = 0; i < data.out.size(); i++)
+            EXPECT_DOUBLE_EQ(data.out[i], fusedOut[i]) << "strategy " << strategy;
+    }
+}
+
+TEST(EvaluationTests, EvalParallel) {
+    const std::string str = "a=P*u;if(u>0){a=a+[s,1,2];}noise(a)";
+    BlockData data;
+    BlockExpression reference(str, data.creator, ExprType().FP(3).Varying());
+    ASSERT_TRUE(reference.isValid());
+    reference.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+    std::vector<double> expected = data.out;
+
+    ExprThreadPool pool(4);
+    ReverseExecutor reverse;
+    ExprExecutor* executors[] = {nullptr, &pool, &reverse};
+    for (Expression::EvaluationStrategy strategy : testedStrategies()) {
+        BlockExpression expr(str, data.creator, ExprType().FP(3).Varying(), strategy);
+        ASSERT_TRUE(expr.isValid());
+        for (ExprExecutor* executor : executors) {
+            std::fill(data.out.begin(), data.out.end(), 0);
+            expr.evalParallel(&data.block, data.offOut, 0, BlockData::numPoints, executor);
+            for (size_t i = 0; i < expected.size(); i++) EXPECT_DOUBLE_EQ(expected[i], data.out[i]) << strategy;
+        }
+    }
+}
+
+TEST(EvaluationTests, ThreadPool) {
+    ExprThreadPool pool(8);
+    std::vector<int> counts(10000);
+    std::vector<int> workers(pool.numWorkers());
+    pool.run(counts.size(), [&](size_t index, int worker) {
+        counts[index]++;
+        workers[worker]++;
+    });
+    for (int count : counts) EXPECT_EQ(count, 1);
+    int total = 0;
+    for (int count : workers) total += count;
+    EXPECT_EQ(total, 10000);
+}
+
+TEST(EvaluationTests, ThreadPoolException) {
+    ExprThreadPool pool(8);
+    std::atomic<int> calls(0);
+    EXPECT_THROW(pool.run(10000,
+                          [&](size_t index, int) {
+                              calls++;
+                              if (index % 1000 == 999) throw std::runtime_error("task failed");
+                          }),
+                 std::runtime_error);
+    EXPECT_LE(calls, 10000);
+
+    // the pool stays usable
+    std::vector<int> counts(10000);
+    pool.run(counts.size(), [&](size_t index, int) { counts[index]++; });
+    for (int count : counts) EXPECT_EQ(count, 1);
+}
+
+TEST(EvaluationTests, ThreadPoolNested) {
+    ExprThreadPool pool(4);
+    std::vector<std::atomic<int> > counts(64 * 64);
+    pool.run(64, [&](size_t outer, int) {
+        pool.run(64, [&](size_t inner, int worker) {
+            EXPECT_LT(worker, pool.numWorkers());
+            counts[outer * 64 + inner]++;
+        });
+    });
+    for (auto& count : counts) EXPECT_EQ(count, 1);
+
+    // evalParallel from within a task of the global pool
+    const std::string str = "a=P*u;if(u>0){a=a+[s,1,2];}noise(a)";
+    BlockData data;
+    BlockExpression reference(str, data.creator, ExprType().FP(3).Varying());
+    ASSERT_TRUE(reference.isValid());
+    reference.evalMultiple(&data.block, data.offOut, 0, BlockData::numPoints);
+    std::vector<double> expected = data.out;
+    std::fill(data.out.begin(), data.out.end(), 0);
+    ExprThreadPool::global().run(1, [&](size_t, int) {
+        reference.evalParallel(&data.block, data.offOut, 0, BlockData::numPoints);
+    });
+    for (size_t i = 0; i < expected.size(); i++) EXPECT_DOUBLE_EQ(expected[i], data.out[i]);
+}
@@ -190,3 +190,16 @@ TEST(StringTests, BinaryOp) {
     EXPECT_TRUE(expr8.isConstant() == true);
     EXPECT_STREQ(expr8.evalStr(), "ok");
 }
+
+TEST(StringTests, Reevaluation) {
+    // results of string operations are rebuilt every evaluation, and compared against literals of any length
+    StringExpression expr("v = stringVar + '/' + stringVar;\nv == 'ab/ab' || stringVar + '' == 'x' ? 'same' : v");
+    EXPECT_TRUE(expr.isValid() == true);
+    EXPECT_TRUE(expr.isConstant() == false);
+    const char* values[] = {"ab", "a much longer value", "", "x", "ab", "abc"};
+    const char* expected[] = {"same", "a much longer value/a much longer value", "/", "same", "same", "abc/abc"};
+    for (int i = 0; i < 6; ++i) {
+        expr.stringVar = values[i];
+        EXPECT_STREQ(expr.evalStr(), expected[i]) << values[i];
+    }
+}